@@ -39,14 +39,78 @@
 #include <pj/pool.h>
 #include <pj/log.h>
 #include <pj/os.h>
+#include <pj/string.h>
+#include <pj/file_io.h>
 
-#include <AudioUnit/AudioUnit.h>
-#include <AudioToolbox/AudioServices.h>
+#include <math.h>
+
+#include "iphonesound.h"
+
+// The driver talks to the platform through a backend (see snd_backend).
+// The core audio backend is only available on Apple platforms.
+// Everywhere else, the driver is built with the loopback backend alone,
+// which runs the IO callbacks from a timer thread (see pjmedia_snd_iphone_use_loopback).
+
+#ifndef PJMEDIA_SND_IPHONE_COREAUDIO
+  #if defined(__APPLE__)
+    #define PJMEDIA_SND_IPHONE_COREAUDIO 1
+  #else
+    #define PJMEDIA_SND_IPHONE_COREAUDIO 0
+  #endif
+#endif
+
+#if PJMEDIA_SND_IPHONE_COREAUDIO
+  #include <AudioUnit/AudioUnit.h>
+  #include <AudioToolbox/AudioServices.h>
+  #include <mach/mach_time.h>
+  #include <pj/errno.h>
+  #include <ctype.h>
+#else
+  // The interruption states passed to pjmedia_snd_audio_session_interruption, as defined by AudioToolbox.
+  // Without an audio session there are no real interruptions, but an application (or test) may still simulate them.
+  enum { kAudioSessionEndInterruption = 0, kAudioSessionBeginInterruption = 1 };
+#endif
+
+// The channel conversion kernels are vectorized where possible.
+// The instruction set is chosen at compile time, with a plain C fallback.
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define USE_NEON 1
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define USE_SSE2 1
+#endif
+
+// Lock-free primitives.
+// 
+// These are only used for values that are written by a single thread and read by another,
+// so all we need are loads and stores with the proper memory ordering.
+
+#define ATOMIC_LOAD(ptr)         __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val)   __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
 
 #define THIS_FILE "iphonesound.c"
 
 #define MANAGE_AUDIO_SESSION  0
 
+// When enabled, core audio is configured with the same channel count as pjsip (usually mono),
+// so no channel conversion is needed in the IO callbacks, and half as many bytes are moved per cycle.
+// If the voice unit refuses the format, we fall back to stereo.
+// See the discussion on architecture at the bottom of this file for more information.
+#define NATIVE_CHANNEL_FORMAT 1
+
+// When enabled, the driver asserts that a stream's memory is sized exactly right when it's opened,
+// and that nothing is allocated for the stream from then on (checked by the IO callbacks). See snd_arena.
+// This is on in debug builds.
+#ifndef SND_ARENA_CHECK
+  #ifdef NDEBUG
+    #define SND_ARENA_CHECK 0
+  #else
+    #define SND_ARENA_CHECK 1
+  #endif
+#endif
+
 // PJ_LOG has 7 levels:
 // 
 // 0 = Disabled
@@ -57,14 +121,11 @@
 // 5 = Detailed
 // 6 = Very Detailed
 
-static pj_thread_desc inputThreadDesc;
-static pj_bool_t input_thread_registered = PJ_FALSE;
-
-static pj_thread_desc outputThreadDesc;
-static pj_bool_t output_thread_registered = PJ_FALSE;
-
 static pj_pool_factory *snd_pool_factory;
 
+// Memory pool for driver-wide objects (created in pjmedia_snd_init)
+static pj_pool_t *snd_pool = NULL;
+
 // struct pjmedia_snd_dev_info {
 //   char name [64];
 //   unsigned input_count;
@@ -78,843 +139,7589 @@ static pjmedia_snd_dev_info iphone_snd_dev_info =
 static unsigned rec_latency = PJMEDIA_SND_DEFAULT_REC_LATENCY;
 static unsigned play_latency = PJMEDIA_SND_DEFAULT_PLAY_LATENCY;
 
-static AudioComponent voiceUnitComponent = NULL;
+// Whether the application explicitly set the latency via pjmedia_snd_set_latency.
+// If not, we leave the hardware IO buffer duration alone. See the discussion on latency below.
+static pj_bool_t latency_configured = PJ_FALSE;
 
-static Boolean poppingSoundWorkaround;
+// The range of hardware IO buffer durations (in seconds) we'll ask for when honoring pjmedia_snd_set_latency.
+#define MIN_IO_BUFFER_DURATION  0.005
+#define MAX_IO_BUFFER_DURATION  0.093
+
+// With adaptive latency, the number of seconds of glitch-free audio after which we shrink the play ring by a packet.
+#define ADAPTIVE_LATENCY_SHRINK_INTERVAL  10
+
+// Options set via pjmedia_snd_iphone_set_options, applied to streams as they are opened.
+static pjmedia_snd_iphone_options snd_options;
+static pj_bool_t snd_options_set = PJ_FALSE;
 
 /**
- * The pjmedia_snd_stream struct is referenced in several other pjlib files,
- * but is ultimately defined here in the sound driver.
- * So we're allowed to put any information we may need in it.
+ * Realtime statistics.
+ * 
+ * The statistics are written by the IO threads, and read from any other thread via a snapshot.
+ * Every value has a single writer, so there's no need for locking or read-modify-write atomics.
+ * We just have to make sure every store and load is atomic.
 **/
-struct pjmedia_snd_stream
+
+// Increments a counter that is only ever written by the calling thread
+#define STAT_INCREMENT(counter)  ATOMIC_STORE(&(counter), (counter) + 1)
+
+/**
+ * Adds a value (in usec) to a histogram.
+**/
+static void histogramAdd(pjmedia_snd_iphone_histogram *histogram, pj_uint32_t usec)
 {
-	pj_pool_t *pool;
-	pjmedia_dir dir;
-	int rec_id;
-	int play_id;
-	unsigned clock_rate;
-	unsigned channel_count;
-	unsigned samples_per_frame;
-	unsigned bits_per_sample;
-	unsigned packet_size;
+	unsigned bucket = 0;
 	
-	pjmedia_snd_rec_cb rec_cb;
-	pjmedia_snd_play_cb play_cb;
+	while((usec >> bucket) > 0 && bucket < (PJMEDIA_SND_IPHONE_HISTOGRAM_BUCKETS - 1))
+	{
+		bucket++;
+	}
 	
-	void *user_data;
+	STAT_INCREMENT(histogram->count[bucket]);
 	
-	AudioUnit voiceUnit;
-	AudioStreamBasicDescription streamDesc;
+	if(usec > histogram->max)
+	{
+		ATOMIC_STORE(&histogram->max, usec);
+	}
+}
+
+/**
+ * Per direction state used to compute the statistics of the IO cycles.
+**/
+typedef struct snd_io_tracker
+{
+	pj_timestamp lastStart;
+	pj_uint32_t lastFrames;
+	double nextSampleTime;
+	
+} snd_io_tracker;
+
+/**
+ * Invoked at the start of each IO callback.
+ * Records the number of frames, any discontinuity in the sample time, and the jitter of the callback interval.
+**/
+static void ioStatsBegin(pjmedia_snd_iphone_io_stats *stats,
+                         snd_io_tracker *tracker,
+                         const pj_timestamp *now,
+                         pj_uint32_t numFrames,
+                         double sampleTime,
+                         double sampleRate)
+{
+	if(stats->callbacks > 0)
+	{
+		// The time since the previous callback should match the duration of the frames it handled.
+		
+		pj_uint32_t interval = pj_elapsed_usec(&tracker->lastStart, now);
+		pj_uint32_t expected = (pj_uint32_t)(tracker->lastFrames * 1000000.0 / sampleRate);
+		
+		histogramAdd(&stats->jitter_usec, (interval > expected) ? (interval - expected) : (expected - interval));
+		
+		if(sampleTime != tracker->nextSampleTime)
+		{
+			STAT_INCREMENT(stats->discontinuities);
+		}
+		
+		if(numFrames < stats->min_frames) ATOMIC_STORE(&stats->min_frames, numFrames);
+		if(numFrames > stats->max_frames) ATOMIC_STORE(&stats->max_frames, numFrames);
+	}
+	else
+	{
+		ATOMIC_STORE(&stats->min_frames, numFrames);
+		ATOMIC_STORE(&stats->max_frames, numFrames);
+	}
 	
-	AudioBufferList *inputBufferList;
-	void *inputBuffer;
-	UInt32 inputBufferOffset;
+	ATOMIC_STORE(&stats->last_frames, numFrames);
+	STAT_INCREMENT(stats->callbacks);
+	
+	tracker->lastStart = *now;
+	tracker->lastFrames = numFrames;
+	tracker->nextSampleTime = sampleTime + numFrames;
+}
+
+/**
+ * Invoked at the end of each IO callback.
+**/
+static void ioStatsEnd(pjmedia_snd_iphone_io_stats *stats, const pj_timestamp *start)
+{
+	pj_timestamp now;
+	pj_get_timestamp(&now);
 	
-	void *outputBuffer;
-	UInt32 outputBufferOffset;
+	histogramAdd(&stats->callback_usec, pj_elapsed_usec(start, &now));
+}
+
+/**
+ * Copies the given statistics one value at a time, using atomic loads.
+**/
+static void statsSnapshot(pjmedia_snd_iphone_stats *dst, pjmedia_snd_iphone_stats *src)
+{
+	// The struct consists of nothing but 32-bit values
 	
-	pj_uint32_t inputBusTimestamp;
-	pj_uint32_t outputBusTimestamp;
+	pj_uint32_t *d = (pj_uint32_t *)dst;
+	pj_uint32_t *s = (pj_uint32_t *)src;
 	
-	Boolean isActive;
-};
+	unsigned i;
+	for(i = 0; i < sizeof(pjmedia_snd_iphone_stats) / sizeof(pj_uint32_t); i++)
+	{
+		d[i] = ATOMIC_LOAD(&s[i]);
+	}
+}
 
-// Static pointer to the stream that gets created when the sound driver is open.
-// The sole purpose of this pointer is to get access to the stream from within the audio session interruption callback.
-static pjmedia_snd_stream *snd_strm_instance = NULL;
+/**
+ * Deferred log.
+ * 
+ * PJ_LOG may block (it writes to the console, a file, etc), so we must not use it from the IO threads.
+ * Instead the IO threads put their messages in a deferred log, which is later drained into PJ_LOG by a normal thread:
+ * the worker thread in asynchronous mode, and otherwise whichever pjsip thread calls into the stream
+ * (see streamDrainLogs).
+ * 
+ * A message consists of a log level, a format string, and up to two integer arguments.
+ * Since the message is only formatted when the log is drained, the format string must be a string literal.
+ * 
+ * Each deferred log has a single writer and a single reader, so it's lock-free, just like the rings.
+ * If the log is full the message is dropped (and counted), so writing to it never blocks.
+**/
 
-#if MANAGE_AUDIO_SESSION
-  static pj_bool_t audio_session_initialized = PJ_FALSE;
-#else
-  // Optional audio session callbacks to be used by the application.
-  // These should be used when MANAGE_AUDIO_SESSION is disabled.
-  static pjmedia_snd_audio_session_callback audio_session_callbacks;
-#endif
+#define DEFERRED_LOG_SIZE  16
+
+typedef struct snd_log_entry
+{
+	int level;
+	const char *format;
+	long arg1;
+	long arg2;
+	
+} snd_log_entry;
+
+typedef struct snd_log
+{
+	snd_log_entry entries[DEFERRED_LOG_SIZE];
+	
+	pj_uint32_t writeIndex;
+	pj_uint32_t readIndex;
+	pj_uint32_t dropped;
+	
+} snd_log;
 
 /**
- * Conditionally initializes the audio session.
- * Use this method for proper audio session management.
+ * Adds a message to the deferred log.
+ * May only be called by the writer (an IO thread).
 **/
-static void initializeAudioSession()
+static void deferredLog(snd_log *log, int level, const char *format, long arg1, long arg2)
 {
-#if MANAGE_AUDIO_SESSION
+	pj_uint32_t writeIndex = log->writeIndex;
 	
-	if(!audio_session_initialized)
+	if(writeIndex - ATOMIC_LOAD(&log->readIndex) >= DEFERRED_LOG_SIZE)
 	{
-		PJ_LOG(5, (THIS_FILE, "AudioSessionInitialize"));
+		STAT_INCREMENT(log->dropped);
+		return;
+	}
+	
+	snd_log_entry *entry = &log->entries[writeIndex % DEFERRED_LOG_SIZE];
+	
+	entry->level  = level;
+	entry->format = format;
+	entry->arg1   = arg1;
+	entry->arg2   = arg2;
+	
+	ATOMIC_STORE(&log->writeIndex, writeIndex + 1);
+}
+
+/**
+ * Logs a message with a log level that isn't known at compile time.
+ * (PJ_LOG only accepts a constant log level.)
+**/
+static void logWithLevel(int level, const char *format, long arg1, long arg2)
+{
+	switch(level)
+	{
+		case 1  : PJ_LOG(1, (THIS_FILE, format, arg1, arg2)); break;
+		case 2  : PJ_LOG(2, (THIS_FILE, format, arg1, arg2)); break;
+		case 3  : PJ_LOG(3, (THIS_FILE, format, arg1, arg2)); break;
+		case 4  : PJ_LOG(4, (THIS_FILE, format, arg1, arg2)); break;
+		case 5  : PJ_LOG(5, (THIS_FILE, format, arg1, arg2)); break;
+		default : PJ_LOG(6, (THIS_FILE, format, arg1, arg2)); break;
+	}
+}
+
+/**
+ * Passes all messages in the deferred log on to PJ_LOG.
+ * May only be called by the reader. (Streams make sure of that in streamDrainLogs.)
+**/
+static void deferredLogDrain(snd_log *log)
+{
+	pj_uint32_t readIndex = log->readIndex;
+	pj_uint32_t writeIndex = ATOMIC_LOAD(&log->writeIndex);
+	
+	while(readIndex != writeIndex)
+	{
+		snd_log_entry *entry = &log->entries[readIndex % DEFERRED_LOG_SIZE];
 		
-		AudioSessionInitialize(NULL,                                   // Run loop (NULL = main run loop)
-		                       kCFRunLoopDefaultMode,                  // Run loop mode
-		(void(*)(void*,UInt32))pjmedia_snd_audio_session_interruption, // Interruption callback
-		                       NULL);                                  // Optional User data
+		logWithLevel(entry->level, entry->format, entry->arg1, entry->arg2);
 		
-		audio_session_initialized = PJ_TRUE;
+		readIndex++;
+		ATOMIC_STORE(&log->readIndex, readIndex);
+	}
+	
+	pj_uint32_t dropped = ATOMIC_LOAD(&log->dropped);
+	
+	if(dropped > 0)
+	{
+		PJ_LOG(2, (THIS_FILE, "Deferred log overflowed, %u messages were dropped", dropped));
+		
+		// The writer only ever increments the counter, so subtract what we've reported
+		__atomic_fetch_sub(&log->dropped, dropped, __ATOMIC_ACQ_REL);
 	}
+}
+
+/**
+ * Stream arena.
+ * 
+ * All the memory a stream needs is worked out up front in pjmedia_snd_open: the stream itself, the reframer
+ * staging buffers, the rings, the resamplers, and every packet and scratch buffer. It's allocated from the
+ * stream's pool as a single block, and the arena hands out pieces of that block.
+ * 
+ * Every piece starts on a cache line, which suits any SIMD load or store, and keeps buffers that are written
+ * by different threads off each other's cache lines. The whole block is zeroed up front, so its pages
+ * are mapped long before an IO thread touches them.
+ * 
+ * The pool is created without any room to grow. Once the stream is open, nothing can be allocated for it,
+ * let alone on an IO thread. (The worker thread has a pool of its own, see startWorkerThread.)
+**/
+typedef struct snd_arena
+{
+	pj_uint8_t *base;
+	pj_size_t size;
+	pj_size_t used;
+	
+} snd_arena;
+
+#define ARENA_ALIGNMENT  64
+
+/**
+ * Returns the room an allocation of the given size takes up in an arena.
+**/
+static pj_size_t arenaSize(pj_size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~((pj_size_t)ARENA_ALIGNMENT - 1);
+}
 
+/**
+ * Invoked by pjlib if an allocation doesn't fit in a stream pool, which can't grow.
+**/
+static void arenaPoolExhausted(pj_pool_t *pool, pj_size_t size)
+{
+	PJ_LOG(1, (THIS_FILE, "Stream pool exhausted, %u bytes requested", (unsigned)size));
+	
+#if SND_ARENA_CHECK
+	pj_assert(!"Stream pool exhausted");
 #endif
 }
 
 /**
- * Conditionally activates the audio session.
- * Use this method for proper audio session management.
+ * Creates a pool that holds an arena of the given size (a sum of arenaSize values), and nothing else.
+ * Returns NULL if there's not enough memory.
 **/
-static void startAudioSession(pjmedia_dir dir)
+static pj_pool_t *arenaCreate(pj_size_t size, snd_arena *arena)
 {
-	UInt32 sessionCategory;
+	// The pool keeps its own bookkeeping at the start of its first block,
+	// and the arena may have to skip ahead to the next cache line
 	
-	if(dir == PJMEDIA_DIR_CAPTURE) {
-		sessionCategory = kAudioSessionCategory_RecordAudio;
-	}
-	else if(dir == PJMEDIA_DIR_PLAYBACK) {
-		sessionCategory = kAudioSessionCategory_MediaPlayback;
-	}
-	else {
-		sessionCategory = kAudioSessionCategory_PlayAndRecord;
+	pj_size_t poolSize = sizeof(pj_pool_t) + sizeof(pj_pool_block) + PJ_POOL_ALIGNMENT + size + ARENA_ALIGNMENT;
+	
+	pj_pool_t *pool = pj_pool_create(snd_pool_factory,    // memory pool factory to use for pool creation
+	                                 "iphonesndstream",   // memory pool name
+	                                 poolSize,            // initial size
+	                                 0,                   // increment size (none, so the pool can't grow)
+	                                 arenaPoolExhausted); // error callback
+	if(pool == NULL)
+	{
+		return NULL;
 	}
 	
-#if MANAGE_AUDIO_SESSION
+	pj_uint8_t *block = (pj_uint8_t *)pj_pool_alloc(pool, size + ARENA_ALIGNMENT);
 	
-	AudioSessionSetProperty(kAudioSessionProperty_AudioCategory,
-	                        sizeof(sessionCategory), &sessionCategory);
+	if(block == NULL)
+	{
+		pj_pool_release(pool);
+		return NULL;
+	}
 	
-	AudioSessionSetActive(true);
+	arena->base = (pj_uint8_t *)(((pj_size_t)block + ARENA_ALIGNMENT - 1) & ~((pj_size_t)ARENA_ALIGNMENT - 1));
+	arena->size = size;
+	arena->used = 0;
 	
-#else
+	pj_bzero(arena->base, size);
 	
-	if(audio_session_callbacks.startAudioSession)
+	return pool;
+}
+
+/**
+ * Allocates size bytes (zeroed, and aligned to a cache line) from the arena.
+ * The arena is sized up front, so this never fails, unless the sizing is wrong.
+**/
+static void *arenaAlloc(snd_arena *arena, pj_size_t size)
+{
+	pj_size_t room = arenaSize(size);
+	
+	if(room > (arena->size - arena->used))
 	{
-		audio_session_callbacks.startAudioSession(sessionCategory);
+		PJ_LOG(1, (THIS_FILE, "Stream arena exhausted, %u bytes requested", (unsigned)size));
+		
+#if SND_ARENA_CHECK
+		pj_assert(!"Stream arena exhausted");
+#endif
+		return NULL;
 	}
 	
-#endif
+	void *p = arena->base + arena->used;
+	arena->used += room;
+	
+	return p;
 }
 
 /**
- * Conditionally deactivates the audio session when it is no longer needed.
- * Use this method for proper audio session management.
+ * The fade stage (options.fade_msec).
+ * 
+ * Whenever playback starts out of nothing, or stops in the middle of something, the jump from (or to) silence
+ * is heard as a click. So we ramp the volume up over the first few milliseconds of audio that pjsip gives us
+ * after the stream is started, resumed after an interruption, or recovers from an underrun.
+ * And when the stream is stopped, we ramp it down before the voice unit lets go of it.
+ * 
+ * The ramp is applied to the 16-bit packets as they come out of the play callback (see reframerInvokePlay),
+ * so anything the reframer has staged is already faded. Once a fade in is done, the stage costs nothing but a check.
+ * For the same reason, a fade out isn't over when the ramp is (FADE_DRAIN), but once the reframer asks for
+ * the next packet, meaning the rest of the faded packet went out to the voice unit (FADE_SILENT).
 **/
-static void stopAudioSession()
+typedef enum snd_fade_state
 {
-#if MANAGE_AUDIO_SESSION
+	FADE_NONE = 0,
+	FADE_IN,
+	FADE_OUT,
+	FADE_DRAIN,
+	FADE_SILENT
 	
-	AudioSessionSetActive(false);
+} snd_fade_state;
+
+typedef struct snd_fade
+{
+	// The gains of the fade in, in Q15, one per sample (so each channel of a frame has the same gain).
+	// The fade out uses the complement of the same gains.
+	pj_int16_t *ramp;
+	unsigned length;
+	unsigned channels;
 	
-#else
+	// Only touched by the render IO thread, except while the stream isn't being served (see fadeStart)
+	snd_fade_state state;
+	unsigned position;
 	
-	if(audio_session_callbacks.stopAudioSession)
+	// Set by pjmedia_snd_stream_stop, and picked up by the render IO thread
+	pj_bool_t stopRequested;
+	
+} snd_fade;
+
+/**
+ * Prepares a fade stage, with a ramp of the given number of frames (a raised cosine).
+ * The ramp must have room for numFrames * channels samples.
+**/
+static void fadeInit(snd_fade *fade, pj_int16_t *ramp, unsigned numFrames, unsigned channels)
+{
+	unsigned i, c;
+	for(i = 0; i < numFrames; i++)
 	{
-		audio_session_callbacks.stopAudioSession();
+		double gain = (1.0 - cos(M_PI * (i + 0.5) / numFrames)) / 2.0;
+		
+		for(c = 0; c < channels; c++)
+		{
+			ramp[(i * channels) + c] = (pj_int16_t)lrint(gain * 32767.0);
+		}
 	}
 	
-#endif
+	fade->ramp = ramp;
+	fade->length = numFrames * channels;
+	fade->channels = channels;
+	fade->state = FADE_NONE;
+	fade->position = 0;
+	fade->stopRequested = PJ_FALSE;
 }
 
 /**
- * Optional audio session callbacks to be used by the application.
- * These should be used when MANAGE_AUDIO_SESSION is disabled.
+ * Starts a fade in from silence.
+ * 
+ * Invoked on the render IO thread, or while the IO threads aren't serving the stream.
 **/
-void pjmedia_snd_audio_session_set_callbacks(pjmedia_snd_audio_session_callback *cb)
+static void fadeStart(snd_fade *fade)
 {
-#if !MANAGE_AUDIO_SESSION
-
-	audio_session_callbacks = *cb;
+	fade->position = 0;
+	ATOMIC_STORE(&fade->state, FADE_IN);
+}
 
-#endif
+/**
+ * Starts a fade in from the given gain (in Q15) rather than from silence,
+ * e.g. from wherever an underrun concealment left off (see concealmentGain).
+ * 
+ * Invoked on the render IO thread.
+**/
+static void fadeStartFrom(snd_fade *fade, pj_int32_t gain)
+{
+	// The ramp only ever rises, so look for the first frame that's at least as loud.
+	// Every channel of a frame has the same gain, so the fade starts at a frame.
+	
+	unsigned first = 0;
+	unsigned last = fade->length / fade->channels;
+	
+	while(first < last)
+	{
+		unsigned middle = (first + last) / 2;
+		
+		if(fade->ramp[middle * fade->channels] < gain)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	
+	fade->position = first * fade->channels;
+	ATOMIC_STORE(&fade->state, (fade->position < fade->length) ? FADE_IN : FADE_NONE);
 }
 
 /**
- * Invoked when our audio session is interrupted, or uninterrupted.
+ * Multiplies numSamples samples by the given Q15 gains (or by their complement if invert is set).
 **/
-void pjmedia_snd_audio_session_interruption(void *userData, pj_uint32_t interruptionState)
+static void rampApply(pj_int16_t *samples, const pj_int16_t *gains, unsigned numSamples, pj_bool_t invert)
 {
-	if(interruptionState == kAudioSessionBeginInterruption)
+#if USE_NEON
+	
+	int16x8_t full = vdupq_n_s16(32767);
+	
+	while(numSamples >= 8)
 	{
-		PJ_LOG(3, (THIS_FILE, "interruptionListenerCallback: kAudioSessionBeginInterruption"));
+		int16x8_t x = vld1q_s16(samples);
+		int16x8_t g = vld1q_s16(gains);
 		
-		if(snd_strm_instance && snd_strm_instance->isActive)
+		if(invert)
 		{
-			// Audio session has already been stopped at this point
-			
-			// Stop the audio unit
-			AudioOutputUnitStop(snd_strm_instance->voiceUnit);
-			
-			// Once you stop the audio unit the related threads might disappear as well.
-			// So we should clear any thread registration variables at this point.
-			input_thread_registered = PJ_FALSE;
-			output_thread_registered = PJ_FALSE;
-			
-			pj_bzero(inputThreadDesc, sizeof(inputThreadDesc));
-			pj_bzero(outputThreadDesc, sizeof(outputThreadDesc));
+			g = vsubq_s16(full, g);
 		}
+		
+		int16x4_t lo = vqrshrn_n_s32(vmull_s16(vget_low_s16(x), vget_low_s16(g)), 15);
+		int16x4_t hi = vqrshrn_n_s32(vmull_s16(vget_high_s16(x), vget_high_s16(g)), 15);
+		
+		vst1q_s16(samples, vcombine_s16(lo, hi));
+		
+		samples += 8;
+		gains += 8;
+		numSamples -= 8;
 	}
-	else if(interruptionState == kAudioSessionEndInterruption)
+	
+#elif USE_SSE2
+	
+	__m128i full = _mm_set1_epi16(32767);
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi32(1 << 14);
+	
+	while(numSamples >= 8)
 	{
-		PJ_LOG(3, (THIS_FILE, "interruptionListenerCallback: kAudioSessionEndInterruption"));
+		__m128i x = _mm_loadu_si128((const __m128i *)samples);
+		__m128i g = _mm_loadu_si128((const __m128i *)gains);
 		
-		if(snd_strm_instance && snd_strm_instance->isActive)
+		if(invert)
 		{
-			// Activate the audio session
-			startAudioSession(snd_strm_instance->dir);
-			
-			// Start the audio unit
-			AudioOutputUnitStart(snd_strm_instance->voiceUnit);
+			g = _mm_sub_epi16(full, g);
 		}
+		
+		// Pairing each sample and gain with a zero makes madd a plain 16x16 -> 32 bit multiply
+		__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(x, zero), _mm_unpacklo_epi16(g, zero));
+		__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(x, zero), _mm_unpackhi_epi16(g, zero));
+		
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 15);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 15);
+		
+		_mm_storeu_si128((__m128i *)samples, _mm_packs_epi32(lo, hi));
+		
+		samples += 8;
+		gains += 8;
+		numSamples -= 8;
 	}
-}
-
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		pj_int32_t g = invert ? (32767 - *gains) : *gains;
+		
+		*samples = (pj_int16_t)(((*samples * g) + (1 << 14)) >> 15);
+		
+		samples++;
+		gains++;
+	}
+}
+
 /**
- * Voice Unit Callback.
- * Called when the voice unit output needs us to input the data that it should play through the speakers.
- * 
- * Parameters:
- * inRefCon
- *    Custom data that you provided when registering your callback with the audio unit.
- * ioActionFlags
- *    Flags used to describe more about the context of this call.
- * inTimeStamp
- *    The timestamp associated with this call of audio unit render.
- * inBusNumber
- *    The bus number associated with this call of audio unit render.
- * inNumberFrames
- *    The number of sample frames that will be represented in the audio data in the provided ioData parameter.
- * ioData
- *    The AudioBufferList that will be used to contain the provided audio data.
- **/
-static OSStatus MyOutputBusRenderCallack(void                       *inRefCon,
-                                         AudioUnitRenderActionFlags *ioActionFlags,
-                                         const AudioTimeStamp       *inTimeStamp,
-                                         UInt32                      inBusNumber,
-                                         UInt32                      inNumberFrames,
-                                         AudioBufferList            *ioData)
+ * Applies the fade stage to the next numSamples samples of the stream.
+ * Invoked on the render IO thread, but only while a fade is underway (or requested).
+**/
+static void fadeApply(snd_fade *fade, pj_int16_t *samples, unsigned numSamples)
 {
-	// Our job in this method is to get the audio data from the pjsip callback method,
-	// and then fill the buffers in the given AudioBufferList with the fetched audio data.
+	if(ATOMIC_LOAD(&fade->stopRequested) && ((fade->state == FADE_NONE) || (fade->state == FADE_IN)))
+	{
+		// Fade out from wherever the fade in got to.
+		// The ramp is symmetric, so the complement of gain (length - position) is the gain at position.
+		
+		fade->position = (fade->state == FADE_IN) ? (fade->length - fade->position) : 0;
+		ATOMIC_STORE(&fade->state, FADE_OUT);
+	}
 	
-	// According to Apple, we should avoid the following in audio unit IO callbacks:
-	// - memory allocation
-	// - semaphores/mutexes
-	// - objective-c method dispatching
+	if(fade->state == FADE_DRAIN)
+	{
+		// The reframer is done with the packet the fade out ended in
+		ATOMIC_STORE(&fade->state, FADE_SILENT);
+	}
 	
-	// The AudioUnit callbacks operate on a different real-time thread
-	if(!output_thread_registered)
+	while(numSamples > 0)
 	{
-		if(!pj_thread_is_registered())
+		snd_fade_state state = fade->state;
+		
+		if(state == FADE_NONE)
 		{
-			PJ_LOG(5, (THIS_FILE, "AudioUnit output created a separate thread"));
-			
-			// pj_status_t pj_thread_register(const char  *thread_name,
-			//                            pj_thread_desc   desc,
-			//                               pj_thread_t **thread)
-			// 
-			// Register a thread that was created by external or native API to PJLIB.
-			// This function must be called in the context of the thread being registered.
-			// When the thread is created by external function or API call, it must be 'registered'
-			// to PJLIB using pj_thread_register(), so that it can cooperate with PJLIB's framework.
-			// During registration, some data needs to be maintained, and this data must remain
-			// available during the thread's lifetime.
-			
-			pj_thread_t * thread;
-			if(pj_thread_register(NULL, outputThreadDesc, &thread) == PJ_SUCCESS)
-			{
-				output_thread_registered = PJ_TRUE;
-			}
-			else
-			{
-				PJ_LOG(1, (THIS_FILE, "AudioUnit output thread failed to register with PJLIB"));
-			}
+			return;
 		}
-		else
+		
+		if((state == FADE_DRAIN) || (state == FADE_SILENT))
+		{
+			memset(samples, 0, numSamples * sizeof(pj_int16_t));
+			return;
+		}
+		
+		unsigned count = fade->length - fade->position;
+		if(count > numSamples)
 		{
-			PJ_LOG(5, (THIS_FILE, "AudioUnit output thread already registered"));
-			output_thread_registered = PJ_TRUE;
+			count = numSamples;
+		}
+		
+		rampApply(samples, fade->ramp + fade->position, count, (state == FADE_OUT));
+		
+		fade->position += count;
+		samples += count;
+		numSamples -= count;
+		
+		if(fade->position == fade->length)
+		{
+			ATOMIC_STORE(&fade->state, (state == FADE_IN) ? FADE_NONE : FADE_DRAIN);
 		}
 	}
+}
+
+/**
+ * Voice activity detection (options.vad).
+ * 
+ * A packet is voice if it's loud enough, or if it's a little quieter but crosses zero often
+ * (unvoiced sounds like "s" and "f" carry little energy, but are noise-like).
+ * After voice, packets are considered voice for a while longer (the hangover),
+ * so the ends of words, and the short pauses between them, aren't cut off.
+ * 
+ * This is deliberately simple, so it costs next to nothing per packet.
+ * Anything smarter (noise adaptation, spectral features) is left to the codec or pjsip.
+**/
+typedef struct snd_vad
+{
+	// Thresholds on the energy (sum of squares) per sample, and on the zero crossings per 1000 samples
+	double activeEnergy;
+	double quietEnergy;
+	unsigned zcrThreshold;
 	
-	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)inRefCon;
+	// The hangover, in packets, and the number of packets of it left
+	unsigned hangoverPackets;
+	unsigned hangover;
 	
-	// The ioData variable is a structure that looks like this:
-	// 
-	// struct AudioBufferList {
-	//   UInt32      mNumberBuffers;
-	//   AudioBuffer mBuffers[1];
-	// }
-	// 
-	// struct AudioBuffer {
-	//   UInt32  mNumberChannels;
-	//   UInt32  mDataByteSize;
-	//   void*   mData;
-	// }
-	// 
-	// It's our job to fill the mData variable.
-	// We can do this by calling the play callback method to get audio data from pjlib.
-	// Every call to this method will return exactly packet_size bytes of incoming audio data.
+	// The number of interleaved channels in a packet
+	unsigned channels;
 	
-	// The stream is usually configured as follows:
-	// 
-	// snd_strm->samples_per_frame = 160
-	// snd_strm->bits_per_sample = 16
-	// 
-	// snd_strm->packet_size = samples_per_frame * bits_per_sample / 8 = 320
+} snd_vad;
+
+/**
+ * Prepares voice activity detection with the thresholds from the given options,
+ * for packets of the given number of frames (and channels).
+**/
+static void vadInit(snd_vad *vad,
+                    const pjmedia_snd_iphone_options *options,
+                    unsigned clockRate,
+                    unsigned packetFrames,
+                    unsigned channels)
+{
+	// 0 dBFS is a full scale square wave, i.e. an energy of 32768^2 per sample
+	double fullScale = 32768.0 * 32768.0;
 	
-	// Now here is the catch...
-	// We have no control over the amount of data that core data will ask for.
-	// The amount it is asking for is in the mDataByteSize variable.
-	// And each time we invoke the pjlib play callback we get a fixed amount of data.
-	// So what we do is use our own buffer, and automatically handle any overflow of data.
+	vad->activeEnergy = fullScale * pow(10.0, options->vad_threshold / 10.0);
+	vad->quietEnergy  = fullScale * pow(10.0, (options->vad_threshold - 10) / 10.0);
+	vad->zcrThreshold = options->vad_zcr_threshold;
 	
-	// For a complete discussion on this code, please see discussion on architecture at the bottom of this file.
+	unsigned packetMsec = packetFrames * 1000 / clockRate;
 	
-	if(snd_strm->channel_count == 1)
+	vad->hangoverPackets = (packetMsec > 0) ? (options->vad_hangover_msec + packetMsec - 1) / packetMsec : 0;
+	vad->hangover = 0;
+	
+	vad->channels = channels;
+}
+
+/**
+ * Computes the energy (sum of squares) of the given samples, and counts the sign changes between them.
+ * 
+ * The samples are interleaved if there's more than one channel, and each sample is compared with
+ * the next one of the same channel. (Comparing neighbours would count the sign changes between the channels,
+ * so a quiet hum with the channels out of phase would look like noise.)
+**/
+static void vadAnalyze(const pj_int16_t *samples,
+                       unsigned numSamples,
+                       unsigned channels,
+                       pj_uint64_t *energy,
+                       unsigned *crossings)
+{
+	pj_uint64_t sum = 0;
+	unsigned count = 0;
+	unsigned i = 0;
+	
+#if USE_NEON
+	
+	uint64x2_t vsum = vdupq_n_u64(0);
+	int16x8_t vcount = vdupq_n_s16(0);
+	
+	// Each lane of vcount counts at most numSamples / 8 crossings, so this is good for packets of up to 256k samples
+	
+	for(; (i + 8 + channels) <= numSamples; i += 8)
 	{
-		// When we ask pjsip for audio data, it will return mono data.
-		// However, we've configured core audio to be stereo (left + right channel).
-		// So what we'll need to do is loop through the data that pjsip gives us,
-		// and copy each sample into the left and right channel of the core audio buffer.
+		int16x8_t x = vld1q_s16(samples + i);
+		int16x8_t y = vld1q_s16(samples + i + channels);
 		
-		UInt16 *audioBuffer = (UInt16 *)(ioData->mBuffers[0].mData);
-		UInt32 audioBufferSize = ioData->mBuffers[0].mDataByteSize;
+		int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+		int32x4_t hi = vmull_s16(vget_high_s16(x), vget_high_s16(x));
 		
-		// The audioBufferSize variable indicates the amount of space that we have left in the core audio buffer.
-		// As we fill the core audio buffer, we decrement this variable.
-		// So this is the amount of data that we have yet to fill.
+		vsum = vpadalq_u32(vsum, vreinterpretq_u32_s32(lo));
+		vsum = vpadalq_u32(vsum, vreinterpretq_u32_s32(hi));
 		
-		// Note: When we ask pjlib for incoming audio data, it fills our entire outputBuffer.
-		// We then copy data out of the output buffer and into the core audio buffer.
-		// The outputBufferOffset points to the first byte that we haven't given to core audio yet.
+		// The sign bit of x ^ y is set where the sign changes, and an arithmetic shift makes that -1
+		vcount = vsubq_s16(vcount, vshrq_n_s16(veorq_s16(x, y), 15));
+	}
+	
+	sum = vgetq_lane_u64(vsum, 0) + vgetq_lane_u64(vsum, 1);
+	
+	int32x4_t vcount32 = vpaddlq_s16(vcount);
+	count = (unsigned)(vgetq_lane_s32(vcount32, 0) + vgetq_lane_s32(vcount32, 1) +
+	                   vgetq_lane_s32(vcount32, 2) + vgetq_lane_s32(vcount32, 3));
+	
+#elif USE_SSE2
+	
+	__m128i vsum = _mm_setzero_si128();
+	__m128i vcount = _mm_setzero_si128();
+	__m128i zero = _mm_setzero_si128();
+	
+	for(; (i + 8 + channels) <= numSamples; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(samples + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(samples + i + channels));
 		
-		UInt16 *outputBuffer = (UInt16 *)(snd_strm->outputBuffer + snd_strm->outputBufferOffset);
-		UInt32 outputBufferSize = (snd_strm->packet_size - snd_strm->outputBufferOffset);
+		// Each 32-bit lane is the sum of two squares, at most 2^31, so it fits as long as we treat it as unsigned
+		__m128i squares = _mm_madd_epi16(x, x);
 		
-		// The outputBufferSize indicates the amount of available data in the outputBuffer
-		// that we haven't yet copied into core audio buffers.
-		// That is, this is the amount of data that we have yet to copy.
+		vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(squares, zero));
+		vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(squares, zero));
 		
-		// First we check to see if there is any leftover data in the output buffer from last time
+		// The sign bit of x ^ y is set where the sign changes, and an arithmetic shift makes that -1
+		vcount = _mm_sub_epi16(vcount, _mm_srai_epi16(_mm_xor_si128(x, y), 15));
+	}
+	
+	pj_uint64_t sums[2];
+	_mm_storeu_si128((__m128i *)sums, vsum);
+	sum = sums[0] + sums[1];
+	
+	// Each lane counts at most numSamples / 8 crossings, so a horizontal add of pairs can't overflow
+	__m128i vcount32 = _mm_madd_epi16(vcount, _mm_set1_epi16(1));
+	
+	pj_int32_t counts[4];
+	_mm_storeu_si128((__m128i *)counts, vcount32);
+	count = (unsigned)(counts[0] + counts[1] + counts[2] + counts[3]);
+	
+#endif
+	
+	for(; i < numSamples; i++)
+	{
+		sum += (pj_int32_t)samples[i] * samples[i];
 		
-		if((outputBufferSize > 0) && (audioBufferSize > 0))
+		if(((i + channels) < numSamples) && ((samples[i] ^ samples[i + channels]) < 0))
 		{
-			do
-			{
-				// Copy mono outputBuffer into stereo audioBuffer by copying each sample from output
-				// into both left and right sample of audio.
-				
-				*audioBuffer++ = *outputBuffer;
-				*audioBuffer++ = *outputBuffer++;
-				
-				audioBufferSize -= 4;
-				outputBufferSize -= 2;
-				
-			} while((outputBufferSize > 0) && (audioBufferSize > 0));
-			
-			if(outputBufferSize > 0)
-			{
-				// There's data leftover in the outputBuffer
-				
-				UInt32 numFramesRead = ioData->mBuffers[0].mDataByteSize / 4;
-				UInt32 numBytesRead = numFramesRead * 2;
-				
-				snd_strm->outputBufferOffset += numBytesRead;
-			}
-			else
-			{
-				// We used up all the leftover data in the outputBuffer
-				
-				snd_strm->outputBufferOffset = 0;
-			}
+			count++;
 		}
+	}
+	
+	*energy = sum;
+	*crossings = count;
+}
+
+/**
+ * Classifies the given packet, and returns whether it's voice (or within the hangover of voice).
+**/
+static pj_bool_t vadProcess(snd_vad *vad, const pj_int16_t *samples, unsigned numSamples)
+{
+	if(numSamples == 0)
+	{
+		return PJ_FALSE;
+	}
+	
+	pj_uint64_t energy;
+	unsigned crossings;
+	
+	vadAnalyze(samples, numSamples, vad->channels, &energy, &crossings);
+	
+	double meanEnergy = (double)energy / numSamples;
+	
+	pj_bool_t voice = (meanEnergy > vad->activeEnergy) ||
+	                  ((meanEnergy > vad->quietEnergy) && ((crossings * 1000) > (vad->zcrThreshold * numSamples)));
+	
+	if(voice)
+	{
+		vad->hangover = vad->hangoverPackets;
+		return PJ_TRUE;
+	}
+	
+	if(vad->hangover > 0)
+	{
+		vad->hangover--;
+		return PJ_TRUE;
+	}
+	
+	return PJ_FALSE;
+}
+
+/**
+ * The echo cancellation reference (options.aec_cb).
+ * 
+ * A software echo canceller needs the far-end audio (what we played) along with the near-end audio
+ * (what we captured), and it needs to know how the two line up in time.
+ * 
+ * So the render IO thread publishes every packet it gets from pjsip into a ring of slots, along with its
+ * play timestamp and the hardware sample time and host time at which its first frame is played.
+ * The capture side looks up the captured packet's host time (see snd_capture_timeline),
+ * and pairs it with the far-end packet that started playing most recently before that.
+ * 
+ * The render side never waits for the capture side. It simply overwrites the oldest slot.
+ * There are enough slots to cover the play and rec latency (plus a margin), so a slot isn't overwritten
+ * while it's still of any use to the capture side. But if the capture side falls far enough behind,
+ * a slot may be overwritten while it's being read. So the capture side copies the far-end packet out of its slot,
+ * and only uses the copy if the slot's sequence number didn't change in the meantime (like a seqlock).
+**/
+typedef struct snd_reference_slot
+{
+	// The sequence number of the packet in the slot, plus one (0 while the slot is empty or being written)
+	pj_uint32_t sequence;
+	
+	pj_uint32_t timestamp;
+	double sampleTime;
+	pj_uint64_t hostTime;
+	
+	pj_int16_t *samples;
+	
+} snd_reference_slot;
+
+typedef struct snd_reference
+{
+	snd_reference_slot *slots;
+	unsigned numSlots;
+	unsigned packetSamples;
+	
+	unsigned channels;
+	unsigned clockRate;
+	double hwRate;
+	double hostTicksPerSecond;
+	
+	// Render side: Where the current IO cycle starts, as a (fractional) pjsip frame,
+	// and the hardware sample time and host time of that frame (see referenceSetAnchor)
+	pj_bool_t anchorValid;
+	double anchorFrame;
+	double anchorSampleTime;
+	pj_uint64_t anchorHostTime;
+	
+	// The number of packets published so far (written by the render side)
+	pj_uint32_t writeSequence;
+	
+	// The first packet the capture side is still interested in,
+	// and its copy of the far-end packet it found last (only touched by the capture side)
+	pj_uint32_t readSequence;
+	pj_int16_t *farEnd;
+	
+} snd_reference;
+
+// How much audio (in milliseconds) the reference ring holds on top of the play and rec latency
+#define REFERENCE_MARGIN_MSEC  200
+
+/**
+ * Returns the arena memory needed for a reference ring of the given number of slots.
+**/
+static pj_size_t referenceArenaSize(unsigned numSlots, unsigned packetSize)
+{
+	return arenaSize(numSlots * sizeof(snd_reference_slot)) + ((numSlots + 1) * arenaSize(packetSize));
+}
+
+/**
+ * Prepares a reference ring, allocating its slots from the given arena.
+**/
+static void referenceInit(snd_reference *ref,
+                          snd_arena *arena,
+                          unsigned numSlots,
+                          unsigned packetSize,
+                          unsigned channels,
+                          unsigned clockRate,
+                          double hwRate,
+                          double hostTicksPerSecond)
+{
+	pj_bzero(ref, sizeof(snd_reference));
+	
+	ref->slots = (snd_reference_slot *)arenaAlloc(arena, numSlots * sizeof(snd_reference_slot));
+	ref->numSlots = numSlots;
+	ref->packetSamples = packetSize / sizeof(pj_int16_t);
+	
+	unsigned i;
+	for(i = 0; i < numSlots; i++)
+	{
+		ref->slots[i].samples = (pj_int16_t *)arenaAlloc(arena, packetSize);
+	}
+	
+	ref->farEnd = (pj_int16_t *)arenaAlloc(arena, packetSize);
+	
+	ref->channels = channels;
+	ref->clockRate = clockRate;
+	ref->hwRate = hwRate;
+	ref->hostTicksPerSecond = hostTicksPerSecond;
+}
+
+/**
+ * Empties the reference ring.
+ * May only be invoked while neither IO thread serves the stream.
+**/
+static void referenceReset(snd_reference *ref)
+{
+	unsigned i;
+	for(i = 0; i < ref->numSlots; i++)
+	{
+		ref->slots[i].sequence = 0;
+	}
+	
+	ref->anchorValid = PJ_FALSE;
+	ref->readSequence = 0;
+	
+	ATOMIC_STORE(&ref->writeSequence, 0);
+}
+
+/**
+ * Invoked by the render IO thread at the start of every IO cycle:
+ * The given (fractional) pjsip frame is played at the given time.
+**/
+static void referenceSetAnchor(snd_reference *ref, double frame, double sampleTime, pj_uint64_t hostTime, pj_bool_t valid)
+{
+	ref->anchorValid = valid;
+	ref->anchorFrame = frame;
+	ref->anchorSampleTime = sampleTime;
+	ref->anchorHostTime = hostTime;
+}
+
+/**
+ * Publishes a packet that was just rendered, with the given play timestamp.
+ * Invoked by the render IO thread.
+**/
+static void referencePublish(snd_reference *ref, pj_uint32_t timestamp, const pj_int16_t *samples)
+{
+	if(!ref->anchorValid)
+	{
+		// Without a host time, the capture side has no way of lining the packet up
+		return;
+	}
+	
+	pj_uint32_t sequence = ref->writeSequence;
+	snd_reference_slot *slot = &ref->slots[sequence & (ref->numSlots - 1)];
+	
+	double frames = ((double)timestamp / ref->channels) - ref->anchorFrame;
+	
+	ATOMIC_STORE(&slot->sequence, 0);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	slot->timestamp  = timestamp;
+	slot->sampleTime = ref->anchorSampleTime + (frames * ref->hwRate / ref->clockRate);
+	slot->hostTime   = ref->anchorHostTime + (pj_int64_t)floor((frames * ref->hostTicksPerSecond / ref->clockRate) + 0.5);
+	
+	memcpy(slot->samples, samples, ref->packetSamples * sizeof(pj_int16_t));
+	
+	ATOMIC_STORE(&slot->sequence, sequence + 1);
+	ATOMIC_STORE(&ref->writeSequence, sequence + 1);
+}
+
+/**
+ * Finds the far-end packet that started playing most recently at (or before) the given host time,
+ * and copies it to ref->farEnd, along with the host time at which it started playing (slotHostTime).
+ * Invoked by the capture side, with the host times of the captured packets in order.
+ * 
+ * Returns the copy, or NULL if there's no such packet (e.g. nothing has been played yet),
+ * or if the render side overwrote the packet while it was being copied.
+**/
+static const pj_int16_t *referenceFind(snd_reference *ref, pj_uint64_t hostTime, pj_uint64_t *slotHostTime)
+{
+	pj_uint32_t writeSequence = ATOMIC_LOAD(&ref->writeSequence);
+	
+	// Slots that are about to be overwritten are no good to us.
+	// (Keep a couple of slots clear of the render side, since it may be writing one right now.)
+	
+	if((pj_int32_t)(writeSequence - ref->readSequence) > (pj_int32_t)(ref->numSlots - 2))
+	{
+		ref->readSequence = writeSequence - (ref->numSlots - 2);
+	}
+	
+	snd_reference_slot *found = NULL;
+	pj_uint32_t sequence;
+	
+	for(sequence = ref->readSequence; sequence != writeSequence; sequence++)
+	{
+		snd_reference_slot *slot = &ref->slots[sequence & (ref->numSlots - 1)];
 		
-		// Now query pjlib for data until we've filled up the audio buffer
-		
-		while(audioBufferSize > 0)
+		if(ATOMIC_LOAD(&slot->sequence) != (sequence + 1))
 		{
-			// pjmedia_snd_play_cb:
-			// This callback is called by player stream when it needs additional data to be played by the device.
-			// Application must fill in the whole of output buffer with sound samples.
-			// 
-			// Parameters:
-			// void *user_data
-			//    User data associated with the stream.
-			// pj_uint32_t timestamp 
-			//    Timestamp, in samples.
-			// void *output
-			//    Buffer to be filled out by application.
-			// unsigned size
-			//    The size requested in bytes, which will be equal to the size of one whole packet.
-			
-			snd_strm->play_cb(snd_strm->user_data,
-			                  snd_strm->outputBusTimestamp,
-			                  snd_strm->outputBuffer,
-			                  snd_strm->packet_size);
-			
-			snd_strm->outputBusTimestamp += snd_strm->samples_per_frame;
-			
-			outputBuffer = (UInt16 *)(snd_strm->outputBuffer);
-			outputBufferSize = snd_strm->packet_size;
-			
-			do
-			{
-				// Copy mono outputBuffer into stereo audioBuffer by copying each sample from output
-				// into both left and right sample of audio.
-				
-				*audioBuffer++ = *outputBuffer;
-				*audioBuffer++ = *outputBuffer++;
-				
-				audioBufferSize -= 4;
-				outputBufferSize -= 2;
-				
-			} while((audioBufferSize > 0) && (outputBufferSize > 0));
-			
-			if(outputBufferSize > 0)
-			{
-				// There's data leftover in the outputBuffer
-				snd_strm->outputBufferOffset = snd_strm->packet_size - outputBufferSize;
-			}
-			else
-			{
-				// We used up all the data in the outputBuffer
-				snd_strm->outputBufferOffset = 0;
-			}
+			break;
 		}
 		
-		if(poppingSoundWorkaround)
+		if((pj_int64_t)(slot->hostTime - hostTime) > 0)
 		{
-			// Workaround for issue #820 in pjsip.
-            // The very first time we ask PJLIB for audio data, it gives us a popping noise.
-			// So we simply fill the audio buffer with silence instead of this annoying popping sound.
-			memset(ioData->mBuffers[0].mData, 0, ioData->mBuffers[0].mDataByteSize);
-			poppingSoundWorkaround = false;
+			break;
 		}
+		
+		found = slot;
 	}
-	else
+	
+	if(found == NULL)
 	{
-		// PJSIP and core audio are both configured for stereo data.
-		
-		// Important: The code is this branch is untested because, in all my testing,
-		// I've never seen PJLIB use anything but Mono.
-		// 
-		// Additional optimizations are possible if an entire packet of audio lies completely
-		// in the ioData buffer. In this case, a memcpy may be avoided.
+		return NULL;
+	}
+	
+	// The next captured packet starts later, so it won't need anything before the slot we found
+	ref->readSequence = sequence - 1;
+	
+	pj_uint64_t foundHostTime = found->hostTime;
+	memcpy(ref->farEnd, found->samples, ref->packetSamples * sizeof(pj_int16_t));
+	
+	// The render side clears the slot's sequence number before it touches anything else (see referencePublish).
+	// So if it's still the same, what we copied is the packet we found.
+	
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	
+	if(ATOMIC_LOAD(&found->sequence) != (ref->readSequence + 1))
+	{
+		return NULL;
+	}
+	
+	*slotHostTime = foundHostTime;
+	
+	return ref->farEnd;
+}
+
+/**
+ * The reframer.
+ * 
+ * Core audio asks us for (or hands us) audio buffers of whatever size it feels like,
+ * and the size may change from one callback to the next.
+ * But pjsip only ever deals in fixed size packets of exactly packet_size bytes.
+ * The reframer sits between the two, and stages any partial packet in its own buffer.
+ * 
+ * It also takes care of converting between the pjsip channel count (packetChannels)
+ * and the channel count of the core audio buffers (deviceChannels).
+ * 
+ * Note that nothing in here depends on core audio.
+ * The device buffers are just interleaved 16-bit samples, of any size.
+ * So the reframer may be driven by anything that produces or consumes such buffers.
+**/
+typedef struct snd_reframer
+{
+	// The staging buffer is always exactly one packet (packetSize bytes).
+	// 
+	// For rendering, bufferOffset points to the first byte that we haven't handed to core audio yet.
+	// For capturing, bufferOffset points to the first empty byte that we haven't filled yet.
+	
+	pj_uint8_t *buffer;
+	unsigned bufferOffset;
+	
+	unsigned packetSize;
+	unsigned packetChannels;
+	unsigned deviceChannels;
+	unsigned samplesPerFrame;
+	
+	// Timestamp (in samples) that gets passed to the next invocation of the pjsip callback
+	pj_uint32_t timestamp;
+	
+	// The pjsip callback we're reframing for.
+	// A render reframer uses play_cb, and a capture reframer uses rec_cb.
+	pjmedia_snd_play_cb play_cb;
+	pjmedia_snd_rec_cb rec_cb;
+	void *user_data;
+	
+	// If set, the time spent in each invocation of the pjsip callback is recorded here
+	pjmedia_snd_iphone_histogram *callbackTime;
+	
+	// If set, every packet from the play callback goes through this fade stage
+	snd_fade *fade;
+	
+	// If set, every packet from the play callback (after the fade stage) is published to this echo reference
+	snd_reference *reference;
+	
+	// Copy accounting.
+	// 
+	// directCount is the number of packets that pjsip read or wrote in place, directly in the device buffer.
+	// stagedCount is the number of packets that went through the staging buffer.
+	// copyCount and bytesCopied count the copies made between the staging buffer and the device buffers.
+	// lastBytesCopied is the number of bytes copied during the most recent invocation of the reframer.
+	
+	pj_uint32_t directCount;
+	pj_uint32_t stagedCount;
+	pj_uint32_t copyCount;
+	pj_uint32_t bytesCopied;
+	pj_uint32_t lastBytesCopied;
+	
+} snd_reframer;
+
+// Whether pjsip can be handed the given pointer into a device buffer as a packet buffer.
+#define IS_SAMPLE_ALIGNED(ptr)  ((((pj_size_t)(ptr)) & (sizeof(pj_int16_t) - 1)) == 0)
+
+/**
+ * Converts mono to stereo by copying each sample into both the left and right channel.
+ * 
+ * This runs for every sample we play when pjsip is mono and core audio is stereo,
+ * so we do 8 samples at a time when we have a vector unit available.
+**/
+static void monoToStereo(pj_int16_t *dst, const pj_int16_t *src, unsigned numFrames)
+{
+#if USE_NEON
+	
+	while(numFrames >= 8)
+	{
+		int16x8x2_t lr;
+		lr.val[0] = vld1q_s16(src);
+		lr.val[1] = lr.val[0];
+		
+		vst2q_s16(dst, lr);
+		
+		src += 8;
+		dst += 16;
+		numFrames -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	while(numFrames >= 8)
+	{
+		__m128i m = _mm_loadu_si128((const __m128i *)src);
+		
+		_mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(m, m));
+		_mm_storeu_si128((__m128i *)(dst + 8), _mm_unpackhi_epi16(m, m));
+		
+		src += 8;
+		dst += 16;
+		numFrames -= 8;
+	}
+	
+#endif
+	
+	while(numFrames-- > 0)
+	{
+		*dst++ = *src;
+		*dst++ = *src++;
+	}
+}
+
+/**
+ * Converts stereo to mono by taking the left channel.
+ * 
+ * This runs for every sample we record when pjsip is mono and core audio is stereo,
+ * so we do 8 frames at a time when we have a vector unit available.
+**/
+static void stereoToMono(pj_int16_t *dst, const pj_int16_t *src, unsigned numFrames)
+{
+#if USE_NEON
+	
+	while(numFrames >= 8)
+	{
+		int16x8x2_t lr = vld2q_s16(src);
+		
+		vst1q_s16(dst, lr.val[0]);
+		
+		src += 16;
+		dst += 8;
+		numFrames -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	while(numFrames >= 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 8));
+		
+		// The left sample is in the low half of each 32-bit frame.
+		// Sign extend it to 32 bits, and then pack back down to 16 bits.
+		// The saturation in the pack is a no-op since every value already fits.
+		
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(a, b));
+		
+		src += 16;
+		dst += 8;
+		numFrames -= 8;
+	}
+	
+#endif
+	
+	while(numFrames-- > 0)
+	{
+		*dst++ = *src;
+		src += 2;
+	}
+}
+
+/**
+ * Copies numFrames frames of 16-bit audio from src to dst, converting the channel count as needed.
+ * 
+ * Mono is converted to stereo by copying each sample into both the left and right channel.
+ * Stereo is converted to mono by taking the left channel.
+**/
+static void copyFrames(void *dst, unsigned dstChannels, const void *src, unsigned srcChannels, unsigned numFrames)
+{
+	if(dstChannels == srcChannels)
+	{
+		memcpy(dst, src, numFrames * dstChannels * sizeof(pj_int16_t));
+	}
+	else if(srcChannels == 1)
+	{
+		monoToStereo((pj_int16_t *)dst, (const pj_int16_t *)src, numFrames);
+	}
+	else
+	{
+		stereoToMono((pj_int16_t *)dst, (const pj_int16_t *)src, numFrames);
+	}
+}
+
+/**
+ * Mixes numSamples samples of src into dst, by adding them.
+ * 
+ * The sum saturates at the limits of the 16-bit range. Two loud sources clip, rather than wrap around.
+ * This runs for every sample of every additional stream we play, so we do 8 samples at a time when we can.
+**/
+static void mixSaturate(pj_int16_t *dst, const pj_int16_t *src, unsigned numSamples)
+{
+#if USE_NEON
+	
+	while(numSamples >= 8)
+	{
+		vst1q_s16(dst, vqaddq_s16(vld1q_s16(dst), vld1q_s16(src)));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	while(numSamples >= 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)dst);
+		__m128i b = _mm_loadu_si128((const __m128i *)src);
+		
+		_mm_storeu_si128((__m128i *)dst, _mm_adds_epi16(a, b));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		pj_int32_t sum = (pj_int32_t)*dst + *src++;
+		
+		if(sum > 32767)  sum = 32767;
+		if(sum < -32768) sum = -32768;
+		
+		*dst++ = (pj_int16_t)sum;
+	}
+}
+
+// Sample format conversion (options.float_format and 32-bit pjsip frames).
+// 
+// Full scale is +/-1.0 for float samples, and +/-2^31 for 32-bit samples,
+// so a 16-bit sample converts to either by a plain scale (or shift), without any loss.
+
+// The number of lanes of the dither generator (see ditherInit)
+#define DITHER_LANES  4
+
+/**
+ * Seeds a dither generator.
+ * 
+ * The generator is a 32-bit xorshift per lane, so the vector units can run all lanes at once.
+ * Each output splits into two 16-bit uniform values, whose difference has a triangular distribution
+ * of +/-1 LSB (TPDF dither). That decorrelates the rounding error from the signal,
+ * so quiet audio doesn't turn into harmonic distortion when it's cut down to 16 bits.
+**/
+static void ditherInit(pj_uint32_t *state)
+{
+	unsigned i;
+	for(i = 0; i < DITHER_LANES; i++)
+	{
+		// Any non-zero seed will do, as long as the lanes differ
+		state[i] = 0x9E3779B9u * (i + 1);
+	}
+}
+
+static pj_uint32_t ditherNext(pj_uint32_t *lane)
+{
+	pj_uint32_t x = *lane;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	
+	return (*lane = x);
+}
+
+/**
+ * Converts numSamples 16-bit samples to float.
+ * 
+ * This runs for every sample we play when the voice unit runs in float,
+ * so we do 8 samples at a time when we have a vector unit available.
+**/
+static void int16ToFloat(float *dst, const pj_int16_t *src, unsigned numSamples)
+{
+	const float scale = 1.0f / 32768.0f;
+	
+#if USE_NEON
+	
+	while(numSamples >= 8)
+	{
+		int16x8_t s = vld1q_s16(src);
+		
+		vst1q_f32(dst + 0, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), scale));
+		vst1q_f32(dst + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), scale));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	__m128 vscale = _mm_set1_ps(scale);
+	
+	while(numSamples >= 8)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)src);
+		
+		// Sign extend to 32 bits, by unpacking each sample into the high half of a 32-bit lane
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+		
+		_mm_storeu_ps(dst + 0, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+		_mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		*dst++ = *src++ * scale;
+	}
+}
+
+#if USE_NEON
+
+/**
+ * Advances all lanes of a dither generator, and returns the next 4 dither values (in LSB).
+**/
+static float32x4_t neonDither(uint32x4_t *state)
+{
+	uint32x4_t x = *state;
+	
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	x = veorq_u32(x, vshlq_n_u32(x, 5));
+	
+	*state = x;
+	
+	int32x4_t d = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(x, 16)),
+	                        vreinterpretq_s32_u32(vandq_u32(x, vdupq_n_u32(0xFFFF))));
+	
+	return vmulq_n_f32(vcvtq_f32_s32(d), 1.0f / 65536.0f);
+}
+
+#elif USE_SSE2
+
+/**
+ * Advances all lanes of a dither generator, and returns the next 4 dither values (in LSB).
+**/
+static __m128 sse2Dither(__m128i *state)
+{
+	__m128i x = *state;
+	
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	
+	*state = x;
+	
+	__m128i d = _mm_sub_epi32(_mm_srli_epi32(x, 16), _mm_and_si128(x, _mm_set1_epi32(0xFFFF)));
+	
+	return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+#endif
+
+/**
+ * Converts numSamples float samples to 16 bits, rounding to nearest and saturating.
+ * 
+ * If a dither generator is given (see ditherInit), TPDF dither is added before rounding.
+ * This runs for every sample we record when the voice unit runs in float,
+ * so we do 8 samples at a time when we have a vector unit available.
+**/
+static void floatToInt16(pj_int16_t *dst, const float *src, unsigned numSamples, pj_uint32_t *dither)
+{
+	const float ditherScale = 1.0f / 65536.0f;
+	
+#if USE_NEON
+	
+	float32x4_t vscale = vdupq_n_f32(32768.0f);
+	
+  #if !defined(__aarch64__)
+	float32x4_t vmax = vdupq_n_f32(32767.0f);
+	float32x4_t vmin = vdupq_n_f32(-32768.0f);
+	float32x4_t magic = vdupq_n_f32(12582912.0f);
+  #endif
+	
+	uint32x4_t state = dither ? vld1q_u32(dither) : vdupq_n_u32(0);
+	
+	while(numSamples >= 8)
+	{
+		float32x4_t a = vmulq_f32(vld1q_f32(src + 0), vscale);
+		float32x4_t b = vmulq_f32(vld1q_f32(src + 4), vscale);
+		
+		if(dither)
+		{
+			a = vaddq_f32(a, neonDither(&state));
+			b = vaddq_f32(b, neonDither(&state));
+		}
+		
+		// All paths must round alike (to nearest, ties to even, like _mm_cvtps_epi32 and lrintf),
+		// or the same float audio would come out differently on ARM and x86.
+		
+  #if defined(__aarch64__)
+		
+		// vcvtnq_s32_f32 rounds to nearest even, and saturates
+		int16x4_t lo = vqmovn_s32(vcvtnq_s32_f32(a));
+		int16x4_t hi = vqmovn_s32(vcvtnq_s32_f32(b));
+		
+  #else
+		
+		// ARMv7 can only convert with truncation. So clamp, and then add and subtract 1.5 * 2^23,
+		// which leaves no bits for a fraction. NEON always rounds to nearest even, so that does the rounding,
+		// and the conversion is exact.
+		a = vmaxq_f32(vminq_f32(a, vmax), vmin);
+		b = vmaxq_f32(vminq_f32(b, vmax), vmin);
+		
+		a = vsubq_f32(vaddq_f32(a, magic), magic);
+		b = vsubq_f32(vaddq_f32(b, magic), magic);
+		
+		int16x4_t lo = vqmovn_s32(vcvtq_s32_f32(a));
+		int16x4_t hi = vqmovn_s32(vcvtq_s32_f32(b));
+		
+  #endif
+		
+		vst1q_s16(dst, vcombine_s16(lo, hi));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+	if(dither)
+	{
+		vst1q_u32(dither, state);
+	}
+	
+#elif USE_SSE2
+	
+	__m128 vscale = _mm_set1_ps(32768.0f);
+	__m128 vmax = _mm_set1_ps(32767.0f);
+	__m128 vmin = _mm_set1_ps(-32768.0f);
+	
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither) : _mm_setzero_si128();
+	
+	while(numSamples >= 8)
+	{
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + 0), vscale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + 4), vscale);
+		
+		if(dither)
+		{
+			a = _mm_add_ps(a, sse2Dither(&state));
+			b = _mm_add_ps(b, sse2Dither(&state));
+		}
+		
+		// _mm_cvtps_epi32 rounds to nearest, but doesn't saturate, so clamp first
+		a = _mm_max_ps(_mm_min_ps(a, vmax), vmin);
+		b = _mm_max_ps(_mm_min_ps(b, vmax), vmin);
+		
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+	if(dither)
+	{
+		_mm_storeu_si128((__m128i *)dither, state);
+	}
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		float value = *src++ * 32768.0f;
+		
+		if(dither)
+		{
+			pj_uint32_t r = ditherNext(dither);
+			value += ((pj_int32_t)(r >> 16) - (pj_int32_t)(r & 0xFFFF)) * ditherScale;
+		}
+		
+		if(value >= 32767.0f)
+			*dst++ = 32767;
+		else if(value <= -32768.0f)
+			*dst++ = -32768;
+		else
+			*dst++ = (pj_int16_t)lrintf(value);
+	}
+}
+
+/**
+ * Converts numSamples 16-bit samples to 32 bits.
+**/
+static void int16ToInt32(pj_int32_t *dst, const pj_int16_t *src, unsigned numSamples)
+{
+#if USE_NEON
+	
+	while(numSamples >= 8)
+	{
+		int16x8_t s = vld1q_s16(src);
+		
+		vst1q_s32(dst + 0, vshll_n_s16(vget_low_s16(s), 16));
+		vst1q_s32(dst + 4, vshll_n_s16(vget_high_s16(s), 16));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	__m128i zero = _mm_setzero_si128();
+	
+	while(numSamples >= 8)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)src);
+		
+		// Unpacking each sample into the high half of a 32-bit lane is the shift by 16
+		_mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi16(zero, s));
+		_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(zero, s));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		*dst++ = (pj_int32_t)((pj_uint32_t)(pj_uint16_t)*src++ << 16);
+	}
+}
+
+/**
+ * Converts numSamples 32-bit samples to 16 bits, by rounding off the lower 16 bits of each.
+ * 
+ * That's (sample + 0x8000) >> 16, with halves rounded up, saturated at the top of the range
+ * (where the sum would overflow). All paths must round alike, or the same audio would come out
+ * differently on ARM and x86.
+**/
+static void int32ToInt16(pj_int16_t *dst, const pj_int32_t *src, unsigned numSamples)
+{
+#if USE_NEON
+	
+	while(numSamples >= 8)
+	{
+		// vqrshrn_n_s32 rounds, shifts and saturates in one go
+		int16x4_t lo = vqrshrn_n_s32(vld1q_s32(src + 0), 16);
+		int16x4_t hi = vqrshrn_n_s32(vld1q_s32(src + 4), 16);
+		
+		vst1q_s16(dst, vcombine_s16(lo, hi));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#elif USE_SSE2
+	
+	__m128i one = _mm_set1_epi32(1);
+	
+	while(numSamples >= 8)
+	{
+		// SSE2 has no saturating 32-bit add. But ((sample >> 15) + 1) >> 1 is the same as (sample + 0x8000) >> 16,
+		// without the overflow. The pack then saturates 32768 (from the top of the range) to 32767.
+		
+		__m128i lo = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 0)), 15);
+		__m128i hi = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4)), 15);
+		
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, one), 1);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, one), 1);
+		
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(lo, hi));
+		
+		src += 8;
+		dst += 8;
+		numSamples -= 8;
+	}
+	
+#endif
+	
+	while(numSamples-- > 0)
+	{
+		pj_int32_t rounded = ((*src++ >> 15) + 1) >> 1;
+		
+		*dst++ = (pj_int16_t)((rounded > 32767) ? 32767 : rounded);
+	}
+}
+
+/**
+ * Prepares a reframer for use.
+ * The staging buffer must be (at least) packetSize bytes.
+**/
+static void reframerInit(snd_reframer *rf,
+                         void *buffer,
+                         unsigned packetSize,
+                         unsigned packetChannels,
+                         unsigned deviceChannels,
+                         unsigned samplesPerFrame)
+{
+	rf->buffer          = (pj_uint8_t *)buffer;
+	rf->packetSize      = packetSize;
+	rf->packetChannels  = packetChannels;
+	rf->deviceChannels  = deviceChannels;
+	rf->samplesPerFrame = samplesPerFrame;
+	rf->timestamp       = 0;
+	
+	rf->directCount = 0;
+	rf->stagedCount = 0;
+	rf->copyCount   = 0;
+	rf->bytesCopied = 0;
+	
+	rf->lastBytesCopied = 0;
+	
+	// Timing of the pjsip callbacks is opt-in (see callbackTime)
+	rf->callbackTime = NULL;
+	
+	// So are the fade stage and the echo reference
+	rf->fade = NULL;
+	rf->reference = NULL;
+	
+	// A render reframer starts out with nothing staged (the whole packet has been consumed),
+	// and a capture reframer starts out with nothing filled.
+	// The appropriate reframerReset* method is invoked to set bufferOffset.
+	rf->bufferOffset = 0;
+}
+
+/**
+ * Discards any staged data in a render reframer.
+**/
+static void reframerResetRender(snd_reframer *rf)
+{
+	rf->bufferOffset = rf->packetSize;
+}
+
+/**
+ * Discards any staged data in a capture reframer.
+**/
+static void reframerResetCapture(snd_reframer *rf)
+{
+	rf->bufferOffset = 0;
+}
+
+/**
+ * Invokes the play callback for a packet, timing it if requested.
+ * The packet is then run through the fade stage, if there is one, and a fade is underway.
+**/
+static void reframerInvokePlay(snd_reframer *rf, void *packet)
+{
+	if(rf->callbackTime)
+	{
+		pj_timestamp start, end;
+		pj_get_timestamp(&start);
+		
+		rf->play_cb(rf->user_data, rf->timestamp, packet, rf->packetSize);
+		
+		pj_get_timestamp(&end);
+		histogramAdd(rf->callbackTime, pj_elapsed_usec(&start, &end));
+	}
+	else
+	{
+		rf->play_cb(rf->user_data, rf->timestamp, packet, rf->packetSize);
+	}
+	
+	snd_fade *fade = rf->fade;
+	
+	if(fade && ((fade->state != FADE_NONE) || ATOMIC_LOAD(&fade->stopRequested)))
+	{
+		fadeApply(fade, (pj_int16_t *)packet, rf->packetSize / sizeof(pj_int16_t));
+	}
+	
+	if(rf->reference)
+	{
+		referencePublish(rf->reference, rf->timestamp, (const pj_int16_t *)packet);
+	}
+}
+
+/**
+ * Invokes the rec callback for a packet, timing it if requested.
+**/
+static void reframerInvokeRec(snd_reframer *rf, void *packet)
+{
+	if(rf->callbackTime)
+	{
+		pj_timestamp start, end;
+		pj_get_timestamp(&start);
+		
+		rf->rec_cb(rf->user_data, rf->timestamp, packet, rf->packetSize);
+		
+		pj_get_timestamp(&end);
+		histogramAdd(rf->callbackTime, pj_elapsed_usec(&start, &end));
+	}
+	else
+	{
+		rf->rec_cb(rf->user_data, rf->timestamp, packet, rf->packetSize);
+	}
+}
+
+/**
+ * Fills the given device buffer with audio data from the play callback.
+ * 
+ * The play callback is invoked as many times as needed to fill the device buffer.
+ * Whenever a whole packet fits in the device buffer (and no channel conversion is needed),
+ * the play callback writes straight into the device buffer.
+ * Only a packet that straddles the end of the device buffer goes through the staging buffer.
+ * The part of it that doesn't fit is used first on the next invocation.
+**/
+static void reframerRender(snd_reframer *rf, void *deviceBuffer, unsigned deviceBufferSize)
+{
+	unsigned packetFrameSize = rf->packetChannels * sizeof(pj_int16_t);
+	unsigned deviceFrameSize = rf->deviceChannels * sizeof(pj_int16_t);
+	unsigned packetFrames = rf->packetSize / packetFrameSize;
+	
+	pj_bool_t inPlace = (rf->packetChannels == rf->deviceChannels) && IS_SAMPLE_ALIGNED(deviceBuffer);
+	
+	pj_uint8_t *out = (pj_uint8_t *)deviceBuffer;
+	unsigned framesLeft = deviceBufferSize / deviceFrameSize;
+	
+	rf->lastBytesCopied = 0;
+	
+	// The framesLeft variable indicates the amount of space that we have left in the device buffer.
+	// As we fill the device buffer, we decrement this variable.
+	
+	while(framesLeft > 0)
+	{
+		if(rf->bufferOffset == rf->packetSize)
+		{
+			// We've used up all the data in the staging buffer, so ask pjsip for another packet.
+			// 
+			// pjmedia_snd_play_cb:
+			// This callback is called by player stream when it needs additional data to be played by the device.
+			// Application must fill in the whole of output buffer with sound samples.
+			// 
+			// Parameters:
+			// void *user_data
+			//    User data associated with the stream.
+			// pj_uint32_t timestamp 
+			//    Timestamp, in samples.
+			// void *output
+			//    Buffer to be filled out by application.
+			// unsigned size
+			//    The size requested in bytes, which will be equal to the size of one whole packet.
+			
+			if(inPlace && (framesLeft >= packetFrames))
+			{
+				// The whole packet fits in the device buffer, so there's no need to stage it.
+				
+				reframerInvokePlay(rf, out);
+				
+				ATOMIC_STORE(&rf->timestamp, rf->timestamp + rf->samplesPerFrame);
+				rf->directCount++;
+				
+				out += rf->packetSize;
+				framesLeft -= packetFrames;
+				
+				continue;
+			}
+			
+			reframerInvokePlay(rf, rf->buffer);
+			
+			ATOMIC_STORE(&rf->timestamp, rf->timestamp + rf->samplesPerFrame);
+			rf->stagedCount++;
+			rf->bufferOffset = 0;
+		}
+		
+		unsigned numFrames = (rf->packetSize - rf->bufferOffset) / packetFrameSize;
+		
+		if(numFrames > framesLeft)
+		{
+			numFrames = framesLeft;
+		}
+		
+		copyFrames(out, rf->deviceChannels, rf->buffer + rf->bufferOffset, rf->packetChannels, numFrames);
+		
+		rf->copyCount++;
+		rf->bytesCopied += numFrames * deviceFrameSize;
+		rf->lastBytesCopied += numFrames * deviceFrameSize;
+		rf->bufferOffset += numFrames * packetFrameSize;
+		
+		out += numFrames * deviceFrameSize;
+		framesLeft -= numFrames;
+	}
+}
+
+/**
+ * Passes the given device buffer to the rec callback.
+ * 
+ * The rec callback is invoked once for every complete packet.
+ * Whenever a whole packet lies in the device buffer (and no channel conversion is needed),
+ * the rec callback is handed a pointer straight into the device buffer.
+ * Only a packet that straddles the end of the device buffer goes through the staging buffer.
+ * The part of it that we have is kept there, and will be completed on the next invocation.
+**/
+static void reframerCapture(snd_reframer *rf, const void *deviceBuffer, unsigned deviceBufferSize)
+{
+	unsigned packetFrameSize = rf->packetChannels * sizeof(pj_int16_t);
+	unsigned deviceFrameSize = rf->deviceChannels * sizeof(pj_int16_t);
+	unsigned packetFrames = rf->packetSize / packetFrameSize;
+	
+	pj_bool_t inPlace = (rf->packetChannels == rf->deviceChannels) && IS_SAMPLE_ALIGNED(deviceBuffer);
+	
+	const pj_uint8_t *in = (const pj_uint8_t *)deviceBuffer;
+	unsigned framesLeft = deviceBufferSize / deviceFrameSize;
+	
+	rf->lastBytesCopied = 0;
+	
+	// The framesLeft variable indicates the amount of data left in the device buffer.
+	// As we copy data from the device buffer, we decrement this variable.
+	
+	while(framesLeft > 0)
+	{
+		// pjmedia_snd_rec_cb:
+		// This callback is called by recorder stream when it has captured
+		// the whole packet worth of audio samples.
+		// 
+		// Parameters:
+		// void *user_data
+		//    User data associated with the stream.
+		// pj_uint32_t timestamp
+		//    Timestamp, in samples.
+		// void *input
+		//    Buffer containing the captured audio samples.
+		// unsigned size
+		//    The size of the data in the buffer, in bytes.
+		
+		if(inPlace && (rf->bufferOffset == 0) && (framesLeft >= packetFrames))
+		{
+			// A whole packet lies in the device buffer, so there's no need to stage it.
+			
+			reframerInvokeRec(rf, (void *)in);
+			
+			ATOMIC_STORE(&rf->timestamp, rf->timestamp + rf->samplesPerFrame);
+			rf->directCount++;
+			
+			in += rf->packetSize;
+			framesLeft -= packetFrames;
+			
+			continue;
+		}
+		
+		unsigned numFrames = (rf->packetSize - rf->bufferOffset) / packetFrameSize;
+		
+		if(numFrames > framesLeft)
+		{
+			numFrames = framesLeft;
+		}
+		
+		copyFrames(rf->buffer + rf->bufferOffset, rf->packetChannels, in, rf->deviceChannels, numFrames);
+		
+		rf->copyCount++;
+		rf->bytesCopied += numFrames * packetFrameSize;
+		rf->lastBytesCopied += numFrames * packetFrameSize;
+		rf->bufferOffset += numFrames * packetFrameSize;
+		
+		in += numFrames * deviceFrameSize;
+		framesLeft -= numFrames;
+		
+		// We can't call the rec callback function unless we have a full staging buffer.
+		// That is, unless the staging buffer has exactly packet_size bytes.
+		
+		if(rf->bufferOffset == rf->packetSize)
+		{
+			reframerInvokeRec(rf, rf->buffer);
+			
+			ATOMIC_STORE(&rf->timestamp, rf->timestamp + rf->samplesPerFrame);
+			rf->stagedCount++;
+			rf->bufferOffset = 0;
+		}
+	}
+}
+
+/**
+ * Single-producer / single-consumer lock-free ring buffer.
+ * 
+ * One thread may write to the ring while another thread reads from it, without any locking.
+ * Neither side ever blocks, so this is safe to use from the realtime core audio IO threads.
+ * 
+ * The read and write indexes run freely (wrapping at 2^32), and the capacity is a power of two,
+ * so the amount of data in the ring is always (writeIndex - readIndex).
+ * 
+ * Like the reframer, this has no knowledge of core audio.
+**/
+typedef struct snd_ring
+{
+	pj_uint8_t *buffer;
+	pj_uint32_t capacity;
+	
+	// Only ever written by the producer
+	pj_uint32_t writeIndex;
+	
+	// Keep the indexes on separate cache lines, so the two threads don't fight over them
+	pj_uint8_t padding[64 - sizeof(pj_uint32_t)];
+	
+	// Only ever written by the consumer
+	pj_uint32_t readIndex;
+	
+} snd_ring;
+
+/**
+ * Returns the smallest power of two that is greater than or equal to the given value.
+**/
+static pj_uint32_t roundUpToPowerOfTwo(pj_uint32_t value)
+{
+	pj_uint32_t result = 1;
+	
+	while(result < value)
+	{
+		result <<= 1;
+	}
+	
+	return result;
+}
+
+/**
+ * Prepares a ring for use.
+ * The capacity must be a power of two, and the buffer must be (at least) capacity bytes.
+**/
+static void ringInit(snd_ring *ring, void *buffer, pj_uint32_t capacity)
+{
+	pj_assert((capacity & (capacity - 1)) == 0);
+	
+	ring->buffer = (pj_uint8_t *)buffer;
+	ring->capacity = capacity;
+	ring->writeIndex = 0;
+	ring->readIndex = 0;
+}
+
+/**
+ * Discards everything in the ring.
+ * This may only be used while neither the producer nor the consumer are using the ring.
+**/
+static void ringReset(snd_ring *ring)
+{
+	ATOMIC_STORE(&ring->writeIndex, 0);
+	ATOMIC_STORE(&ring->readIndex, 0);
+}
+
+/**
+ * Discards everything that is currently in the ring.
+ * 
+ * May only be called by the consumer.
+**/
+static void ringDiscard(snd_ring *ring)
+{
+	ATOMIC_STORE(&ring->readIndex, ATOMIC_LOAD(&ring->writeIndex));
+}
+
+/**
+ * Returns the number of bytes available for reading.
+**/
+static pj_uint32_t ringAvailable(snd_ring *ring)
+{
+	return ATOMIC_LOAD(&ring->writeIndex) - ATOMIC_LOAD(&ring->readIndex);
+}
+
+/**
+ * Returns the number of bytes that may be written.
+**/
+static pj_uint32_t ringSpace(snd_ring *ring)
+{
+	return ring->capacity - ringAvailable(ring);
+}
+
+/**
+ * Writes exactly size bytes into the ring.
+ * Returns PJ_FALSE (and writes nothing) if there isn't enough space.
+ * 
+ * May only be called by the producer.
+**/
+static pj_bool_t ringWrite(snd_ring *ring, const void *data, pj_uint32_t size)
+{
+	pj_uint32_t writeIndex = ring->writeIndex;
+	pj_uint32_t readIndex = ATOMIC_LOAD(&ring->readIndex);
+	
+	if(ring->capacity - (writeIndex - readIndex) < size)
+	{
+		return PJ_FALSE;
+	}
+	
+	pj_uint32_t offset = writeIndex & (ring->capacity - 1);
+	pj_uint32_t firstPart = ring->capacity - offset;
+	
+	if(firstPart >= size)
+	{
+		memcpy(ring->buffer + offset, data, size);
+	}
+	else
+	{
+		memcpy(ring->buffer + offset, data, firstPart);
+		memcpy(ring->buffer, (const pj_uint8_t *)data + firstPart, size - firstPart);
+	}
+	
+	// Publish the data to the consumer
+	ATOMIC_STORE(&ring->writeIndex, writeIndex + size);
+	
+	return PJ_TRUE;
+}
+
+/**
+ * Reads exactly size bytes from the ring.
+ * Returns PJ_FALSE (and reads nothing) if there isn't enough data.
+ * 
+ * May only be called by the consumer.
+**/
+static pj_bool_t ringRead(snd_ring *ring, void *data, pj_uint32_t size)
+{
+	pj_uint32_t readIndex = ring->readIndex;
+	pj_uint32_t writeIndex = ATOMIC_LOAD(&ring->writeIndex);
+	
+	if((writeIndex - readIndex) < size)
+	{
+		return PJ_FALSE;
+	}
+	
+	pj_uint32_t offset = readIndex & (ring->capacity - 1);
+	pj_uint32_t firstPart = ring->capacity - offset;
+	
+	if(firstPart >= size)
+	{
+		memcpy(data, ring->buffer + offset, size);
+	}
+	else
+	{
+		memcpy(data, ring->buffer + offset, firstPart);
+		memcpy((pj_uint8_t *)data + firstPart, ring->buffer, size - firstPart);
+	}
+	
+	// Hand the space back to the producer
+	ATOMIC_STORE(&ring->readIndex, readIndex + size);
+	
+	return PJ_TRUE;
+}
+
+/**
+ * Polyphase resampler.
+ * 
+ * Converts 16-bit interleaved audio from one sample rate to another, by any rational ratio.
+ * 
+ * The ratio is reduced to outRate/inRate = L/M. Conceptually, the input is upsampled by L (by inserting zeros),
+ * passed through a low-pass filter, and then downsampled by M. In practice we only ever compute the outputs
+ * we keep, and only multiply by the filter coefficients that line up with a real input sample.
+ * Those coefficients depend on the phase of the output relative to the input, which is one of L values.
+ * So the filter is split into L phases, each of which is a short FIR filter applied directly to the input.
+ * 
+ * The filter is a Kaiser windowed sinc, designed once when the resampler is created.
+ * Its length is given in samples of the lower of the two rates, and is a measure of quality:
+ * a longer filter has a sharper cutoff, and thus a wider passband for the same alias rejection.
+ * The stopband starts at half the lower rate, and is attenuated by about 80 dB.
+ * 
+ * The coefficients are stored as 16-bit fixed point values, in the order in which the input history is stored,
+ * so each output sample is a straightforward dot product of two 16-bit vectors.
+ * That's where nearly all the time goes, so the dot product is vectorized when we have a vector unit available.
+ * 
+ * The resampler keeps its own history of the input, so it may be fed any number of frames at a time
+ * (up to maxInput). Which means it can be used in both directions:
+ * - To push data through it, pass in whatever you have, and take whatever comes out.
+ * - To pull a specific number of frames out of it, ask resamplerInputFrames how much to pass in.
+ * 
+ * A variable resampler may also have its ratio adjusted by a tiny amount (see resamplerSetAdjustment),
+ * which is how we compensate for clock drift. The position of the next output then no longer falls exactly
+ * on one of the phases, so we interpolate between the two nearest phases. For this to be accurate,
+ * a variable resampler always has at least RESAMPLER_VARIABLE_PHASES phases, even if the ratio is 1.
+**/
+
+#define RESAMPLER_MAX_CHANNELS  2
+#define RESAMPLER_MAX_PHASES    1024
+
+// The minimum number of phases of a variable resampler.
+// Linearly interpolating between 64 phases keeps the error about 80 dB down.
+#define RESAMPLER_VARIABLE_PHASES  64
+
+// The position within a phase has 16 fractional bits
+#define RESAMPLER_PHASE_SHIFT   16
+
+// Fixed point format of the coefficients.
+// The sum of the absolute values of the coefficients of a phase stays well below 4,
+// so a 32-bit accumulator can't overflow with 14 fractional bits.
+#define RESAMPLER_COEF_SHIFT    14
+
+// The resampler is used in the IO callbacks in chunks of (at most) this many frames.
+// This bounds the size of the buffers we need, regardless of how many frames core audio asks for.
+#define RESAMPLER_CHUNK_FRAMES  256
+
+typedef struct snd_resampler
+{
+	unsigned inRate;
+	unsigned outRate;
+	unsigned channels;
+	
+	// The ratio outRate/inRate, reduced to phases/step
+	unsigned phases;
+	unsigned step;
+	
+	// The step, split into whole input frames and the remaining fraction.
+	// The fraction is in phases, with RESAMPLER_PHASE_SHIFT fractional bits.
+	unsigned stepFrames;
+	pj_uint32_t stepPhases;
+	
+	// Whether the ratio may be adjusted, and the current adjustment (in parts per billion)
+	pj_bool_t variable;
+	pj_int32_t adjustment;
+	
+	// Number of coefficients per phase (a multiple of 8), and the coefficients of all phases.
+	// There's one more phase than needed, so we can always interpolate between a phase and the next one.
+	unsigned taps;
+	pj_int16_t *coefs;
+	
+	// The input history of each channel.
+	// The first taps samples are the tail of the previous input, followed by room for maxInput new samples.
+	unsigned maxInput;
+	pj_int16_t *history[RESAMPLER_MAX_CHANNELS];
+	
+	// The position of the next output, as an input frame index relative to the start of the next input,
+	// plus the phase within that input frame (with RESAMPLER_PHASE_SHIFT fractional bits).
+	// The index may be -1, in which case it refers to the history.
+	int index;
+	pj_uint32_t phase;
+	
+} snd_resampler;
+
+static unsigned greatestCommonDivisor(unsigned a, unsigned b)
+{
+	while(b != 0)
+	{
+		unsigned r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/**
+ * Returns the number of phases for the given rates.
+**/
+static unsigned resamplerPhases(unsigned inRate, unsigned outRate, pj_bool_t variable)
+{
+	unsigned phases = outRate / greatestCommonDivisor(inRate, outRate);
+	
+	if(variable && (phases < RESAMPLER_VARIABLE_PHASES))
+	{
+		// Any multiple of the reduced ratio works, so pick the smallest one that has enough phases
+		phases *= (RESAMPLER_VARIABLE_PHASES + phases - 1) / phases;
+	}
+	
+	return phases;
+}
+
+/**
+ * Returns the number of coefficients per phase for the given rates and filter length.
+ * 
+ * The filter length is given in samples of the lower rate.
+ * When downsampling, each phase has to span the same stretch of time at the higher input rate.
+**/
+static unsigned resamplerTapsPerPhase(unsigned inRate, unsigned outRate, unsigned filterLength)
+{
+	unsigned taps = filterLength;
+	
+	if(inRate > outRate)
+	{
+		taps = (unsigned)(((pj_uint64_t)filterLength * inRate + outRate - 1) / outRate);
+	}
+	
+	// The dot product works on 8 samples at a time
+	return (taps + 7) & ~7u;
+}
+
+/**
+ * Returns the amount of arena memory needed by resamplerCreate with the same parameters.
+**/
+static pj_size_t resamplerArenaSize(unsigned inRate,
+                                   unsigned outRate,
+                                   unsigned channels,
+                                   unsigned filterLength,
+                                   unsigned maxInput,
+                                   pj_bool_t variable)
+{
+	unsigned phases = resamplerPhases(inRate, outRate, variable);
+	unsigned taps = resamplerTapsPerPhase(inRate, outRate, filterLength);
+	
+	pj_size_t size = arenaSize(sizeof(snd_resampler));
+	size += arenaSize((phases + 1) * taps * sizeof(pj_int16_t));
+	size += channels * arenaSize((taps + maxInput) * sizeof(pj_int16_t));
+	
+	return size;
+}
+
+/**
+ * Computes the zeroth order modified Bessel function of the first kind, which shapes the Kaiser window.
+ * The power series converges quickly for the values we use.
+**/
+static double besselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	double halfX = x / 2.0;
+	
+	int k;
+	for(k = 1; k < 64; k++)
+	{
+		double t = halfX / k;
+		term *= t * t;
+		sum += term;
+		
+		if(term < sum * 1e-12) break;
+	}
+	
+	return sum;
+}
+
+/**
+ * Designs the filter, and stores it in the resampler's coefficient table.
+ * 
+ * This uses floating point math, and is only ever invoked when a stream is opened.
+**/
+static void resamplerDesignFilter(snd_resampler *rs)
+{
+	unsigned L = rs->phases;
+	unsigned taps = rs->taps;
+	unsigned length = L * taps;
+	
+	// Note: The prototype filter has length + 1 coefficients, from 0 to length (inclusive).
+	// The extra coefficient is only ever used by the extra phase (phase L),
+	// which is phase 0 of the next input frame.
+	
+	// The prototype filter runs at the upsampled rate, inRate * L.
+	// Everything below is normalized to that rate.
+	
+	double lowerRate = (rs->inRate < rs->outRate) ? rs->inRate : rs->outRate;
+	double upsampledRate = (double)rs->inRate * L;
+	
+	// For a Kaiser window, the transition band width that buys an attenuation of A dB is
+	// (A - 8) / (2.285 * 2 * pi * length). With A = 80 that comes down to about 5 input samples.
+	// We put the stopband edge at half the lower rate, so nothing aliases into the passband.
+	
+	double attenuation = 80.0;
+	double beta = 0.1102 * (attenuation - 8.7);
+	double transition = (attenuation - 8.0) / (2.285 * 2.0 * M_PI * length);
+	double cutoff = (lowerRate / 2.0) / upsampledRate - (transition / 2.0);
+	
+	double center = length / 2.0;
+	double i0Beta = besselI0(beta);
+	
+	unsigned phase;
+	for(phase = 0; phase <= L; phase++)
+	{
+		// Each phase should have a gain of exactly 1, so we normalize each phase separately.
+		// This keeps DC (and therefore low frequency) content at exactly the same level regardless of phase.
+		
+		double h[taps];
+		double sum = 0.0;
+		
+		unsigned k;
+		for(k = 0; k < taps; k++)
+		{
+			double n = phase + (double)k * L;
+			double x = n - center;
+			
+			double sinc = (x == 0.0) ? 1.0 : sin(2.0 * M_PI * cutoff * x) / (2.0 * M_PI * cutoff * x);
+			
+			double r = (2.0 * n / length) - 1.0;
+			double window = besselI0(beta * sqrt(fmax(0.0, 1.0 - r * r))) / i0Beta;
+			
+			h[k] = sinc * window;
+			sum += h[k];
+		}
+		
+		// Coefficient k applies to the input k frames before the current one.
+		// The history is stored oldest first, so store the coefficients in reverse.
+		
+		pj_int16_t *coefs = rs->coefs + (phase * taps);
+		
+		for(k = 0; k < taps; k++)
+		{
+			double c = (h[k] / sum) * (1 << RESAMPLER_COEF_SHIFT);
+			coefs[taps - 1 - k] = (pj_int16_t)((c < 0) ? (c - 0.5) : (c + 0.5));
+		}
+	}
+}
+
+/**
+ * Discards the input history, and starts over at phase zero.
+**/
+static void resamplerReset(snd_resampler *rs)
+{
+	unsigned c;
+	for(c = 0; c < rs->channels; c++)
+	{
+		pj_bzero(rs->history[c], rs->taps * sizeof(pj_int16_t));
+	}
+	
+	rs->index = 0;
+	rs->phase = 0;
+}
+
+/**
+ * Creates a resampler in the given arena.
+ * 
+ * The filter length is in samples of the lower rate (see above).
+ * Each call to resamplerProcess may pass up to maxInput frames of input.
+**/
+static pj_status_t resamplerCreate(snd_arena *arena,
+                                   unsigned inRate,
+                                   unsigned outRate,
+                                   unsigned channels,
+                                   unsigned filterLength,
+                                   unsigned maxInput,
+                                   pj_bool_t variable,
+                                   snd_resampler **p_rs)
+{
+	PJ_ASSERT_RETURN(inRate > 0 && outRate > 0, PJ_EINVAL);
+	PJ_ASSERT_RETURN(channels >= 1 && channels <= RESAMPLER_MAX_CHANNELS, PJ_EINVAL);
+	
+	unsigned phases = resamplerPhases(inRate, outRate, variable);
+	
+	if(phases > RESAMPLER_MAX_PHASES)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unsupported sample rate conversion: %u -> %u", inRate, outRate));
+		return PJ_EINVAL;
+	}
+	
+	snd_resampler *rs = (snd_resampler *)arenaAlloc(arena, sizeof(snd_resampler));
+	
+	rs->inRate   = inRate;
+	rs->outRate  = outRate;
+	rs->channels = channels;
+	
+	rs->phases = phases;
+	rs->step   = (unsigned)((pj_uint64_t)inRate * phases / outRate);
+	
+	rs->variable = variable;
+	
+	rs->stepFrames = rs->step / rs->phases;
+	rs->stepPhases = (rs->step % rs->phases) << RESAMPLER_PHASE_SHIFT;
+	
+	rs->taps  = resamplerTapsPerPhase(inRate, outRate, filterLength);
+	rs->coefs = (pj_int16_t *)arenaAlloc(arena, (rs->phases + 1) * rs->taps * sizeof(pj_int16_t));
+	
+	rs->maxInput = maxInput;
+	
+	unsigned c;
+	for(c = 0; c < channels; c++)
+	{
+		rs->history[c] = (pj_int16_t *)arenaAlloc(arena, (rs->taps + maxInput) * sizeof(pj_int16_t));
+	}
+	
+	resamplerDesignFilter(rs);
+	resamplerReset(rs);
+	
+	*p_rs = rs;
+	return PJ_SUCCESS;
+}
+
+/**
+ * Adjusts the ratio of a variable resampler by the given amount, in parts per billion.
+ * 
+ * A positive adjustment consumes the input faster, so fewer frames come out per frame that goes in.
+ * The adjustment is relative to the nominal ratio, not to the previous adjustment.
+**/
+static void resamplerSetAdjustment(snd_resampler *rs, pj_int32_t ppb)
+{
+	if(!rs->variable || (ppb == rs->adjustment)) return;
+	
+	// The step in phases, with RESAMPLER_PHASE_SHIFT fractional bits.
+	// At the resolution of the fraction, the smallest adjustment is (1 / (step << 16)),
+	// which is well under a part per million.
+	
+	double step = (double)rs->step * (1 << RESAMPLER_PHASE_SHIFT) * (1.0 + (ppb / 1e9));
+	pj_uint64_t fixedStep = (pj_uint64_t)(step + 0.5);
+	pj_uint64_t fixedPhases = (pj_uint64_t)rs->phases << RESAMPLER_PHASE_SHIFT;
+	
+	rs->stepFrames = (unsigned)(fixedStep / fixedPhases);
+	rs->stepPhases = (pj_uint32_t)(fixedStep % fixedPhases);
+	rs->adjustment = ppb;
+}
+
+/**
+ * Returns the number of input frames that must be passed to resamplerProcess
+ * in order to get exactly the given number of output frames out of it.
+ * 
+ * This is at most (outFrames * inRate / outRate) + 3, plus the adjustment (if any).
+**/
+static unsigned resamplerInputFrames(snd_resampler *rs, unsigned outFrames)
+{
+	if(outFrames == 0) return 0;
+	
+	pj_uint64_t fixedPhases = (pj_uint64_t)rs->phases << RESAMPLER_PHASE_SHIFT;
+	pj_uint64_t fixedStep = (rs->stepFrames * fixedPhases) + rs->stepPhases;
+	
+	// The last output we produce lies in this input frame (relative to the start of the input)
+	pj_int64_t last = rs->index + (pj_int64_t)((rs->phase + (outFrames - 1) * fixedStep) / fixedPhases);
+	
+	return (last < 0) ? 0 : (unsigned)(last + 1);
+}
+
+/**
+ * Returns the position of the input that the next output corresponds to,
+ * in input frames relative to the start of the next input.
+ * 
+ * This accounts for the delay of the filter (half its length), so it's usually negative.
+**/
+static double resamplerPosition(snd_resampler *rs)
+{
+	double phase = (double)rs->phase / ((pj_uint64_t)rs->phases << RESAMPLER_PHASE_SHIFT);
+	
+	return rs->index + phase - (rs->taps / 2.0);
+}
+
+/**
+ * Computes the dot product of two vectors of 16-bit values.
+ * The length must be a multiple of 8.
+**/
+static pj_int32_t dotProduct(const pj_int16_t *x, const pj_int16_t *h, unsigned length)
+{
+#if USE_NEON
+	
+	int32x4_t acc = vdupq_n_s32(0);
+	
+	unsigned i;
+	for(i = 0; i < length; i += 8)
+	{
+		int16x8_t xv = vld1q_s16(x + i);
+		int16x8_t hv = vld1q_s16(h + i);
+		
+		acc = vmlal_s16(acc, vget_low_s16(xv), vget_low_s16(hv));
+		acc = vmlal_s16(acc, vget_high_s16(xv), vget_high_s16(hv));
+	}
+	
+	int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	sum = vpadd_s32(sum, sum);
+	
+	return vget_lane_s32(sum, 0);
+	
+#elif USE_SSE2
+	
+	__m128i acc = _mm_setzero_si128();
+	
+	unsigned i;
+	for(i = 0; i < length; i += 8)
+	{
+		__m128i xv = _mm_loadu_si128((const __m128i *)(x + i));
+		__m128i hv = _mm_loadu_si128((const __m128i *)(h + i));
+		
+		// Multiplies the 8 pairs of samples, and adds adjacent products into 4 32-bit sums
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(xv, hv));
+	}
+	
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	
+	return _mm_cvtsi128_si32(acc);
+	
+#else
+	
+	pj_int32_t acc = 0;
+	
+	unsigned i;
+	for(i = 0; i < length; i++)
+	{
+		acc += (pj_int32_t)x[i] * h[i];
+	}
+	
+	return acc;
+	
+#endif
+}
+
+/**
+ * Resamples the given input, and writes up to maxOutput frames of output.
+ * 
+ * All of the input is consumed (and kept in the history as needed), and inFrames may not exceed maxInput.
+ * Output is produced until either maxOutput frames are written, or the input runs out.
+ * Returns the number of frames written.
+**/
+static unsigned resamplerProcess(snd_resampler *rs,
+                                 const pj_int16_t *input,
+                                 unsigned inFrames,
+                                 pj_int16_t *output,
+                                 unsigned maxOutput)
+{
+	unsigned channels = rs->channels;
+	unsigned taps = rs->taps;
+	
+	// Append the new input to the history of each channel
+	
+	unsigned c, i;
+	
+	if(channels == 1)
+	{
+		memcpy(rs->history[0] + taps, input, inFrames * sizeof(pj_int16_t));
+	}
+	else
+	{
+		for(c = 0; c < channels; c++)
+		{
+			pj_int16_t *dst = rs->history[c] + taps;
+			
+			for(i = 0; i < inFrames; i++)
+			{
+				dst[i] = input[(i * channels) + c];
+			}
+		}
+	}
+	
+	int index = rs->index;
+	pj_uint32_t phase = rs->phase;
+	pj_uint32_t fixedPhases = rs->phases << RESAMPLER_PHASE_SHIFT;
+	unsigned produced = 0;
+	
+	while((produced < maxOutput) && (index < (int)inFrames))
+	{
+		const pj_int16_t *coefs = rs->coefs + ((phase >> RESAMPLER_PHASE_SHIFT) * taps);
+		pj_int32_t fraction = phase & ((1 << RESAMPLER_PHASE_SHIFT) - 1);
+		
+		for(c = 0; c < channels; c++)
+		{
+			// The window of taps samples ending at the current input frame
+			const pj_int16_t *window = rs->history[c] + index + 1;
+			
+			pj_int32_t acc = dotProduct(window, coefs, taps);
+			
+			if(fraction != 0)
+			{
+				// We're somewhere between two phases (only ever the case for an adjusted variable resampler)
+				pj_int32_t next = dotProduct(window, coefs + taps, taps);
+				acc += (pj_int32_t)((((pj_int64_t)next - acc) * fraction) >> RESAMPLER_PHASE_SHIFT);
+			}
+			
+			acc = (acc + (1 << (RESAMPLER_COEF_SHIFT - 1))) >> RESAMPLER_COEF_SHIFT;
+			
+			if(acc > 32767)  acc = 32767;
+			if(acc < -32768) acc = -32768;
+			
+			*output++ = (pj_int16_t)acc;
+		}
+		
+		produced++;
+		
+		index += rs->stepFrames;
+		phase += rs->stepPhases;
+		
+		if(phase >= fixedPhases)
+		{
+			phase -= fixedPhases;
+			index++;
+		}
+	}
+	
+	// Keep the last taps samples around for the next call
+	
+	for(c = 0; c < channels; c++)
+	{
+		memmove(rs->history[c], rs->history[c] + inFrames, taps * sizeof(pj_int16_t));
+	}
+	
+	rs->index = index - (int)inFrames;
+	rs->phase = phase;
+	
+	return produced;
+}
+
+/**
+ * Renders numFrames frames into the device buffer, through the given resampler.
+ * 
+ * The reframer produces data at the pjsip rate, in the pjsip channel count (so its device channels must match).
+ * This is resampled to the device rate, and then converted to the device channel count.
+ * 
+ * The scratch buffer must hold (maxInput + RESAMPLER_CHUNK_FRAMES) frames in the pjsip channel count.
+**/
+static void resampleRender(snd_reframer *rf,
+                           snd_resampler *rs,
+                           pj_int16_t *scratch,
+                           void *deviceBuffer,
+                           unsigned deviceChannels,
+                           unsigned numFrames)
+{
+	unsigned channels = rs->channels;
+	
+	pj_int16_t *input = scratch;
+	pj_int16_t *output = scratch + (rs->maxInput * channels);
+	
+	pj_int16_t *out = (pj_int16_t *)deviceBuffer;
+	
+	while(numFrames > 0)
+	{
+		unsigned chunkFrames = (numFrames < RESAMPLER_CHUNK_FRAMES) ? numFrames : RESAMPLER_CHUNK_FRAMES;
+		unsigned inFrames = resamplerInputFrames(rs, chunkFrames);
+		
+		reframerRender(rf, input, inFrames * channels * sizeof(pj_int16_t));
+		
+		if(deviceChannels == channels)
+		{
+			resamplerProcess(rs, input, inFrames, out, chunkFrames);
+		}
+		else
+		{
+			resamplerProcess(rs, input, inFrames, output, chunkFrames);
+			copyFrames(out, deviceChannels, output, channels, chunkFrames);
+		}
+		
+		out += chunkFrames * deviceChannels;
+		numFrames -= chunkFrames;
+	}
+}
+
+/**
+ * Passes numFrames frames from the device buffer to the reframer, through the given resampler.
+ * 
+ * The device data is converted to the pjsip channel count, and then resampled to the pjsip rate.
+ * The reframer receives data in the pjsip channel count (so its device channels must match).
+ * 
+ * The maxInput of the resampler must be at least RESAMPLER_CHUNK_FRAMES, and the scratch buffer must hold
+ * (RESAMPLER_CHUNK_FRAMES + maxOutput) frames in the pjsip channel count,
+ * where maxOutput is (RESAMPLER_CHUNK_FRAMES * outRate / inRate) + 2.
+**/
+static void resampleCapture(snd_reframer *rf,
+                            snd_resampler *rs,
+                            pj_int16_t *scratch,
+                            const void *deviceBuffer,
+                            unsigned deviceChannels,
+                            unsigned numFrames)
+{
+	unsigned channels = rs->channels;
+	
+	pj_int16_t *input = scratch;
+	pj_int16_t *output = scratch + (RESAMPLER_CHUNK_FRAMES * channels);
+	
+	unsigned maxOutput = (RESAMPLER_CHUNK_FRAMES * rs->outRate / rs->inRate) + 2;
+	
+	const pj_int16_t *in = (const pj_int16_t *)deviceBuffer;
+	
+	while(numFrames > 0)
+	{
+		unsigned chunkFrames = (numFrames < RESAMPLER_CHUNK_FRAMES) ? numFrames : RESAMPLER_CHUNK_FRAMES;
+		unsigned outFrames;
+		
+		if(deviceChannels == channels)
+		{
+			outFrames = resamplerProcess(rs, in, chunkFrames, output, maxOutput);
+		}
+		else
+		{
+			copyFrames(input, channels, in, deviceChannels, chunkFrames);
+			outFrames = resamplerProcess(rs, input, chunkFrames, output, maxOutput);
+		}
+		
+		reframerCapture(rf, output, outFrames * channels * sizeof(pj_int16_t));
+		
+		in += chunkFrames * deviceChannels;
+		numFrames -= chunkFrames;
+	}
+}
+
+/**
+ * Clock drift.
+ * 
+ * Core audio tags every IO cycle with the sample time of its first frame (mSampleTime),
+ * and the host time at which that frame hits the hardware (mHostTime).
+ * Comparing how far the sample time advances against how far the host time advances
+ * tells us the actual sample rate of the hardware, as opposed to the nominal one.
+ * 
+ * The capture and render side each get a clock estimator. As long as they're driven by the same clock,
+ * their rates are identical (even if they're both slightly off). But if the input and output are different
+ * pieces of hardware (a bluetooth headset, a USB interface, etc) their clocks drift apart.
+ * pjsip then sees more (or fewer) captured frames than played frames, and its delay buffer
+ * has to drop or insert audio every so often to make up for it.
+ * 
+ * The drift controller prevents that by adjusting the ratio of the input resampler, so that the capture side
+ * delivers frames at the same rate at which the render side consumes them.
+ * The measured rates do most of the work. On top of that, any difference between the number of frames
+ * captured and rendered (relative to when we started) is slowly steered back to zero,
+ * so small errors in the measurement can't add up over a long call.
+**/
+
+// Number of seconds of audio over which each rate measurement is made
+#define DRIFT_MEASURE_SECONDS  2
+
+// The time constant (in seconds) with which the difference between captured and rendered frames is steered back
+#define DRIFT_FILL_SECONDS  300
+
+// The largest adjustment we'll ever make, in parts per million.
+// Real clocks are off by a few hundred ppm at most, anything beyond that is a measurement gone wrong.
+#define DRIFT_MAX_PPM  1000
+
+typedef struct snd_clock_estimator
+{
+	double nominalRate;
+	double hostTicksPerSecond;
+	
+	// The start of the current measurement
+	pj_bool_t haveReference;
+	double referenceSampleTime;
+	pj_uint64_t referenceHostTime;
+	
+	// The sample time we expect next, to detect discontinuities
+	double nextSampleTime;
+	
+	// The smoothed rate, in samples per second, and its deviation from the nominal rate
+	pj_bool_t valid;
+	double rate;
+	pj_int32_t ppb;
+	
+	// Number of measurements taken
+	pj_uint32_t measurements;
+	
+} snd_clock_estimator;
+
+/**
+ * Prepares a clock estimator for use.
+**/
+static void clockEstimatorInit(snd_clock_estimator *est, double nominalRate, double hostTicksPerSecond)
+{
+	pj_bzero(est, sizeof(snd_clock_estimator));
+	
+	est->nominalRate = nominalRate;
+	est->hostTicksPerSecond = hostTicksPerSecond;
+}
+
+/**
+ * Forgets all measurements.
+**/
+static void clockEstimatorReset(snd_clock_estimator *est)
+{
+	est->haveReference = PJ_FALSE;
+	est->valid = PJ_FALSE;
+	est->measurements = 0;
+	
+	ATOMIC_STORE(&est->ppb, 0);
+}
+
+/**
+ * Invoked for every IO cycle, with the sample time and host time of its first frame.
+ * Returns PJ_TRUE whenever a new measurement was completed.
+**/
+static pj_bool_t clockEstimatorUpdate(snd_clock_estimator *est,
+                                      double sampleTime,
+                                      pj_uint64_t hostTime,
+                                      unsigned numFrames)
+{
+	pj_bool_t continuous = (sampleTime == est->nextSampleTime);
+	est->nextSampleTime = sampleTime + numFrames;
+	
+	if(!est->haveReference || !continuous)
+	{
+		// Start (or restart, after a discontinuity) the measurement here
+		est->haveReference = PJ_TRUE;
+		est->referenceSampleTime = sampleTime;
+		est->referenceHostTime = hostTime;
+		
+		return PJ_FALSE;
+	}
+	
+	double elapsedSamples = sampleTime - est->referenceSampleTime;
+	
+	if(elapsedSamples < (est->nominalRate * DRIFT_MEASURE_SECONDS))
+	{
+		return PJ_FALSE;
+	}
+	
+	double elapsedSeconds = (double)(hostTime - est->referenceHostTime) / est->hostTicksPerSecond;
+	
+	est->referenceSampleTime = sampleTime;
+	est->referenceHostTime = hostTime;
+	
+	if(elapsedSeconds <= 0.0)
+	{
+		return PJ_FALSE;
+	}
+	
+	double rate = elapsedSamples / elapsedSeconds;
+	
+	// Throw away anything that's obviously not a clock being slightly off
+	if(fabs((rate / est->nominalRate) - 1.0) > (DRIFT_MAX_PPM / 1e6))
+	{
+		return PJ_FALSE;
+	}
+	
+	// Smooth out the jitter of the individual measurements
+	if(est->valid)
+		est->rate += (rate - est->rate) * 0.1;
+	else
+		est->rate = rate;
+	
+	est->valid = PJ_TRUE;
+	STAT_INCREMENT(est->measurements);
+	
+	ATOMIC_STORE(&est->ppb, (pj_int32_t)(((est->rate / est->nominalRate) - 1.0) * 1e9));
+	
+	return PJ_TRUE;
+}
+
+typedef struct snd_drift_ctl
+{
+	// The pjsip clock rate, in frames per second
+	unsigned clockRate;
+	
+	// The difference between captured and rendered frames when we started steering
+	pj_bool_t haveBaseline;
+	pj_int32_t baseline;
+	
+	// The adjustment we currently apply, in parts per billion
+	pj_int32_t correction;
+	
+} snd_drift_ctl;
+
+/**
+ * Prepares a drift controller for use.
+**/
+static void driftCtlInit(snd_drift_ctl *ctl, unsigned clockRate)
+{
+	ctl->clockRate = clockRate;
+	ctl->haveBaseline = PJ_FALSE;
+	ctl->baseline = 0;
+	
+	ATOMIC_STORE(&ctl->correction, 0);
+}
+
+/**
+ * Computes the adjustment for the input resampler, in parts per billion.
+ * 
+ * The capture and render deviation are those measured by the clock estimators.
+ * The difference is the number of frames captured minus the number of frames rendered so far.
+**/
+static pj_int32_t driftCtlUpdate(snd_drift_ctl *ctl,
+                                 pj_int32_t capturePpb,
+                                 pj_int32_t renderPpb,
+                                 pj_int32_t difference)
+{
+	if(!ctl->haveBaseline)
+	{
+		ctl->haveBaseline = PJ_TRUE;
+		ctl->baseline = difference;
+	}
+	
+	// If the capture clock runs fast, we have to consume the captured frames faster
+	double correction = (double)capturePpb - (double)renderPpb;
+	
+	// And if we've captured more frames than we've rendered, we have to consume them a little faster still
+	correction += (difference - ctl->baseline) * 1e9 / ((double)ctl->clockRate * DRIFT_FILL_SECONDS);
+	
+	double limit = DRIFT_MAX_PPM * 1000.0;
+	
+	if(correction > limit)  correction = limit;
+	if(correction < -limit) correction = -limit;
+	
+	ATOMIC_STORE(&ctl->correction, (pj_int32_t)correction);
+	
+	return ctl->correction;
+}
+
+/**
+ * Capture timeline.
+ * 
+ * The rec_cb timestamp advances by exactly samples_per_frame for every packet.
+ * As long as core audio delivers every frame, that's all there is to it.
+ * But if the hardware sample time jumps ahead (an overloaded IO thread, a failed AudioUnitRender, etc)
+ * the frames in between are lost. The timeline notices this, and tells us how far to advance the timestamp,
+ * so that it keeps following the hardware sample time (mapped to the pjsip clock rate).
+ * 
+ * The timeline also maps pjsip timestamps back to the host time at which they were captured,
+ * which is what an application needs to synchronize captured audio with anything else (e.g. video).
+ * Every capture IO cycle publishes an anchor: the pjsip timestamp of a frame, and the host time of that frame.
+ * Any other timestamp is converted relative to the most recent anchor, at the nominal sample rate.
+ * The anchor is published with a sequence counter, so it may be read from any thread without locking.
+**/
+typedef struct snd_capture_timeline
+{
+	double hwRate;
+	unsigned clockRate;
+	unsigned channels;
+	double hostTicksPerSecond;
+	
+	// The sample time we expect next, and the fraction of a pjsip frame left over from previous gaps
+	pj_bool_t started;
+	double nextSampleTime;
+	double gapRemainder;
+	
+	// The anchor. The sequence counter is odd while the anchor is being updated, and zero if there's no anchor yet.
+	pj_uint32_t anchorSequence;
+	pj_uint32_t anchorTimestamp;
+	pj_uint64_t anchorHostTime;
+	
+} snd_capture_timeline;
+
+/**
+ * Prepares a capture timeline for use.
+**/
+static void timelineInit(snd_capture_timeline *tl,
+                         double hwRate,
+                         unsigned clockRate,
+                         unsigned channels,
+                         double hostTicksPerSecond)
+{
+	pj_bzero(tl, sizeof(snd_capture_timeline));
+	
+	tl->hwRate = hwRate;
+	tl->clockRate = clockRate;
+	tl->channels = channels;
+	tl->hostTicksPerSecond = hostTicksPerSecond;
+}
+
+/**
+ * Starts the timeline over, at whatever sample time comes next.
+ * May only be invoked while the capture IO thread isn't running.
+**/
+static void timelineReset(snd_capture_timeline *tl)
+{
+	tl->started = PJ_FALSE;
+	tl->gapRemainder = 0;
+	
+	ATOMIC_STORE(&tl->anchorSequence, 0);
+}
+
+/**
+ * Invoked for every IO cycle whose frames were all delivered, with the sample time of its first frame.
+ * 
+ * Returns the number of samples (in the pjsip clock rate and channel count) by which the timestamp
+ * must advance to account for frames that were lost since the previous IO cycle.
+**/
+static pj_uint32_t timelineUpdate(snd_capture_timeline *tl, double sampleTime, unsigned numFrames)
+{
+	double gap = sampleTime - tl->nextSampleTime;
+	
+	pj_bool_t started = tl->started;
+	
+	tl->started = PJ_TRUE;
+	tl->nextSampleTime = sampleTime + numFrames;
+	
+	if(!started || (gap <= 0))
+	{
+		// Either the very first cycle, or the sample time went backwards (the hardware was reset).
+		// There's nothing sensible to skip in either case, so we simply continue from here.
+		return 0;
+	}
+	
+	// Convert the lost hardware frames to pjsip frames, keeping the fraction for next time.
+	// The fraction isn't exact, so a sum like 1/6 + 5/6 may come out a hair short of a whole frame.
+	// Round those up, or we'd lose a frame (the remainder then goes a hair negative, which is fine).
+	
+	double frames = (gap * tl->clockRate / tl->hwRate) + tl->gapRemainder;
+	double wholeFrames = floor(frames + 1e-6);
+	
+	tl->gapRemainder = frames - wholeFrames;
+	
+	return (pj_uint32_t)wholeFrames * tl->channels;
+}
+
+/**
+ * Publishes a new anchor: the given pjsip timestamp was captured at the given host time.
+ * May only be invoked by the capture IO thread.
+**/
+static void timelineSetAnchor(snd_capture_timeline *tl, pj_uint32_t timestamp, pj_uint64_t hostTime)
+{
+	// An odd sequence tells readers we're in the middle of an update.
+	// Skip zero, which means there's no anchor at all.
+	
+	pj_uint32_t sequence = tl->anchorSequence;
+	
+	ATOMIC_STORE(&tl->anchorSequence, sequence | 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	ATOMIC_STORE(&tl->anchorTimestamp, timestamp);
+	ATOMIC_STORE(&tl->anchorHostTime, hostTime);
+	
+	sequence = (sequence | 1) + 1;
+	
+	ATOMIC_STORE(&tl->anchorSequence, (sequence == 0) ? 2 : sequence);
+}
+
+/**
+ * Converts the given pjsip timestamp to the host time at which it was captured.
+ * May be invoked from any thread. Returns PJ_FALSE if nothing has been captured yet.
+**/
+static pj_bool_t timelineHostTime(snd_capture_timeline *tl, pj_uint32_t timestamp, pj_uint64_t *hostTime)
+{
+	pj_uint32_t sequence;
+	pj_uint32_t anchorTimestamp;
+	pj_uint64_t anchorHostTime;
+	
+	do
+	{
+		sequence = ATOMIC_LOAD(&tl->anchorSequence);
+		
+		if(sequence == 0)
+		{
+			return PJ_FALSE;
+		}
+		
+		anchorTimestamp = ATOMIC_LOAD(&tl->anchorTimestamp);
+		anchorHostTime = ATOMIC_LOAD(&tl->anchorHostTime);
+		
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		
+	} while((sequence & 1) || (sequence != ATOMIC_LOAD(&tl->anchorSequence)));
+	
+	// The timestamp may lie before or after the anchor
+	
+	double frames = (double)(pj_int32_t)(timestamp - anchorTimestamp) / tl->channels;
+	double ticks = frames * tl->hostTicksPerSecond / tl->clockRate;
+	
+	*hostTime = (pj_uint64_t)((pj_int64_t)anchorHostTime + (pj_int64_t)floor(ticks + 0.5));
+	
+	return PJ_TRUE;
+}
+
+/**
+ * Adaptive latency controller.
+ * 
+ * Decides how much audio we keep buffered in the play ring (the target, in bytes).
+ * 
+ * Whenever a glitch is observed (the IO thread ran out of play data, or had to drop captured data)
+ * the target grows by one step. After a stretch of glitch-free audio, it shrinks back by one step,
+ * but never below the configured minimum. So the buffering quickly adapts to a struggling device,
+ * and slowly creeps back towards the lowest latency that works.
+ * 
+ * The controller doesn't look at the clock, or at the rings.
+ * It is only ever told how much audio has been played, and how many glitches have occurred so far.
+ * So its behavior is completely deterministic, and it may be driven by a synthetic timing trace.
+**/
+typedef struct snd_latency_ctl
+{
+	unsigned minTarget;
+	unsigned maxTarget;
+	unsigned step;
+	unsigned target;
+	
+	// Number of frames of glitch-free audio required before shrinking the target by one step
+	pj_uint32_t shrinkInterval;
+	
+	// Number of frames of glitch-free audio since the last glitch (or last shrink)
+	pj_uint32_t quietFrames;
+	
+	// Glitch counters as of the previous update
+	pj_uint32_t lastUnderruns;
+	pj_uint32_t lastOverruns;
+	
+	// Number of times the target was grown or shrunk
+	pj_uint32_t growCount;
+	pj_uint32_t shrinkCount;
+	
+} snd_latency_ctl;
+
+/**
+ * Prepares a latency controller for use.
+ * All sizes are in bytes. The target starts out at the minimum.
+**/
+static void latencyCtlInit(snd_latency_ctl *ctl,
+                           unsigned minTarget,
+                           unsigned maxTarget,
+                           unsigned step,
+                           pj_uint32_t shrinkInterval)
+{
+	pj_bzero(ctl, sizeof(snd_latency_ctl));
+	
+	ctl->minTarget = minTarget;
+	ctl->maxTarget = (maxTarget > minTarget) ? maxTarget : minTarget;
+	ctl->step = step;
+	ctl->target = minTarget;
+	ctl->shrinkInterval = shrinkInterval;
+}
+
+/**
+ * Feeds the controller with the number of frames played since the previous update,
+ * and the current (running) underrun and overrun counts.
+ * 
+ * Returns the new target.
+**/
+static unsigned latencyCtlUpdate(snd_latency_ctl *ctl,
+                                 pj_uint32_t elapsedFrames,
+                                 pj_uint32_t underruns,
+                                 pj_uint32_t overruns)
+{
+	pj_bool_t glitch = (underruns != ctl->lastUnderruns) || (overruns != ctl->lastOverruns);
+	
+	ctl->lastUnderruns = underruns;
+	ctl->lastOverruns = overruns;
+	
+	if(glitch)
+	{
+		// Grow by a single step per update, regardless of how many glitches there were.
+		// A single stall usually causes a burst of underruns, and we don't want to overreact to it.
+		
+		if(ctl->target + ctl->step <= ctl->maxTarget)
+		{
+			ctl->target += ctl->step;
+			ctl->growCount++;
+		}
+		
+		ctl->quietFrames = 0;
+	}
+	else
+	{
+		ctl->quietFrames += elapsedFrames;
+		
+		if(ctl->quietFrames >= ctl->shrinkInterval)
+		{
+			if(ctl->target >= ctl->minTarget + ctl->step)
+			{
+				ctl->target -= ctl->step;
+				ctl->shrinkCount++;
+			}
+			
+			ctl->quietFrames = 0;
+		}
+	}
+	
+	return ctl->target;
+}
+
+// The maximum number of streams that may be active on the voice unit at the same time, in each direction
+#define MAX_ACTIVE_STREAMS  8
+
+// The largest number of frames core audio may ask for in one IO cycle.
+// We set this on the voice unit, so we know how big our scratch buffers need to be.
+// (4096 is what Apple recommends, so audio keeps playing while the screen is locked.)
+#define MAX_FRAMES_PER_SLICE  4096
+
+// How long to wait for the IO threads to let go of a stream that is being stopped (in milliseconds)
+#define IO_CYCLE_WAIT  200
+
+// The number of packets over which REPEAT concealment fades out the last packet
+#define CONCEAL_REPEAT_PACKETS  3
+
+// How fast the comfort noise level follows the audio getting louder (as a shift, so 1/16 per packet)
+#define CONCEAL_FLOOR_RISE  4
+
+// The comfort noise level before we've seen any audio
+#define CONCEAL_FLOOR_UNKNOWN  ((unsigned)-1)
+
+/**
+ * The client format of a voice unit bus: interleaved linear PCM, either 16-bit or 32-bit float.
+ * 
+ * The streams always see 16-bit audio (see streamBusFormat).
+ * A float bus is converted at the edge of the voice unit, by voiceUnitRender and voiceUnitCapture.
+**/
+typedef struct snd_bus_format
+{
+	unsigned sampleRate;
+	unsigned channels;
+	unsigned bytesPerFrame;
+	pj_bool_t isFloat;
+	
+} snd_bus_format;
+
+/**
+ * The timing of an IO cycle, as reported by the backend.
+ *
+ * The sample time counts frames on the hardware timeline, and the host time is the matching
+ * time of the host clock (mach_absolute_time units for core audio, see snd_backend.getHostTicksPerSecond).
+ * Either may be missing.
+**/
+typedef struct snd_io_time
+{
+	double sampleTime;
+	pj_uint64_t hostTime;
+	
+	pj_bool_t sampleTimeValid;
+	pj_bool_t hostTimeValid;
+	
+} snd_io_time;
+
+// Whether the given snd_io_time has both a valid sample time and host time
+#define HAS_SAMPLE_HOST_TIME(time)  ((time)->sampleTimeValid && (time)->hostTimeValid)
+
+typedef struct snd_backend snd_backend;
+
+/**
+ * The voice unit, shared by all open streams.
+ * 
+ * There's only one VoiceProcessingIO unit per process. It's expensive to create,
+ * and several voice processing units would fight over the echo canceller anyway.
+ * It's created when the first stream is opened, and disposed of when the last stream is closed.
+ * 
+ * Streams that don't need voice processing can have it run on a RemoteIO unit instead,
+ * or have its voice processing bypassed (see options.unit_type and voiceUnitType).
+ * 
+ * The IO callbacks serve every active stream:
+ * - The render callback mixes the audio of all active playback streams (call audio, tones, prompts, ...)
+ * - The capture callback fetches the captured audio once, and hands it to all active capture streams.
+ * 
+ * Each stream keeps its own reframers, resamplers, rings and statistics,
+ * so streams may use different clock rates, channel counts and frame sizes.
+ * The voice unit itself runs at the sample rate picked for the stream that created it.
+ * 
+ * Everything here, except for the IO thread state, is protected by snd_streams_mutex.
+ * The IO threads only read the player and recorder slots, which are published atomically.
+**/
+typedef struct snd_voice_unit
+{
+	pj_pool_t *pool;
+	
+	// The backend the voice unit was created by, and the backend's own state for it
+	const snd_backend *backend;
+	void *backendState;
+	
+	// The directions enabled on the voice unit, the sample rate it runs at,
+	// and the client formats of its buses
+	pjmedia_dir dir;
+	unsigned clockRate;
+	snd_bus_format inputFormat;
+	snd_bus_format outputFormat;
+	
+	// The kind of audio unit the voice unit runs on (never PJMEDIA_SND_IPHONE_UNIT_AUTO),
+	// and whether the AGC of voice processing is enabled
+	pjmedia_snd_iphone_unit_type unitType;
+	pj_bool_t agc;
+	
+	// The channel counts the bus formats were picked for, and whether float was asked for (options.float_format).
+	// (The backend may have rejected them, see snd_backend.unitSetFormat.)
+	unsigned inputChannels;
+	unsigned outputChannels;
+	pj_bool_t floatFormat;
+	
+	// Float buses: The 16-bit audio on its way to or from the bus (allocated once a bus goes float),
+	// and the dither generator for captured audio (options.dither).
+	pj_int16_t *renderConvertBuffer;
+	pj_int16_t *captureConvertBuffer;
+	pj_bool_t dither;
+	pj_uint32_t ditherState[DITHER_LANES];
+	
+	// Scratch buffers for the IO threads, scratchSize bytes each.
+	// The render callback has each additional playback stream render into mixBuffer, and mixes it in from there.
+	// The capture callback gives each capture stream but the last its own copy of the audio in captureBuffer,
+	// since the rec callback is allowed to modify the audio in place (e.g. echo cancellation).
+	pj_int16_t *mixBuffer;
+	pj_int16_t *captureBuffer;
+	unsigned scratchSize;
+	
+	// The number of open streams
+	unsigned openCount;
+	
+	// Whether the voice unit is currently started
+	pj_bool_t isRunning;
+	
+	// The active playback and capture streams.
+	// Empty slots are NULL, and the IO threads simply skip them.
+	pjmedia_snd_stream *players[MAX_ACTIVE_STREAMS];
+	pjmedia_snd_stream *recorders[MAX_ACTIVE_STREAMS];
+	
+	// The number of completed IO cycles.
+	// Once these have moved on, the IO threads are done with any stream that was removed from the slots.
+	pj_uint32_t renderCycles;
+	pj_uint32_t captureCycles;
+	
+	// The core audio IO threads, whether we tried to register them with pjlib, and whether that failed.
+	// These are reset whenever the voice unit is stopped, since its threads may disappear along with it.
+	pj_thread_desc inputThreadDesc;
+	pj_bool_t inputThreadRegistered;
+	pj_bool_t inputThreadFailed;
+	
+	pj_thread_desc outputThreadDesc;
+	pj_bool_t outputThreadRegistered;
+	pj_bool_t outputThreadFailed;
+	
+} snd_voice_unit;
+
+/**
+ * Audio backend.
+ *
+ * Everything the driver needs from the platform goes through one of these.
+ * The core audio backend drives a VoiceProcessingIO (or RemoteIO) unit and the audio session.
+ * The loopback backend drives the same IO callbacks from a timer thread, with WAV files or
+ * an in-memory loopback in place of the audio hardware, so the driver can be tested without a device.
+ *
+ * The backend calls voiceUnitRender and voiceUnitCapture from its IO thread(s).
+ * Apart from those, everything is invoked with the streams locked.
+ *
+ * The unit operations mirror the life cycle of an audio unit: a unit is created, has IO enabled and its
+ * bus formats set while uninitialized, and is then initialized, started and stopped any number of times.
+ * (The output format is set after initializing, see voiceUnitConfigure.)
+**/
+struct snd_backend
+{
+	const char *name;
+	
+	// Invoked by pjmedia_snd_init and pjmedia_snd_deinit
+	pj_status_t (*init)(void);
+	void (*deinit)(void);
+	
+	// Activates the audio session for the given combined direction of all active streams, or deactivates it
+	void (*startSession)(pjmedia_dir dir);
+	void (*stopSession)(void);
+	
+	// The hardware IO buffer duration (in seconds) to ask for, and the one currently in effect
+	void (*setPreferredIOBufferDuration)(double duration);
+	double (*getIOBufferDuration)(void);
+	
+	// The current hardware sample rate (or 0 if unknown), and the host clock rate of snd_io_time.hostTime
+	unsigned (*getHardwareSampleRate)(void);
+	double (*getHostTicksPerSecond)(void);
+	
+	// The size of the backend state of a voice unit (allocated by voiceUnitCreate)
+	pj_size_t unitStateSize;
+	
+	// Creates the kind of unit given by snd_voice_unit.unitType
+	pj_status_t (*unitCreate)(snd_voice_unit *unit);
+	void (*unitDispose)(snd_voice_unit *unit);
+	
+	// Applies snd_voice_unit.unitType and agc to the voice processing of the unit (if it has any)
+	pj_status_t (*unitSetProcessing)(snd_voice_unit *unit);
+	
+	// Enables or disables IO on the capture or playback bus
+	pj_status_t (*unitEnableIO)(snd_voice_unit *unit, pjmedia_dir bus, pj_bool_t enabled);
+	
+	// Sets the client format (16-bit or float) of the capture or playback bus.
+	// The backend may pick a different channel count or sample format, and stores the format it applied.
+	pj_status_t (*unitSetFormat)(snd_voice_unit *unit, pjmedia_dir bus, unsigned clockRate, unsigned channels,
+	                             pj_bool_t isFloat, snd_bus_format *format);
+	
+	pj_status_t (*unitInitialize)(snd_voice_unit *unit);
+	void (*unitUninitialize)(snd_voice_unit *unit);
+	
+	// Stop doesn't return until the IO callbacks are done
+	pj_status_t (*unitStart)(snd_voice_unit *unit);
+	void (*unitStop)(snd_voice_unit *unit);
+	
+	// Fetches the audio captured in the current IO cycle (in the input bus format).
+	// Invoked by voiceUnitCapture, with the context the backend passed to it.
+	pj_status_t (*unitFetchCapture)(snd_voice_unit *unit, void *context, unsigned numFrames,
+	                                const void **data, unsigned *size);
+};
+
+/**
+ * The state of a stream.
+ * 
+ * A started stream is suspended while the audio session is interrupted (e.g. by a phone call),
+ * and resumed once the interruption ends. See streamSuspend and streamResume.
+**/
+typedef enum snd_stream_state
+{
+	SND_STREAM_STOPPED,
+	SND_STREAM_RUNNING,
+	SND_STREAM_SUSPENDED
+	
+} snd_stream_state;
+
+/**
+ * The pjmedia_snd_stream struct is referenced in several other pjlib files,
+ * but is ultimately defined here in the sound driver.
+ * So we're allowed to put any information we may need in it.
+**/
+struct pjmedia_snd_stream
+{
+	// The pool holding the stream's arena, and nothing else (see snd_arena)
+	pj_pool_t *pool;
+	
+#if SND_ARENA_CHECK
+	// The used size of the pool once the stream was opened, which is checked by the IO callbacks
+	pj_size_t poolUsed;
+#endif
+	
+	pjmedia_dir dir;
+	int rec_id;
+	int play_id;
+	unsigned clock_rate;
+	unsigned channel_count;
+	unsigned samples_per_frame;
+	unsigned bits_per_sample;
+	unsigned packet_size;
+	
+	pjmedia_snd_rec_cb rec_cb;
+	pjmedia_snd_play_cb play_cb;
+	
+	void *user_data;
+	
+	// The callbacks the reframers (or the worker thread) invoke for each 16-bit packet of packet_size bytes.
+	// These are play_cb and rec_cb themselves, unless pjsip uses 32-bit frames (bits_per_sample == 32).
+	// Then they're widePlayCallback and wideRecCallback, which convert to and from the 32-bit packets
+	// (of pjsipPacketSize bytes) that pjsip deals in. Everything else in the driver only ever sees 16-bit audio.
+	// 
+	// With voice activity detection (options.vad), packetRec is vadRecCallback, which passes packets on to vadRec.
+	// With an echo canceller (options.aec_cb), packetRec is aecRecCallback, which passes packets on to aecRec.
+	pjmedia_snd_play_cb packetPlay;
+	pjmedia_snd_rec_cb packetRec;
+	void *packetPlayUserData;
+	void *packetRecUserData;
+	
+	unsigned pjsipPacketSize;
+	pj_int32_t *widePlayBuffer;
+	pj_int32_t *wideRecBuffer;
+	
+	snd_vad vad;
+	pjmedia_snd_rec_cb vadRec;
+	void *vadRecUserData;
+	
+	// The played packets, for the echo canceller (options.aec_cb).
+	// The output reframer publishes to this, and aecRecCallback pairs the captured packets up with them.
+	snd_reference reference;
+	pjmedia_snd_rec_cb aecRec;
+	void *aecRecUserData;
+	
+	// The voice unit is shared by all open streams (see snd_voice_unit).
+	// These are the client formats of its buses, as far as this stream uses them (always 16-bit, see streamBusFormat).
+	snd_voice_unit *unit;
+	snd_bus_format inputFormat;
+	snd_bus_format outputFormat;
+	
+	snd_reframer inputReframer;
+	snd_reframer outputReframer;
+	
+	// In-driver sample rate conversion (options.hw_clock_rate).
+	// 
+	// The sample rate the voice unit runs at. When this differs from clock_rate, we convert between the two
+	// ourselves, and the reframers work in the pjsip channel count, with the resamplers between them and core audio.
+	// Otherwise the resamplers are NULL.
+	
+	unsigned hwClockRate;
+	
+	snd_resampler *inputResampler;
+	snd_resampler *outputResampler;
+	
+	pj_int16_t *inputResampleBuffer;
+	pj_int16_t *outputResampleBuffer;
+	
+	// Clock drift compensation (options.drift_compensation).
+	// The input resampler is then always used, and its ratio is adjusted by the drift controller.
+	
+	pj_bool_t driftCompensation;
+	
+	snd_clock_estimator captureClock;
+	snd_clock_estimator renderClock;
+	snd_drift_ctl driftCtl;
+	
+	// Keeps the capture timestamps in line with the hardware sample time,
+	// and maps them to host time (see pjmedia_snd_iphone_stream_get_capture_host_time).
+	snd_capture_timeline captureTimeline;
+	
+	// The options that were in effect when the stream was opened
+	pjmedia_snd_iphone_options options;
+	
+	// Asynchronous callbacks (options.async_callbacks).
+	// 
+	// The IO callbacks move audio between core audio and the rings,
+	// and the worker thread moves audio between the rings and pjsip.
+	
+	snd_ring playRing;
+	snd_ring recRing;
+	unsigned playRingTarget;
+	
+	// Adaptive latency (options.adaptive_latency).
+	// Adjusts playRingTarget based on the underruns and overruns seen by the IO callbacks.
+	snd_latency_ctl latencyCtl;
+	pj_uint32_t latencyCtlTimestamp;
+	
+	void *workerBuffer;
+	pj_pool_t *workerPool;
+	pj_thread_t *workerThread;
+	pj_bool_t workerRunning;
+	unsigned workerInterval;
+	
+	pj_uint32_t workerPlayTimestamp;
+	
+	pj_uint32_t playUnderruns;
+	pj_uint32_t recOverruns;
+	
+	// The hardware IO buffer duration (in seconds) that core audio actually granted us
+	double ioBufferDuration;
+	
+	// Messages from the IO threads, drained by the worker thread.
+	// The render and capture callbacks may run on different threads, so each has its own log.
+	snd_log renderLog;
+	snd_log captureLog;
+	pj_uint32_t logsDraining;
+	
+	// Realtime statistics (see pjmedia_snd_iphone_stream_get_stats)
+	pjmedia_snd_iphone_stats stats;
+	pj_timestamp openTime;
+	snd_io_tracker renderTracker;
+	snd_io_tracker captureTracker;
+	
+	// Fades playback in and out (options.fade_msec).
+	// The output reframer only uses it if the ramp isn't empty.
+	snd_fade fade;
+	
+	// Whether the play ring ran dry (asynchronous mode), so playback fades in again once it recovers
+	pj_bool_t playStarved;
+	
+	// Underrun concealment (options.underrun_concealment), only touched by the render IO thread.
+	// 
+	// concealPacket is a copy of the last packet we got out of the play ring (REPEAT),
+	// and concealCount is the number of packets concealed since.
+	// concealFloor is the level (RMS) of the quietest recent audio, and concealNoise the noise generator (NOISE).
+	
+	pj_int16_t *concealPacket;
+	unsigned concealCount;
+	unsigned concealFloor;
+	pj_uint32_t concealNoise;
+	
+	// The next stream in the list of open streams (snd_streams)
+	pjmedia_snd_stream *next;
+	
+	snd_stream_state state;
+	
+	// Suspend/resume bookkeeping.
+	// The resumed flags are set while the voice unit is stopped,
+	// and cleared by the IO threads on the first cycle after the stream was resumed.
+	pj_timestamp suspendTime;
+	pj_timestamp resumeTime;
+	pj_bool_t renderResumed;
+	pj_bool_t captureResumed;
+};
+
+// All open streams.
+// A playback-only stream (e.g. a ringtone) may be open at the same time as a full-duplex call stream.
+// The audio session is shared by all of them, so starting and stopping the audio session,
+// as well as handling audio session interruptions, needs to take every stream into account.
+// 
+// The list (and the state of each stream) is protected by snd_streams_mutex.
+static pjmedia_snd_stream *snd_streams = NULL;
+static pj_mutex_t *snd_streams_mutex = NULL;
+
+// Whether the audio session is currently interrupted.
+// Protected by snd_streams_mutex.
+static pj_bool_t snd_interrupted = PJ_FALSE;
+
+static void lockStreams()
+{
+	if(snd_streams_mutex) pj_mutex_lock(snd_streams_mutex);
+}
+
+static void unlockStreams()
+{
+	if(snd_streams_mutex) pj_mutex_unlock(snd_streams_mutex);
+}
+
+/**
+ * Adds the given stream to the list of open streams.
+**/
+static void registerStream(pjmedia_snd_stream *snd_strm)
+{
+	lockStreams();
+	
+	snd_strm->next = snd_streams;
+	snd_streams = snd_strm;
+	
+	unlockStreams();
+}
+
+/**
+ * Removes the given stream from the list of open streams.
+**/
+static void unregisterStream(pjmedia_snd_stream *snd_strm)
+{
+	lockStreams();
+	
+	pjmedia_snd_stream **link = &snd_streams;
+	
+	while(*link)
+	{
+		if(*link == snd_strm)
+		{
+			*link = snd_strm->next;
+			break;
+		}
+		link = &((*link)->next);
+	}
+	
+	snd_strm->next = NULL;
+	
+	unlockStreams();
+}
+
+/**
+ * Returns the combined direction of all active streams.
+ * The streams must be locked.
+**/
+static pjmedia_dir activeStreamsDirection()
+{
+	int dir = PJMEDIA_DIR_NONE;
+	
+	pjmedia_snd_stream *snd_strm;
+	for(snd_strm = snd_streams; snd_strm; snd_strm = snd_strm->next)
+	{
+		if(snd_strm->state != SND_STREAM_STOPPED)
+		{
+			dir |= snd_strm->dir;
+		}
+	}
+	
+	return (pjmedia_dir)dir;
+}
+
+// The shared voice unit, or NULL if no stream is open.
+// Protected by snd_streams_mutex.
+static snd_voice_unit *snd_unit = NULL;
+
+/**
+ * Forgets the IO threads of the voice unit.
+ * Once you stop the audio unit the related threads might disappear as well.
+ * So we should clear any thread registration variables at this point.
+**/
+static void resetIOThreads(snd_voice_unit *unit)
+{
+	unit->inputThreadRegistered = PJ_FALSE;
+	unit->outputThreadRegistered = PJ_FALSE;
+	
+	unit->inputThreadFailed = PJ_FALSE;
+	unit->outputThreadFailed = PJ_FALSE;
+	
+	pj_bzero(unit->inputThreadDesc, sizeof(unit->inputThreadDesc));
+	pj_bzero(unit->outputThreadDesc, sizeof(unit->outputThreadDesc));
+}
+
+/**
+ * Suspends a running stream, because the audio session was interrupted.
+ * 
+ * The voice unit must already be stopped, so the IO callbacks don't touch the stream anymore.
+ * Everything else about the stream (including the worker thread) stays as it is.
+ * The streams must be locked.
+**/
+static void streamSuspend(pjmedia_snd_stream *snd_strm)
+{
+	snd_strm->state = SND_STREAM_SUSPENDED;
+	pj_get_timestamp(&snd_strm->suspendTime);
+}
+
+/**
+ * Gets a suspended stream ready to run again, because the audio session interruption has ended.
+ * 
+ * Whatever the stream still holds from before the interruption is stale by now.
+ * Playing it would glitch, and the state derived from the old hardware timeline no longer applies.
+ * So we start over, the same as pjmedia_snd_stream_start does:
+ * 
+ * - The staging buffers of the reframers are flushed. A partial capture packet is dropped.
+ *   The timestamps simply continue, so pjsip sees a contiguous stream.
+ * - The resampler histories are cleared.
+ * - The capture timeline (and thus the host time mapping) is rebased on the hardware sample time after resume.
+ * - The clocks are measured from scratch, and the drift compensation gets a new baseline.
+ * - In asynchronous mode, the render IO thread discards the play ring on its first cycle after resume.
+ *   (It's the consumer of the play ring, so it's the only one that may do so while the worker thread is running.)
+ * 
+ * The voice unit must still be stopped.
+ * The streams must be locked.
+**/
+static void streamResume(pjmedia_snd_stream *snd_strm)
+{
+	pj_get_timestamp(&snd_strm->resumeTime);
+	
+	reframerResetRender(&snd_strm->outputReframer);
+	reframerResetCapture(&snd_strm->inputReframer);
+	
+	if(snd_strm->outputResampler)
+	{
+		resamplerReset(snd_strm->outputResampler);
+	}
+	
+	if(snd_strm->inputResampler)
+	{
+		resamplerReset(snd_strm->inputResampler);
+	}
+	
+	timelineReset(&snd_strm->captureTimeline);
+	
+	if(snd_strm->driftCompensation)
+	{
+		clockEstimatorReset(&snd_strm->captureClock);
+		clockEstimatorReset(&snd_strm->renderClock);
+		
+		driftCtlInit(&snd_strm->driftCtl, snd_strm->clock_rate);
+		resamplerSetAdjustment(snd_strm->inputResampler, 0);
+	}
+	
+	ATOMIC_STORE(&snd_strm->stats.suspended_msec, pj_elapsed_msec(&snd_strm->suspendTime, &snd_strm->resumeTime));
+	STAT_INCREMENT(snd_strm->stats.resumes);
+	
+	// Playback picks up wherever pjsip is now, so fade it in.
+	// And don't conceal an underrun with audio from before the interruption.
+	if(snd_strm->outputReframer.fade)
+	{
+		fadeStart(snd_strm->outputReframer.fade);
+	}
+	
+	snd_strm->concealCount = CONCEAL_REPEAT_PACKETS;
+	
+	snd_strm->renderResumed = PJ_TRUE;
+	snd_strm->captureResumed = PJ_TRUE;
+	
+	snd_strm->state = SND_STREAM_RUNNING;
+}
+
+#if !MANAGE_AUDIO_SESSION
+  // Optional audio session callbacks to be used by the application.
+  // These should be used when MANAGE_AUDIO_SESSION is disabled.
+  static pjmedia_snd_audio_session_callback audio_session_callbacks;
+#endif
+
+/**
+ * Fills in the options that should be used for a newly opened stream.
+**/
+static void getCurrentOptions(pjmedia_snd_iphone_options *opt)
+{
+	if(snd_options_set)
+	{
+		*opt = snd_options;
+	}
+	else
+	{
+		pjmedia_snd_iphone_options_default(opt);
+	}
+}
+
+/**
+ * Optional audio session callbacks to be used by the application.
+ * These should be used when MANAGE_AUDIO_SESSION is disabled.
+**/
+void pjmedia_snd_audio_session_set_callbacks(pjmedia_snd_audio_session_callback *cb)
+{
+#if !MANAGE_AUDIO_SESSION
+
+	audio_session_callbacks = *cb;
+
+#endif
+}
+
+/**
+ * Adjusts the input resampler to follow the render clock.
+ * 
+ * This is invoked on the capture IO thread, whenever the capture clock estimator completes a measurement.
+ * Nothing happens until the render clock estimator has completed its first measurement as well.
+**/
+static void updateDriftCompensation(pjmedia_snd_stream *snd_strm)
+{
+	if(ATOMIC_LOAD(&snd_strm->renderClock.measurements) == 0)
+	{
+		return;
+	}
+	
+	// The difference between the number of frames captured and rendered so far.
+	// The render timestamp is owned by the render IO thread, the capture counters are ours.
+	
+	snd_reframer *input = &snd_strm->inputReframer;
+	
+	pj_uint32_t rendered = ATOMIC_LOAD(&snd_strm->outputReframer.timestamp);
+	pj_uint32_t captured = (input->directCount + input->stagedCount) * input->samplesPerFrame;
+	
+	pj_int32_t difference = (pj_int32_t)(captured - rendered) / (pj_int32_t)snd_strm->channel_count;
+	
+	pj_int32_t correction = driftCtlUpdate(&snd_strm->driftCtl,
+	                                       ATOMIC_LOAD(&snd_strm->captureClock.ppb),
+	                                       ATOMIC_LOAD(&snd_strm->renderClock.ppb),
+	                                       difference);
+	
+	resamplerSetAdjustment(snd_strm->inputResampler, correction);
+}
+
+#if SND_ARENA_CHECK
+
+/**
+ * Asserts that nothing was allocated for the given stream since it was opened (see snd_arena).
+ * Invoked by the IO callbacks at the end of every IO cycle.
+**/
+static void arenaCheck(pjmedia_snd_stream *snd_strm)
+{
+	pj_assert(pj_pool_get_used_size(snd_strm->pool) == snd_strm->poolUsed);
+}
+
+#endif
+
+/**
+ * Updates the capture timeline with the given IO cycle, before its frames are passed to the input reframer.
+ * Invoked on the capture IO thread.
+**/
+static void updateCaptureTimeline(pjmedia_snd_stream *snd_strm, const snd_io_time *time, unsigned numFrames)
+{
+	snd_reframer *rf = &snd_strm->inputReframer;
+	snd_capture_timeline *tl = &snd_strm->captureTimeline;
+	
+	pj_uint32_t skip = timelineUpdate(tl, time->sampleTime, numFrames);
+	
+	if(skip > 0)
+	{
+		deferredLog(&snd_strm->captureLog, 4, "Capture lost %ld samples, timestamp skips ahead", skip, 0);
+		ATOMIC_STORE(&rf->timestamp, rf->timestamp + skip);
+	}
+	
+	if(!HAS_SAMPLE_HOST_TIME(time))
+	{
+		return;
+	}
+	
+	// The next frame the reframer receives will get this timestamp.
+	// (The partial packet in the staging buffer comes first.)
+	
+	pj_uint32_t timestamp = rf->timestamp + (rf->bufferOffset / sizeof(pj_int16_t));
+	
+	// Without a resampler, that frame is the first frame of this IO cycle.
+	// With a resampler, it's somewhere around there, depending on the resampler's state and filter delay.
+	
+	double offsetFrames = 0;
+	
+	if(snd_strm->inputResampler)
+	{
+		offsetFrames = resamplerPosition(snd_strm->inputResampler);
+	}
+	
+	pj_int64_t offsetTicks = (pj_int64_t)floor((offsetFrames * tl->hostTicksPerSecond / tl->hwRate) + 0.5);
+	
+	timelineSetAnchor(tl, timestamp, (pj_uint64_t)((pj_int64_t)time->hostTime + offsetTicks));
+}
+
+/**
+ * Tells the echo reference when the audio of this IO cycle is played, before the output reframer is asked for it.
+ * Invoked on the render IO thread.
+**/
+static void updateRenderReference(pjmedia_snd_stream *snd_strm, const snd_io_time *time)
+{
+	snd_reframer *rf = &snd_strm->outputReframer;
+	
+	if(!HAS_SAMPLE_HOST_TIME(time))
+	{
+		referenceSetAnchor(&snd_strm->reference, 0, 0, 0, PJ_FALSE);
+		return;
+	}
+	
+	// The first frame the reframer hands out is the first frame left in its staging buffer.
+	// That's the end of the packet that was staged last, minus whatever is left of it.
+	
+	double frame = (double)(rf->timestamp - ((rf->packetSize - rf->bufferOffset) / sizeof(pj_int16_t)));
+	frame /= snd_strm->channel_count;
+	
+	// With a resampler, the first frame of this IO cycle is somewhere around there,
+	// depending on the resampler's state and filter delay.
+	
+	if(snd_strm->outputResampler)
+	{
+		frame += resamplerPosition(snd_strm->outputResampler);
+	}
+	
+	referenceSetAnchor(&snd_strm->reference, frame, time->sampleTime, time->hostTime, PJ_TRUE);
+}
+
+/**
+ * Registers the calling core audio IO thread with pjlib.
+ * 
+ * The IO threads are created by core audio, so pjlib doesn't know about them.
+ * And since play_cb and rec_cb call into pjlib, they must be registered before we invoke those callbacks.
+ * 
+ * This is only invoked on the first IO cycle after the audio unit is started.
+ * It's kept out of line so the IO callbacks themselves only have to test the registered flag.
+ * Anything worth mentioning goes to the deferred log.
+ * 
+ * If registration fails, the failed flag is set, and the IO callbacks must not call into pjsip on this thread
+ * (they play silence and drop the captured audio instead). We don't retry, so the failure is only logged once.
+**/
+static void registerIOThread(pj_thread_desc desc, pj_bool_t *registered, pj_bool_t *failed, snd_log *log)
+{
+	if(pj_thread_is_registered())
+	{
+		deferredLog(log, 5, "AudioUnit IO thread already registered", 0, 0);
+		*registered = PJ_TRUE;
+		return;
+	}
+	
+	// pj_status_t pj_thread_register(const char  *thread_name,
+	//                            pj_thread_desc   desc,
+	//                               pj_thread_t **thread)
+	// 
+	// Register a thread that was created by external or native API to PJLIB.
+	// This function must be called in the context of the thread being registered.
+	// When the thread is created by external function or API call, it must be 'registered'
+	// to PJLIB using pj_thread_register(), so that it can cooperate with PJLIB's framework.
+	// During registration, some data needs to be maintained, and this data must remain
+	// available during the thread's lifetime.
+	
+	pj_thread_t *thread;
+	pj_status_t status = pj_thread_register(NULL, desc, &thread);
+	
+	if(status == PJ_SUCCESS)
+	{
+		deferredLog(log, 5, "AudioUnit created a separate IO thread, now registered with PJLIB", 0, 0);
+		*registered = PJ_TRUE;
+	}
+	else
+	{
+		deferredLog(log, 1, "AudioUnit IO thread failed to register with PJLIB (%ld), stream goes quiet", status, 0);
+		
+		// Don't keep retrying on every IO cycle
+		*failed = PJ_TRUE;
+		*registered = PJ_TRUE;
+	}
+}
+
+/**
+ * Renders the next size bytes of audio of the given stream into the given buffer, in the format of the output bus.
+ * Invoked on the render IO thread, once per IO cycle for every active playback stream.
+**/
+static void renderStream(snd_voice_unit *unit,
+                         pjmedia_snd_stream *snd_strm,
+                         const snd_io_time *time,
+                         unsigned numFrames,
+                         void *buffer,
+                         unsigned size)
+{
+	// The AudioUnit callbacks operate on a different real-time thread.
+	// In asynchronous mode we never call into pjsip from here, so there's no need to register it with pjlib.
+	if(!unit->outputThreadRegistered && !snd_strm->options.async_callbacks)
+	{
+		registerIOThread(unit->outputThreadDesc, &unit->outputThreadRegistered, &unit->outputThreadFailed,
+		                 &snd_strm->renderLog);
+	}
+	
+	pj_timestamp callbackStart;
+	pj_get_timestamp(&callbackStart);
+	
+	if(snd_strm->stats.render.callbacks == 0)
+	{
+		pj_uint32_t usec = pj_elapsed_usec(&snd_strm->openTime, &callbackStart);
+		
+		ATOMIC_STORE(&snd_strm->stats.first_render_usec, usec);
+		deferredLog(&snd_strm->renderLog, 4, "First render callback %ld usec after open", usec, 0);
+	}
+	
+	if(snd_strm->renderResumed)
+	{
+		pj_uint32_t usec = pj_elapsed_usec(&snd_strm->resumeTime, &callbackStart);
+		
+		ATOMIC_STORE(&snd_strm->stats.resume_render_usec, usec);
+		deferredLog(&snd_strm->renderLog, 4, "First render callback %ld usec after resume", usec, 0);
+		
+		// The play ring holds audio from before the interruption (see streamResume)
+		if(snd_strm->options.async_callbacks)
+		{
+			ringDiscard(&snd_strm->playRing);
+		}
+		
+		snd_strm->renderResumed = PJ_FALSE;
+	}
+	
+	ioStatsBegin(&snd_strm->stats.render,
+	             &snd_strm->renderTracker,
+	             &callbackStart,
+	             numFrames,
+	             time->sampleTime,
+	             snd_strm->outputFormat.sampleRate);
+	
+	if(snd_strm->driftCompensation && HAS_SAMPLE_HOST_TIME(time))
+	{
+		clockEstimatorUpdate(&snd_strm->renderClock, time->sampleTime, time->hostTime, numFrames);
+	}
+	
+	// The stream is usually configured as follows:
+	// 
+	// snd_strm->samples_per_frame = 160
+	// snd_strm->bits_per_sample = 16
+	// 
+	// snd_strm->packet_size = samples_per_frame * bits_per_sample / 8 = 320
+	
+	// Now here is the catch...
+	// We have no control over the amount of data that core data will ask for.
+	// And each time we invoke the pjlib play callback we get a fixed amount of data.
+	// 
+	// The output reframer takes care of this for us.
+	// It invokes the play callback as many times as needed to fill the buffer,
+	// converts from the pjsip channel count to the core audio channel count,
+	// and keeps any overflow of data around for the next time we're called.
+	// Whole packets that need no conversion are written by pjsip directly into the buffer, without a memcpy.
+	
+	// For a complete discussion on this code, please see discussion on architecture at the bottom of this file.
+	
+	// If the voice unit runs at a different sample rate than pjsip, the output resampler sits between
+	// the output reframer and core audio, and takes care of the channel conversion as well.
+	
+	// And if this thread couldn't be registered with pjlib, we can't invoke the play callback at all.
+	
+	if(snd_strm->outputReframer.reference)
+	{
+		updateRenderReference(snd_strm, time);
+	}
+	
+	if(unit->outputThreadFailed && !snd_strm->options.async_callbacks)
+	{
+		memset(buffer, 0, size);
+	}
+	else if(snd_strm->outputResampler)
+	{
+		resampleRender(&snd_strm->outputReframer,
+		               snd_strm->outputResampler,
+		               snd_strm->outputResampleBuffer,
+		               buffer,
+		               snd_strm->outputFormat.channels,
+		               size / snd_strm->outputFormat.bytesPerFrame);
+	}
+	else
+	{
+		reframerRender(&snd_strm->outputReframer, buffer, size);
+	}
+	
+	ioStatsEnd(&snd_strm->stats.render, &callbackStart);
+	
+#if SND_ARENA_CHECK
+	arenaCheck(snd_strm);
+#endif
+}
+
+/**
+ * Returns the format in which the streams see the given voice unit bus.
+ * That's the bus format itself, but always in 16 bits (see voiceUnitRender and voiceUnitCapture).
+**/
+static snd_bus_format streamBusFormat(const snd_bus_format *bus)
+{
+	snd_bus_format format = *bus;
+	
+	format.bytesPerFrame = format.channels * sizeof(pj_int16_t);
+	format.isFloat = PJ_FALSE;
+	
+	return format;
+}
+
+/**
+ * Renders the next IO cycle of the voice unit, by mixing the audio of every active playback stream
+ * into the given buffer (in the format of the output bus).
+ * 
+ * Invoked by the backend on the render IO thread.
+ * Returns PJ_FALSE if no stream is playing, in which case the buffer is filled with silence.
+**/
+static pj_bool_t voiceUnitRender(snd_voice_unit *unit,
+                                 const snd_io_time *time,
+                                 unsigned numFrames,
+                                 void *output,
+                                 unsigned size)
+{
+	// Our job in this method is to get the audio data from the pjsip callback method of every active playback stream,
+	// and then fill the given buffer with the mix of the fetched audio data.
+	
+	// According to Apple, we should avoid the following in audio unit IO callbacks:
+	// - memory allocation
+	// - semaphores/mutexes
+	// - objective-c method dispatching
+	
+	// The first stream renders straight into the output buffer, so the common case of a single stream costs nothing extra.
+	// Every other stream renders into the mix buffer, and is then added to the output buffer.
+	
+	// If the bus is float, the streams render (and are mixed) in 16 bits, and the mix is converted at the end.
+	
+	void *mixOutput = output;
+	unsigned mixSize = size;
+	
+	if(unit->outputFormat.isFloat)
+	{
+		mixOutput = unit->renderConvertBuffer;
+		mixSize = numFrames * unit->outputFormat.channels * sizeof(pj_int16_t);
+		
+		if(mixSize > unit->scratchSize)
+		{
+			// The backend asked for more than MAX_FRAMES_PER_SLICE, which it promised not to do
+			memset(output, 0, size);
+			
+			ATOMIC_STORE(&unit->renderCycles, unit->renderCycles + 1);
+			return PJ_FALSE;
+		}
+	}
+	
+	unsigned mixed = 0;
+	unsigned i;
+	
+	for(i = 0; i < MAX_ACTIVE_STREAMS; i++)
+	{
+		pjmedia_snd_stream *snd_strm = ATOMIC_LOAD(&unit->players[i]);
+		
+		if(snd_strm == NULL)
+		{
+			continue;
+		}
+		
+		if(mixed == 0)
+		{
+			renderStream(unit, snd_strm, time, numFrames, mixOutput, mixSize);
+		}
+		else if(mixSize <= unit->scratchSize)
+		{
+			renderStream(unit, snd_strm, time, numFrames, unit->mixBuffer, mixSize);
+			mixSaturate((pj_int16_t *)mixOutput, unit->mixBuffer, mixSize / sizeof(pj_int16_t));
+		}
+		else
+		{
+			// The backend asked for more than MAX_FRAMES_PER_SLICE, which it promised not to do
+			deferredLog(&snd_strm->renderLog, 1, "Render of %ld bytes exceeds the mix buffer", mixSize, 0);
+		}
+		
+		mixed++;
+	}
+	
+	if(mixed == 0)
+	{
+		memset(output, 0, size);
+	}
+	else if(unit->outputFormat.isFloat)
+	{
+		int16ToFloat((float *)output, unit->renderConvertBuffer, mixSize / sizeof(pj_int16_t));
+	}
+	
+	ATOMIC_STORE(&unit->renderCycles, unit->renderCycles + 1);
+	
+	return (mixed > 0);
+}
+
+/**
+ * Passes the given captured audio, in the format of the input bus, to the given stream.
+ * Invoked on the capture IO thread, once per IO cycle for every active capture stream.
+**/
+static void captureStream(snd_voice_unit *unit,
+                          pjmedia_snd_stream *snd_strm,
+                          const snd_io_time *time,
+                          unsigned numFrames,
+                          const void *buffer,
+                          unsigned size)
+{
+	// The AudioUnit callbacks operate on a different real-time thread.
+	// In asynchronous mode we never call into pjsip from here, so there's no need to register it with pjlib.
+	if(!unit->inputThreadRegistered && !snd_strm->options.async_callbacks)
+	{
+		registerIOThread(unit->inputThreadDesc, &unit->inputThreadRegistered, &unit->inputThreadFailed,
+		                 &snd_strm->captureLog);
+	}
+	
+	pj_timestamp callbackStart;
+	pj_get_timestamp(&callbackStart);
+	
+	if(snd_strm->stats.capture.callbacks == 0)
+	{
+		pj_uint32_t usec = pj_elapsed_usec(&snd_strm->openTime, &callbackStart);
+		
+		ATOMIC_STORE(&snd_strm->stats.first_capture_usec, usec);
+		deferredLog(&snd_strm->captureLog, 4, "First capture callback %ld usec after open", usec, 0);
+	}
+	
+	if(snd_strm->captureResumed)
+	{
+		pj_uint32_t usec = pj_elapsed_usec(&snd_strm->resumeTime, &callbackStart);
+		
+		ATOMIC_STORE(&snd_strm->stats.resume_capture_usec, usec);
+		deferredLog(&snd_strm->captureLog, 4, "First capture callback %ld usec after resume", usec, 0);
+		
+		snd_strm->captureResumed = PJ_FALSE;
+	}
+	
+	ioStatsBegin(&snd_strm->stats.capture,
+	             &snd_strm->captureTracker,
+	             &callbackStart,
+	             numFrames,
+	             time->sampleTime,
+	             snd_strm->inputFormat.sampleRate);
+	
+	if(snd_strm->driftCompensation && HAS_SAMPLE_HOST_TIME(time))
+	{
+		if(clockEstimatorUpdate(&snd_strm->captureClock, time->sampleTime, time->hostTime, numFrames))
+		{
+			updateDriftCompensation(snd_strm);
+		}
+	}
+	
+	// All frames of this IO cycle were delivered, so update the capture timeline.
+	// If any frames were lost since the previous cycle, the timestamp skips ahead accordingly.
+	
+	if(time->sampleTimeValid)
+	{
+		updateCaptureTimeline(snd_strm, time, numFrames);
+	}
+	
+	// So now we have a bunch of audio data.
+	// We need to pass it to PJLIB via the rec callback, but it only accepts exactly packet_size bytes at a time.
+	// And we have no control over the amount of data that core audio gives us.
+	// 
+	// The input reframer takes care of this for us.
+	// It converts from the core audio channel count to the pjsip channel count,
+	// invokes the rec callback for each complete packet,
+	// and keeps any partial packet around until we're called again.
+	// Whole packets that need no conversion are passed to pjsip straight out of the buffer, without a memcpy.
+	
+	// If the voice unit runs at a different sample rate than pjsip, the input resampler sits between
+	// core audio and the input reframer, and takes care of the channel conversion as well.
+	
+	// And if this thread couldn't be registered with pjlib, we can't invoke the rec callback at all.
+	
+	if(unit->inputThreadFailed && !snd_strm->options.async_callbacks)
+	{
+		// Nothing to do but drop the captured audio
+	}
+	else if(snd_strm->inputResampler)
+	{
+		resampleCapture(&snd_strm->inputReframer,
+		                snd_strm->inputResampler,
+		                snd_strm->inputResampleBuffer,
+		                buffer,
+		                snd_strm->inputFormat.channels,
+		                size / snd_strm->inputFormat.bytesPerFrame);
+	}
+	else
+	{
+		reframerCapture(&snd_strm->inputReframer, buffer, size);
+	}
+	
+	ioStatsEnd(&snd_strm->stats.capture, &callbackStart);
+	
+#if SND_ARENA_CHECK
+	arenaCheck(snd_strm);
+#endif
+}
+
+/**
+ * Captures the next IO cycle of the voice unit, and passes the audio to every active capture stream.
+ * 
+ * Invoked by the backend on the capture IO thread.
+ * The audio is only fetched from the backend (see snd_backend.unitFetchCapture) if a stream is capturing,
+ * with the given context. Returns the status of the fetch.
+**/
+static pj_status_t voiceUnitCapture(snd_voice_unit *unit,
+                                    const snd_io_time *time,
+                                    unsigned numFrames,
+                                    void *context)
+{
+	// Our job in this method is to get the data from the backend and pass it to the pjsip callback method
+	// of every active capture stream.
+	
+	// According to Apple, we should avoid the following in audio unit IO callbacks:
+	// - memory allocation
+	// - semaphores/mutexes
+	// - objective-c method dispatching
+	
+	// Take a snapshot of the active capture streams
+	
+	pjmedia_snd_stream *recorders[MAX_ACTIVE_STREAMS];
+	unsigned numRecorders = 0;
+	unsigned i;
+	
+	for(i = 0; i < MAX_ACTIVE_STREAMS; i++)
+	{
+		pjmedia_snd_stream *snd_strm = ATOMIC_LOAD(&unit->recorders[i]);
+		
+		if(snd_strm)
+		{
+			recorders[numRecorders++] = snd_strm;
+		}
+	}
+	
+	// If nobody is listening (e.g. only a ringtone is playing), there's no need to fetch the audio at all
+	
+	if(numRecorders == 0)
+	{
+		ATOMIC_STORE(&unit->captureCycles, unit->captureCycles + 1);
+		return PJ_SUCCESS;
+	}
+	
+	const void *input = NULL;
+	unsigned size = 0;
+	
+	pj_status_t status = unit->backend->unitFetchCapture(unit, context, numFrames, &input, &size);
+	
+	if(status != PJ_SUCCESS)
+	{
+		for(i = 0; i < numRecorders; i++)
+		{
+			deferredLog(&recorders[i]->captureLog, 1, "Capture error: %ld", status, 0);
+			STAT_INCREMENT(recorders[i]->stats.capture.errors);
+		}
+		
+		ATOMIC_STORE(&unit->captureCycles, unit->captureCycles + 1);
+		return status;
+	}
+	
+	// If the bus is float, convert the audio to 16 bits for the streams, with dither if enabled
+	
+	if(unit->inputFormat.isFloat)
+	{
+		unsigned numSamples = size / sizeof(float);
+		
+		if(numSamples * sizeof(pj_int16_t) > unit->scratchSize)
+		{
+			// The backend delivered more than MAX_FRAMES_PER_SLICE, which it promised not to do
+			numSamples = unit->scratchSize / sizeof(pj_int16_t);
+		}
+		
+		floatToInt16(unit->captureConvertBuffer, (const float *)input, numSamples,
+		             unit->dither ? unit->ditherState : NULL);
+		
+		input = unit->captureConvertBuffer;
+		size = numSamples * sizeof(pj_int16_t);
+	}
+	
+	// Fan the audio out to the capture streams.
+	// The rec callback may modify the audio in place, so every stream but the last gets its own copy.
+	// The last one (usually the only one) gets the audio straight out of the backend.
+	
+	for(i = 0; i + 1 < numRecorders; i++)
+	{
+		if(size <= unit->scratchSize)
+		{
+			memcpy(unit->captureBuffer, input, size);
+			captureStream(unit, recorders[i], time, numFrames, unit->captureBuffer, size);
+		}
+		else
+		{
+			// The backend delivered more than MAX_FRAMES_PER_SLICE, which it promised not to do
+			deferredLog(&recorders[i]->captureLog, 1, "Capture of %ld bytes exceeds the capture buffer", size, 0);
+		}
+	}
+	
+	captureStream(unit, recorders[numRecorders - 1], time, numFrames, input, size);
+	
+	ATOMIC_STORE(&unit->captureCycles, unit->captureCycles + 1);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Returns the RMS level of the given samples.
+**/
+static unsigned packetLevel(const pj_int16_t *samples, unsigned numSamples)
+{
+	pj_uint64_t sum = 0;
+	
+	unsigned i;
+	for(i = 0; i < numSamples; i++)
+	{
+		sum += (pj_int32_t)samples[i] * samples[i];
+	}
+	
+	return (unsigned)sqrt((double)sum / numSamples);
+}
+
+/**
+ * Remembers a packet that came out of the play ring, for concealing any underrun that may follow it.
+ * 
+ * Invoked on the render IO thread for every packet (asynchronous mode),
+ * so this only does what the concealment method actually needs.
+**/
+static void concealmentUpdate(pjmedia_snd_stream *snd_strm, const pj_int16_t *packet, unsigned size)
+{
+	snd_strm->concealCount = 0;
+	
+	switch(snd_strm->options.underrun_concealment)
+	{
+		case PJMEDIA_SND_IPHONE_CONCEAL_REPEAT:
+		{
+			memcpy(snd_strm->concealPacket, packet, size);
+			break;
+		}
+		case PJMEDIA_SND_IPHONE_CONCEAL_NOISE:
+		{
+			// Track the background level: Follow it down right away, but only slowly back up,
+			// so talking doesn't turn the comfort noise into a roar.
+			
+			unsigned level = packetLevel(packet, size / sizeof(pj_int16_t));
+			
+			if(level < snd_strm->concealFloor)
+				snd_strm->concealFloor = level;
+			else
+				snd_strm->concealFloor += (level - snd_strm->concealFloor) >> CONCEAL_FLOOR_RISE;
+			
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * Fills a packet that the play ring didn't have, according to options.underrun_concealment.
+ * Returns PJ_TRUE if the packet holds anything but silence.
+ * 
+ * REPEAT plays the last packet again, fading it out over CONCEAL_REPEAT_PACKETS packets, and then silence.
+ * NOISE plays white noise at the level of the quietest recent audio (the background noise of the call).
+**/
+static pj_bool_t concealmentFill(pjmedia_snd_stream *snd_strm, pj_int16_t *packet, unsigned size)
+{
+	unsigned numSamples = size / sizeof(pj_int16_t);
+	unsigned count = snd_strm->concealCount++;
+	
+	switch(snd_strm->options.underrun_concealment)
+	{
+		case PJMEDIA_SND_IPHONE_CONCEAL_REPEAT:
+		{
+			if(count >= CONCEAL_REPEAT_PACKETS)
+			{
+				break;
+			}
+			
+			// The gain falls linearly from (count / CONCEAL_REPEAT_PACKETS) of the way down, to (count + 1)
+			
+			pj_int32_t total = CONCEAL_REPEAT_PACKETS * numSamples;
+			pj_int32_t done  = count * numSamples;
+			
+			unsigned i;
+			for(i = 0; i < numSamples; i++)
+			{
+				pj_int32_t gain = ((total - done - (pj_int32_t)i) << 15) / total;
+				
+				packet[i] = (pj_int16_t)((snd_strm->concealPacket[i] * gain) >> 15);
+			}
+			
+			return PJ_TRUE;
+		}
+		case PJMEDIA_SND_IPHONE_CONCEAL_NOISE:
+		{
+			if((snd_strm->concealFloor == 0) || (snd_strm->concealFloor == CONCEAL_FLOOR_UNKNOWN))
+			{
+				break;
+			}
+			
+			// Uniform noise of amplitude A has an RMS level of A / sqrt(3)
+			
+			pj_int32_t amplitude = (pj_int32_t)(snd_strm->concealFloor * 1.732f);
+			
+			if(amplitude > 32767)
+			{
+				amplitude = 32767;
+			}
+			
+			unsigned i;
+			for(i = 0; i < numSamples; i++)
+			{
+				pj_int32_t r = (pj_int32_t)(ditherNext(&snd_strm->concealNoise) >> 16) - 32768;
+				
+				packet[i] = (pj_int16_t)((r * amplitude) >> 15);
+			}
+			
+			return PJ_TRUE;
+		}
+		default:
+		{
+			break;
+		}
+	}
+	
+	pj_bzero(packet, size);
+	return PJ_FALSE;
+}
+
+/**
+ * Returns the gain (in Q15) the concealment of an underrun left off at, which is where the fade in starts
+ * once pjsip catches up again.
+ * 
+ * That's 0, unless REPEAT hadn't faded the last packet all the way out yet.
+ * (Comfort noise is at the level of the background noise, which the fade in starts from anyway.)
+**/
+static pj_int32_t concealmentGain(const pjmedia_snd_stream *snd_strm)
+{
+	if((snd_strm->options.underrun_concealment != PJMEDIA_SND_IPHONE_CONCEAL_REPEAT) ||
+	   (snd_strm->concealCount >= CONCEAL_REPEAT_PACKETS))
+	{
+		return 0;
+	}
+	
+	// See concealmentFill
+	return ((CONCEAL_REPEAT_PACKETS - snd_strm->concealCount) << 15) / CONCEAL_REPEAT_PACKETS;
+}
+
+/**
+ * Play callback used by the output reframer in asynchronous mode.
+ * 
+ * This is invoked on the core audio IO thread, and simply takes the next packet out of the play ring.
+ * If the worker thread hasn't kept up, we conceal the missing packet rather than waiting for it.
+**/
+static pj_status_t ringPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	
+	if(!ringRead(&snd_strm->playRing, output, size))
+	{
+		if(!snd_strm->playStarved)
+		{
+			STAT_INCREMENT(snd_strm->stats.underrun_events);
+			snd_strm->playStarved = PJ_TRUE;
+		}
+		
+		if(concealmentFill(snd_strm, (pj_int16_t *)output, size))
+		{
+			STAT_INCREMENT(snd_strm->stats.concealed_packets);
+		}
+		
+		ATOMIC_STORE(&snd_strm->playUnderruns, snd_strm->playUnderruns + 1);
+		
+		return PJ_SUCCESS;
+	}
+	
+	if(snd_strm->playStarved)
+	{
+		// The worker thread caught up again. Fade back in, rather than jumping straight back in from the concealment.
+		// The fade picks up from the level the concealment got down to, so a short underrun doesn't dip to silence.
+		// (Unless the stream is being faded out already.)
+		
+		snd_strm->playStarved = PJ_FALSE;
+		
+		if(snd_strm->outputReframer.fade && (snd_strm->fade.state == FADE_NONE))
+		{
+			fadeStartFrom(&snd_strm->fade, concealmentGain(snd_strm));
+		}
+	}
+	
+	concealmentUpdate(snd_strm, (const pj_int16_t *)output, size);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Rec callback used by the input reframer in asynchronous mode.
+ * 
+ * This is invoked on the core audio IO thread, and simply puts the timestamp and packet into the rec ring.
+ * If the worker thread hasn't kept up, the packet is dropped rather than waiting for it.
+ * 
+ * The timestamp travels along with the packet, so the worker thread passes exactly the same timestamps to pjsip
+ * as the input reframer would have, even if packets are dropped along the way.
+**/
+static pj_status_t ringRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	
+	// We're the only writer, so once we know there's room for both, neither write can fail.
+	// The worker thread doesn't read an entry until all of it is in the ring.
+	
+	if(ringSpace(&snd_strm->recRing) < (sizeof(timestamp) + size))
+	{
+		ATOMIC_STORE(&snd_strm->recOverruns, snd_strm->recOverruns + 1);
+		return PJ_SUCCESS;
+	}
+	
+	ringWrite(&snd_strm->recRing, &timestamp, sizeof(timestamp));
+	ringWrite(&snd_strm->recRing, input, size);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Play callback used when pjsip deals in 32-bit frames (bits_per_sample == 32).
+ * 
+ * The driver only ever deals in 16-bit packets internally, so we get a 32-bit packet from pjsip,
+ * and reduce it to 16 bits. This is invoked wherever play_cb itself would have been
+ * (by the output reframer, or the worker thread in asynchronous mode).
+**/
+static pj_status_t widePlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	
+	pj_status_t status = snd_strm->play_cb(snd_strm->user_data,
+	                                       timestamp,
+	                                       snd_strm->widePlayBuffer,
+	                                       snd_strm->pjsipPacketSize);
+	
+	int32ToInt16((pj_int16_t *)output, snd_strm->widePlayBuffer, size / sizeof(pj_int16_t));
+	
+	return status;
+}
+
+/**
+ * Rec callback used when pjsip deals in 32-bit frames (bits_per_sample == 32).
+ * 
+ * Widens the 16-bit packet to 32 bits, and passes it on to pjsip.
+**/
+static pj_status_t wideRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	
+	int16ToInt32(snd_strm->wideRecBuffer, (const pj_int16_t *)input, size / sizeof(pj_int16_t));
+	
+	return snd_strm->rec_cb(snd_strm->user_data,
+	                        timestamp,
+	                        snd_strm->wideRecBuffer,
+	                        snd_strm->pjsipPacketSize);
+}
+
+/**
+ * Rec callback used with voice activity detection (options.vad).
+ * 
+ * Classifies the packet, reports the result, and passes the packet on to pjsip (unless it's suppressed).
+ * This is invoked wherever rec_cb itself would have been.
+**/
+static pj_status_t vadRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	
+	pj_bool_t active = vadProcess(&snd_strm->vad, (const pj_int16_t *)input, size / sizeof(pj_int16_t));
+	
+	if(active)
+		STAT_INCREMENT(snd_strm->stats.vad_active_packets);
+	else
+		STAT_INCREMENT(snd_strm->stats.vad_silent_packets);
+	
+	if(snd_strm->options.vad_cb)
+	{
+		snd_strm->options.vad_cb(snd_strm->user_data, timestamp, active);
+	}
+	
+	if(!active && snd_strm->options.vad_suppress)
+	{
+		STAT_INCREMENT(snd_strm->stats.vad_suppressed_packets);
+		return PJ_SUCCESS;
+	}
+	
+	return snd_strm->vadRec(snd_strm->vadRecUserData, timestamp, input, size);
+}
+
+/**
+ * Rec callback used with an echo canceller (options.aec_cb).
+ * 
+ * Looks up the played packet that lines up with the captured packet, and hands both to the echo canceller.
+ * Then passes the (processed) packet on to pjsip.
+ * This is invoked wherever rec_cb itself would have been.
+**/
+static pj_status_t aecRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)user_data;
+	snd_reference *ref = &snd_strm->reference;
+	
+	unsigned samples = size / sizeof(pj_int16_t);
+	
+	const pj_int16_t *farEnd = NULL;
+	unsigned delay = 0;
+	
+	pj_uint64_t hostTime;
+	
+	if(timelineHostTime(&snd_strm->captureTimeline, timestamp, &hostTime))
+	{
+		pj_uint64_t slotHostTime;
+		const pj_int16_t *found = referenceFind(ref, hostTime, &slotHostTime);
+		
+		if(found)
+		{
+			double frames = (double)(hostTime - slotHostTime) * ref->clockRate / ref->hostTicksPerSecond;
+			pj_uint32_t slotDelay = (pj_uint32_t)floor((frames * ref->channels) + 0.5);
+			
+			// If playback stalled, the last packet played may have nothing to do with this one
+			if(slotDelay < samples)
+			{
+				farEnd = found;
+				delay = slotDelay;
+			}
+		}
+	}
+	
+	if(farEnd)
+		STAT_INCREMENT(snd_strm->stats.aec_pairs);
+	else
+		STAT_INCREMENT(snd_strm->stats.aec_unaligned);
+	
+	snd_strm->options.aec_cb(snd_strm->user_data, timestamp, farEnd, (pj_int16_t *)input, samples, delay);
+	
+	return snd_strm->aecRec(snd_strm->aecRecUserData, timestamp, input, size);
+}
+
+/**
+ * Drains the deferred logs of the stream's IO threads.
+ *
+ * This is invoked by the worker thread (in asynchronous mode), and by the pjsip threads calling into the stream
+ * (pjmedia_snd_stream_get_info, pjmedia_snd_iphone_stream_get_stats, pjmedia_snd_stream_stop).
+ * A deferred log only supports a single reader, so if another thread is already draining, we simply skip it.
+ * The messages aren't lost, they're logged by that other thread (or the next time around).
+**/
+static void streamDrainLogs(pjmedia_snd_stream *snd_strm)
+{
+	if(__atomic_exchange_n(&snd_strm->logsDraining, 1, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+	
+	deferredLogDrain(&snd_strm->renderLog);
+	deferredLogDrain(&snd_strm->captureLog);
+	
+	ATOMIC_STORE(&snd_strm->logsDraining, 0);
+}
+
+/**
+ * The worker thread.
+ * 
+ * This is a normal pjlib thread, so it's free to block, lock, allocate and log.
+ * It only runs in asynchronous mode, where it keeps the play ring topped up with data from the play callback,
+ * and drains the rec ring into the rec callback. Since it runs regularly anyway, it also drains the deferred logs.
+ * 
+ * In synchronous mode there's nothing that needs a thread of its own,
+ * so the deferred logs are drained by the pjsip threads calling into the stream instead (see streamDrainLogs).
+ * 
+ * Since the IO callbacks never wait on this thread, we simply poll every workerInterval milliseconds.
+**/
+static int workerThreadProc(void *arg)
+{
+	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)arg;
+	
+	PJ_LOG(5, (THIS_FILE, "Worker thread started"));
+	
+	while(ATOMIC_LOAD(&snd_strm->workerRunning))
+	{
+		streamDrainLogs(snd_strm);
+		
+		if(snd_strm->options.adaptive_latency)
+		{
+			// The output reframer timestamp tells us how much audio the IO thread has played.
+			// So the controller runs on audio time, not on however long we happened to sleep.
+			
+			pj_uint32_t timestamp = ATOMIC_LOAD(&snd_strm->outputReframer.timestamp);
+			pj_uint32_t elapsedFrames = (timestamp - snd_strm->latencyCtlTimestamp) / snd_strm->channel_count;
+			
+			snd_strm->latencyCtlTimestamp = timestamp;
+			
+			unsigned target = latencyCtlUpdate(&snd_strm->latencyCtl,
+			                                   elapsedFrames,
+			                                   ATOMIC_LOAD(&snd_strm->playUnderruns),
+			                                   ATOMIC_LOAD(&snd_strm->recOverruns));
+			
+			if(target != snd_strm->playRingTarget)
+			{
+				PJ_LOG(4, (THIS_FILE, "Adaptive latency: play ring target %u -> %u bytes",
+				           snd_strm->playRingTarget, target));
+				
+				snd_strm->playRingTarget = target;
+			}
+		}
+		
+		if(snd_strm->play_cb)
+		{
+			while((ringAvailable(&snd_strm->playRing) + snd_strm->packet_size) <= snd_strm->playRingTarget)
+			{
+				pj_timestamp start, end;
+				pj_get_timestamp(&start);
+				
+				snd_strm->packetPlay(snd_strm->packetPlayUserData,
+				                     snd_strm->workerPlayTimestamp,
+				                     snd_strm->workerBuffer,
+				                     snd_strm->packet_size);
+				
+				pj_get_timestamp(&end);
+				histogramAdd(&snd_strm->stats.render.pjsip_usec, pj_elapsed_usec(&start, &end));
+				
+				snd_strm->workerPlayTimestamp += snd_strm->samples_per_frame;
+				
+				ringWrite(&snd_strm->playRing, snd_strm->workerBuffer, snd_strm->packet_size);
+			}
+		}
+		
+		if(snd_strm->rec_cb)
+		{
+			// Each entry in the rec ring is a timestamp followed by a packet (see ringRecCallback)
+			
+			pj_uint32_t timestamp;
+			
+			while(ringAvailable(&snd_strm->recRing) >= (sizeof(timestamp) + snd_strm->packet_size))
+			{
+				ringRead(&snd_strm->recRing, &timestamp, sizeof(timestamp));
+				ringRead(&snd_strm->recRing, snd_strm->workerBuffer, snd_strm->packet_size);
+				
+				pj_timestamp start, end;
+				pj_get_timestamp(&start);
+				
+				snd_strm->packetRec(snd_strm->packetRecUserData,
+				                    timestamp,
+				                    snd_strm->workerBuffer,
+				                    snd_strm->packet_size);
+				
+				pj_get_timestamp(&end);
+				histogramAdd(&snd_strm->stats.capture.pjsip_usec, pj_elapsed_usec(&start, &end));
+			}
+		}
+		
+		pj_thread_sleep(snd_strm->workerInterval);
+	}
+	
+	PJ_LOG(5, (THIS_FILE, "Worker thread stopped"));
+	
+	return 0;
+}
+
+/**
+ * Starts the worker thread (asynchronous mode only).
+ * 
+ * Any data left in the rings from a previous run is discarded.
+**/
+static pj_status_t startWorkerThread(pjmedia_snd_stream *snd_strm)
+{
+	// The IO callbacks aren't running yet, so it's safe to reset the rings and reframers
+	ringReset(&snd_strm->playRing);
+	ringReset(&snd_strm->recRing);
+	
+	reframerResetRender(&snd_strm->outputReframer);
+	reframerResetCapture(&snd_strm->inputReframer);
+	
+	if(snd_strm->options.adaptive_latency)
+	{
+		// Start over from the minimum.
+		snd_strm->latencyCtl.target = snd_strm->latencyCtl.minTarget;
+		snd_strm->latencyCtl.quietFrames = 0;
+		snd_strm->latencyCtl.lastUnderruns = snd_strm->playUnderruns;
+		snd_strm->latencyCtl.lastOverruns = snd_strm->recOverruns;
+		
+		snd_strm->playRingTarget = snd_strm->latencyCtl.target;
+		snd_strm->latencyCtlTimestamp = snd_strm->outputReframer.timestamp;
+	}
+	
+	// The thread structure gets a pool of its own, which goes away with the thread.
+	// The stream's pool can't grow (see snd_arena), and we may be started and stopped any number of times.
+	
+	snd_strm->workerPool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
+	                                      "iphonesndworker", // memory pool name
+	                                      512,              // initial size
+	                                      512,              // increment size
+	                                      NULL);            // error callback
+	if(snd_strm->workerPool == NULL)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	ATOMIC_STORE(&snd_strm->workerRunning, PJ_TRUE);
+	
+	pj_status_t status = pj_thread_create(snd_strm->workerPool,         // memory pool for the thread structure
+	                                      "iphonesnd",                  // thread name
+	                                      workerThreadProc,             // thread entry point
+	                                      snd_strm,                     // thread argument
+	                                      PJ_THREAD_DEFAULT_STACK_SIZE, // stack size
+	                                      0,                            // flags
+	                                      &snd_strm->workerThread);     // the created thread
+	if(status != PJ_SUCCESS)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unable to create worker thread: %i", (int)status));
+		
+		ATOMIC_STORE(&snd_strm->workerRunning, PJ_FALSE);
+		snd_strm->workerThread = NULL;
+		
+		pj_pool_release(snd_strm->workerPool);
+		snd_strm->workerPool = NULL;
+		
+		return status;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Stops the worker thread, and waits for it to exit.
+ * 
+ * This should be invoked after the audio unit is stopped.
+ * Any messages left in the deferred logs are logged before we return.
+**/
+static void stopWorkerThread(pjmedia_snd_stream *snd_strm)
+{
+	ATOMIC_STORE(&snd_strm->workerRunning, PJ_FALSE);
+	
+	pj_thread_join(snd_strm->workerThread);
+	pj_thread_destroy(snd_strm->workerThread);
+	
+	snd_strm->workerThread = NULL;
+	
+	pj_pool_release(snd_strm->workerPool);
+	snd_strm->workerPool = NULL;
+	
+	streamDrainLogs(snd_strm);
+}
+
+/**
+ * Returns the size (in bytes) of a buffer holding the given latency worth of audio.
+ * The result is rounded up to a whole number of packets, and is never less than two packets.
+**/
+static unsigned bytesForLatency(unsigned latency_ms,
+                                unsigned clock_rate,
+                                unsigned channel_count,
+                                unsigned packet_size)
+{
+	unsigned bytes = (unsigned)(((pj_uint64_t)latency_ms * clock_rate / 1000) * channel_count * sizeof(pj_int16_t));
+	unsigned packets = (bytes + packet_size - 1) / packet_size;
+	
+	if(packets < 2)
+	{
+		packets = 2;
+	}
+	
+	return packets * packet_size;
+}
+
+/**
+ * Returns the latency (in milliseconds) configured via pjmedia_snd_set_latency for the given direction.
+ * For a full-duplex stream this is the smaller of the two.
+**/
+static unsigned latencyForDirection(pjmedia_dir dir)
+{
+	if(dir == PJMEDIA_DIR_CAPTURE)
+		return rec_latency;
+	
+	if(dir == PJMEDIA_DIR_PLAYBACK)
+		return play_latency;
+	
+	return (rec_latency < play_latency) ? rec_latency : play_latency;
+}
+
+#if PJMEDIA_SND_IPHONE_COREAUDIO
+
+/**
+ * Core audio backend.
+ *
+ * Runs the voice unit on a VoiceProcessingIO (or RemoteIO) audio unit,
+ * and takes care of the audio session (or leaves that to the application, see MANAGE_AUDIO_SESSION).
+**/
+
+// The VoiceProcessingIO and RemoteIO audio components (found in pjmedia_snd_init)
+static AudioComponent voiceUnitComponent = NULL;
+static AudioComponent remoteIOComponent = NULL;
+
+#if MANAGE_AUDIO_SESSION
+  static pj_bool_t audio_session_initialized = PJ_FALSE;
+#endif
+
+/**
+ * Converts the result of a core audio call to a pj_status_t.
+ * 
+ * Core audio errors are often four character codes (e.g. '!ini'), which are far easier to look up than
+ * the number pjlib makes of them. So a failure is logged here, along with the name of the call that failed,
+ * and the caller only needs to log the pj_status_t.
+ * 
+ * Must not be used on the IO threads (see coreaudioFetchCapture).
+**/
+static pj_status_t coreaudioStatus(OSStatus status, const char *call)
+{
+	if(status == noErr)
+	{
+		return PJ_SUCCESS;
+	}
+	
+	char code[5];
+	pj_bool_t printable = PJ_TRUE;
+	int i;
+	
+	for(i = 0; i < 4; i++)
+	{
+		code[i] = (char)(status >> (24 - (8 * i)));
+		printable = printable && isprint((unsigned char)code[i]);
+	}
+	
+	code[4] = 0;
+	
+	if(printable)
+	{
+		PJ_LOG(2, (THIS_FILE, "%s failed: OSStatus %d '%s'", call, (int)status, code));
+	}
+	else
+	{
+		PJ_LOG(2, (THIS_FILE, "%s failed: OSStatus %d", call, (int)status));
+	}
+	
+	return PJ_STATUS_FROM_OS(status);
+}
+
+/**
+ * The core audio state of the voice unit.
+**/
+typedef struct snd_coreaudio_unit
+{
+	AudioUnit voiceUnit;
+	
+	// This gets used in MyInputBusInputCallback() when calling AudioUnitRender to get microphone data.
+	AudioBufferList inputBufferList;
+	
+} snd_coreaudio_unit;
+
+/**
+ * The arguments of MyInputBusInputCallback, which AudioUnitRender needs (see coreaudioFetchCapture).
+**/
+typedef struct snd_coreaudio_render_context
+{
+	AudioUnitRenderActionFlags *ioActionFlags;
+	const AudioTimeStamp *inTimeStamp;
+	UInt32 inBusNumber;
+	
+} snd_coreaudio_render_context;
+
+/**
+ * Conditionally initializes the audio session.
+ * Use this method for proper audio session management.
+**/
+static void initializeAudioSession()
+{
+#if MANAGE_AUDIO_SESSION
+	
+	if(!audio_session_initialized)
+	{
+		PJ_LOG(5, (THIS_FILE, "AudioSessionInitialize"));
+		
+		AudioSessionInitialize(NULL,                                   // Run loop (NULL = main run loop)
+		                       kCFRunLoopDefaultMode,                  // Run loop mode
+		(void(*)(void*,UInt32))pjmedia_snd_audio_session_interruption, // Interruption callback
+		                       NULL);                                  // Optional User data
+		
+		audio_session_initialized = PJ_TRUE;
+	}
+
+#endif
+}
+
+/**
+ * Conditionally activates the audio session.
+ * Use this method for proper audio session management.
+ * 
+ * The direction should cover every active stream, since the session category applies to all of them.
+**/
+static void startAudioSession(pjmedia_dir dir)
+{
+	UInt32 sessionCategory;
+	
+	if(dir == PJMEDIA_DIR_CAPTURE) {
+		sessionCategory = kAudioSessionCategory_RecordAudio;
+	}
+	else if(dir == PJMEDIA_DIR_PLAYBACK) {
+		sessionCategory = kAudioSessionCategory_MediaPlayback;
+	}
+	else {
+		sessionCategory = kAudioSessionCategory_PlayAndRecord;
+	}
+	
+#if MANAGE_AUDIO_SESSION
+	
+	AudioSessionSetProperty(kAudioSessionProperty_AudioCategory,
+	                        sizeof(sessionCategory), &sessionCategory);
+	
+	AudioSessionSetActive(true);
+	
+#else
+	
+	if(audio_session_callbacks.startAudioSession)
+	{
+		audio_session_callbacks.startAudioSession(sessionCategory);
+	}
+	
+#endif
+}
+
+/**
+ * Conditionally deactivates the audio session when it is no longer needed.
+ * Use this method for proper audio session management.
+**/
+static void stopAudioSession()
+{
+#if MANAGE_AUDIO_SESSION
+	
+	AudioSessionSetActive(false);
+	
+#else
+	
+	if(audio_session_callbacks.stopAudioSession)
+	{
+		audio_session_callbacks.stopAudioSession();
+	}
+	
+#endif
+}
+
+/**
+ * Asks core audio for the given hardware IO buffer duration (in seconds).
+ *
+ * This is only a preference, and core audio may grant something else.
+ * Use getCurrentIOBufferDuration to find out what we actually got.
+**/
+static void setPreferredHardwareIOBufferDuration(double seconds)
+{
+	Float32 duration = seconds;
+	
+	OSStatus status = AudioSessionSetProperty(kAudioSessionProperty_PreferredHardwareIOBufferDuration,
+	                                          sizeof(duration), &duration);
+	if(status != noErr)
+	{
+		PJ_LOG(2, (THIS_FILE, "Failed to set preferred IO buffer duration: %d",
+		           coreaudioStatus(status, "AudioSessionSetProperty")));
+	}
+	else
+	{
+		PJ_LOG(4, (THIS_FILE, "Preferred IO buffer duration: %.3f", duration));
+	}
+}
+
+/**
+ * Returns the hardware IO buffer duration (in seconds) currently in effect.
+**/
+static double getCurrentIOBufferDuration()
+{
+	Float32 duration = 0;
+	UInt32 size = sizeof(duration);
+	
+	AudioSessionGetProperty(kAudioSessionProperty_CurrentHardwareIOBufferDuration, &size, &duration);
+	
+	return duration;
+}
+
+/**
+ * Returns the current hardware sample rate, or 0 if the audio session won't tell us.
+**/
+static unsigned getCurrentHardwareSampleRate()
+{
+	Float64 sampleRate = 0;
+	UInt32 size = sizeof(sampleRate);
+	
+	OSStatus status = AudioSessionGetProperty(kAudioSessionProperty_CurrentHardwareSampleRate, &size, &sampleRate);
+	
+	if(status != noErr)
+	{
+		PJ_LOG(2, (THIS_FILE, "Unable to get the hardware sample rate: %d",
+		           coreaudioStatus(status, "AudioSessionGetProperty")));
+		return 0;
+	}
+	
+	return (unsigned)(sampleRate + 0.5);
+}
+
+/**
+ * Returns the number of host time ticks (as used by AudioTimeStamp.mHostTime) per second.
+**/
+static double getHostTicksPerSecond()
+{
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	
+	// The timebase converts ticks to nanoseconds
+	return 1e9 * timebase.denom / timebase.numer;
+}
+
+/**
+ * Converts the timestamp of a core audio IO callback.
+**/
+static void coreaudioIOTime(const AudioTimeStamp *inTimeStamp, snd_io_time *time)
+{
+	time->sampleTime = inTimeStamp->mSampleTime;
+	time->hostTime   = inTimeStamp->mHostTime;
+	
+	time->sampleTimeValid = (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid) != 0;
+	time->hostTimeValid   = (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid) != 0;
+}
+
+/**
+ * Voice Unit Callback.
+ * Called when the voice unit output needs us to input the data that it should play through the speakers.
+ *
+ * Parameters:
+ * inRefCon
+ *    Custom data that you provided when registering your callback with the audio unit.
+ * ioActionFlags
+ *    Flags used to describe more about the context of this call.
+ * inTimeStamp
+ *    The timestamp associated with this call of audio unit render.
+ * inBusNumber
+ *    The bus number associated with this call of audio unit render.
+ * inNumberFrames
+ *    The number of sample frames that will be represented in the audio data in the provided ioData parameter.
+ * ioData
+ *    The AudioBufferList that will be used to contain the provided audio data.
+ **/
+static OSStatus MyOutputBusRenderCallack(void                       *inRefCon,
+                                         AudioUnitRenderActionFlags *ioActionFlags,
+                                         const AudioTimeStamp       *inTimeStamp,
+                                         UInt32                      inBusNumber,
+                                         UInt32                      inNumberFrames,
+                                         AudioBufferList            *ioData)
+{
+	snd_voice_unit *unit = (snd_voice_unit *)inRefCon;
+	
+	// The ioData variable is a structure that looks like this:
+	//
+	// struct AudioBufferList {
+	//   UInt32      mNumberBuffers;
+	//   AudioBuffer mBuffers[1];
+	// }
+	//
+	// struct AudioBuffer {
+	//   UInt32  mNumberChannels;
+	//   UInt32  mDataByteSize;
+	//   void*   mData;
+	// }
+	//
+	// It's our job to fill the mData variable.
+	// The amount of data core audio is asking for is in the mDataByteSize variable.
+	
+	snd_io_time time;
+	coreaudioIOTime(inTimeStamp, &time);
+	
+	if(!voiceUnitRender(unit, &time, inNumberFrames, ioData->mBuffers[0].mData, ioData->mBuffers[0].mDataByteSize))
+	{
+		*ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+	}
+	
+	return noErr;
+}
+
+/**
+ * Voice Unit Callback.
+ *
+ * Called when the voice unit input has recorded data that we can fetch from it.
+ *
+ * Parameters:
+ * inRefCon
+ *    Custom data that you provided when registering your callback with the audio unit.
+ * ioActionFlags
+ *    Flags used to describe more about the context of this call.
+ * inTimeStamp
+ *    The timestamp associated with this call of audio unit render.
+ * inBusNumber
+ *    The bus number associated with this call of audio unit render.
+ * inNumberFrames
+ *    The number of sample frames that will be represented in the audio data in the provided ioData parameter.
+ * ioData
+ *    This is NULL - use AudioUnitRender to fetch the audio data.
+**/
+static OSStatus MyInputBusInputCallback(void                       *inRefCon,
+                                        AudioUnitRenderActionFlags *ioActionFlags,
+                                        const AudioTimeStamp       *inTimeStamp,
+                                        UInt32                      inBusNumber,
+                                        UInt32                      inNumberFrames,
+                                        AudioBufferList            *ioData)
+{
+	snd_voice_unit *unit = (snd_voice_unit *)inRefCon;
+	
+	snd_io_time time;
+	coreaudioIOTime(inTimeStamp, &time);
+	
+	// The audio is fetched by coreaudioFetchCapture, if anybody is listening
+	
+	snd_coreaudio_render_context context;
+	context.ioActionFlags = ioActionFlags;
+	context.inTimeStamp   = inTimeStamp;
+	context.inBusNumber   = inBusNumber;
+	
+	if(voiceUnitCapture(unit, &time, inNumberFrames, &context) != PJ_SUCCESS)
+	{
+		return -1;
+	}
+	
+	return noErr;
+}
+
+/**
+ * Fetches the captured audio of the current IO cycle from the voice unit.
+ * Invoked (via voiceUnitCapture) from MyInputBusInputCallback, with the arguments it was given.
+**/
+static pj_status_t coreaudioFetchCapture(snd_voice_unit *unit,
+                                         void *context,
+                                         unsigned numFrames,
+                                         const void **data,
+                                         unsigned *size)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	snd_coreaudio_render_context *rc = (snd_coreaudio_render_context *)context;
+	
+	// Remember: The ioData parameter of the input callback is NULL.
+	// We need to use our own AudioBufferList in combination with the AudioUnitRender method to get the audio data.
+	
+	AudioBufferList *abl = &ca->inputBufferList;
+	abl->mNumberBuffers = 1;
+	abl->mBuffers[0].mNumberChannels = unit->inputFormat.channels;
+	abl->mBuffers[0].mData = NULL;
+	abl->mBuffers[0].mDataByteSize = numFrames * unit->inputFormat.bytesPerFrame;
+	
+	// OSStatus AudioUnitRender(AudioUnit                   inUnit,
+	//                          AudioUnitRenderActionFlags *ioActionFlags,
+	//                          const AudioTimeStamp       *inTimeStamp,
+	//                          UInt32                      inOutputBusNumber,
+	//                          UInt32                      inNumberFrames,
+	//                          AudioBufferList            *ioData)
+	//
+	// Parameters:
+	// inUnit
+	//    The audio unit that you are asking to render.
+	// ioActionFlags
+	//    Flags to configure the rendering operation.
+	// inTimeStamp
+	//    The audio time stamp for the render operation. Each time stamp must contain a valid sample time that is
+	//    incremented monotonically from the previous call to this function. That is, the next time stamp is
+	//    equal to inTimeStamp + inNumberFrames.
+	//    If sample time does not increase like this from one render call to the next, the audio unit interprets
+	//    that as a discontinuity with the timeline it is rendering for.
+	//    When rendering to multiple output buses, ensure that this value is the same for each bus.
+	//    Using the same value allows an audio unit to determine that the rendering for each output bus is
+	//    part of a single render operation.
+	// inOutputBusNumber
+	//    The output bus to render for.
+	// inNumberFrames
+	//    The number of audio sample frames to render.
+	// ioData
+	//    On input, the audio buffer list that the audio unit is to render into.
+	//    On output, the audio data that was rendered by the audio unit.
+	//
+	// The AudioBufferList that you provide on input must match the topology for the current audio format
+	// for the given bus. The buffer list can be either of these two variants:
+	//   - If the mData pointers are non-null, the audio unit renders its output into those buffers.
+	//   - If the mData pointers are null, the audio unit can provide pointers to its own buffers.
+	//     In this case, the audio unit must keep those buffers valid for the duration
+	//     of the calling thread’s I/O cycle.
+	
+	OSStatus status = AudioUnitRender(ca->voiceUnit,
+	                                  rc->ioActionFlags,
+	                                  rc->inTimeStamp,
+	                                  rc->inBusNumber,
+	                                  numFrames,
+	                                  abl);
+	if(status != noErr)
+	{
+		// No logging on the IO thread, voiceUnitCapture takes care of that
+		return PJ_STATUS_FROM_OS(status);
+	}
+	
+	*data = abl->mBuffers[0].mData;
+	*size = abl->mBuffers[0].mDataByteSize;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Sets the client stream format (16-bit or 32-bit float linear PCM) on the given bus and scope of the voice unit.
+ * 
+ * If NATIVE_CHANNEL_FORMAT is enabled, we first try to use the given channel count.
+ * If the voice unit rejects it (or NATIVE_CHANNEL_FORMAT is disabled) we use stereo.
+ * 
+ * On success, the format that was actually applied is stored in streamDesc.
+**/
+static OSStatus setClientStreamFormat(AudioUnit voiceUnit,
+                                      AudioUnitScope scope,
+                                      AudioUnitElement bus,
+                                      unsigned clock_rate,
+                                      unsigned channel_count,
+                                      pj_bool_t isFloat,
+                                      AudioStreamBasicDescription *streamDesc)
+{
+	OSStatus status = -1;
+	
+	// kAudioFormatFlagsCanonical == kLinearPCMFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked
+	// kAudioFormatFlagsNativeFloatPacked == kAudioFormatFlagIsFloat | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked
+	
+	unsigned sampleSize = isFloat ? sizeof(float) : sizeof(pj_int16_t);
+	
+	pj_bzero(streamDesc, sizeof(AudioStreamBasicDescription));
+	
+	streamDesc->mSampleRate      = clock_rate;
+	streamDesc->mFormatID        = kAudioFormatLinearPCM;
+	streamDesc->mFormatFlags     = isFloat ? kAudioFormatFlagsNativeFloatPacked : kAudioFormatFlagsCanonical;
+	streamDesc->mBitsPerChannel  = sampleSize * 8;
+	streamDesc->mFramesPerPacket = 1;
+	
+#if NATIVE_CHANNEL_FORMAT
+	
+	if(channel_count != 2)
+	{
+		streamDesc->mChannelsPerFrame = channel_count;
+		streamDesc->mBytesPerFrame    = channel_count * sampleSize;
+		streamDesc->mBytesPerPacket   = channel_count * sampleSize;
+		
+		status = AudioUnitSetProperty(voiceUnit,                           // The audio unit to set property value for
+		                              kAudioUnitProperty_StreamFormat,     // The audio unit property identifier
+		                              scope,                               // The audio unit scope for the property
+		                              bus,                                 // The audio unit element for the property
+		                              streamDesc,                          // The value to apply to the property
+		                              sizeof(AudioStreamBasicDescription)); // The size of the value
+		if(status == noErr)
+		{
+			return noErr;
+		}
+		
+		PJ_LOG(2, (THIS_FILE, "Voice unit rejected %u channel format on bus %u (%i), falling back to stereo",
+		           channel_count, (unsigned)bus, (int)status));
+	}
+	
+#endif
+	
+	// Configure core audio in stereo.
+	// See the discussion on architecture at the bottom of this file for more information.
+	
+	streamDesc->mChannelsPerFrame = 2;
+	streamDesc->mBytesPerFrame    = 2 * sampleSize;
+	streamDesc->mBytesPerPacket   = 2 * sampleSize;
+	
+	status = AudioUnitSetProperty(voiceUnit,                           // The audio unit to set property value for
+	                              kAudioUnitProperty_StreamFormat,     // The audio unit property identifier
+	                              scope,                               // The audio unit scope for the property
+	                              bus,                                 // The audio unit element for the property
+	                              streamDesc,                          // The value to apply to the property
+	                              sizeof(AudioStreamBasicDescription)); // The size of the value
+	return status;
+}
+
+/**
+ * Enables or disables IO on the given bus of the voice unit.
+**/
+static pj_status_t coreaudioUnitEnableIO(snd_voice_unit *unit, pjmedia_dir bus, pj_bool_t enabled)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	// Remember - there are two buses, input and output.
+	// Output is bus #0, Input is bus #1.
+	// Think: 'Output' starts with a 0, 'Input' starts with a 1.
+	
+	AudioUnitScope scope     = (bus == PJMEDIA_DIR_CAPTURE) ? kAudioUnitScope_Input : kAudioUnitScope_Output;
+	AudioUnitElement element = (bus == PJMEDIA_DIR_CAPTURE) ? 1 : 0;
+	
+	UInt32 enable = enabled ? 1 : 0;
+	
+	OSStatus status;
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                     // The audio unit to set property value for
+	                              kAudioOutputUnitProperty_EnableIO, // The audio unit property identifier
+	                              scope,                             // The audio unit scope for the property
+	                              element,                           // The audio unit element for the property
+	                              &enable,                           // The value to apply to the property
+	                              sizeof(enable));                   // The size of the value
+	
+	return coreaudioStatus(status, "AudioUnitSetProperty(EnableIO)");
+}
+
+/**
+ * Sets the client format of the given bus of the voice unit (see setClientStreamFormat).
+ * If the voice unit rejects float, we fall back to 16 bits.
+**/
+static pj_status_t coreaudioUnitSetFormat(snd_voice_unit *unit,
+                                          pjmedia_dir bus,
+                                          unsigned clockRate,
+                                          unsigned channels,
+                                          pj_bool_t isFloat,
+                                          snd_bus_format *format)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	// Note: For the input bus, we're setting the format of the data we would like to have output to us.
+	// For the output bus, we're setting the format of the data we'll be supplying/inputting to the output stream.
+	
+	AudioUnitScope scope     = (bus == PJMEDIA_DIR_CAPTURE) ? kAudioUnitScope_Output : kAudioUnitScope_Input;
+	AudioUnitElement element = (bus == PJMEDIA_DIR_CAPTURE) ? 1 : 0;
+	
+	AudioStreamBasicDescription streamDesc;
+	OSStatus status;
+	
+	status = setClientStreamFormat(ca->voiceUnit, scope, element, clockRate, channels, isFloat, &streamDesc);
+	
+	if((status != noErr) && isFloat)
+	{
+		PJ_LOG(2, (THIS_FILE, "Voice unit rejected float format on bus %u (%i), falling back to 16 bits",
+		           (unsigned)element, (int)status));
+		
+		status = setClientStreamFormat(ca->voiceUnit, scope, element, clockRate, channels, PJ_FALSE, &streamDesc);
+	}
+	
+	if(status != noErr)
+	{
+		return coreaudioStatus(status, "AudioUnitSetProperty(StreamFormat)");
+	}
+	
+	format->sampleRate    = (unsigned)streamDesc.mSampleRate;
+	format->channels      = streamDesc.mChannelsPerFrame;
+	format->bytesPerFrame = streamDesc.mBytesPerFrame;
+	format->isFloat       = (streamDesc.mFormatFlags & kAudioFormatFlagIsFloat) != 0;
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t coreaudioUnitInitialize(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	return coreaudioStatus(AudioUnitInitialize(ca->voiceUnit), "AudioUnitInitialize");
+}
+
+static void coreaudioUnitUninitialize(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	AudioUnitUninitialize(ca->voiceUnit);
+}
+
+static pj_status_t coreaudioUnitStart(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	return coreaudioStatus(AudioOutputUnitStart(ca->voiceUnit), "AudioOutputUnitStart");
+}
+
+static void coreaudioUnitStop(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	// AudioOutputUnitStop doesn't return until the IO callbacks are done
+	AudioOutputUnitStop(ca->voiceUnit);
+}
+
+/**
+ * Turns the voice processing of a VoiceProcessingIO unit on or off (bypassed), and sets up its AGC.
+ * The unit must be uninitialized.
+**/
+static pj_status_t coreaudioUnitSetProcessing(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	if(unit->unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO)
+	{
+		// Nothing to set up
+		return PJ_SUCCESS;
+	}
+	
+	UInt32 bypass = (unit->unitType == PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING_BYPASSED) ? 1 : 0;
+	UInt32 agc = unit->agc ? 1 : 0;
+	
+	OSStatus status;
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                          // The audio unit to set property value for
+	                              kAUVoiceIOProperty_BypassVoiceProcessing, // The audio unit property identifier
+	                              kAudioUnitScope_Global,                 // The audio unit scope for the property
+	                              0,                                      // The audio unit element for the property
+	                              &bypass,                                // The value to apply to the property
+	                              sizeof(bypass));                        // The size of the value
+	if(status != noErr)
+	{
+		return coreaudioStatus(status, "AudioUnitSetProperty(BypassVoiceProcessing)");
+	}
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                               // The audio unit to set property value for
+	                              kAUVoiceIOProperty_VoiceProcessingEnableAGC, // The audio unit property identifier
+	                              kAudioUnitScope_Global,                      // The audio unit scope for the property
+	                              0,                                           // The audio unit element for the property
+	                              &agc,                                        // The value to apply to the property
+	                              sizeof(agc));                                // The size of the value
+	
+	return coreaudioStatus(status, "AudioUnitSetProperty(VoiceProcessingEnableAGC)");
+}
+
+/**
+ * Disposes of the audio unit, if there is one.
+**/
+static void coreaudioUnitDispose(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	if(ca->voiceUnit)
+	{
+		AudioUnitUninitialize(ca->voiceUnit);
+		AudioComponentInstanceDispose(ca->voiceUnit);
+		
+		ca->voiceUnit = NULL;
+	}
+}
+
+/**
+ * Instantiates the audio unit, and points its IO callbacks at the given voice unit.
+ *
+ * Returns PJ_SUCCESS, or one of the (negative) error codes that pjmedia_snd_open has always returned.
+ * On failure, the voice unit is destroyed by the caller, which disposes of anything created so far.
+**/
+static pj_status_t coreaudioUnitCreate(snd_voice_unit *unit)
+{
+	snd_coreaudio_unit *ca = (snd_coreaudio_unit *)unit->backendState;
+	
+	OSStatus status;
+	
+	// Instantiate the audio component
+	
+	AudioComponent component = voiceUnitComponent;
+	
+	if(unit->unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO)
+	{
+		component = remoteIOComponent;
+	}
+	
+	status = AudioComponentInstanceNew(component, &(ca->voiceUnit));
+	
+	if(status != noErr)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unable to instantiate voice unit: %d",
+		           coreaudioStatus(status, "AudioComponentInstanceNew")));
+		
+		ca->voiceUnit = NULL;
+		return -1;
+	}
+	
+	// Tell the voice unit how many frames we're prepared to handle per IO cycle.
+	// Our scratch buffers are sized accordingly.
+	
+	UInt32 maxFrames = MAX_FRAMES_PER_SLICE;
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                          // The audio unit to set property value for
+	                              kAudioUnitProperty_MaximumFramesPerSlice, // The audio unit property identifier
+	                              kAudioUnitScope_Global,                 // The audio unit scope for the property
+	                              0,                                      // The audio unit element for the property
+	                              &maxFrames,                             // The value to apply to the property
+	                              sizeof(maxFrames));                     // The size of the value
+	if(status != noErr)
+	{
+		PJ_LOG(2, (THIS_FILE, "Failed to set voice unit maximum frames per slice: %d",
+		           coreaudioStatus(status, "AudioUnitSetProperty(MaximumFramesPerSlice)")));
+	}
+	
+	// Setup input and render callbacks
+	//
+	// Both callbacks will use the voice unit as the user data, and serve all active streams
+	
+	// The render callback is invoked by the outputBus when it needs more data to play through the speaker.
+	//
+	// struct AURenderCallbackStruct {
+	//   AURenderCallback  inputProc;
+	//   void             *inputProcRefCon;
+	// };
+	
+	AudioUnitElement inputBus = 1;
+	AudioUnitElement outputBus = 0;
+	
+	AURenderCallbackStruct outputBusRenderCallback;
+	outputBusRenderCallback.inputProc = MyOutputBusRenderCallack;
+	outputBusRenderCallback.inputProcRefCon = unit;
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                        // The audio unit to set property value for
+	                              kAudioUnitProperty_SetRenderCallback, // The audio unit property identifier
+	                              kAudioUnitScope_Input,                // The audio unit scope for the property
+	                              outputBus,                            // The audio unit element for the property
+						          &outputBusRenderCallback,             // The value to apply to the property
+	                              sizeof(outputBusRenderCallback));     // The size of the value
+	
+	if(status != noErr)
+	{
+		PJ_LOG(1, (THIS_FILE, "Failed to set outputBus render callback: %d",
+		           coreaudioStatus(status, "AudioUnitSetProperty(SetRenderCallback)")));
+		return -7;
+	}
+	
+	AURenderCallbackStruct inputBusRenderCallback;
+	inputBusRenderCallback.inputProc = MyInputBusInputCallback;
+	inputBusRenderCallback.inputProcRefCon = unit;
+	
+	status = AudioUnitSetProperty(ca->voiceUnit,                             // The audio unit to set property value for
+	                              kAudioOutputUnitProperty_SetInputCallback, // The audio unit property identifier
+	                              kAudioUnitScope_Global,                    // The audio unit scope for the property
+	                              inputBus,                                  // The audio unit element for the property
+						          &inputBusRenderCallback,                   // The value to apply to the property
+	                              sizeof(inputBusRenderCallback));           // The size of the value
+	
+	if(status != noErr)
+	{
+		PJ_LOG(1, (THIS_FILE, "Failed to set input callback: %d",
+		           coreaudioStatus(status, "AudioUnitSetProperty(SetInputCallback)")));
+		return -8;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Initializes the audio session, and finds the voice unit audio component.
+**/
+static pj_status_t coreaudioInit()
+{
+	// Initialize audio session for iPhone
+	initializeAudioSession();
+	
+	// To setup and use an audio unit, the following steps are performed in order:
+	// 
+	// - Ask the system for a reference to the audio unit
+	// - Instantiate the audio unit
+	// - Configure the audio unit instance
+	// - Initialize the instance and start using it
+	
+	// Since this is an init method, we're not actually going to instantiate the audio unit,
+	// but we can go ahead and get a reference to the voice unit.
+	// In order to do this, we have to ask the system for a reference to it.
+	// We do this by searching, based on a query of sorts, described by a AudioComponentDescription struct.
+	
+	AudioComponentDescription desc;
+	
+	// struct AudioComponentDescription {
+	//   OSType componentType;
+	//   OSType componentSubType;
+	//   OSType componentManufacturer;
+	//   UInt32 componentFlags;
+	//   UInt32 componentFlagsMask;
+	// };
+	
+	desc.componentType = kAudioUnitType_Output;
+	desc.componentSubType = kAudioUnitSubType_VoiceProcessingIO;
+	desc.componentManufacturer = kAudioUnitManufacturer_Apple;
+	desc.componentFlags = 0;
+	desc.componentFlagsMask = 0;
+	
+	// AudioComponent
+	// AudioComponentFindNext(AudioComponent inComponent, const AudioComponentDescription *inDesc)
+	// 
+	// This function is used to find an audio component that is the closest match to the provide values.
+	// 
+	// inComponent
+	//   If NULL, then the search starts from the beginning until an audio component is found that matches
+	//   the description provided by inDesc.
+	//   If not-NULL, then the search starts (continues) from the previously found audio component specified
+	//   by inComponent, and will return the nextfound audio component.
+	// inDesc
+	//   The type, subtype and manufacturer fields are used to specify the audio component to search for.
+	//   A value of 0 (zero) for any of these fiels is a wildcard, so the first match found is returned.
+	// 
+	// Returns: An audio component that matches the search parameters, or NULL if none found.
+	
+	voiceUnitComponent = AudioComponentFindNext(NULL, &desc);
+	
+	if(voiceUnitComponent == NULL)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unable to find voice unit audio component!"));
+		return -1;
+	}
+	
+	// And the RemoteIO unit, for streams that don't need voice processing (see options.unit_type)
+	
+	desc.componentSubType = kAudioUnitSubType_RemoteIO;
+	
+	remoteIOComponent = AudioComponentFindNext(NULL, &desc);
+	
+	if(remoteIOComponent == NULL)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unable to find RemoteIO audio component!"));
+		return -1;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+static void coreaudioDeinit()
+{
+	voiceUnitComponent = NULL;
+	remoteIOComponent = NULL;
+}
+
+static const snd_backend coreaudio_backend =
+{
+	"coreaudio",
+	
+	coreaudioInit,
+	coreaudioDeinit,
+	
+	startAudioSession,
+	stopAudioSession,
+	
+	setPreferredHardwareIOBufferDuration,
+	getCurrentIOBufferDuration,
+	
+	getCurrentHardwareSampleRate,
+	getHostTicksPerSecond,
+	
+	sizeof(snd_coreaudio_unit),
+	
+	coreaudioUnitCreate,
+	coreaudioUnitDispose,
+	coreaudioUnitSetProcessing,
+	
+	coreaudioUnitEnableIO,
+	coreaudioUnitSetFormat,
+	
+	coreaudioUnitInitialize,
+	coreaudioUnitUninitialize,
+	
+	coreaudioUnitStart,
+	coreaudioUnitStop,
+	
+	coreaudioFetchCapture
+};
+
+#endif /* PJMEDIA_SND_IPHONE_COREAUDIO */
+
+
+/**
+ * Loopback backend.
+ *
+ * Runs the voice unit without any audio hardware, so the whole driver can be tested and benchmarked
+ * on any platform pjlib runs on (see pjmedia_snd_iphone_use_loopback).
+ *
+ * A timer thread plays the part of the core audio IO thread.
+ * Every IO cycle, it renders a buffer of audio via voiceUnitRender, and then captures one via voiceUnitCapture.
+ *
+ * - The rendered audio is appended to a WAV file (render_file), if there is one.
+ * - The captured audio is read from a WAV file (capture_file), which is played in a loop.
+ *   Without a capture file, the rendered audio is captured again, loopback_delay IO cycles later.
+ *
+ * In realtime mode, the IO cycles are paced by the host clock, like the real thing.
+ * If the thread falls behind by more than a cycle, the missed cycles are skipped, and the sample time jumps ahead,
+ * the same as core audio does when its IO thread is overloaded.
+ * Otherwise the IO cycles run back to back, as fast as the driver keeps up.
+ *
+ * Either way, the timestamps of the IO cycles follow the nominal sample rate exactly,
+ * so the timeline the driver sees doesn't depend on how the host happens to schedule the thread.
+**/
+
+// The IO buffer duration used unless pjmedia_snd_set_latency asks for something else.
+// This is what an iPhone gives us by default (see the discussion on latency).
+#define LOOPBACK_DEFAULT_IO_BUFFER_DURATION  0.023
+
+#define LOOPBACK_MAX_PATH  256
+
+// The longest loopback_delay, in IO cycles
+#define LOOPBACK_MAX_DELAY  32
+
+// Size of the header of the WAV files we write
+#define WAV_HEADER_SIZE  44
+
+// The parameters of the loopback backend (see pjmedia_snd_iphone_use_loopback)
+static pjmedia_snd_iphone_loopback_param loopback_param;
+static pj_bool_t loopback_param_set = PJ_FALSE;
+
+static char loopback_capture_file[LOOPBACK_MAX_PATH];
+static char loopback_render_file[LOOPBACK_MAX_PATH];
+
+// The IO buffer duration (in seconds) asked for via setPreferredIOBufferDuration, or 0 for the default
+static double loopback_io_buffer_duration = 0;
+
+/**
+ * A 16-bit PCM WAV file, open for either reading or writing.
+**/
+typedef struct snd_wav_file
+{
+	pj_oshandle_t fd;
+	
+	unsigned sampleRate;
+	unsigned channels;
+	
+	// Where the audio data starts, how many bytes of it there are (or have been written so far),
+	// and how many of them have been read so far
+	long dataOffset;
+	pj_uint32_t dataSize;
+	pj_uint32_t position;
+	
+} snd_wav_file;
+
+/**
+ * The loopback state of the voice unit.
+**/
+typedef struct snd_loopback_unit
+{
+	// The directions with IO enabled, and whether the unit is initialized
+	int ioDir;
+	pj_bool_t initialized;
+	
+	pj_thread_t *thread;
+	pj_bool_t running;
+	
+	// The number of frames per IO cycle, and the sample time of the next IO cycle
+	unsigned framesPerCycle;
+	double sampleTime;
+	
+	// Buffers of MAX_FRAMES_PER_SLICE stereo frames each:
+	// The rendered and the captured audio (in the bus formats, so big enough for float samples),
+	// the audio read from the capture file, and the 16-bit version of the rendered or captured audio if a bus is float.
+	void *renderBuffer;
+	void *captureBuffer;
+	pj_int16_t *fileBuffer;
+	pj_int16_t *pcmBuffer;
+	
+	// The rendered audio of the last (loopback_delay + 1) IO cycles, as 16-bit samples with the output bus channels.
+	// Slot delayIndex receives the current IO cycle, and the one after it is the oldest.
+	pj_int16_t *delayLine;
+	unsigned delaySlots;
+	unsigned delayIndex;
+	
+	snd_wav_file captureFile;
+	snd_wav_file renderFile;
+	
+	// The pools of the open WAV files and of the timer thread, which go away along with them.
+	// The unit's pool can't be used for these, since the unit may be started any number of times (see keep_warm).
+	pj_pool_t *filePool;
+	pj_pool_t *threadPool;
+	
+} snd_loopback_unit;
+
+// The size (in samples) of the buffers and delay line slots of the loopback state
+#define LOOPBACK_BUFFER_SAMPLES  (MAX_FRAMES_PER_SLICE * 2)
+
+static void wavPutLE16(pj_uint8_t *p, pj_uint16_t value)
+{
+	p[0] = (pj_uint8_t)(value);
+	p[1] = (pj_uint8_t)(value >> 8);
+}
+
+static void wavPutLE32(pj_uint8_t *p, pj_uint32_t value)
+{
+	p[0] = (pj_uint8_t)(value);
+	p[1] = (pj_uint8_t)(value >> 8);
+	p[2] = (pj_uint8_t)(value >> 16);
+	p[3] = (pj_uint8_t)(value >> 24);
+}
+
+static pj_uint16_t wavGetLE16(const pj_uint8_t *p)
+{
+	return (pj_uint16_t)(p[0] | (p[1] << 8));
+}
+
+static pj_uint32_t wavGetLE32(const pj_uint8_t *p)
+{
+	return (pj_uint32_t)p[0] | ((pj_uint32_t)p[1] << 8) | ((pj_uint32_t)p[2] << 16) | ((pj_uint32_t)p[3] << 24);
+}
+
+/**
+ * Reads exactly size bytes from the given file.
+**/
+static pj_bool_t wavReadFully(pj_oshandle_t fd, void *data, pj_ssize_t size)
+{
+	pj_ssize_t read = size;
+	
+	return (pj_file_read(fd, data, &read) == PJ_SUCCESS) && (read == size);
+}
+
+/**
+ * Opens a WAV file for reading, and finds its audio data.
+ * Only 16-bit PCM, mono or stereo, is supported.
+**/
+static pj_status_t wavOpenRead(pj_pool_t *pool, const char *path, snd_wav_file *wav)
+{
+	pj_bzero(wav, sizeof(snd_wav_file));
+	
+	pj_status_t status = pj_file_open(pool, path, PJ_O_RDONLY, &wav->fd);
+	
+	if(status != PJ_SUCCESS)
+	{
+		wav->fd = NULL;
+		return status;
+	}
+	
+	pj_uint8_t header[16];
+	long offset = 12;
+	
+	if(!wavReadFully(wav->fd, header, 12) || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+	{
+		pj_file_close(wav->fd);
+		wav->fd = NULL;
+		
+		return PJ_EINVAL;
+	}
+	
+	// Walk the chunks until we find the audio data.
+	// The format chunk has to come first.
+	
+	pj_uint16_t bitsPerSample = 0;
+	
+	while(wavReadFully(wav->fd, header, 8))
+	{
+		pj_uint32_t chunkSize = wavGetLE32(header + 4);
+		offset += 8;
+		
+		if(memcmp(header, "fmt ", 4) == 0)
+		{
+			if((chunkSize < 16) || !wavReadFully(wav->fd, header, 16))
+			{
+				break;
+			}
+			
+			// Format 1 is PCM, and 0xFFFE (extensible) is checked by the bits per sample alone
+			pj_uint16_t format = wavGetLE16(header);
+			
+			wav->channels   = wavGetLE16(header + 2);
+			wav->sampleRate = wavGetLE32(header + 4);
+			bitsPerSample   = wavGetLE16(header + 14);
+			
+			if((format != 1) && (format != 0xFFFE))
+			{
+				bitsPerSample = 0;
+			}
+			
+			offset += 16;
+			chunkSize -= 16;
+		}
+		else if(memcmp(header, "data", 4) == 0)
+		{
+			if((bitsPerSample != 16) || (wav->channels < 1) || (wav->channels > 2))
+			{
+				break;
+			}
+			
+			wav->dataOffset = offset;
+			wav->dataSize = chunkSize - (chunkSize % (wav->channels * sizeof(pj_int16_t)));
+			
+			return PJ_SUCCESS;
+		}
+		
+		// Skip the rest of the chunk (which is padded to an even size)
+		chunkSize += (chunkSize & 1);
+		
+		pj_file_setpos(wav->fd, (long)chunkSize, PJ_SEEK_CUR);
+		offset += chunkSize;
+	}
+	
+	pj_file_close(wav->fd);
+	wav->fd = NULL;
+	
+	return PJ_ENOTSUP;
+}
+
+/**
+ * Reads numFrames frames from a WAV file opened with wavOpenRead.
+ * The file is played in a loop. An empty file reads as silence.
+**/
+static void wavRead(snd_wav_file *wav, pj_int16_t *data, unsigned numFrames)
+{
+	pj_uint32_t size = numFrames * wav->channels * sizeof(pj_int16_t);
+	pj_uint8_t *dst = (pj_uint8_t *)data;
+	
+	while(size > 0)
+	{
+		if(wav->position >= wav->dataSize)
+		{
+			if(wav->dataSize == 0)
+			{
+				memset(dst, 0, size);
+				return;
+			}
+			
+			pj_file_setpos(wav->fd, wav->dataOffset, PJ_SEEK_SET);
+			wav->position = 0;
+		}
+		
+		pj_ssize_t chunk = wav->dataSize - wav->position;
+		
+		if(chunk > (pj_ssize_t)size)
+		{
+			chunk = size;
+		}
+		
+		if(pj_file_read(wav->fd, dst, &chunk) != PJ_SUCCESS || (chunk <= 0))
+		{
+			// The file got shorter than its header says
+			memset(dst, 0, size);
+			wav->dataSize = wav->position;
+			return;
+		}
+		
+		wav->position += chunk;
+		dst += chunk;
+		size -= chunk;
+	}
+}
+
+/**
+ * Creates a WAV file for writing 16-bit PCM.
+ * The sizes in the header are filled in by wavClose.
+**/
+static pj_status_t wavOpenWrite(pj_pool_t *pool, const char *path, unsigned sampleRate, unsigned channels,
+                                snd_wav_file *wav)
+{
+	pj_bzero(wav, sizeof(snd_wav_file));
+	
+	pj_status_t status = pj_file_open(pool, path, PJ_O_WRONLY, &wav->fd);
+	
+	if(status != PJ_SUCCESS)
+	{
+		wav->fd = NULL;
+		return status;
+	}
+	
+	wav->sampleRate = sampleRate;
+	wav->channels = channels;
+	wav->dataOffset = WAV_HEADER_SIZE;
+	
+	pj_uint8_t header[WAV_HEADER_SIZE];
+	
+	memcpy(header, "RIFF", 4);
+	wavPutLE32(header + 4, WAV_HEADER_SIZE - 8);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	wavPutLE32(header + 16, 16);
+	wavPutLE16(header + 20, 1);
+	wavPutLE16(header + 22, channels);
+	wavPutLE32(header + 24, sampleRate);
+	wavPutLE32(header + 28, sampleRate * channels * sizeof(pj_int16_t));
+	wavPutLE16(header + 32, channels * sizeof(pj_int16_t));
+	wavPutLE16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	wavPutLE32(header + 40, 0);
+	
+	pj_ssize_t size = WAV_HEADER_SIZE;
+	
+	return pj_file_write(wav->fd, header, &size);
+}
+
+/**
+ * Appends numFrames frames to a WAV file opened with wavOpenWrite.
+**/
+static void wavWrite(snd_wav_file *wav, const pj_int16_t *data, unsigned numFrames)
+{
+	pj_ssize_t size = numFrames * wav->channels * sizeof(pj_int16_t);
+	
+	if(pj_file_write(wav->fd, data, &size) == PJ_SUCCESS)
+	{
+		wav->dataSize += size;
+	}
+}
+
+/**
+ * Closes a WAV file, if it's open.
+ * A file that was written gets the final sizes in its header.
+**/
+static void wavClose(snd_wav_file *wav, pj_bool_t written)
+{
+	if(wav->fd == NULL)
+	{
+		return;
+	}
+	
+	if(written)
+	{
+		pj_uint8_t size[4];
+		pj_ssize_t length = sizeof(size);
+		
+		pj_file_setpos(wav->fd, 4, PJ_SEEK_SET);
+		wavPutLE32(size, WAV_HEADER_SIZE - 8 + wav->dataSize);
+		pj_file_write(wav->fd, size, &length);
+		
+		pj_file_setpos(wav->fd, 40, PJ_SEEK_SET);
+		wavPutLE32(size, wav->dataSize);
+		length = sizeof(size);
+		pj_file_write(wav->fd, size, &length);
+	}
+	
+	pj_file_close(wav->fd);
+	wav->fd = NULL;
+}
+
+static void loopbackStartSession(pjmedia_dir dir)
+{
+	// There's no audio session to activate
+}
+
+static void loopbackStopSession()
+{
+}
+
+static void loopbackSetPreferredIOBufferDuration(double duration)
+{
+	loopback_io_buffer_duration = duration;
+}
+
+/**
+ * Returns the number of frames per IO cycle at the given sample rate.
+ * That's frames_per_cycle if set, or whatever matches the IO buffer duration.
+**/
+static unsigned loopbackFramesPerCycle(unsigned sampleRate)
+{
+	unsigned frames = loopback_param.frames_per_cycle;
+	
+	if(frames == 0)
+	{
+		double duration = loopback_io_buffer_duration;
+		
+		if(duration <= 0)
+		{
+			duration = LOOPBACK_DEFAULT_IO_BUFFER_DURATION;
+		}
+		
+		frames = (unsigned)(duration * sampleRate + 0.5);
+	}
+	
+	if(frames < 1) frames = 1;
+	if(frames > MAX_FRAMES_PER_SLICE) frames = MAX_FRAMES_PER_SLICE;
+	
+	return frames;
+}
+
+static double loopbackGetIOBufferDuration()
+{
+	unsigned sampleRate = snd_unit ? snd_unit->clockRate : loopback_param.hw_clock_rate;
+	
+	return (double)loopbackFramesPerCycle(sampleRate) / sampleRate;
+}
+
+static unsigned loopbackGetHardwareSampleRate()
+{
+	return loopback_param.hw_clock_rate;
+}
+
+static double loopbackGetHostTicksPerSecond()
+{
+	pj_timestamp freq;
+	pj_get_timestamp_freq(&freq);
+	
+	return (double)freq.u64;
+}
+
+/**
+ * Fetches the captured audio of the current IO cycle: from the capture file if there is one,
+ * or else from the delay line. The result is converted to the input bus format (channels and sample format).
+**/
+static pj_status_t loopbackFetchCapture(snd_voice_unit *unit,
+                                        void *context,
+                                        unsigned numFrames,
+                                        const void **data,
+                                        unsigned *size)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	unsigned channels = unit->inputFormat.channels;
+	
+	// For a float bus we gather the 16-bit audio first, and convert it afterwards
+	pj_int16_t *pcm = unit->inputFormat.isFloat ? lb->pcmBuffer : (pj_int16_t *)lb->captureBuffer;
+	
+	if(lb->captureFile.fd)
+	{
+		wavRead(&lb->captureFile, lb->fileBuffer, numFrames);
+		copyFrames(pcm, channels, lb->fileBuffer, lb->captureFile.channels, numFrames);
+	}
+	else if(lb->ioDir & PJMEDIA_DIR_PLAYBACK)
+	{
+		unsigned oldest = (lb->delayIndex + 1) % lb->delaySlots;
+		const pj_int16_t *slot = lb->delayLine + (oldest * LOOPBACK_BUFFER_SAMPLES);
+		
+		copyFrames(pcm, channels, slot, unit->outputFormat.channels, numFrames);
+	}
+	else
+	{
+		memset(pcm, 0, numFrames * channels * sizeof(pj_int16_t));
+	}
+	
+	if(unit->inputFormat.isFloat)
+	{
+		int16ToFloat((float *)lb->captureBuffer, pcm, numFrames * channels);
+	}
+	
+	*data = lb->captureBuffer;
+	*size = numFrames * unit->inputFormat.bytesPerFrame;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Runs one IO cycle: renders, and then captures, numFrames frames.
+**/
+static void loopbackCycle(snd_voice_unit *unit, snd_loopback_unit *lb, const snd_io_time *time, unsigned numFrames)
+{
+	pj_int16_t *slot = lb->delayLine + (lb->delayIndex * LOOPBACK_BUFFER_SAMPLES);
+	
+	if(lb->ioDir & PJMEDIA_DIR_PLAYBACK)
+	{
+		unsigned size = numFrames * unit->outputFormat.bytesPerFrame;
+		
+		voiceUnitRender(unit, time, numFrames, lb->renderBuffer, size);
+		
+		// The WAV file and the delay line take 16-bit audio
+		pj_int16_t *pcm = (pj_int16_t *)lb->renderBuffer;
+		
+		if(unit->outputFormat.isFloat)
+		{
+			pcm = lb->pcmBuffer;
+			floatToInt16(pcm, (const float *)lb->renderBuffer, numFrames * unit->outputFormat.channels, NULL);
+		}
+		
+		if(lb->renderFile.fd)
+		{
+			wavWrite(&lb->renderFile, pcm, numFrames);
+		}
+		
+		memcpy(slot, pcm, numFrames * unit->outputFormat.channels * sizeof(pj_int16_t));
+	}
+	
+	if(lb->ioDir & PJMEDIA_DIR_CAPTURE)
+	{
+		voiceUnitCapture(unit, time, numFrames, NULL);
+	}
+	
+	lb->delayIndex = (lb->delayIndex + 1) % lb->delaySlots;
+}
+
+/**
+ * Sleeps until the host clock reaches the given time.
+ *
+ * We sleep in whole milliseconds while there's time, and then yield until the deadline,
+ * so the IO cycles start within a few microseconds of when they should.
+**/
+static void loopbackWaitUntil(pj_uint64_t deadline, pj_uint64_t ticksPerMsec)
+{
+	for(;;)
+	{
+		pj_timestamp now;
+		pj_get_timestamp(&now);
+		
+		if(now.u64 >= deadline)
+		{
+			return;
+		}
+		
+		pj_uint64_t remaining = deadline - now.u64;
+		
+		if(remaining > (2 * ticksPerMsec))
+		{
+			pj_thread_sleep((unsigned)(remaining / ticksPerMsec) - 1);
+		}
+		else
+		{
+			pj_thread_sleep(0);
+		}
+	}
+}
+
+/**
+ * The timer thread, which stands in for the core audio IO thread.
+**/
+static int loopbackThreadProc(void *arg)
+{
+	snd_voice_unit *unit = (snd_voice_unit *)arg;
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	pj_timestamp freq;
+	pj_get_timestamp_freq(&freq);
+	
+	pj_uint64_t ticksPerMsec = freq.u64 / 1000;
+	double ticksPerFrame = (double)freq.u64 / unit->clockRate;
+	
+	unsigned numFrames = lb->framesPerCycle;
+	
+	// The host time of the first IO cycle. The IO cycles follow at exact multiples of numFrames from there.
+	
+	pj_timestamp start;
+	pj_get_timestamp(&start);
+	
+	double startSampleTime = lb->sampleTime;
+	pj_uint64_t cycle = 0;
+	
+	while(ATOMIC_LOAD(&lb->running))
+	{
+		pj_uint64_t deadline = start.u64 + (pj_uint64_t)(cycle * numFrames * ticksPerFrame);
+		
+		if(loopback_param.realtime)
+		{
+			loopbackWaitUntil(deadline, ticksPerMsec);
+			
+			// If we've fallen more than a cycle behind, skip the cycles we missed
+			pj_timestamp now;
+			pj_get_timestamp(&now);
+			
+			pj_uint64_t due = (pj_uint64_t)((now.u64 - start.u64) / (numFrames * ticksPerFrame));
+			
+			if(due > cycle + 1)
+			{
+				cycle = due;
+				deadline = start.u64 + (pj_uint64_t)(cycle * numFrames * ticksPerFrame);
+			}
+		}
+		
+		snd_io_time time;
+		time.sampleTime      = startSampleTime + ((double)cycle * numFrames);
+		time.hostTime        = deadline;
+		time.sampleTimeValid = PJ_TRUE;
+		time.hostTimeValid   = PJ_TRUE;
+		
+		loopbackCycle(unit, lb, &time, numFrames);
+		
+		cycle++;
+		lb->sampleTime = startSampleTime + ((double)cycle * numFrames);
+	}
+	
+	return 0;
+}
+
+static pj_status_t loopbackUnitCreate(snd_voice_unit *unit)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	// The buffers survive the unit being created again as a different kind of unit (see voiceUnitConfigure)
+	lb->ioDir = PJMEDIA_DIR_NONE;
+	
+	if(lb->renderBuffer)
+	{
+		return PJ_SUCCESS;
+	}
+	
+	lb->delaySlots = loopback_param.loopback_delay + 1;
+	
+	pj_size_t bufferSize = LOOPBACK_BUFFER_SAMPLES * sizeof(pj_int16_t);
+	pj_size_t floatBufferSize = LOOPBACK_BUFFER_SAMPLES * sizeof(float);
+	
+	lb->renderBuffer  = pj_pool_zalloc(unit->pool, floatBufferSize);
+	lb->captureBuffer = pj_pool_zalloc(unit->pool, floatBufferSize);
+	lb->fileBuffer    = (pj_int16_t *)pj_pool_zalloc(unit->pool, bufferSize);
+	lb->pcmBuffer     = (pj_int16_t *)pj_pool_zalloc(unit->pool, bufferSize);
+	lb->delayLine     = (pj_int16_t *)pj_pool_zalloc(unit->pool, lb->delaySlots * bufferSize);
+	
+	if(!lb->renderBuffer || !lb->captureBuffer || !lb->fileBuffer || !lb->pcmBuffer || !lb->delayLine)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Closes the WAV files.
+ * They're opened again (and the render file starts over) the next time the unit is started.
+**/
+static void loopbackCloseFiles(snd_loopback_unit *lb)
+{
+	wavClose(&lb->captureFile, PJ_FALSE);
+	wavClose(&lb->renderFile, PJ_TRUE);
+	
+	if(lb->filePool)
+	{
+		pj_pool_release(lb->filePool);
+		lb->filePool = NULL;
+	}
+}
+
+/**
+ * Returns the pool for the WAV files, creating it if needed.
+ * Returns NULL if we're out of memory.
+**/
+static pj_pool_t *loopbackFilePool(snd_loopback_unit *lb)
+{
+	if(lb->filePool == NULL)
+	{
+		lb->filePool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
+		                              "iphonesndwav",   // memory pool name
+		                              256,              // initial size
+		                              256,              // increment size
+		                              NULL);            // error callback
+	}
+	
+	return lb->filePool;
+}
+
+static void loopbackUnitDispose(snd_voice_unit *unit)
+{
+	loopbackCloseFiles((snd_loopback_unit *)unit->backendState);
+}
+
+static pj_status_t loopbackUnitSetProcessing(snd_voice_unit *unit)
+{
+	// There's no voice processing to speak of
+	return PJ_SUCCESS;
+}
+
+static pj_status_t loopbackUnitEnableIO(snd_voice_unit *unit, pjmedia_dir bus, pj_bool_t enabled)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	if(enabled)
+		lb->ioDir |= bus;
+	else
+		lb->ioDir &= ~bus;
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t loopbackUnitSetFormat(snd_voice_unit *unit,
+                                         pjmedia_dir bus,
+                                         unsigned clockRate,
+                                         unsigned channels,
+                                         pj_bool_t isFloat,
+                                         snd_bus_format *format)
+{
+	// Like the voice unit, we take mono or stereo, in 16-bit or float samples
+	if((channels < 1) || (channels > 2))
+	{
+		channels = 2;
+	}
+	
+	format->sampleRate    = clockRate;
+	format->channels      = channels;
+	format->bytesPerFrame = channels * (isFloat ? sizeof(float) : sizeof(pj_int16_t));
+	format->isFloat       = isFloat;
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t loopbackUnitInitialize(snd_voice_unit *unit)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	lb->initialized = PJ_TRUE;
+	
+	return PJ_SUCCESS;
+}
+
+static void loopbackUnitUninitialize(snd_voice_unit *unit)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	// The bus formats may be about to change
+	loopbackCloseFiles(lb);
+	
+	lb->initialized = PJ_FALSE;
+}
+
+/**
+ * Opens the WAV files (if they aren't open already), and starts the timer thread.
+ * Everything allocated here comes from the pools of the files and the thread, not the unit's pool.
+**/
+static pj_status_t loopbackUnitStart(snd_voice_unit *unit)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	PJ_ASSERT_RETURN(lb->initialized, PJ_EINVALIDOP);
+	
+	pj_status_t status;
+	
+	if(loopback_param.capture_file && (lb->ioDir & PJMEDIA_DIR_CAPTURE) && !lb->captureFile.fd)
+	{
+		pj_pool_t *pool = loopbackFilePool(lb);
+		
+		status = pool ? wavOpenRead(pool, loopback_param.capture_file, &lb->captureFile) : PJ_ENOMEM;
+		
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Unable to read capture file %s: %i", loopback_param.capture_file, (int)status));
+		}
+		else if(lb->captureFile.sampleRate != unit->clockRate)
+		{
+			PJ_LOG(2, (THIS_FILE, "Capture file %s is %u Hz, captured at %u Hz without conversion",
+			           loopback_param.capture_file, lb->captureFile.sampleRate, unit->clockRate));
+		}
+	}
+	
+	if(loopback_param.render_file && (lb->ioDir & PJMEDIA_DIR_PLAYBACK) && !lb->renderFile.fd)
+	{
+		pj_pool_t *pool = loopbackFilePool(lb);
+		
+		status = pool ? wavOpenWrite(pool, loopback_param.render_file,
+		                             unit->clockRate, unit->outputFormat.channels, &lb->renderFile) : PJ_ENOMEM;
+		
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Unable to create render file %s: %i", loopback_param.render_file, (int)status));
+			wavClose(&lb->renderFile, PJ_FALSE);
+		}
+	}
+	
+	lb->framesPerCycle = loopbackFramesPerCycle(unit->clockRate);
+	
+	lb->threadPool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
+	                                "iphonesndlb",    // memory pool name
+	                                512,              // initial size
+	                                512,              // increment size
+	                                NULL);            // error callback
+	if(lb->threadPool == NULL)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	ATOMIC_STORE(&lb->running, PJ_TRUE);
+	
+	status = pj_thread_create(lb->threadPool,               // memory pool for the thread structure
+	                          "iphonesnd_io",               // thread name
+	                          loopbackThreadProc,           // thread entry point
+	                          unit,                         // thread argument
+	                          PJ_THREAD_DEFAULT_STACK_SIZE, // stack size
+	                          0,                            // flags
+	                          &lb->thread);                 // the created thread
+	if(status != PJ_SUCCESS)
+	{
+		ATOMIC_STORE(&lb->running, PJ_FALSE);
+		lb->thread = NULL;
+		
+		pj_pool_release(lb->threadPool);
+		lb->threadPool = NULL;
+		
+		return status;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Stops the timer thread, and waits for it to exit.
+**/
+static void loopbackUnitStop(snd_voice_unit *unit)
+{
+	snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+	
+	if(lb->thread == NULL)
+	{
+		return;
+	}
+	
+	ATOMIC_STORE(&lb->running, PJ_FALSE);
+	
+	pj_thread_join(lb->thread);
+	pj_thread_destroy(lb->thread);
+	
+	lb->thread = NULL;
+	
+	pj_pool_release(lb->threadPool);
+	lb->threadPool = NULL;
+}
+
+static pj_status_t loopbackInit()
+{
+	if(!loopback_param_set)
+	{
+		pjmedia_snd_iphone_loopback_param_default(&loopback_param);
+	}
+	
+	return PJ_SUCCESS;
+}
+
+static void loopbackDeinit()
+{
+}
+
+static const snd_backend loopback_backend =
+{
+	"loopback",
+	
+	loopbackInit,
+	loopbackDeinit,
+	
+	loopbackStartSession,
+	loopbackStopSession,
+	
+	loopbackSetPreferredIOBufferDuration,
+	loopbackGetIOBufferDuration,
+	
+	loopbackGetHardwareSampleRate,
+	loopbackGetHostTicksPerSecond,
+	
+	sizeof(snd_loopback_unit),
+	
+	loopbackUnitCreate,
+	loopbackUnitDispose,
+	loopbackUnitSetProcessing,
+	
+	loopbackUnitEnableIO,
+	loopbackUnitSetFormat,
+	
+	loopbackUnitInitialize,
+	loopbackUnitUninitialize,
+	
+	loopbackUnitStart,
+	loopbackUnitStop,
+	
+	loopbackFetchCapture
+};
+
+// The backend used for the audio session, and for voice units created from now on.
+// See pjmedia_snd_iphone_use_loopback.
+
+#if PJMEDIA_SND_IPHONE_COREAUDIO
+  #define DEFAULT_BACKEND  (&coreaudio_backend)
+#else
+  #define DEFAULT_BACKEND  (&loopback_backend)
+#endif
+
+static const snd_backend *snd_io_backend = DEFAULT_BACKEND;
+
+/**
+ * Asks the backend for a hardware IO buffer duration matching the configured latency.
+ *
+ * This is only a preference, and core audio may grant something else.
+ * Use snd_backend.getIOBufferDuration to find out what we actually got.
+**/
+static void setPreferredIOBufferDuration(pjmedia_dir dir)
+{
+	double duration = latencyForDirection(dir) / 1000.0;
+	
+	if(duration < MIN_IO_BUFFER_DURATION) duration = MIN_IO_BUFFER_DURATION;
+	if(duration > MAX_IO_BUFFER_DURATION) duration = MAX_IO_BUFFER_DURATION;
+	
+	snd_io_backend->setPreferredIOBufferDuration(duration);
+}
+
+/**
+ * Starts the voice unit.
+ * If the backend fails to start it, the voice unit stays stopped, and the next active stream tries again.
+ * The streams must be locked.
+**/
+static pj_status_t voiceUnitStart(snd_voice_unit *unit)
+{
+	pj_status_t status = unit->backend->unitStart(unit);
+	
+	if(status != PJ_SUCCESS)
+	{
+		PJ_LOG(1, (THIS_FILE, "Failed to start voice unit: %i", (int)status));
+		return status;
+	}
+	
+	unit->isRunning = PJ_TRUE;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Stops the voice unit. When this returns, the IO callbacks are done.
+ * The streams must be locked.
+**/
+static void voiceUnitStop(snd_voice_unit *unit)
+{
+	unit->backend->unitStop(unit);
+	unit->isRunning = PJ_FALSE;
+	
+	resetIOThreads(unit);
+}
+
+/**
+ * Returns the kind of audio unit the voice unit should run on for a new stream with the given direction(s),
+ * given the stream options (options.unit_type). The voice unit may be NULL, if it doesn't exist yet.
+ * 
+ * Automatically, streams that capture get voice processing, and playback-only streams get the cheapest unit.
+ * That's RemoteIO, unless there's a voice unit kept warm. Bypassing its voice processing is cheaper than
+ * creating a new audio unit.
+ * 
+ * If other streams are open, the new stream never takes voice processing away from them.
+ * But it may add voice processing, even if that means replacing RemoteIO (see voiceUnitConfigure),
+ * so a call opened while a prompt is playing still gets echo cancellation.
+**/
+static pjmedia_snd_iphone_unit_type voiceUnitType(const snd_voice_unit *unit,
+                                                  pjmedia_dir dir,
+                                                  const pjmedia_snd_iphone_options *options)
+{
+	pjmedia_snd_iphone_unit_type unitType = options->unit_type;
+	
+	if(unitType == PJMEDIA_SND_IPHONE_UNIT_AUTO)
+	{
+		if(dir & PJMEDIA_DIR_CAPTURE)
+			unitType = PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING;
+		else if(unit && (unit->unitType != PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO))
+			unitType = PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING_BYPASSED;
+		else
+			unitType = PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO;
+	}
+	
+	if(unit && (unit->openCount > 0) && (unitType < unit->unitType))
+	{
+		unitType = unit->unitType;
+	}
+	
+	return unitType;
+}
+
+/**
+ * What voiceUnitConfigure may change about a voice unit that other streams are using.
+**/
+typedef struct snd_voice_unit_setup
+{
+	pjmedia_dir dir;
+	
+	pjmedia_snd_iphone_unit_type unitType;
+	pj_bool_t agc;
+	
+	snd_bus_format inputFormat;
+	snd_bus_format outputFormat;
+	unsigned inputChannels;
+	unsigned outputChannels;
+	
+} snd_voice_unit_setup;
+
+/**
+ * Creates the audio unit of the voice unit again, and sets it up from scratch as given (see voiceUnitRollback).
+ * On success, the voice unit is initialized, but not started.
+ * The streams must be locked.
+**/
+static pj_status_t voiceUnitRecreate(snd_voice_unit *unit, const snd_voice_unit_setup *setup)
+{
+	const snd_backend *backend = unit->backend;
+	pj_status_t status;
+	
+	pj_bool_t capture  = (setup->dir & PJMEDIA_DIR_CAPTURE) != 0;
+	pj_bool_t playback = (setup->dir & PJMEDIA_DIR_PLAYBACK) != 0;
+	
+	backend->unitDispose(unit);
+	
+	unit->unitType = setup->unitType;
+	unit->agc = setup->agc;
+	
+	status = backend->unitCreate(unit);
+	
+	if(status != PJ_SUCCESS)
+	{
+		return status;
+	}
+	
+	status = backend->unitSetProcessing(unit);
+	
+	if(status != PJ_SUCCESS)
+	{
+		PJ_LOG(2, (THIS_FILE, "Failed to set up voice processing: %i", (int)status));
+	}
+	
+	status = backend->unitEnableIO(unit, PJMEDIA_DIR_CAPTURE, capture);
+	
+	if(status == PJ_SUCCESS)
+	{
+		status = backend->unitEnableIO(unit, PJMEDIA_DIR_PLAYBACK, playback);
+	}
+	
+	// Same order as voiceUnitConfigure: input format, initialize, output format
+	
+	if((status == PJ_SUCCESS) && capture)
+	{
+		status = backend->unitSetFormat(unit, PJMEDIA_DIR_CAPTURE, unit->clockRate, setup->inputChannels,
+		                                unit->floatFormat, &(unit->inputFormat));
+	}
+	
+	if(status == PJ_SUCCESS)
+	{
+		status = backend->unitInitialize(unit);
+	}
+	
+	if((status == PJ_SUCCESS) && playback)
+	{
+		status = backend->unitSetFormat(unit, PJMEDIA_DIR_PLAYBACK, unit->clockRate, setup->outputChannels,
+		                                unit->floatFormat, &(unit->outputFormat));
+	}
+	
+	unit->inputChannels = setup->inputChannels;
+	unit->outputChannels = setup->outputChannels;
+	
+	return status;
+}
+
+/**
+ * Puts the voice unit back the way it was, after voiceUnitConfigure failed to set it up for a new stream.
+ * 
+ * The voice unit is uninitialized at this point (unless initialized says otherwise), and stopped if it was running.
+ * IO may be enabled for the directions in unitDir. The streams that already use the voice unit get it back
+ * with their directions and formats, initialized, and running again if it was.
+ * If the audio unit was created again for the new stream (RemoteIO replaced by VoiceProcessingIO),
+ * the one the other streams had is gone, so it's created again as well (voiceUnitRecreate).
+ * 
+ * If no other stream is open there's nothing to put back, since voiceUnitAcquire disposes of the voice unit.
+ * The streams must be locked.
+**/
+static void voiceUnitRollback(snd_voice_unit *unit,
+                              const snd_voice_unit_setup *setup,
+                              pjmedia_dir unitDir,
+                              pj_bool_t initialized)
+{
+	const snd_backend *backend = unit->backend;
+	pj_status_t status;
+	
+	if(unit->openCount == 0)
+	{
+		return;
+	}
+	
+	PJ_LOG(3, (THIS_FILE, "Restoring the voice unit for the streams already using it"));
+	
+	if(initialized)
+	{
+		backend->unitUninitialize(unit);
+	}
+	
+	if((unit->unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO) != (setup->unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO))
+	{
+		status = voiceUnitRecreate(unit, setup);
+	}
+	else
+	{
+		// Disable any direction that was enabled for the new stream only
+		
+		if((unitDir & PJMEDIA_DIR_CAPTURE) && !(setup->dir & PJMEDIA_DIR_CAPTURE))
+		{
+			backend->unitEnableIO(unit, PJMEDIA_DIR_CAPTURE, PJ_FALSE);
+		}
+		
+		if((unitDir & PJMEDIA_DIR_PLAYBACK) && !(setup->dir & PJMEDIA_DIR_PLAYBACK))
+		{
+			backend->unitEnableIO(unit, PJMEDIA_DIR_PLAYBACK, PJ_FALSE);
+		}
+		
+		if((unit->unitType != setup->unitType) || (unit->agc != setup->agc))
+		{
+			unit->unitType = setup->unitType;
+			unit->agc = setup->agc;
+			
+			backend->unitSetProcessing(unit);
+		}
+		
+		// The buses the other streams use kept their client formats,
+		// but a failed attempt may have left its mark on the format of a bus that's disabled again.
+		
+		unit->inputFormat = setup->inputFormat;
+		unit->outputFormat = setup->outputFormat;
+		unit->inputChannels = setup->inputChannels;
+		unit->outputChannels = setup->outputChannels;
+		
+		status = backend->unitInitialize(unit);
+	}
+	
+	if(status != PJ_SUCCESS)
+	{
+		// There's no going back. The streams stay silent until the voice unit is set up again.
+		
+		PJ_LOG(1, (THIS_FILE, "Failed to set up voice unit again: %i", (int)status));
+		
+		unit->dir = PJMEDIA_DIR_NONE;
+		unit->isRunning = PJ_FALSE;
+		return;
+	}
+	
+	unit->dir = setup->dir;
+	
+	if(unit->isRunning)
+	{
+		status = backend->unitStart(unit);
 		
-		UInt16 *audioBuffer = (UInt16 *)(ioData->mBuffers[0].mData);
-		UInt32 audioBufferSize = ioData->mBuffers[0].mDataByteSize;
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Failed to start voice unit again: %i", (int)status));
+			unit->isRunning = PJ_FALSE;
+		}
+	}
+}
+
+/**
+ * Sets up the voice unit for a new stream with the given direction(s), sample rate and channel count,
+ * and the sample format asked for by the stream options (options.float_format).
+ * 
+ * If other streams are open, the voice unit keeps its sample rate and bus formats,
+ * and any direction the new stream needs is enabled in addition to those already enabled.
+ * 
+ * If no other stream is open (the voice unit was kept warm, see options.keep_warm),
+ * it's set up exactly for the new stream. Unused directions are disabled again.
+ * But if the new stream uses the same format as the previous one, there's nothing to do at all.
+ * 
+ * The kind of audio unit follows voiceUnitType. Switching between RemoteIO and VoiceProcessingIO means
+ * creating the audio unit again. If other streams are open, that's only ever to add voice processing,
+ * and the buses they use are set up again with the formats they had.
+ * 
+ * The voice unit has to be uninitialized for any change, so if it's running it's briefly stopped.
+ * If the change fails, the streams already using the voice unit get it back as it was (voiceUnitRollback).
+ * The streams must be locked.
+ * 
+ * Returns PJ_SUCCESS, the status of the backend if the voice unit fails to initialize,
+ * or otherwise one of the (negative) error codes that pjmedia_snd_open has always returned.
+**/
+static pj_status_t voiceUnitConfigure(snd_voice_unit *unit,
+                                      pjmedia_dir dir,
+                                      unsigned clockRate,
+                                      unsigned channel_count,
+                                      const pjmedia_snd_iphone_options *options)
+{
+	const snd_backend *backend = unit->backend;
+	pj_status_t status;
+	
+	pj_bool_t idle = (unit->openCount == 0);
+	
+	// The dither setting doesn't need any reconfiguration, so the stream that has the voice unit to itself
+	// simply gets its way.
+	
+	if(idle)
+	{
+		unit->dither = options->dither;
+	}
+	
+	pjmedia_dir unitDir = idle ? dir : (pjmedia_dir)(unit->dir | dir);
+	
+	// The stream that picks the kind of unit also gets its way with the AGC
+	
+	pjmedia_snd_iphone_unit_type unitType = voiceUnitType(unit, dir, options);
+	pj_bool_t agc = (idle || (unitType != unit->unitType)) ? options->voice_agc : unit->agc;
+	
+	pj_bool_t recreate = ((unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO) !=
+	                      (unit->unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO));
+	pj_bool_t processing = (unitType != unit->unitType) || (agc != unit->agc);
+	
+	// Figure out which buses need a client format.
+	// That's any newly enabled bus, and for an idle voice unit, any bus whose format doesn't suit the new stream.
+	
+	int formatDir = unitDir & ~unit->dir;
+	
+	if(idle)
+	{
+		if((clockRate != unit->clockRate) || (options->float_format != unit->floatFormat))
+		{
+			formatDir = unitDir;
+		}
+		if(channel_count != unit->inputChannels)
+		{
+			formatDir |= (unitDir & PJMEDIA_DIR_CAPTURE);
+		}
+		if(channel_count != unit->outputChannels)
+		{
+			formatDir |= (unitDir & PJMEDIA_DIR_PLAYBACK);
+		}
+	}
+	
+	// If the application told us what latency it wants, this is where we ask for the matching
+	// hardware IO buffer duration, so it's in effect by the time the voice unit is (re)initialized.
+	// (It's a property of the audio session, so it's worth doing even if the voice unit is fine as it is.)
+	
+	if(latency_configured)
+	{
+		setPreferredIOBufferDuration(unitDir);
+	}
+	
+	if((formatDir == PJMEDIA_DIR_NONE) && (unitDir == unit->dir) && !processing)
+	{
+		return PJ_SUCCESS;
+	}
+	
+	snd_voice_unit_setup setup;
+	
+	setup.dir            = unit->dir;
+	setup.unitType       = unit->unitType;
+	setup.agc            = unit->agc;
+	setup.inputFormat    = unit->inputFormat;
+	setup.outputFormat   = unit->outputFormat;
+	setup.inputChannels  = unit->inputChannels;
+	setup.outputChannels = unit->outputChannels;
+	
+	if(unit->isRunning)
+	{
+		backend->unitStop(unit);
+		resetIOThreads(unit);
+	}
+	
+	if(unit->dir != PJMEDIA_DIR_NONE)
+	{
+		backend->unitUninitialize(unit);
+	}
+	
+	unit->unitType = unitType;
+	unit->agc = agc;
+	
+	if(recreate)
+	{
+		// A new audio unit starts from scratch, with nothing enabled and no client formats
+		
+		PJ_LOG(4, (THIS_FILE, "Creating voice unit again as %s",
+		           (unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO) ? "RemoteIO" : "VoiceProcessingIO"));
+		
+		backend->unitDispose(unit);
+		
+		status = backend->unitCreate(unit);
+		
+		if(status != PJ_SUCCESS)
+		{
+			voiceUnitRollback(unit, &setup, unitDir, PJ_FALSE);
+			return status;
+		}
+		
+		unit->dir = PJMEDIA_DIR_NONE;
+		formatDir = unitDir;
+	}
+	
+	// The buses the other streams already use keep the channel counts their formats were picked for
+	// (they only need a format again if the audio unit was created again)
+	
+	unsigned inputChannels  = (!idle && (setup.dir & PJMEDIA_DIR_CAPTURE)) ? setup.inputChannels : channel_count;
+	unsigned outputChannels = (!idle && (setup.dir & PJMEDIA_DIR_PLAYBACK)) ? setup.outputChannels : channel_count;
+	
+	if(processing || recreate)
+	{
+		status = backend->unitSetProcessing(unit);
+		
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(2, (THIS_FILE, "Failed to set up voice processing: %i", (int)status));
+		}
+	}
+	
+	// Enable (or disable) input and/or output on the voice unit
+	
+	pj_bool_t capture  = (unitDir & PJMEDIA_DIR_CAPTURE) != 0;
+	pj_bool_t playback = (unitDir & PJMEDIA_DIR_PLAYBACK) != 0;
+	
+	if(capture != ((unit->dir & PJMEDIA_DIR_CAPTURE) != 0))
+	{
+		status = backend->unitEnableIO(unit, PJMEDIA_DIR_CAPTURE, capture);
+		
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Failed to enable voice unit input: %i", (int)status));
+			voiceUnitRollback(unit, &setup, unitDir, PJ_FALSE);
+			return -2;
+		}
+	}
+	
+	if(playback != ((unit->dir & PJMEDIA_DIR_PLAYBACK) != 0))
+	{
+		status = backend->unitEnableIO(unit, PJMEDIA_DIR_PLAYBACK, playback);
+		
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Failed to enable voice unit output: %i", (int)status));
+			voiceUnitRollback(unit, &setup, unitDir, PJ_FALSE);
+			return -3;
+		}
+	}
+	
+	// From here on, the voice unit is uninitialized, with IO enabled as the new stream needs it
+	
+	unit->dir = PJMEDIA_DIR_NONE;
+	
+	if(idle)
+	{
+		unit->clockRate = clockRate;
+		unit->floatFormat = options->float_format;
+	}
+	
+	// Configure input and output streams
+	
+	// Note: The backend tries the pjsip channel count first (when NATIVE_CHANNEL_FORMAT is enabled),
+	// and falls back to stereo otherwise. The input and output bus may therefore end up with different formats.
+	// The format of a bus is picked by the first stream that uses it. The reframers and resamplers of other streams
+	// convert between their own channel count and that of the bus.
+	
+	if(formatDir & PJMEDIA_DIR_CAPTURE)
+	{
+		// Configure input stream
+		
+		status = backend->unitSetFormat(unit,
+		                                PJMEDIA_DIR_CAPTURE,
+		                                unit->clockRate,
+		                                inputChannels,
+		                                unit->floatFormat,
+		                                &(unit->inputFormat));
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Failed to set client inputBus stream format: %i", (int)status));
+			voiceUnitRollback(unit, &setup, unitDir, PJ_FALSE);
+			return -4;
+		}
+		
+		if(unit->inputFormat.isFloat && !unit->captureConvertBuffer)
+		{
+			unit->captureConvertBuffer = (pj_int16_t *)pj_pool_alloc(unit->pool, unit->scratchSize);
+		}
+		
+		unit->inputChannels = inputChannels;
+	}
+	
+	// So here's the deal...
+	// 
+	// The documentation for AudioUnitInitialize states the following:
+	// 
+	// On successful initialization, the audio formats for input and output are valid and the audio unit is ready
+	// to render. During initialization, an audio unit allocates memory according to the maximum number of audio
+	// frames it can produce in response to a single render call.
+	// In common practise major state of an audio unit (such as its I/O formats, memory allocations)
+	// cannot be changed while an audio unit is inialized.
+	// 
+	// On top of this, the "Audio Unit Loading Guide" states the following:
+	// 
+	// After you have fully configured your audio unit instance, you initialize it [with AudioUnitInitialize].
+	// 
+	// This lead me to believe that AudioUnitInitialize shouldn't be invoked until the end of this method.
+	// However, doing so caused the VoiceUnit to not function properly when I tried this in a test app.
+	// That is, it didn't properly provide echo cancellation.
+	// 
+	// But I later noticed, in some WWDC slides, that Apple was initializing a voice unit before
+	// setting the stream format. I wondered to myself, could this possibly be right, and can it
+	// help to make the voice unit work properly?  As it turns out, initializing the voice unit in this
+	// specific spot (after setting input stream format, but before setting output stream format)
+	// makes the voice unit magically work...
+	// 
+	// On top of this, if the application's audio session is ever interrupted, then another odd thing happens.
+	// Say the open and start methods are called, and the audio driver is doing its thing.
+	// Then a phone call comes in, and the audio session is interrupted.
+	// When the interruption is ended, the audio session is reactivated and the audio driver resumes.
+	// After the sip call is eventually ended, and another call is later started,
+	// the AudioUnitInitialize method will fail with a kAudioSessionNotActiveError code.
+	// The method will never fail with this code under normal circumstances.
+	// But it will always fail after the app has been interrupted once.
+	// So even though it seems more logical to activate the session in the start method,
+	// we need to do so here, before calling AudioUnitInitialize, in order to get around this problem.
+	
+	// Other streams may be active already, so the session category has to suit them as well.
+	snd_io_backend->startSession((pjmedia_dir)(activeStreamsDirection() | unitDir));
+	
+	status = backend->unitInitialize(unit);
+	
+	if(status != PJ_SUCCESS)
+	{
+		PJ_LOG(1, (THIS_FILE, "Failed to initialize voice unit: %d", status));
+		voiceUnitRollback(unit, &setup, unitDir, PJ_FALSE);
+		return status;
+	}
+	
+	if(formatDir & PJMEDIA_DIR_PLAYBACK)
+	{
+		// Configure output stream
 		
-		// The audioBufferSize variable indicates the amount of space that we have left in the core audio buffer.
-		// As we fill the core audio buffer, we decrement this variable.
-		// So this is the amount of data that we have yet to fill.
+		status = backend->unitSetFormat(unit,
+		                                PJMEDIA_DIR_PLAYBACK,
+		                                unit->clockRate,
+		                                outputChannels,
+		                                unit->floatFormat,
+		                                &(unit->outputFormat));
+		if(status != PJ_SUCCESS)
+		{
+			PJ_LOG(1, (THIS_FILE, "Failed to set client outputBus stream format: %i", (int)status));
+			voiceUnitRollback(unit, &setup, unitDir, PJ_TRUE);
+			return -6;
+		}
 		
-		UInt16 *outputBuffer = (UInt16 *)(snd_strm->outputBuffer + snd_strm->outputBufferOffset);
-		UInt32 outputBufferSize = (snd_strm->packet_size - snd_strm->outputBufferOffset);
+		if(unit->outputFormat.isFloat && !unit->renderConvertBuffer)
+		{
+			unit->renderConvertBuffer = (pj_int16_t *)pj_pool_alloc(unit->pool, unit->scratchSize);
+		}
 		
-		// The outputBufferSize indicates the amount of available data in the outputBuffer
-		// that we haven't yet copied into core audio buffers.
-		// That is, this is the amount of data that we have yet to copy.
+		unit->outputChannels = outputChannels;
+	}
+	
+	unit->dir = unitDir;
+	
+	if(unit->isRunning)
+	{
+		unit->isRunning = PJ_FALSE;
+		voiceUnitStart(unit);
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Disposes of the voice unit, and everything that goes with it.
+ * The streams must be locked.
+**/
+static void voiceUnitDestroy(snd_voice_unit *unit)
+{
+	PJ_LOG(5, (THIS_FILE, "Shutting down voiceUnit"));
+	
+	if(unit->isRunning)
+	{
+		unit->backend->unitStop(unit);
+	}
+	
+	unit->backend->unitDispose(unit);
+	
+	if(snd_unit == unit)
+	{
+		snd_unit = NULL;
+	}
+	
+	pj_pool_release(unit->pool);
+}
+
+/**
+ * Creates the voice unit, running at the given sample rate, on the given kind of audio unit.
+ * Its voice processing is set up by voiceUnitConfigure.
+ * The streams must be locked.
+**/
+static pj_status_t voiceUnitCreate(unsigned clockRate, pjmedia_snd_iphone_unit_type unitType, snd_voice_unit **p_unit)
+{
+	const snd_backend *backend = snd_io_backend;
+	
+	// The pool holds the unit itself, the state of the backend, and the two scratch buffers.
+	// Each scratch buffer holds MAX_FRAMES_PER_SLICE stereo frames, which covers any client format we use.
+	
+	unsigned scratchSize = MAX_FRAMES_PER_SLICE * 2 * sizeof(pj_int16_t);
+	
+	pj_size_t poolSize = sizeof(snd_voice_unit) + backend->unitStateSize + (2 * scratchSize) + 128;
+	
+	pj_pool_t *pool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
+	                                 "voiceunit",      // memory pool name
+	                                 poolSize,         // initial size
+	                                 128,              // increment size
+	                                 NULL);            // error callback
+	if(pool == NULL)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	snd_voice_unit *unit = PJ_POOL_ZALLOC_T(pool, snd_voice_unit);
+	
+	unit->pool          = pool;
+	unit->backend       = backend;
+	unit->backendState  = pj_pool_zalloc(pool, backend->unitStateSize);
+	unit->clockRate     = clockRate;
+	unit->dir           = PJMEDIA_DIR_NONE;
+	unit->isRunning     = PJ_FALSE;
+	unit->scratchSize   = scratchSize;
+	unit->mixBuffer     = (pj_int16_t *)pj_pool_alloc(pool, scratchSize);
+	unit->captureBuffer = (pj_int16_t *)pj_pool_alloc(pool, scratchSize);
+	
+	// A new VoiceProcessingIO unit comes with voice processing and AGC enabled.
+	// Anything else is up to voiceUnitConfigure.
+	
+	unit->unitType = (unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO) ? PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO
+	                                                                 : PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING;
+	unit->agc = PJ_TRUE;
+	
+	ditherInit(unit->ditherState);
+	
+	// Instantiate the backend's unit, with its IO callbacks pointed at us
+	
+	pj_status_t status = backend->unitCreate(unit);
+	
+	if(status != PJ_SUCCESS)
+	{
+		voiceUnitDestroy(unit);
+		return status;
+	}
+	
+	*p_unit = unit;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Gets the shared voice unit for a new stream, creating it if needed, and sets it up for the stream (voiceUnitConfigure).
+ * If no other stream is open, the voice unit runs at the given sample rate.
+ * 
+ * On return, created tells whether the voice unit had to be created,
+ * as opposed to being shared with another stream or kept warm.
+ * 
+ * Every successful call must be balanced by a call to voiceUnitRelease.
+ * The streams must be locked.
+**/
+static pj_status_t voiceUnitAcquire(pjmedia_dir dir,
+                                    unsigned clockRate,
+                                    unsigned channel_count,
+                                    const pjmedia_snd_iphone_options *options,
+                                    snd_voice_unit **p_unit,
+                                    pj_bool_t *created)
+{
+	pj_status_t status;
+	
+	snd_voice_unit *unit = snd_unit;
+	
+	*created = (unit == NULL);
+	
+	if(unit == NULL)
+	{
+		status = voiceUnitCreate(clockRate, voiceUnitType(NULL, dir, options), &unit);
 		
-		// First we check to see if there is any leftover data in the output buffer from last time
+		if(status != PJ_SUCCESS)
+		{
+			return status;
+		}
 		
-		if(outputBufferSize > 0)
+		snd_unit = unit;
+	}
+	else if((unit->openCount > 0) && (unit->clockRate != clockRate))
+	{
+		// Another stream opened the voice unit at a different rate while this one was being set up
+		return PJ_EBUSY;
+	}
+	
+	status = voiceUnitConfigure(unit, dir, clockRate, channel_count, options);
+	
+	if(status != PJ_SUCCESS)
+	{
+		if(unit->openCount == 0)
+		{
+			voiceUnitDestroy(unit);
+		}
+		return status;
+	}
+	
+	unit->openCount++;
+	
+	*p_unit = unit;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Releases the voice unit on behalf of a closed stream.
+ * 
+ * Once the last stream is closed, the voice unit is disposed of, unless it should be kept warm.
+ * A warm voice unit stays initialized (and stopped), ready for the next stream.
+ * The streams must be locked.
+**/
+static void voiceUnitRelease(snd_voice_unit *unit, pj_bool_t keepWarm)
+{
+	if((--unit->openCount == 0) && !keepWarm)
+	{
+		voiceUnitDestroy(unit);
+	}
+}
+
+/**
+ * Stores the given stream in a free slot, if there is one.
+**/
+static pj_bool_t voiceUnitSlotAdd(pjmedia_snd_stream **slots, pjmedia_snd_stream *snd_strm)
+{
+	unsigned i;
+	for(i = 0; i < MAX_ACTIVE_STREAMS; i++)
+	{
+		if(slots[i] == NULL)
+		{
+			ATOMIC_STORE(&slots[i], snd_strm);
+			return PJ_TRUE;
+		}
+	}
+	
+	return PJ_FALSE;
+}
+
+/**
+ * Clears the slot of the given stream, if it has one.
+**/
+static void voiceUnitSlotRemove(pjmedia_snd_stream **slots, pjmedia_snd_stream *snd_strm)
+{
+	unsigned i;
+	for(i = 0; i < MAX_ACTIVE_STREAMS; i++)
+	{
+		if(slots[i] == snd_strm)
+		{
+			ATOMIC_STORE(&slots[i], (pjmedia_snd_stream *)NULL);
+		}
+	}
+}
+
+/**
+ * Starts serving the given stream from the IO callbacks, and starts the voice unit if it isn't running yet.
+ * 
+ * Returns PJ_ETOOMANY if there are too many active streams already, or the status of starting the voice unit.
+ * Either way, the stream isn't served on failure.
+ * The streams must be locked.
+**/
+static pj_status_t voiceUnitAttach(snd_voice_unit *unit, pjmedia_snd_stream *snd_strm)
+{
+	if(snd_strm->dir & PJMEDIA_DIR_PLAYBACK)
+	{
+		if(!voiceUnitSlotAdd(unit->players, snd_strm))
 		{
-			if(outputBufferSize <= audioBufferSize)
-			{
-				// All of the outputBuffer can be copied into the audioBuffer
-				
-				memcpy(audioBuffer, outputBuffer, outputBufferSize);
-				
-				audioBufferSize -= outputBufferSize;
-				snd_strm->outputBufferOffset = 0;
-			}
-			else
-			{
-				// Only part of the outputBuffer can be copied into the audioBuffer
-				
-				memcpy(audioBuffer, outputBuffer, audioBufferSize);
-				
-				snd_strm->outputBufferOffset += audioBufferSize;
-				audioBufferSize = 0;
-			}
+			return PJ_ETOOMANY;
 		}
-		
-		// Now query pjlib for data until we've filled up the audio buffer
-		
-		while(audioBufferSize > 0)
+	}
+	
+	if(snd_strm->dir & PJMEDIA_DIR_CAPTURE)
+	{
+		if(!voiceUnitSlotAdd(unit->recorders, snd_strm))
 		{
-			// pjmedia_snd_play_cb:
-			// This callback is called by player stream when it needs additional data to be played by the device.
-			// Application must fill in the whole of output buffer with sound samples.
-			// 
-			// Parameters:
-			// void *user_data
-			//    User data associated with the stream.
-			// pj_uint32_t timestamp 
-			//    Timestamp, in samples.
-			// void *output
-			//    Buffer to be filled out by application.
-			// unsigned size
-			//    The size requested in bytes, which will be equal to the size of one whole packet.
-			
-			snd_strm->play_cb(snd_strm->user_data,
-			                  snd_strm->outputBusTimestamp,
-			                  snd_strm->outputBuffer,
-			                  snd_strm->packet_size);
-			
-			snd_strm->outputBusTimestamp += snd_strm->samples_per_frame;
-			snd_strm->outputBufferOffset = 0;
-			
-			outputBuffer = (UInt16 *)(snd_strm->outputBuffer);
-			outputBufferSize = snd_strm->packet_size;
-			
-			if(outputBufferSize <= audioBufferSize)
-			{
-				// All of the outputBuffer can be copied into the audioBuffer
-				
-				memcpy(audioBuffer, outputBuffer, outputBufferSize);
-				
-				audioBufferSize -= outputBufferSize;
-				snd_strm->outputBufferOffset = 0;
-			}
-			else
-			{
-				// Only part of the outputBuffer can be copied into the audioBuffer
-				
-				memcpy(audioBuffer, outputBuffer, audioBufferSize);
-				
-				snd_strm->outputBufferOffset += audioBufferSize;
-				audioBufferSize = 0;
-			}
+			voiceUnitSlotRemove(unit->players, snd_strm);
+			return PJ_ETOOMANY;
 		}
+	}
+	
+	// While the audio session is interrupted, the voice unit is started once the interruption ends
+	
+	if(!unit->isRunning && !snd_interrupted)
+	{
+		pj_status_t status = voiceUnitStart(unit);
 		
-		if(poppingSoundWorkaround)
+		if(status != PJ_SUCCESS)
 		{
-			// Workaround for issue #820 in pjsip.
-            // The very first time we ask PJLIB for audio data, it gives us a popping noise.
-			// So we simply fill the audio buffer with silence instead of this annoying popping sound.
-			memset(ioData->mBuffers[0].mData, 0, ioData->mBuffers[0].mDataByteSize);
-			poppingSoundWorkaround = false;
+			voiceUnitSlotRemove(unit->players, snd_strm);
+			voiceUnitSlotRemove(unit->recorders, snd_strm);
+			return status;
 		}
 	}
 	
-	return noErr;
+	return PJ_SUCCESS;
 }
 
 /**
- * Voice Unit Callback.
- * 
- * Called when the voice unit input has recorded data that we can fetch from it.
+ * Stops serving the given stream from the IO callbacks.
+ * When this returns, the IO threads no longer touch the stream.
  * 
- * Parameters:
- * inRefCon
- *    Custom data that you provided when registering your callback with the audio unit.
- * ioActionFlags
- *    Flags used to describe more about the context of this call.
- * inTimeStamp
- *    The timestamp associated with this call of audio unit render.
- * inBusNumber
- *    The bus number associated with this call of audio unit render.
- * inNumberFrames
- *    The number of sample frames that will be represented in the audio data in the provided ioData parameter.
- * ioData
- *    This is NULL - use AudioUnitRender to fetch the audio data.
+ * If no other stream is left, the voice unit is stopped.
+ * Otherwise it keeps running, and we wait for the IO threads to finish the cycle they may be in the middle of.
+ * The streams must be locked.
 **/
-static OSStatus MyInputBusInputCallback(void                       *inRefCon,
-                                        AudioUnitRenderActionFlags *ioActionFlags,
-                                        const AudioTimeStamp       *inTimeStamp,
-                                        UInt32                      inBusNumber,
-                                        UInt32                      inNumberFrames,
-                                        AudioBufferList            *ioData)
+static void voiceUnitDetach(snd_voice_unit *unit, pjmedia_snd_stream *snd_strm)
 {
-	// Our job in this method is to get the data from the audio unit and pass it to the pjsip callback method.
+	pj_uint32_t renderCycles = ATOMIC_LOAD(&unit->renderCycles);
+	pj_uint32_t captureCycles = ATOMIC_LOAD(&unit->captureCycles);
 	
-	// According to Apple, we should avoid the following in audio unit IO callbacks:
-	// - memory allocation
-	// - semaphores/mutexes
-	// - objective-c method dispatching
+	voiceUnitSlotRemove(unit->players, snd_strm);
+	voiceUnitSlotRemove(unit->recorders, snd_strm);
+	
+	if(!unit->isRunning)
+	{
+		return;
+	}
+	
+	unsigned i;
+	pj_bool_t othersActive = PJ_FALSE;
 	
-	// The AudioUnit callbacks operate on a different real-time thread
-	if(!input_thread_registered)
+	for(i = 0; i < MAX_ACTIVE_STREAMS; i++)
 	{
-		if(!pj_thread_is_registered())
+		if(unit->players[i] || unit->recorders[i])
 		{
-			PJ_LOG(5, (THIS_FILE, "AudioUnit input created a separate thread"));
-			
-			// pj_status_t pj_thread_register(const char  *thread_name,
-			//                            pj_thread_desc   desc,
-			//                               pj_thread_t **thread)
-			// 
-			// Register a thread that was created by external or native API to PJLIB.
-			// This function must be called in the context of the thread being registered.
-			// When the thread is created by external function or API call, it must be 'registered'
-			// to PJLIB using pj_thread_register(), so that it can cooperate with PJLIB's framework.
-			// During registration, some data needs to be maintained, and this data must remain
-			// available during the thread's lifetime.
-			
-			pj_thread_t * thread;
-			if (pj_thread_register(NULL, inputThreadDesc, &thread) == PJ_SUCCESS)
-			{
-				input_thread_registered = PJ_TRUE;
-			}
-			else
-			{
-				PJ_LOG(1, (THIS_FILE, "AudioUnit input thread failed to register with PJLIB"));
-			}
+			othersActive = PJ_TRUE;
 		}
-		else
+	}
+	
+	if(!othersActive)
+	{
+		voiceUnitStop(unit);
+		return;
+	}
+	
+	// Any IO cycle that starts from now on won't see the stream.
+	// So once the cycle counters have moved on, any cycle that was already underway is done as well.
+	
+	pj_bool_t waitRender  = (snd_strm->dir & PJMEDIA_DIR_PLAYBACK) != 0;
+	pj_bool_t waitCapture = (snd_strm->dir & PJMEDIA_DIR_CAPTURE) != 0;
+	
+	unsigned waited;
+	for(waited = 0; waited < IO_CYCLE_WAIT; waited++)
+	{
+		if(waitRender && (ATOMIC_LOAD(&unit->renderCycles) != renderCycles))
+		{
+			waitRender = PJ_FALSE;
+		}
+		if(waitCapture && (ATOMIC_LOAD(&unit->captureCycles) != captureCycles))
+		{
+			waitCapture = PJ_FALSE;
+		}
+		
+		if(!waitRender && !waitCapture)
 		{
-			PJ_LOG(5, (THIS_FILE, "AudioUnit input thread already registered"));
-			input_thread_registered = PJ_TRUE;
+			return;
 		}
+		
+		pj_thread_sleep(1);
 	}
 	
-	pjmedia_snd_stream *snd_strm = (pjmedia_snd_stream *)inRefCon;
+	PJ_LOG(2, (THIS_FILE, "Timed out waiting for the IO threads to release the stream"));
+}
+
+/**
+ * Has the render IO thread fade out the given stream, and waits until it's done.
+ * 
+ * This only applies to a stream that's actually playing right now.
+ * If the stream is suspended, or the voice unit is stopped, there's nothing to fade out.
+**/
+static void streamFadeOut(pjmedia_snd_stream *snd_strm)
+{
+	snd_fade *fade = snd_strm->outputReframer.fade;
 	
-	// Remember: The ioData parameter is NULL.
-	// We need to use our own AudioBufferList in combination with the AudioUnitRender method to get the audio data.
+	if(fade == NULL)
+	{
+		return;
+	}
 	
-	AudioBufferList *abl = snd_strm->inputBufferList;
-	abl->mNumberBuffers = 1;
-    abl->mBuffers[0].mNumberChannels = 2;
-    abl->mBuffers[0].mData = NULL; 
-    abl->mBuffers[0].mDataByteSize = inNumberFrames * snd_strm->streamDesc.mBytesPerFrame; 
+	lockStreams();
 	
-	// OSStatus AudioUnitRender(AudioUnit                   inUnit,
-	//                          AudioUnitRenderActionFlags *ioActionFlags,
-	//                          const AudioTimeStamp       *inTimeStamp,
-	//                          UInt32                      inOutputBusNumber,
-	//                          UInt32                      inNumberFrames,
-	//                          AudioBufferList            *ioData)
-	// 
-	// Parameters:
-	// inUnit
-	//    The audio unit that you are asking to render.
-	// ioActionFlags
-	//    Flags to configure the rendering operation.
-	// inTimeStamp
-	//    The audio time stamp for the render operation. Each time stamp must contain a valid sample time that is
-	//    incremented monotonically from the previous call to this function. That is, the next time stamp is
-	//    equal to inTimeStamp + inNumberFrames.
-	//    If sample time does not increase like this from one render call to the next, the audio unit interprets
-	//    that as a discontinuity with the timeline it is rendering for.
-	//    When rendering to multiple output buses, ensure that this value is the same for each bus.
-	//    Using the same value allows an audio unit to determine that the rendering for each output bus is
-	//    part of a single render operation.
-	// inOutputBusNumber
-	//    The output bus to render for.
-	// inNumberFrames
-	//    The number of audio sample frames to render.
-	// ioData
-	//    On input, the audio buffer list that the audio unit is to render into.
-	//    On output, the audio data that was rendered by the audio unit.
-	// 
-	// The AudioBufferList that you provide on input must match the topology for the current audio format
-	// for the given bus. The buffer list can be either of these two variants:
-	//   - If the mData pointers are non-null, the audio unit renders its output into those buffers.
-	//   - If the mData pointers are null, the audio unit can provide pointers to its own buffers.
-	//     In this case, the audio unit must keep those buffers valid for the duration
-	//     of the calling thread’s I/O cycle.
+	pj_bool_t playing = (snd_strm->dir & PJMEDIA_DIR_PLAYBACK) &&
+	                    (snd_strm->state == SND_STREAM_RUNNING) && snd_strm->unit->isRunning;
 	
-	OSStatus status = AudioUnitRender(snd_strm->voiceUnit,
-	                                  ioActionFlags,
-	                                  inTimeStamp,
-	                                  inBusNumber,
-	                                  inNumberFrames,
-	                                  abl);
+	if(playing)
+	{
+		ATOMIC_STORE(&fade->stopRequested, PJ_TRUE);
+	}
 	
-	if(status != noErr)
+	unlockStreams();
+	
+	if(!playing)
 	{
-		PJ_LOG(1, (THIS_FILE, "AudioUnitRender error: %i", (int)status));
-		return -1;
+		return;
+	}
+	
+	// The fade out takes as long as the ramp, plus up to an IO cycle for it to start,
+	// and a packet for the end of it to be rendered (see snd_fade)
+	
+	unsigned waited;
+	for(waited = 0; waited < IO_CYCLE_WAIT; waited++)
+	{
+		if(ATOMIC_LOAD(&fade->state) == FADE_SILENT)
+		{
+			return;
+		}
+		
+		if(ATOMIC_LOAD(&snd_strm->state) != SND_STREAM_RUNNING)
+		{
+			// Interrupted in the meantime
+			return;
+		}
+		
+		pj_thread_sleep(1);
 	}
 	
-	if(snd_strm->channel_count == 1)
+	PJ_LOG(2, (THIS_FILE, "Timed out waiting for the stream to fade out"));
+}
+
+/**
+ * Invoked when our audio session is interrupted, or uninterrupted.
+**/
+void pjmedia_snd_audio_session_interruption(void *userData, pj_uint32_t interruptionState)
+{
+	if(interruptionState == kAudioSessionBeginInterruption)
 	{
-		// So now we have a bunch of stereo audio data in the AudioBufferList.
-		// We need to convert it to mono, and pass it to PJLIB via the rec callback.
+		PJ_LOG(3, (THIS_FILE, "interruptionListenerCallback: kAudioSessionBeginInterruption"));
 		
-		// Remember: We allocated the inputBuffer to be packet_size bytes.
+		// Audio session has already been stopped at this point
 		
-		UInt16 *audioBuffer = (UInt16 *)(abl->mBuffers[0].mData);
-		UInt32 audioBufferSize = abl->mBuffers[0].mDataByteSize;
+		lockStreams();
 		
-		// The audioBufferSize variable indicates the amount of available data left in the core audio buffer.
-		// As we copy data from the core audio buffer, we decrement this variable.
-		// So this variable is the amount of data that we have yet to copy.
+		snd_interrupted = PJ_TRUE;
 		
-		while(audioBufferSize > 0)
+		if(snd_unit && snd_unit->isRunning)
 		{
-			// Note: We copy data from core audio into our inputBuffer.
-			// We may not always get enough data from core audio to pass to pjlib.
-			// So the inputBufferOffset points to the first empty byte that we haven't copied into yet.
-			
-			UInt16 *inputBuffer = (UInt16 *)(snd_strm->inputBuffer + snd_strm->inputBufferOffset);
-			UInt32 inputBufferSize = (snd_strm->packet_size - snd_strm->inputBufferOffset);
-			
-			// The inputBufferSize variable indicates the amount of empty space available in the inputBuffer.
-			// That is, this is the amount of data that we have yet to copy.
-			
-			pj_uint32_t numFrames = 0;
-			
-			do
-			{
-				*inputBuffer = *audioBuffer;
-				
-				numFrames++;
-				
-				inputBuffer += 1; // Move forward 1 frame (mono, 16 bits)
-				audioBuffer += 2; // Move forward 1 frame (stereo, 32 bits)
-				
-				inputBufferSize -= 2; 
-				audioBufferSize -= 4;
-				
-			} while((inputBufferSize > 0) && (audioBufferSize > 0));
-			
-			// We've now filled up the inputBuffer with as much data as we could.
-			// This means we either filled it up all the way, or we ran out of audioBuffer data to copy.
-			
-			// Here's the catch...
-			// We can't call the rec callback function unless we have a full inputBuffer.
-			// That is, unless the inputBuffer has exactly packet_size bytes.
-			
-			if(inputBufferSize == 0)
-			{
-				// We filled our inputBuffer with packet_size bytes, so we can invoke our rec callback.
-				
-				// pjmedia_snd_rec_cb:
-				// This callback is called by recorder stream when it has captured
-				// the whole packet worth of audio samples.
-				// 
-				// Parameters:
-				// void *user_data
-				//    User data associated with the stream.
-				// pj_uint32_t timestamp
-				//    Timestamp, in samples.
-				// void *input
-				//    Buffer containing the captured audio samples.
-				// unsigned size
-				//    The size of the data in the buffer, in bytes.
-				
-				snd_strm->rec_cb(snd_strm->user_data,
-								 snd_strm->inputBusTimestamp,
-								 snd_strm->inputBuffer,
-								 snd_strm->packet_size);
-				
-				snd_strm->inputBusTimestamp += numFrames;
-				
-				snd_strm->inputBufferOffset = 0;
-			}
-			else
+			// Stop the audio unit
+			voiceUnitStop(snd_unit);
+		}
+		
+		// Now that the IO callbacks are no longer running, suspend the running streams
+		
+		pjmedia_snd_stream *snd_strm;
+		for(snd_strm = snd_streams; snd_strm; snd_strm = snd_strm->next)
+		{
+			if(snd_strm->state == SND_STREAM_RUNNING)
 			{
-				// We don't have enough data to invoke the rec callback yet.
-				// Update the offset indicator so we know where we left off within the inputBuffer.
-				
-				UInt32 numBytesCopied = numFrames * 2;
-				
-				snd_strm->inputBufferOffset += numBytesCopied;
+				streamSuspend(snd_strm);
 			}
 		}
+		
+		unlockStreams();
 	}
-	else
+	else if(interruptionState == kAudioSessionEndInterruption)
 	{
-		// So now we have a bunch of stereo audio data in the AudioBufferList.
-		// And PJSIP and core audio are both configured for stereo data.
-		
-		// Important: The code is this branch is untested because, in all my testing,
-		// I've never seen PJLIB use anything but Mono.
-		// 
-		// Additional optimizations are possible if an entire packet of audio lies completely
-		// in the abl buffer. In this case, a memcpy may be avoided.
+		PJ_LOG(3, (THIS_FILE, "interruptionListenerCallback: kAudioSessionEndInterruption"));
 		
-		// Remember: We allocated the inputBuffer to be packet_size bytes.
+		lockStreams();
 		
-		UInt16 *audioBuffer = (UInt16 *)(abl->mBuffers[0].mData);
-		UInt32 audioBufferSize = abl->mBuffers[0].mDataByteSize;
+		snd_interrupted = PJ_FALSE;
 		
-		// The audioBufferSize variable indicates the amount of available data left in the core audio buffer.
-		// As we copy data from the core audio buffer, we decrement this variable.
-		// So this variable is the amount of data that we have yet to copy.
+		// Get the suspended streams ready to run again, while the audio unit is still stopped
 		
-		while(audioBufferSize > 0)
+		pjmedia_snd_stream *snd_strm;
+		for(snd_strm = snd_streams; snd_strm; snd_strm = snd_strm->next)
 		{
-			// Note: We copy data from core audio into our inputBuffer.
-			// We may not always get enough data from core audio to pass to pjlib.
-			// So the inputBufferOffset points to the first empty byte that we haven't copied into yet.
-			
-			UInt16 *inputBuffer = (UInt16 *)(snd_strm->inputBuffer + snd_strm->inputBufferOffset);
-			UInt32 inputBufferSize = (snd_strm->packet_size - snd_strm->inputBufferOffset);
-			
-			// The inputBufferSize indicates the amount of empty space available in the inputBuffer.
-			// That is, this is the amount of data that we have yet to copy.
-			
-			pj_uint32_t numFrames = 0;
-			
-			if(inputBufferSize >= audioBufferSize)
-			{
-				// We can copy all of the data in the audioBuffer into the inputBuffer
-				
-				memcpy(inputBuffer, audioBuffer, audioBufferSize);
-				
-				numFrames = audioBufferSize / 4;
-				
-				inputBufferSize -= audioBufferSize;
-				audioBufferSize = 0;
-			}
-			else
+			if(snd_strm->state == SND_STREAM_SUSPENDED)
 			{
-				// We can only copy part of the audioBuffer
-				
-				memcpy(inputBuffer, audioBuffer, inputBufferSize);
-				
-				numFrames = inputBufferSize / 4;
-				
-				audioBufferSize -= inputBufferSize;
-				inputBufferSize = 0;
+				streamResume(snd_strm);
 			}
+		}
+		
+		pjmedia_dir dir = activeStreamsDirection();
+		
+		if(snd_unit && (dir != PJMEDIA_DIR_NONE))
+		{
+			// Activate the audio session (once, for all active streams)
+			snd_io_backend->startSession(dir);
 			
-			// We've now filled up the inputBuffer with as much data as we could.
-			// This means we either filled it up all the way, or we ran out of audioBuffer data to copy.
-			
-			// Here's the catch...
-			// We can't call the rec callback function unless we have a full inputBuffer.
-			// That is, unless the inputBuffer has exactly packet_size bytes.
-			
-			if(inputBufferSize == 0)
-			{
-				// We filled our inputBuffer with packet_size bytes, so we can invoke our rec callback.
-				
-				// pjmedia_snd_rec_cb:
-				// This callback is called by recorder stream when it has captured
-				// the whole packet worth of audio samples.
-				// 
-				// Parameters:
-				// void *user_data
-				//    User data associated with the stream.
-				// pj_uint32_t timestamp
-				//    Timestamp, in samples.
-				// void *input
-				//    Buffer containing the captured audio samples.
-				// unsigned size
-				//    The size of the data in the buffer, in bytes.
-				
-				snd_strm->rec_cb(snd_strm->user_data,
-								 snd_strm->inputBusTimestamp,
-								 snd_strm->inputBuffer,
-								 snd_strm->packet_size);
-				
-				snd_strm->inputBusTimestamp += numFrames;
-				
-				snd_strm->inputBufferOffset = 0;
-			}
-			else
-			{
-				// We don't have enough data to invoke the rec callback yet.
-				// Update the offset indicator so we know where we left off within the inputBuffer.
-				
-				UInt32 numBytesCopied = numFrames * 2;
-				
-				snd_strm->inputBufferOffset += numBytesCopied;
-			}
+			// Start the audio unit.
+			// If that fails, the streams stay quiet until one of them is started again.
+			voiceUnitStart(snd_unit);
 		}
+		
+		unlockStreams();
 	}
-	
-	return noErr;
 }
 
 // Order of calls from PJSIP:
@@ -950,68 +7757,56 @@ static OSStatus MyInputBusInputCallback(void                       *inRefCon,
 **/
 pj_status_t pjmedia_snd_init(pj_pool_factory *factory)
 {
-	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_init"));
-	
-	// Store reference to memory pool factory.
-	// We'll use this later to create and destroy memory pools.
-	snd_pool_factory = factory;
-	
-	// Initialize empty audio session callbacks
-	pj_bzero(&audio_session_callbacks, sizeof(audio_session_callbacks));
-	
-	// Initialize audio session for iPhone
-	initializeAudioSession();
-	
-	// To setup and use an audio unit, the following steps are performed in order:
-	// 
-	// - Ask the system for a reference to the audio unit
-	// - Instantiate the audio unit
-	// - Configure the audio unit instance
-	// - Initialize the instance and start using it
+	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_init"));
 	
-	// Since this is an init method, we're not actually going to instantiate the audio unit,
-	// but we can go ahead and get a reference to the voice unit.
-	// In order to do this, we have to ask the system for a reference to it.
-	// We do this by searching, based on a query of sorts, described by a AudioComponentDescription struct.
+	// Store reference to memory pool factory.
+	// We'll use this later to create and destroy memory pools.
+	snd_pool_factory = factory;
 	
-	AudioComponentDescription desc;
+	// Create the mutex that protects the list of open streams
+	snd_pool = pj_pool_create(factory, "iphonesnd", 256, 256, NULL);
 	
-	// struct AudioComponentDescription {
-	//   OSType componentType;
-	//   OSType componentSubType;
-	//   OSType componentManufacturer;
-	//   UInt32 componentFlags;
-	//   UInt32 componentFlagsMask;
-	// };
+	if(snd_pool == NULL)
+	{
+		snd_pool_factory = NULL;
+		return PJ_ENOMEM;
+	}
 	
-	desc.componentType = kAudioUnitType_Output;
-	desc.componentSubType = kAudioUnitSubType_VoiceProcessingIO;
-	desc.componentManufacturer = kAudioUnitManufacturer_Apple;
-	desc.componentFlags = 0;
-	desc.componentFlagsMask = 0;
+	pj_status_t status = pj_mutex_create_simple(snd_pool, "iphonesnd", &snd_streams_mutex);
 	
-	// AudioComponent
-	// AudioComponentFindNext(AudioComponent inComponent, const AudioComponentDescription *inDesc)
-	// 
-	// This function is used to find an audio component that is the closest match to the provide values.
-	// 
-	// inComponent
-	//   If NULL, then the search starts from the beginning until an audio component is found that matches
-	//   the description provided by inDesc.
-	//   If not-NULL, then the search starts (continues) from the previously found audio component specified
-	//   by inComponent, and will return the nextfound audio component.
-	// inDesc
-	//   The type, subtype and manufacturer fields are used to specify the audio component to search for.
-	//   A value of 0 (zero) for any of these fiels is a wildcard, so the first match found is returned.
-	// 
-	// Returns: An audio component that matches the search parameters, or NULL if none found.
+	if(status != PJ_SUCCESS)
+	{
+		PJ_LOG(1, (THIS_FILE, "Unable to create streams mutex: %i", (int)status));
+		
+		pj_pool_release(snd_pool);
+		snd_pool = NULL;
+		
+		snd_pool_factory = NULL;
+		
+		return status;
+	}
 	
-	voiceUnitComponent = AudioComponentFindNext(NULL, &desc);
+	// Initialize empty audio session callbacks
+	pj_bzero(&audio_session_callbacks, sizeof(audio_session_callbacks));
 	
-	if(voiceUnitComponent == NULL)
+	// Initialize the backend (for core audio, that's the audio session and the voice unit component)
+	status = snd_io_backend->init();
+	
+	if(status != PJ_SUCCESS)
 	{
-		PJ_LOG(1, (THIS_FILE, "Unable to find voice unit audio component!"));
-		return -1;
+		// Leave nothing behind, so the driver doesn't look initialized
+		
+		PJ_LOG(1, (THIS_FILE, "Unable to initialize the %s backend: %i", snd_io_backend->name, (int)status));
+		
+		pj_mutex_destroy(snd_streams_mutex);
+		snd_streams_mutex = NULL;
+		
+		pj_pool_release(snd_pool);
+		snd_pool = NULL;
+		
+		snd_pool_factory = NULL;
+		
+		return status;
 	}
 	
 //	printf("PJMEDIA_SOUND_USE_DELAYBUF: %i\n", (int)PJMEDIA_SOUND_USE_DELAYBUF);
@@ -1031,8 +7826,30 @@ pj_status_t pjmedia_snd_deinit(void)
 	// We check this variable in other parts of the code to see if we've been initialized.
 	snd_pool_factory = NULL;
 	
+	// Dispose of the voice unit, if it was kept warm
+	lockStreams();
+	
+	if(snd_unit && (snd_unit->openCount == 0))
+	{
+		voiceUnitDestroy(snd_unit);
+	}
+	
+	unlockStreams();
+	
 	// Remove references to other variables we setup in the init method.
-	voiceUnitComponent = NULL;
+	snd_io_backend->deinit();
+	
+	if(snd_streams_mutex)
+	{
+		pj_mutex_destroy(snd_streams_mutex);
+		snd_streams_mutex = NULL;
+	}
+	
+	if(snd_pool)
+	{
+		pj_pool_release(snd_pool);
+		snd_pool = NULL;
+	}
 	
 	return PJ_SUCCESS;
 }
@@ -1072,9 +7889,9 @@ const pjmedia_snd_dev_info* pjmedia_snd_get_dev_info(unsigned index)
 	
 	// If, for some reason this causes a problem in the future then we could do something like this:
 	
-//	if(snd_strm_instance)
+//	if(snd_streams)
 //	{
-//		iphone_snd_dev_info.default_samples_per_sec = snd_strm_instance->clock_rate;
+//		iphone_snd_dev_info.default_samples_per_sec = snd_streams->clock_rate;
 //	}
 
 	// Always return the default sound device
@@ -1207,6 +8024,7 @@ pj_status_t pjmedia_snd_open_player(int index,
  * bits_per_sample
  *    Set the number of bits per sample.
  *    The normal value for this parameter is 16 bits per sample.
+ *    32 is supported as well, in which case the frames hold 32-bit samples (with full scale at 2^31).
  * rec_cb
  *    Callback to handle captured audio samples.
  * play_cb
@@ -1230,7 +8048,9 @@ pj_status_t pjmedia_snd_open(int rec_id,
                             void *user_data,
               pjmedia_snd_stream **p_snd_strm)
 {
-	OSStatus status;
+	// Note the time, so we can tell how long it takes until the stream is up and running
+	pj_timestamp openTime;
+	pj_get_timestamp(&openTime);
 	
 	// Memory pool which we'll create from the memory pool factory.
 	pj_pool_t *pool;
@@ -1250,53 +8070,180 @@ pj_status_t pjmedia_snd_open(int rec_id,
 	// This method gets a reference to a memory pool factory which we'll need shortly.
 	PJ_ASSERT_RETURN((snd_pool_factory != NULL), PJ_EINVALIDOP);
 	
-	// We only support 16bits per sample
-	PJ_ASSERT_RETURN((bits_per_sample == 16), PJ_EINVAL);
+	// We support 16 and 32 bits per sample.
+	// Internally the driver always deals in 16-bit packets though, and 32-bit frames are converted
+	// in the pjsip callbacks (see widePlayCallback and wideRecCallback).
+	PJ_ASSERT_RETURN((bits_per_sample == 16) || (bits_per_sample == 32), PJ_EINVAL);
 	
-	// Allocate memory pool.
+	// Allocate the stream's memory.
 	// This is properly deallocated later with pj_pool_release() in pjmedia_snd_stream_close().
 	// 
-	// When we create the memory pool we need to pass an initial size for the pool.
-	// We don't want this to be any bigger than it has to, 
-	// but we also want to avoid making the pool increase in size later if we can.
+	// Everything the stream needs lives in a single arena (see snd_arena), allocated from a pool that can't grow.
+	// So the arena has to be sized exactly, from the structures that we'll be allocating in it.
+	// Each of these starts on a cache line, so each size is rounded up accordingly (see arenaSize).
+	// 
+	// sizeof(pjmedia_snd_stream) + sizeof(outputBuffer) + sizeof(inputBuffer)
+	// 
+	// The outputBuffer and inputBuffer are the staging buffers of the output and input reframers.
+	// Each of these is exactly packet_size bytes.
+	// 
+	// In asynchronous mode we also need the play and rec rings, a packet buffer for the worker thread,
+	// and one for the underrun concealment.
+	// The rings are sized from the latency values set via pjmedia_snd_set_latency.
+	// 
+	// If we convert the sample rate ourselves, we also need the resamplers (mostly their filter coefficients),
+	// and a scratch buffer for each of them. Those are sized for RESAMPLER_CHUNK_FRAMES, since the resamplers
+	// work through an IO cycle a chunk at a time, however many frames the hardware hands us.
+	// (The scratch buffers of the voice unit itself are sized for MAX_FRAMES_PER_SLICE, see voiceUnitCreate.)
 	// 
-	// We can calculate an initial size from the structures that we'll be allocating in the pool.
+	// If pjsip uses 32-bit frames, we also need a 32-bit packet buffer for each direction.
 	// 
-	// sizeof(pjmedia_snd_stream) = 124
-	// sizeof(AudioBufferList)    =  16
-	// sizeof(outputBuffer)       = 320
-	// sizeof(inputBuffer)        = 320
+	// And we need the ramp of the fade stage, one gain per sample of options.fade_msec of pjsip audio.
 	// 
-	// if(channel_count == 1)
-	//     116 + 16 + 320 + 320 = 772 (rounded up 512 + 256 + 128 = 896)
-	// else
-	//     116 + 16 + 320 = 452 (rounded up to 512)
+	// With an echo canceller, we also need the slots of the echo reference,
+	// enough to cover the play and rec latency plus a margin (see snd_reference).
 	
-	if(channel_count == 1)
+	pjmedia_snd_iphone_options options;
+	getCurrentOptions(&options);
+	
+	unsigned packet_size = samples_per_frame * sizeof(pj_int16_t);
+	unsigned pjsipPacketSize = samples_per_frame * bits_per_sample / 8;
+	
+	unsigned playRingTarget = 0;
+	unsigned playRingCapacity = 0;
+	unsigned recRingCapacity = 0;
+	
+	if(options.async_callbacks)
 	{
-		pool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
-		                      NULL,             // memory pool name
-		                      896,              // initial size
-		                      128,              // increment size
-		                      NULL);            // error callback
+		playRingTarget   = bytesForLatency(play_latency, clock_rate, channel_count, packet_size);
+		playRingCapacity = roundUpToPowerOfTwo(playRingTarget);
+		recRingCapacity  = roundUpToPowerOfTwo(bytesForLatency(rec_latency, clock_rate, channel_count, packet_size));
+		
+		if(options.adaptive_latency)
+		{
+			// The play ring has to be big enough for the largest target the controller may pick
+			unsigned maxTarget = playRingTarget +
+			                     bytesForLatency(options.adaptive_latency_max, clock_rate, channel_count, packet_size);
+			
+			playRingCapacity = roundUpToPowerOfTwo(maxTarget);
+		}
 	}
-	else
+	
+	pj_size_t streamArenaSize = arenaSize(sizeof(pjmedia_snd_stream)) + (2 * arenaSize(packet_size));
+	
+	if(options.async_callbacks)
+	{
+		streamArenaSize += arenaSize(playRingCapacity) + arenaSize(recRingCapacity) + (2 * arenaSize(packet_size));
+	}
+	
+	if(bits_per_sample == 32)
+	{
+		streamArenaSize += 2 * arenaSize(pjsipPacketSize);
+	}
+	
+	unsigned fadeFrames = play_cb ? (clock_rate * options.fade_msec / 1000) : 0;
+	
+	streamArenaSize += arenaSize(fadeFrames * channel_count * sizeof(pj_int16_t));
+	
+	// The echo canceller needs both directions
+	pj_bool_t aec = (options.aec_cb != NULL) && (rec_cb != NULL) && (play_cb != NULL) && (rec_id != -2) && (play_id != -2);
+	
+	unsigned referenceSlots = 0;
+	
+	if(aec)
+	{
+		unsigned referenceLatency = play_latency + rec_latency + REFERENCE_MARGIN_MSEC;
+		
+		if(options.async_callbacks && options.adaptive_latency)
+		{
+			referenceLatency += options.adaptive_latency_max;
+		}
+		
+		unsigned referenceBytes = bytesForLatency(referenceLatency, clock_rate, channel_count, packet_size);
+		
+		referenceSlots = roundUpToPowerOfTwo((referenceBytes / packet_size) + 2);
+		
+		streamArenaSize += referenceArenaSize(referenceSlots, packet_size);
+	}
+	
+	// Figure out which sample rate to run the voice unit at.
+	// If another stream is open already, the voice unit is running at its rate, and we simply go along with that.
+	
+	unsigned hwClockRate = clock_rate;
+	
+	// (A voice unit that was kept warm is simply reconfigured if needed.)
+	
+	lockStreams();
+	unsigned unitClockRate = (snd_unit && (snd_unit->openCount > 0)) ? snd_unit->clockRate : 0;
+	unlockStreams();
+	
+	if(unitClockRate != 0)
+	{
+		hwClockRate = unitClockRate;
+	}
+	else if(options.hw_clock_rate == PJMEDIA_SND_IPHONE_NATIVE_RATE)
+	{
+		hwClockRate = snd_io_backend->getHardwareSampleRate();
+		
+		if(hwClockRate == 0)
+		{
+			hwClockRate = clock_rate;
+		}
+	}
+	else if(options.hw_clock_rate != 0)
+	{
+		hwClockRate = options.hw_clock_rate;
+	}
+	
+	// Drift compensation only makes sense if we both capture and play.
+	// It needs the input resampler, even if the voice unit runs at the pjsip rate.
+	
+	pj_bool_t driftCompensation = options.drift_compensation && (rec_id != -2) && (play_id != -2);
+	
+	pj_bool_t resampleOutput = (hwClockRate != clock_rate);
+	pj_bool_t resampleInput  = (hwClockRate != clock_rate) || driftCompensation;
+	
+	// The output resampler converts from pjsip to core audio, and is asked for a chunk of output at a time.
+	// The input resampler converts from core audio to pjsip, and is given a chunk of input at a time.
+	
+	unsigned outputResampleInput = (RESAMPLER_CHUNK_FRAMES * clock_rate / hwClockRate) + 3;
+	unsigned inputResampleOutput = (RESAMPLER_CHUNK_FRAMES * clock_rate / hwClockRate) + 2;
+	
+	unsigned frameSize = channel_count * sizeof(pj_int16_t);
+	
+	if(resampleOutput || resampleInput)
+	{
+		PJ_LOG(4, (THIS_FILE, "pjmedia_snd_open: resampling %u <-> %u, filter length = %u, drift compensation = %d",
+		           clock_rate, hwClockRate, options.resampler_taps, driftCompensation));
+	}
+	
+	if(resampleOutput)
+	{
+		streamArenaSize += resamplerArenaSize(clock_rate, hwClockRate, channel_count,
+		                                      options.resampler_taps, outputResampleInput, PJ_FALSE);
+		streamArenaSize += arenaSize((outputResampleInput + RESAMPLER_CHUNK_FRAMES) * frameSize);
+	}
+	
+	if(resampleInput)
+	{
+		streamArenaSize += resamplerArenaSize(hwClockRate, clock_rate, channel_count,
+		                                      options.resampler_taps, RESAMPLER_CHUNK_FRAMES, driftCompensation);
+		streamArenaSize += arenaSize((RESAMPLER_CHUNK_FRAMES + inputResampleOutput) * frameSize);
+	}
+	
+	snd_arena arena;
+	
+	pool = arenaCreate(streamArenaSize, &arena);
+	
+	if(pool == NULL)
 	{
-		pool = pj_pool_create(snd_pool_factory, // memory pool factory to use for pool creation
-		                      NULL,             // memory pool name
-		                      512,              // initial size
-		                      128,              // increment size
-		                      NULL);            // error callback
+		return PJ_ENOMEM;
 	}
 	
 	// Allocate snd_stream structure to hold all of our "instance" variables
-	snd_strm = PJ_POOL_ZALLOC_T(pool, pjmedia_snd_stream);
+	snd_strm = (pjmedia_snd_stream *)arenaAlloc(&arena, sizeof(pjmedia_snd_stream));
 	
-	// Note: The PJ_POOL_ZALLOC_T() macro allocates storage from the pool and initialize it to zero.
-	// It uses the pj_pool_zalloc method with sizeof(), and returns the given type.
-	// 
-	// E.g.:
-	// snd_strm = (pjmedia_snd_stream)pj_pool_zalloc(pool, sizeof(pjmedia_snd_stream));
+	// Note: The arena is zeroed when it's created, so everything allocated from it starts out zeroed.
 	
 	// Store our passed instance variables
 	
@@ -1309,259 +8256,320 @@ pj_status_t pjmedia_snd_open(int rec_id,
 	snd_strm->channel_count     = channel_count;
 	snd_strm->samples_per_frame = samples_per_frame;
 	snd_strm->bits_per_sample   = bits_per_sample;
-	snd_strm->packet_size       = samples_per_frame * bits_per_sample / 8;
+	snd_strm->packet_size       = packet_size;
 	snd_strm->rec_cb            = rec_cb;
 	snd_strm->play_cb           = play_cb;
 	snd_strm->user_data         = user_data;
-	snd_strm->isActive          = false;
-	
-	// Allocate our inputBufferList.
-	// This gets used in MyInputBusInputCallback() when calling AudioUnitRender to get microphone data.
-	snd_strm->inputBufferList = PJ_POOL_ZALLOC_T(pool, AudioBufferList);
-	
-	// Allocate our outputBuffer.
-	// This gets used in MyOutputBusRenderCallback() to get incoming audio data from pjlib.
-	// Each invocation of the play_cb method returns packet_size bytes of incoming audio data.
+	snd_strm->state             = SND_STREAM_STOPPED;
+	snd_strm->options           = options;
 	
-	snd_strm->outputBuffer = pj_pool_alloc(pool, snd_strm->packet_size);
-	snd_strm->outputBufferOffset = 0;
+	snd_strm->pjsipPacketSize    = pjsipPacketSize;
+	snd_strm->packetPlay         = play_cb;
+	snd_strm->packetRec          = rec_cb;
+	snd_strm->packetPlayUserData = user_data;
+	snd_strm->packetRecUserData  = user_data;
 	
-	// Allocate our inputBuffer
-	// This may get used in MyInputBusInputCallback() to convert stereo audio data to mono data
-	if(channel_count == 1)
+	if(bits_per_sample == 32)
 	{
-		snd_strm->inputBuffer = pj_pool_alloc(pool, snd_strm->packet_size);
-		snd_strm->inputBufferOffset = 0;
+		snd_strm->widePlayBuffer = (pj_int32_t *)arenaAlloc(&arena, pjsipPacketSize);
+		snd_strm->wideRecBuffer  = (pj_int32_t *)arenaAlloc(&arena, pjsipPacketSize);
+		
+		snd_strm->packetPlay         = play_cb ? widePlayCallback : NULL;
+		snd_strm->packetRec          = rec_cb ? wideRecCallback : NULL;
+		snd_strm->packetPlayUserData = snd_strm;
+		snd_strm->packetRecUserData  = snd_strm;
 	}
 	
-	// Store reference to the sound stream's associated memory pool.
-	snd_strm->pool = pool;
-	
-	// If rec_id or play_id are -1, we are supposed to use the first available to device.
-	if(rec_id == -1) rec_id = 0;
-	if(play_id == -1) play_id = 0;
-	
-	// Check for full-duplex or half-duplex.
-	// The half-duplex methods (pjmedia_snd_open_rec and pjmedia_snd_open_player) call
-	// this method with an id's of -2.
-	if(rec_id >= 0 && play_id >= 0)
-	{
-		snd_strm->dir = PJMEDIA_DIR_CAPTURE_PLAYBACK;
-	}
-	else if(rec_id >= 0)
+	// Voice activity detection sits in front of whatever passes the captured packets on to pjsip
+	if(options.vad && rec_cb)
 	{
-		snd_strm->dir = PJMEDIA_DIR_CAPTURE;
+		vadInit(&snd_strm->vad, &options, clock_rate, samples_per_frame / channel_count, channel_count);
+		
+		snd_strm->vadRec         = snd_strm->packetRec;
+		snd_strm->vadRecUserData = snd_strm->packetRecUserData;
+		
+		snd_strm->packetRec         = vadRecCallback;
+		snd_strm->packetRecUserData = snd_strm;
 	}
-	else if(play_id >= 0)
+	
+	// The echo canceller comes first, so voice activity detection sees the processed audio
+	if(aec)
 	{
-		snd_strm->dir = PJMEDIA_DIR_PLAYBACK;
+		referenceInit(&snd_strm->reference,
+		              &arena,
+		              referenceSlots,
+		              packet_size,
+		              channel_count,
+		              clock_rate,
+		              hwClockRate,
+		              snd_io_backend->getHostTicksPerSecond());
+		
+		snd_strm->aecRec         = snd_strm->packetRec;
+		snd_strm->aecRecUserData = snd_strm->packetRecUserData;
+		
+		snd_strm->packetRec         = aecRecCallback;
+		snd_strm->packetRecUserData = snd_strm;
+		
+		PJ_LOG(4, (THIS_FILE, "pjmedia_snd_open: echo reference, %u slots", referenceSlots));
 	}
 	
-	// Instantiate the audio component
+	// Setup our output reframer.
+	// This gets used in voiceUnitRender() to get incoming audio data from pjlib.
+	// Each invocation of the play_cb method returns packet_size bytes of incoming audio data.
+	// 
+	// Note: The device channel count is updated below, once we know which format the voice unit accepted.
 	
-	status = AudioComponentInstanceNew(voiceUnitComponent, &(snd_strm->voiceUnit));
+	reframerInit(&snd_strm->outputReframer,
+	             arenaAlloc(&arena, snd_strm->packet_size),
+	             snd_strm->packet_size,
+	             channel_count,
+	             channel_count,
+	             samples_per_frame);
+	reframerResetRender(&snd_strm->outputReframer);
 	
-	if(status != noErr)
+	snd_strm->outputReframer.play_cb   = snd_strm->packetPlay;
+	snd_strm->outputReframer.user_data = snd_strm->packetPlayUserData;
+	
+	// Setup the fade stage, which works on the packets the output reframer gets from pjsip
+	if(fadeFrames > 0)
 	{
-		PJ_LOG(1, (THIS_FILE, "Unable to instantiate voice unit: %i", (int)status));
-		return -1;
+		fadeInit(&snd_strm->fade,
+		         (pj_int16_t *)arenaAlloc(&arena, fadeFrames * channel_count * sizeof(pj_int16_t)),
+		         fadeFrames,
+		         channel_count);
+		
+		snd_strm->outputReframer.fade = &snd_strm->fade;
 	}
 	
-	// Enable input and output on the voice unit
+	// The output reframer publishes the packets to the echo reference, after the fade stage
+	if(aec)
+	{
+		snd_strm->outputReframer.reference = &snd_strm->reference;
+	}
 	
-	// Remember - there are two buses, input and output.
-	// Output is bus #0, Input is bus #1.
-	// Think: 'Output' starts with a 0, 'Input' starts with a 1.
+	// Setup our input reframer.
+	// This gets used in MyInputBusInputCallback() to collect microphone data into whole packets for pjlib.
 	
-	UInt32 enable = 1;
+	reframerInit(&snd_strm->inputReframer,
+	             arenaAlloc(&arena, snd_strm->packet_size),
+	             snd_strm->packet_size,
+	             channel_count,
+	             channel_count,
+	             samples_per_frame);
+	reframerResetCapture(&snd_strm->inputReframer);
 	
-	AudioUnitElement inputBus = 1;
-	AudioUnitElement outputBus = 0;
+	snd_strm->inputReframer.rec_cb    = snd_strm->packetRec;
+	snd_strm->inputReframer.user_data = snd_strm->packetRecUserData;
 	
-	if(snd_strm->dir & PJMEDIA_DIR_CAPTURE)
-	{
-		status = AudioUnitSetProperty(snd_strm->voiceUnit,               // The audio unit to set property value for
-		                              kAudioOutputUnitProperty_EnableIO, // The audio unit property identifier
-		                              kAudioUnitScope_Input,             // The audio unit scope for the property
-		                              inputBus,                          // The audio unit element for the property
-	                                  &enable,                           // The value to apply to the property
-	                                  sizeof(enable));                   // The size of the value
-		if(status != noErr)
-		{
-			PJ_LOG(1, (THIS_FILE, "Failed to enable voice unit input: %i", (int)status));
-			return -2;
-		}
-	}
+	// Have the reframers time the pjsip callbacks.
+	// In asynchronous mode the reframers no longer call into pjsip, and the worker thread does the timing instead.
 	
-	if(snd_strm->dir & PJMEDIA_DIR_PLAYBACK)
+	snd_strm->outputReframer.callbackTime = &snd_strm->stats.render.pjsip_usec;
+	snd_strm->inputReframer.callbackTime  = &snd_strm->stats.capture.pjsip_usec;
+	
+	if(options.async_callbacks)
 	{
-		status = AudioUnitSetProperty(snd_strm->voiceUnit,               // The audio unit to set property value for
-		                              kAudioOutputUnitProperty_EnableIO, // The audio unit property identifier
-		                              kAudioUnitScope_Output,            // The audio unit scope for the property
-		                              outputBus,                         // The audio unit element for the property
-		                              &enable,                           // The value to apply to the property
-		                              sizeof(enable));                   // The size of the value
-		if(status != noErr)
+		snd_strm->outputReframer.callbackTime = NULL;
+		snd_strm->inputReframer.callbackTime  = NULL;
+		
+		// In asynchronous mode the reframers talk to the rings instead of pjsip.
+		// The worker thread (started in pjmedia_snd_stream_start) talks to pjsip.
+		
+		ringInit(&snd_strm->playRing, arenaAlloc(&arena, playRingCapacity), playRingCapacity);
+		ringInit(&snd_strm->recRing, arenaAlloc(&arena, recRingCapacity), recRingCapacity);
+		
+		snd_strm->playRingTarget = playRingTarget;
+		snd_strm->workerBuffer = arenaAlloc(&arena, packet_size);
+		
+		// The packet for underrun concealment starts out as silence, in case the very first packet is late
+		snd_strm->concealPacket = (pj_int16_t *)arenaAlloc(&arena, packet_size);
+		snd_strm->concealNoise = 0x9E3779B9u;
+		snd_strm->concealFloor = CONCEAL_FLOOR_UNKNOWN;
+		
+		// Poll the rings about twice per packet
+		snd_strm->workerInterval = (samples_per_frame / channel_count) * 1000 / clock_rate / 2;
+		if(snd_strm->workerInterval == 0)
 		{
-			PJ_LOG(1, (THIS_FILE, "Failed to enable voice unit output: %i", (int)status));
-			return -3;
+			snd_strm->workerInterval = 1;
 		}
+		
+		snd_strm->outputReframer.play_cb   = ringPlayCallback;
+		snd_strm->outputReframer.user_data = snd_strm;
+		
+		snd_strm->inputReframer.rec_cb    = ringRecCallback;
+		snd_strm->inputReframer.user_data = snd_strm;
+		
+		PJ_LOG(4, (THIS_FILE, "pjmedia_snd_open: async callbacks, play ring = %u bytes, rec ring = %u bytes",
+		           playRingCapacity, recRingCapacity));
 	}
 	
-	// Configure input and output streams
+	// Setup the resamplers, if the voice unit runs at a different rate than pjsip.
+	// The filters are designed here, so the IO callbacks only ever have to apply them.
 	
-	// Note: The AudioStreamBasicDescription struct was zero'd when snd_strm was created.
+	snd_strm->hwClockRate = hwClockRate;
 	
-	// kAudioFormatFlagsCanonical == kLinearPCMFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked
+	pj_status_t rs_status = PJ_SUCCESS;
+	
+	if(resampleOutput)
+	{
+		rs_status = resamplerCreate(&arena, clock_rate, hwClockRate, channel_count,
+		                            options.resampler_taps, outputResampleInput, PJ_FALSE,
+		                            &snd_strm->outputResampler);
+		
+		snd_strm->outputResampleBuffer =
+		    (pj_int16_t *)arenaAlloc(&arena, (outputResampleInput + RESAMPLER_CHUNK_FRAMES) * frameSize);
+	}
 	
-	snd_strm->streamDesc.mSampleRate       = clock_rate;
-	snd_strm->streamDesc.mFormatID         = kAudioFormatLinearPCM;
-	snd_strm->streamDesc.mFormatFlags      = kAudioFormatFlagsCanonical;
+	if(resampleInput && (rs_status == PJ_SUCCESS))
+	{
+		rs_status = resamplerCreate(&arena, hwClockRate, clock_rate, channel_count,
+		                            options.resampler_taps, RESAMPLER_CHUNK_FRAMES, driftCompensation,
+		                            &snd_strm->inputResampler);
+		
+		snd_strm->inputResampleBuffer =
+		    (pj_int16_t *)arenaAlloc(&arena, (RESAMPLER_CHUNK_FRAMES + inputResampleOutput) * frameSize);
+	}
 	
-	// We specifically configure core audio in stereo.
-	// See the discussion on architecture at the bottom of this file for more information.
+	if(rs_status != PJ_SUCCESS)
+	{
+		pj_pool_release(pool);
+		return rs_status;
+	}
 	
-	snd_strm->streamDesc.mBitsPerChannel   = 16;
-	snd_strm->streamDesc.mChannelsPerFrame = 2;
-	snd_strm->streamDesc.mBytesPerFrame    = 4;
-	snd_strm->streamDesc.mFramesPerPacket  = 1;
-	snd_strm->streamDesc.mBytesPerPacket   = 4;
+	// Setup drift compensation.
+	// Both clocks nominally run at the voice unit sample rate.
 	
-	if(snd_strm->dir & PJMEDIA_DIR_CAPTURE)
+	snd_strm->driftCompensation = driftCompensation;
+	
+	if(driftCompensation)
 	{
-		// Configure input stream
-		// Note: We're setting the format of the data we would like to have output to us.
+		clockEstimatorInit(&snd_strm->captureClock, hwClockRate, snd_io_backend->getHostTicksPerSecond());
+		clockEstimatorInit(&snd_strm->renderClock, hwClockRate, snd_io_backend->getHostTicksPerSecond());
 		
-		status = AudioUnitSetProperty(snd_strm->voiceUnit,             // The audio unit to set property value for
-		                              kAudioUnitProperty_StreamFormat, // The audio unit property identifier
-		                              kAudioUnitScope_Output,          // The audio unit scope for the property
-		                              inputBus,                        // The audio unit element for the property
-		                              &(snd_strm->streamDesc),         // The value to apply to the property
-		                              sizeof(snd_strm->streamDesc));   // The size of the value
-		if(status != noErr)
-		{
-			PJ_LOG(1, (THIS_FILE, "Failed to set client inputBus stream format: %i", (int)status));
-			return -4;
-		}
+		driftCtlInit(&snd_strm->driftCtl, clock_rate);
 	}
 	
-	// So here's the deal...
-	// 
-	// The documentation for AudioUnitInitialize states the following:
-	// 
-	// On successful initialization, the audio formats for input and output are valid and the audio unit is ready
-	// to render. During initialization, an audio unit allocates memory according to the maximum number of audio
-	// frames it can produce in response to a single render call.
-	// In common practise major state of an audio unit (such as its I/O formats, memory allocations)
-	// cannot be changed while an audio unit is inialized.
-	// 
-	// On top of this, the "Audio Unit Loading Guide" states the following:
-	// 
-	// After you have fully configured your audio unit instance, you initialize it [with AudioUnitInitialize].
-	// 
-	// This lead me to believe that AudioUnitInitialize shouldn't be invoked until the end of this method.
-	// However, doing so caused the VoiceUnit to not function properly when I tried this in a test app.
-	// That is, it didn't properly provide echo cancellation.
-	// 
-	// But I later noticed, in some WWDC slides, that Apple was initializing a voice unit before
-	// setting the stream format. I wondered to myself, could this possibly be right, and can it
-	// help to make the voice unit work properly?  As it turns out, initializing the voice unit in this
-	// specific spot (after setting input stream format, but before setting output stream format)
-	// makes the voice unit magically work...
-	// 
-	// On top of this, if the application's audio session is ever interrupted, then another odd thing happens.
-	// Say the open and start methods are called, and the audio driver is doing its thing.
-	// Then a phone call comes in, and the audio session is interrupted.
-	// When the interruption is ended, the audio session is reactivated and the audio driver resumes.
-	// After the sip call is eventually ended, and another call is later started,
-	// the AudioUnitInitialize method will fail with a kAudioSessionNotActiveError code.
-	// The method will never fail with this code under normal circumstances.
-	// But it will always fail after the app has been interrupted once.
-	// So even though it seems more logical to activate the session in the start method,
-	// we need to do so here, before calling AudioUnitInitialize, in order to get around this problem.
+	timelineInit(&snd_strm->captureTimeline, hwClockRate, clock_rate, channel_count, snd_io_backend->getHostTicksPerSecond());
 	
-	startAudioSession(snd_strm->dir);
+	// Store reference to the sound stream's associated memory pool.
+	snd_strm->pool = pool;
+	
+#if SND_ARENA_CHECK
+	// Everything that was sized has been allocated, and nothing else.
+	// From here on, nothing may be allocated for the stream at all.
+	pj_assert(arena.used == arena.size);
+	
+	snd_strm->poolUsed = pj_pool_get_used_size(pool);
+#endif
 	
-	status = AudioUnitInitialize(snd_strm->voiceUnit);
+	// If rec_id or play_id are -1, we are supposed to use the first available to device.
+	if(rec_id == -1) rec_id = 0;
+	if(play_id == -1) play_id = 0;
 	
-	if(status != noErr)
+	// Check for full-duplex or half-duplex.
+	// The half-duplex methods (pjmedia_snd_open_rec and pjmedia_snd_open_player) call
+	// this method with an id's of -2.
+	if(rec_id >= 0 && play_id >= 0)
+	{
+		snd_strm->dir = PJMEDIA_DIR_CAPTURE_PLAYBACK;
+	}
+	else if(rec_id >= 0)
+	{
+		snd_strm->dir = PJMEDIA_DIR_CAPTURE;
+	}
+	else if(play_id >= 0)
 	{
-		PJ_LOG(1, (THIS_FILE, "Failed to initialize voice unit: %i %c%c%c%c", (int)status,
-			   (char)(status >> 24), (char)(status >> 16), (char)(status >> 8), (char)status));
-		return -5;
+		snd_strm->dir = PJMEDIA_DIR_PLAYBACK;
 	}
 	
-	if(snd_strm->dir & PJMEDIA_DIR_PLAYBACK)
+	// Get the shared voice unit, and make sure it's set up for our direction(s).
+	// If we're the first stream, this creates the voice unit, running at hwClockRate.
+	
+	lockStreams();
+	
+	snd_voice_unit *unit = NULL;
+	pj_bool_t unitCreated = PJ_FALSE;
+	
+	pj_status_t unit_status = voiceUnitAcquire(snd_strm->dir, hwClockRate, channel_count, &options, &unit, &unitCreated);
+	
+	if(unit_status == PJ_SUCCESS)
 	{
-		// Configure output stream
-		// Note: We're setting the format of the data we'll be supplying/inputting to the output stream.
-		
-		status = AudioUnitSetProperty(snd_strm->voiceUnit,             // The audio unit to set property value for
-		                              kAudioUnitProperty_StreamFormat, // The audio unit property identifier
-		                              kAudioUnitScope_Input,           // The audio unit scope for the property
-		                              outputBus,                       // The audio unit element for the property
-		                              &(snd_strm->streamDesc),         // The value to apply to the property
-		                              sizeof(snd_strm->streamDesc));   // The size of the value
-		if(status != noErr)
-		{
-			PJ_LOG(1, (THIS_FILE, "Failed to set client outputBus stream format: %i", (int)status));
-			return -6;
-		}
+		snd_strm->unit = unit;
+		snd_strm->inputFormat = streamBusFormat(&unit->inputFormat);
+		snd_strm->outputFormat = streamBusFormat(&unit->outputFormat);
+		snd_strm->stats.unit_type = unit->unitType;
 	}
 	
-	// Setup input and render callbacks
-	// 
-	// Both callbacks will use the snd_strm as the user data
+	unlockStreams();
 	
-	// The render callback is invoked by the outputBus when it needs more data to play through the speaker.
-	// 
-	// struct AURenderCallbackStruct {
-	//   AURenderCallback  inputProc;
-	//   void             *inputProcRefCon;
-	// };
+	if(unit_status != PJ_SUCCESS)
+	{
+		pj_pool_release(pool);
+		return unit_status;
+	}
 	
-	AURenderCallbackStruct outputBusRenderCallback;
-	outputBusRenderCallback.inputProc = MyOutputBusRenderCallack;
-	outputBusRenderCallback.inputProcRefCon = snd_strm;
+	// When resampling, the resamplers do the channel conversion, and the reframers stay in the pjsip format.
+	// Otherwise the reframers convert between the pjsip format and the format of the voice unit buses.
 	
-	status = AudioUnitSetProperty(snd_strm->voiceUnit,                  // The audio unit to set property value for
-	                              kAudioUnitProperty_SetRenderCallback, // The audio unit property identifier
-	                              kAudioUnitScope_Input,                // The audio unit scope for the property
-	                              outputBus,                            // The audio unit element for the property
-						          &outputBusRenderCallback,             // The value to apply to the property
-	                              sizeof(outputBusRenderCallback));     // The size of the value
+	if((snd_strm->dir & PJMEDIA_DIR_CAPTURE) && !snd_strm->inputResampler)
+	{
+		snd_strm->inputReframer.deviceChannels = snd_strm->inputFormat.channels;
+	}
 	
-	if(status != noErr)
+	if((snd_strm->dir & PJMEDIA_DIR_PLAYBACK) && !snd_strm->outputResampler)
 	{
-		PJ_LOG(1, (THIS_FILE, "Failed to set outputBus render callback: %i", (int)status));
-		return -7;
+		snd_strm->outputReframer.deviceChannels = snd_strm->outputFormat.channels;
 	}
 	
-	AURenderCallbackStruct inputBusRenderCallback;
-	inputBusRenderCallback.inputProc = MyInputBusInputCallback;
-	inputBusRenderCallback.inputProcRefCon = snd_strm;
+	// Find out what IO buffer duration we actually got
+	snd_strm->ioBufferDuration = snd_io_backend->getIOBufferDuration();
 	
-	status = AudioUnitSetProperty(snd_strm->voiceUnit,                       // The audio unit to set property value for
-	                              kAudioOutputUnitProperty_SetInputCallback, // The audio unit property identifier
-	                              kAudioUnitScope_Global,                    // The audio unit scope for the property
-	                              inputBus,                                  // The audio unit element for the property
-						          &inputBusRenderCallback,                   // The value to apply to the property
-	                              sizeof(inputBusRenderCallback));           // The size of the value
+	PJ_LOG(4, (THIS_FILE, "pjmedia_snd_open: IO buffer duration = %.3f", snd_strm->ioBufferDuration));
 	
-	if(status != noErr)
+	if(options.async_callbacks && latency_configured)
 	{
-		PJ_LOG(1, (THIS_FILE, "Failed to set input callback: %i", (int)status));
-		return -8;
+		// The hardware IO buffer now accounts for part of the requested playback latency,
+		// so we only need to buffer the remainder in the play ring.
+		
+		unsigned ioLatency = (unsigned)(snd_strm->ioBufferDuration * 1000);
+		unsigned ringLatency = (play_latency > ioLatency) ? (play_latency - ioLatency) : 0;
+		
+		snd_strm->playRingTarget = bytesForLatency(ringLatency, clock_rate, channel_count, packet_size);
+	}
+	
+	if(options.async_callbacks && options.adaptive_latency)
+	{
+		// The configured latency is the minimum, and the controller may add up to adaptive_latency_max on top.
+		// We shrink by one packet after every ADAPTIVE_LATENCY_SHRINK_INTERVAL seconds without a glitch.
+		
+		latencyCtlInit(&snd_strm->latencyCtl,
+		               snd_strm->playRingTarget,
+		               snd_strm->playRing.capacity - packet_size,
+		               packet_size,
+		               ADAPTIVE_LATENCY_SHRINK_INTERVAL * clock_rate);
 	}
 	
 	// The voice unit is now setup and ready to be started.
-	// Remember: Due to undocumented peculiarities, we had to call AudioUnitInitialize earlier.
+	// Remember: Due to undocumented peculiarities, we had to call AudioUnitInitialize before setting the output format.
+	
+	// Record how long the open took.
+	// The IO callbacks add how long it took from here until they first served the stream.
+	
+	pj_timestamp now;
+	pj_get_timestamp(&now);
+	
+	snd_strm->openTime = openTime;
+	snd_strm->stats.open_usec = pj_elapsed_usec(&openTime, &now);
+	snd_strm->stats.unit_created = unitCreated ? 1 : 0;
+	
+	PJ_LOG(4, (THIS_FILE, "pjmedia_snd_open: took %u usec, voice unit %s", snd_strm->stats.open_usec,
+	           unitCreated ? "created" : "reused"));
 	
 	// Update the reference parameter with our allocated and configured custom sound structure
 	*p_snd_strm = snd_strm;
 	
-	// Also update our static reference so we can access our stream from within the audio session interruption callback
-	snd_strm_instance = snd_strm;
+	// Also add the stream to our list of open streams, so we can access it from within the audio session interruption callback
+	registerStream(snd_strm);
 	
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_open: finished"));
 	
@@ -1579,15 +8587,97 @@ pj_status_t pjmedia_snd_stream_start(pjmedia_snd_stream *snd_strm)
 {
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_start"));
 	
-	// Make note of the stream starting
-	snd_strm->isActive = true;
+	// The IO callbacks don't serve this stream yet, so it's safe to reset the capture timeline.
+	// The timestamps simply continue from where they were, whatever the hardware sample time is now.
+	timelineReset(&snd_strm->captureTimeline);
+	
+	// Nor does the worker thread, so the echo reference can start out empty
+	if(snd_strm->outputReframer.reference)
+	{
+		referenceReset(&snd_strm->reference);
+	}
+	
+	if(snd_strm->driftCompensation)
+	{
+		// For the same reason, it's safe to reset the drift compensation.
+		// The clocks are measured from scratch, and the captured/rendered difference gets a new baseline.
+		
+		clockEstimatorReset(&snd_strm->captureClock);
+		clockEstimatorReset(&snd_strm->renderClock);
+		
+		driftCtlInit(&snd_strm->driftCtl, snd_strm->clock_rate);
+		resamplerSetAdjustment(snd_strm->inputResampler, 0);
+	}
+	
+	// In asynchronous mode, start the worker thread before the audio unit.
+	// This gives it a chance to fill the play ring before core audio first asks for data.
+	
+	pj_status_t status;
+	
+	if(snd_strm->options.async_callbacks)
+	{
+		status = startWorkerThread(snd_strm);
+		
+		if(status != PJ_SUCCESS)
+		{
+			return status;
+		}
+	}
+	
+	// Fade in from silence.
+	// This also takes care of issue #820 in pjsip, where the very first packet we get from pjsip is a popping noise.
+	if(snd_strm->outputReframer.fade)
+	{
+		ATOMIC_STORE(&snd_strm->fade.stopRequested, PJ_FALSE);
+		fadeStart(&snd_strm->fade);
+	}
+	
+	// Don't conceal an underrun with audio from the last time the stream was started
+	snd_strm->playStarved = PJ_FALSE;
+	snd_strm->concealCount = CONCEAL_REPEAT_PACKETS;
+	
+	snd_strm->renderResumed = PJ_FALSE;
+	snd_strm->captureResumed = PJ_FALSE;
+	
+	// Make note of the stream starting, and activate the audio session for it along with any other active streams.
+	// Then have the voice unit serve the stream, starting the voice unit if this is the first active stream.
+	
+	// If the audio session is interrupted right now, the stream starts out suspended,
+	// and will be resumed along with any other stream once the interruption ends.
+	
+	lockStreams();
+	
+	if(snd_interrupted)
+	{
+		streamSuspend(snd_strm);
+	}
+	else
+	{
+		snd_strm->state = SND_STREAM_RUNNING;
+		snd_io_backend->startSession(activeStreamsDirection());
+	}
+	
+	status = voiceUnitAttach(snd_strm->unit, snd_strm);
 	
-	// Activate the audio session
-	startAudioSession(snd_strm->dir);
+	if(status != PJ_SUCCESS)
+	{
+		if(status == PJ_ETOOMANY)
+		{
+			PJ_LOG(1, (THIS_FILE, "Too many active streams"));
+		}
+		snd_strm->state = SND_STREAM_STOPPED;
+	}
 	
-	// Start the audio unit
-	poppingSoundWorkaround = true;
-	AudioOutputUnitStart(snd_strm->voiceUnit);
+	unlockStreams();
+	
+	if(status != PJ_SUCCESS)
+	{
+		if(snd_strm->workerThread)
+		{
+			stopWorkerThread(snd_strm);
+		}
+		return status;
+	}
 	
 	return PJ_SUCCESS;
 }
@@ -1603,6 +8693,8 @@ pj_status_t pjmedia_snd_stream_get_info(pjmedia_snd_stream *snd_strm,
 	
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_get_info"));
 	
+	streamDrainLogs(snd_strm);
+	
 	pj_bzero(pi, sizeof(pjmedia_snd_stream_info));
 	
 	pi->dir               = snd_strm->dir;
@@ -1635,14 +8727,32 @@ pj_status_t pjmedia_snd_stream_get_info(pjmedia_snd_stream *snd_strm,
 	// On an iPhone 3G, I've found the default value to be 0.023.
 	// So for mono sound with a sample rate of 8kHz, this gives a latency of around 184 samples.
 	// This is the actual latency of our driver, so this is the latency we report.
+	// 
+	// If pjmedia_snd_set_latency was called, we asked for a matching IO buffer duration when the stream was opened.
+	// But core audio doesn't necessarily grant what we ask for, and the duration may change with route changes.
+	// So we always read back the current value.
+	// 
+	// In asynchronous mode we add the buffering we do ourselves:
+	// - For playback, that's the amount of data we keep in the play ring.
+	// - For capture, the worker thread drains the rec ring every workerInterval milliseconds.
+	
+	double bufferDuration = snd_io_backend->getIOBufferDuration();
+	
+	if(bufferDuration > 0)
+	{
+		snd_strm->ioBufferDuration = bufferDuration;
+	}
 	
-	Float32 bufferDuration;
-	UInt32 size = sizeof(bufferDuration);
+	unsigned ioLatency = snd_strm->ioBufferDuration * snd_strm->clock_rate * snd_strm->channel_count;
 	
-	AudioSessionGetProperty(kAudioSessionProperty_CurrentHardwareIOBufferDuration, &size, &bufferDuration);
+	pi->rec_latency  = ioLatency;
+	pi->play_latency = ioLatency;
 	
-	pi->rec_latency  = bufferDuration * snd_strm->clock_rate * snd_strm->channel_count;
-	pi->play_latency = bufferDuration * snd_strm->clock_rate * snd_strm->channel_count;
+	if(snd_strm->options.async_callbacks)
+	{
+		pi->rec_latency  += snd_strm->workerInterval * snd_strm->clock_rate / 1000 * snd_strm->channel_count;
+		pi->play_latency += snd_strm->playRingTarget / sizeof(pj_int16_t);
+	}
 	
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_get_info: pi->rec_latency=%d", pi->rec_latency));
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_get_info: pi->play_latency=%d", pi->play_latency));
@@ -1660,22 +8770,41 @@ pj_status_t pjmedia_snd_stream_stop(pjmedia_snd_stream *snd_strm)
 {
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_stop"));
 	
-	// Stop the audio unit
-	AudioOutputUnitStop(snd_strm->voiceUnit);
+	// Fade out whatever is playing, rather than cutting it off
+	streamFadeOut(snd_strm);
+	
+	// Have the voice unit stop serving the stream.
+	// If this was the last active stream, this stops the voice unit.
+	
+	lockStreams();
+	voiceUnitDetach(snd_strm->unit, snd_strm);
+	unlockStreams();
+	
+	// Now that the IO callbacks are no longer being invoked for this stream, we can stop the worker thread.
+	// Either way, whatever the IO threads logged gets logged now.
+	if(snd_strm->workerThread)
+	{
+		stopWorkerThread(snd_strm);
+	}
+	else
+	{
+		streamDrainLogs(snd_strm);
+	}
+	
+	// Make a note of the stream stopping.
+	// The audio session is shared with any other open stream,
+	// so we only deactivate it once the last active stream has stopped.
 	
-	// Once you stop the audio unit the related threads might disappear as well.
-	// So we should clear any thread registration variables at this point.
-	input_thread_registered = PJ_FALSE;
-	output_thread_registered = PJ_FALSE;
+	lockStreams();
 	
-	pj_bzero(inputThreadDesc, sizeof(inputThreadDesc));
-	pj_bzero(outputThreadDesc, sizeof(outputThreadDesc));
+	snd_strm->state = SND_STREAM_STOPPED;
 	
-	// Deactivate the audio session
-	stopAudioSession();
+	if(activeStreamsDirection() == PJMEDIA_DIR_NONE)
+	{
+		snd_io_backend->stopSession();
+	}
 	
-	// Make a note of the stream stopping
-	snd_strm->isActive = false;
+	unlockStreams();
 	
 	return PJ_SUCCESS;
 }
@@ -1687,26 +8816,39 @@ pj_status_t pjmedia_snd_stream_close(pjmedia_snd_stream *snd_strm)
 {
 	PJ_LOG(5, (THIS_FILE, "pjmedia_snd_stream_close"));
 	
-	if(snd_strm->voiceUnit)
+	// The voice unit is shared, and may keep running for other streams.
+	// So make sure it's no longer serving this stream before the stream goes away.
+	if(snd_strm->state != SND_STREAM_STOPPED)
+	{
+		pjmedia_snd_stream_stop(snd_strm);
+	}
+	
+	// Let go of the voice unit.
+	// It's disposed of when the last stream is closed, unless the application wants us to keep it warm.
+	if(snd_strm->unit)
 	{
-		PJ_LOG(5, (THIS_FILE, "Shutting down voiceUnit"));
+		pjmedia_snd_iphone_options options;
+		getCurrentOptions(&options);
 		
-		AudioUnitUninitialize(snd_strm->voiceUnit);
-		AudioComponentInstanceDispose(snd_strm->voiceUnit);
+		lockStreams();
+		voiceUnitRelease(snd_strm->unit, options.keep_warm);
+		unlockStreams();
 		
-		snd_strm->voiceUnit = NULL;
+		snd_strm->unit = NULL;
 	}
 	
+	// Remove the stream from our list of open streams (used in the audio session interruption callback).
+	// This has to happen before we release the pool, since the stream itself lives in it.
+	unregisterStream(snd_strm);
+	
 	// Release the memory pool we created in pjmedia_snd_open.
-	// This will release all objects created in the pool including:
+	// This will release the stream's arena, and with it every object of the stream including:
 	// - stream
-	// - stream->inputBufferList
-	// - stream->outputBuffer
+	// - stream->outputReframer.buffer
+	// - stream->inputReframer.buffer
+	// - the rings, resamplers, and other buffers
 	pj_pool_release(snd_strm->pool);
 	
-	// Clear our static reference to the stream instance (used in the audio session interruption callback)
-	snd_strm_instance = NULL;
-	
 	return PJ_SUCCESS;
 }
 
@@ -1738,12 +8880,262 @@ pj_status_t pjmedia_snd_set_latency(unsigned input_latency, unsigned output_late
 	else
 		play_latency = output_latency;
 	
-	// Note: The above values are stored, but are not currently used for anything.
+	// If both values are zero the application just wants the defaults,
+	// in which case we leave the hardware IO buffer duration alone.
+	latency_configured = (input_latency != 0) || (output_latency != 0);
+	
+	// Note: The above values are applied the next time a stream is opened.
 	// Please see the discussion on latency below.
 	
 	return PJ_SUCCESS;
 }
 
+/**
+ * Initializes the given options struct with the default values.
+**/
+void pjmedia_snd_iphone_options_default(pjmedia_snd_iphone_options *opt)
+{
+	pj_bzero(opt, sizeof(pjmedia_snd_iphone_options));
+	
+	opt->async_callbacks = PJ_FALSE;
+	
+	opt->adaptive_latency = PJ_FALSE;
+	opt->adaptive_latency_max = 200;
+	
+	opt->underrun_concealment = PJMEDIA_SND_IPHONE_CONCEAL_REPEAT;
+	
+	opt->hw_clock_rate = 0;
+	opt->resampler_taps = 64;
+	
+	opt->drift_compensation = PJ_FALSE;
+	
+	opt->keep_warm = PJ_FALSE;
+	
+	opt->unit_type = PJMEDIA_SND_IPHONE_UNIT_AUTO;
+	opt->voice_agc = PJ_TRUE;
+	
+	opt->float_format = PJ_FALSE;
+	opt->dither = PJ_TRUE;
+	
+	opt->fade_msec = 5;
+	
+	opt->vad = PJ_FALSE;
+	opt->vad_threshold = -45;
+	opt->vad_zcr_threshold = 300;
+	opt->vad_hangover_msec = 200;
+	opt->vad_suppress = PJ_FALSE;
+	opt->vad_cb = NULL;
+	
+	opt->aec_cb = NULL;
+}
+
+/**
+ * Sets the options used for streams opened from now on.
+ * Streams that are already open are not affected.
+**/
+pj_status_t pjmedia_snd_iphone_set_options(const pjmedia_snd_iphone_options *opt)
+{
+	PJ_ASSERT_RETURN(opt, PJ_EINVAL);
+	
+	// The resampler filter is applied 8 samples at a time
+	PJ_ASSERT_RETURN((opt->resampler_taps >= 16) && (opt->resampler_taps <= 128), PJ_EINVAL);
+	PJ_ASSERT_RETURN((opt->resampler_taps % 8) == 0, PJ_EINVAL);
+	
+	PJ_ASSERT_RETURN(opt->underrun_concealment <= PJMEDIA_SND_IPHONE_CONCEAL_NOISE, PJ_EINVAL);
+	
+	// The fade out holds up pjmedia_snd_stream_stop, so keep it short
+	PJ_ASSERT_RETURN(opt->fade_msec <= 100, PJ_EINVAL);
+	
+	PJ_ASSERT_RETURN((opt->vad_threshold <= 0) && (opt->vad_zcr_threshold <= 1000), PJ_EINVAL);
+	
+	PJ_ASSERT_RETURN(opt->unit_type <= PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING, PJ_EINVAL);
+	
+	snd_options = *opt;
+	snd_options_set = PJ_TRUE;
+	
+	// If the voice unit is only still around because it was kept warm, there's no reason to keep it any longer
+	if(!opt->keep_warm)
+	{
+		lockStreams();
+		
+		if(snd_unit && (snd_unit->openCount == 0))
+		{
+			voiceUnitDestroy(snd_unit);
+		}
+		
+		unlockStreams();
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Gets the options currently used for newly opened streams.
+**/
+pj_status_t pjmedia_snd_iphone_get_options(pjmedia_snd_iphone_options *opt)
+{
+	PJ_ASSERT_RETURN(opt, PJ_EINVAL);
+	
+	getCurrentOptions(opt);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Takes a snapshot of the realtime statistics of the given stream.
+ * This may be invoked from any thread, at any time.
+**/
+pj_status_t pjmedia_snd_iphone_stream_get_stats(pjmedia_snd_stream *snd_strm, pjmedia_snd_iphone_stats *stats)
+{
+	PJ_ASSERT_RETURN(snd_strm, PJ_EINVAL);
+	PJ_ASSERT_RETURN(stats, PJ_EINVAL);
+	
+	streamDrainLogs(snd_strm);
+	
+	statsSnapshot(stats, &snd_strm->stats);
+	
+	// The remaining values are kept elsewhere, by their respective writers
+	
+	stats->render.direct_packets  = ATOMIC_LOAD(&snd_strm->outputReframer.directCount);
+	stats->render.staged_packets  = ATOMIC_LOAD(&snd_strm->outputReframer.stagedCount);
+	stats->render.bytes_copied    = ATOMIC_LOAD(&snd_strm->outputReframer.bytesCopied);
+	
+	stats->capture.direct_packets = ATOMIC_LOAD(&snd_strm->inputReframer.directCount);
+	stats->capture.staged_packets = ATOMIC_LOAD(&snd_strm->inputReframer.stagedCount);
+	stats->capture.bytes_copied   = ATOMIC_LOAD(&snd_strm->inputReframer.bytesCopied);
+	
+	stats->play_underruns = ATOMIC_LOAD(&snd_strm->playUnderruns);
+	stats->rec_overruns   = ATOMIC_LOAD(&snd_strm->recOverruns);
+	
+	stats->capture_clock_ppb    = ATOMIC_LOAD(&snd_strm->captureClock.ppb);
+	stats->render_clock_ppb     = ATOMIC_LOAD(&snd_strm->renderClock.ppb);
+	stats->drift_correction_ppb = ATOMIC_LOAD(&snd_strm->driftCtl.correction);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Converts a capture timestamp (as passed to rec_cb) to the host time at which it was captured.
+ * This may be invoked from any thread, at any time.
+**/
+pj_status_t pjmedia_snd_iphone_stream_get_capture_host_time(pjmedia_snd_stream *snd_strm,
+                                                            pj_uint32_t timestamp,
+                                                            pj_uint64_t *host_time)
+{
+	PJ_ASSERT_RETURN(snd_strm, PJ_EINVAL);
+	PJ_ASSERT_RETURN(host_time, PJ_EINVAL);
+	
+	if(!timelineHostTime(&snd_strm->captureTimeline, timestamp, host_time))
+	{
+		return PJ_EINVALIDOP;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Initializes the given loopback parameters with the default values.
+**/
+void pjmedia_snd_iphone_loopback_param_default(pjmedia_snd_iphone_loopback_param *param)
+{
+	pj_bzero(param, sizeof(pjmedia_snd_iphone_loopback_param));
+	
+	param->hw_clock_rate = 44100;
+	param->frames_per_cycle = 0;
+	param->realtime = PJ_TRUE;
+	
+	param->capture_file = NULL;
+	param->render_file = NULL;
+	param->loopback_delay = 0;
+}
+
+/**
+ * Copies a file name of the loopback parameters into the given buffer.
+ * Returns PJ_FALSE if it doesn't fit.
+**/
+static pj_bool_t copyLoopbackPath(char *dst, const char *src, const char **p_path)
+{
+	if(src == NULL)
+	{
+		*p_path = NULL;
+		return PJ_TRUE;
+	}
+	
+	if(pj_ansi_strlen(src) >= LOOPBACK_MAX_PATH)
+	{
+		return PJ_FALSE;
+	}
+	
+	pj_ansi_strcpy(dst, src);
+	*p_path = dst;
+	
+	return PJ_TRUE;
+}
+
+/**
+ * Switches the driver to the loopback backend (or back to the default backend, if param is NULL).
+ * Any voice unit that is kept warm belongs to the previous backend, so it's disposed of.
+**/
+pj_status_t pjmedia_snd_iphone_use_loopback(const pjmedia_snd_iphone_loopback_param *param)
+{
+	if(param)
+	{
+		PJ_ASSERT_RETURN(param->hw_clock_rate > 0, PJ_EINVAL);
+		PJ_ASSERT_RETURN(param->frames_per_cycle <= MAX_FRAMES_PER_SLICE, PJ_EINVAL);
+		PJ_ASSERT_RETURN(param->loopback_delay <= LOOPBACK_MAX_DELAY, PJ_EINVAL);
+	}
+	
+	lockStreams();
+	
+	if(snd_streams)
+	{
+		unlockStreams();
+		return PJ_EBUSY;
+	}
+	
+	if(param)
+	{
+		pjmedia_snd_iphone_loopback_param copy = *param;
+		
+		if(!copyLoopbackPath(loopback_capture_file, param->capture_file, &copy.capture_file) ||
+		   !copyLoopbackPath(loopback_render_file, param->render_file, &copy.render_file))
+		{
+			unlockStreams();
+			return PJ_ENAMETOOLONG;
+		}
+		
+		loopback_param = copy;
+		loopback_param_set = PJ_TRUE;
+	}
+	
+	const snd_backend *backend = param ? &loopback_backend : DEFAULT_BACKEND;
+	
+	if(snd_unit)
+	{
+		voiceUnitDestroy(snd_unit);
+	}
+	
+	pj_status_t status = PJ_SUCCESS;
+	
+	if(backend != snd_io_backend)
+	{
+		PJ_LOG(4, (THIS_FILE, "Switching from the %s backend to the %s backend", snd_io_backend->name, backend->name));
+		
+		// If we're initialized, the backends have to be as well
+		if(snd_pool_factory)
+		{
+			snd_io_backend->deinit();
+			status = backend->init();
+		}
+		
+		snd_io_backend = backend;
+	}
+	
+	unlockStreams();
+	
+	return status;
+}
+
 #endif	/* PJMEDIA_SOUND_IMPLEMENTATION */
 
 
@@ -1776,6 +9168,14 @@ pj_status_t pjmedia_snd_set_latency(unsigned input_latency, unsigned output_late
 // then core audio simply refuses to play any audio - all we get is silence.
 // Luckily, if we configure core audio to be stereo and properly fill the buffer everytime,
 // then the sound comes through crystal clear.
+// 
+// Update: Since the above was written the callbacks have been reworked so that they always fill the entire
+// buffer with exactly the requested number of frames, regardless of the channel count.
+// With that in place, configuring core audio with the pjsip channel count is worth trying again,
+// as it removes the channel conversion from both IO callbacks and halves the bytes moved per cycle.
+// So this is now what we do by default (see NATIVE_CHANNEL_FORMAT).
+// If the voice unit rejects the format for a bus, we fall back to stereo on that bus.
+// If you run into the crackling described above on some device, set NATIVE_CHANNEL_FORMAT to 0.
 
 
 // LATENCY:
@@ -1785,12 +9185,17 @@ pj_status_t pjmedia_snd_set_latency(unsigned input_latency, unsigned output_late
 // It is also much lower than the default latency settings (184 vs 800).
 // 
 // There is also a way to explicitly set the latency via the pjmedia_snd_set_latency.
-// This is currently not used.
-// However, if it is used in the future, I'm not sure how exactly we should respond.
-// I currently store the information for future use.
-// Consider, for example, if the user called this method with a value of 0, meaning use the default values.
+// If the application calls it with a value of 0 (meaning use the default values), we leave core audio alone.
 // The user likely thinks the default value is 100 milliseconds since this is PJMEDIA_SND_DEFAULT_REC_LATENCY.
-// But our default value is actually around 23 milliseconds.
-// Or what if they called the method with parameters of 50 milliseconds.
-// Do they actually want us to increase the latency, or are they attempting to decrease it?
-// For these reasons, I've left the values as is.
\ No newline at end of file
+// But our default value is actually around 23 milliseconds, and there's no reason to make it worse.
+// 
+// If the application passes an explicit value, we take it at face value,
+// and ask core audio for a matching hardware IO buffer duration when the next stream is opened
+// (clamped to MIN_IO_BUFFER_DURATION ... MAX_IO_BUFFER_DURATION).
+// For a full-duplex stream we use the smaller of the two values, since there's only one IO buffer duration.
+// 
+// In asynchronous mode, the values also determine the size of the rings between the IO callbacks and the
+// worker thread. The play ring holds whatever part of the playback latency the IO buffer doesn't account for.
+// 
+// Core audio may not grant the exact duration we ask for, so pjmedia_snd_stream_get_info always reports
+// the duration that's actually in effect (plus our own buffering in asynchronous mode).
@@ -0,0 +1,550 @@
+/**
+ * Created by Robbie Hanson of Voalte, Inc.
+ *
+ * Project page:
+ * http://code.google.com/p/pjsip-iphone-audio-driver
+ *
+ * Mailing list:
+ * http://groups.google.com/group/pjsip-iphone-audio-driver
+ *
+ * Open sourced under a BSD style license.
+ * See iphonesound.c for the full license text.
+**/
+
+#ifndef __IPHONESOUND_H__
+#define __IPHONESOUND_H__
+
+// Extensions to the pjmedia sound API that are specific to the iPhone sound driver.
+//
+// Everything in here is optional.
+// An application that never calls any of these methods gets the default driver behavior.
+
+#include <pjmedia/sound.h>
+
+PJ_BEGIN_DECL
+
+/**
+ * What the render side plays when the play ring runs dry (see underrun_concealment).
+**/
+typedef enum pjmedia_snd_iphone_concealment
+{
+	/** Silence. **/
+	PJMEDIA_SND_IPHONE_CONCEAL_SILENCE,
+
+	/** The last packet, repeated a few times while it fades out. **/
+	PJMEDIA_SND_IPHONE_CONCEAL_REPEAT,
+
+	/** Comfort noise, at the level of the quietest recent audio. **/
+	PJMEDIA_SND_IPHONE_CONCEAL_NOISE
+
+} pjmedia_snd_iphone_concealment;
+
+/**
+ * The kind of audio unit the voice unit runs on (see unit_type), from the cheapest to the most expensive.
+**/
+typedef enum pjmedia_snd_iphone_unit_type
+{
+	/** Voice processing for streams that capture, and the cheapest unit for playback-only streams. **/
+	PJMEDIA_SND_IPHONE_UNIT_AUTO,
+
+	/** RemoteIO: Plain hardware IO, without any voice processing. **/
+	PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO,
+
+	/** VoiceProcessingIO, with the voice processing (echo cancellation, AGC, noise suppression) bypassed. **/
+	PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING_BYPASSED,
+
+	/** VoiceProcessingIO, with voice processing (see voice_agc). **/
+	PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING
+
+} pjmedia_snd_iphone_unit_type;
+
+/**
+ * Reports the voice activity of a captured packet (see vad_cb).
+ *
+ * The user_data and timestamp are the same as those passed to rec_cb for the packet.
+**/
+typedef void (*pjmedia_snd_iphone_vad_cb)(void *user_data, pj_uint32_t timestamp, pj_bool_t active);
+
+/**
+ * Hands a captured packet to a software echo canceller, along with the played packet it lines up with (see aec_cb).
+ *
+ * The user_data and timestamp are the same as those passed to rec_cb for the near-end packet.
+ * The near-end packet may be modified in place, and is passed on to rec_cb afterwards.
+ *
+ * The far-end packet is the packet (as returned by play_cb, after the driver's own processing) that started
+ * playing most recently before the first sample of the near-end packet was captured.
+ * The delay is the number of samples (in timestamp units, so all channels) by which the start of the far-end
+ * packet precedes the start of the near-end packet, so it's always less than samples.
+ * An echo canceller that works on a continuous far-end signal can simply feed it each packet as it comes,
+ * and take the delay into account for its alignment.
+ *
+ * If no played packet lines up with the near-end packet (e.g. nothing has been played yet,
+ * or the time of either isn't known), far_end is NULL and delay is 0.
+ *
+ * Both packets are 16-bit, with the given number of samples (all channels).
+ * The far-end packet only remains valid until the callback returns.
+**/
+typedef void (*pjmedia_snd_iphone_aec_cb)(void *user_data,
+                                          pj_uint32_t timestamp,
+                                          const pj_int16_t *far_end,
+                                          pj_int16_t *near_end,
+                                          unsigned samples,
+                                          unsigned delay);
+
+/**
+ * Driver options.
+ *
+ * Options are applied to streams when they are opened.
+ * Changing the options does not affect streams that are already open.
+**/
+typedef struct pjmedia_snd_iphone_options
+{
+	/**
+	 * When enabled, play_cb and rec_cb are not invoked from the realtime core audio IO threads.
+	 * Instead, captured and played audio is passed through lock-free ring buffers,
+	 * and a separate (pjlib registered) worker thread invokes the callbacks.
+	 *
+	 * This prevents a stall in pjsip (conference bridge, codec, jitter buffer, etc) from turning
+	 * directly into an audible glitch, at the cost of additional latency.
+	 * The size of the ring buffers is derived from the values passed to pjmedia_snd_set_latency.
+	 *
+	 * When disabled, the IO threads are registered with pjlib before they invoke the callbacks.
+	 * If that fails, the stream plays silence and drops the captured audio, rather than call into pjsip anyway.
+	 * Also, the IO threads never log directly (logging may block), and without the worker thread their messages
+	 * are only logged when pjmedia_snd_stream_get_info, pjmedia_snd_iphone_stream_get_stats
+	 * or pjmedia_snd_stream_stop is called.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t async_callbacks;
+
+	/**
+	 * When enabled (along with async_callbacks), the amount of audio buffered in the play ring adapts
+	 * to the device. It grows whenever the IO thread runs out of play data or has to drop captured data,
+	 * and slowly shrinks back towards the latency set via pjmedia_snd_set_latency while things run smoothly.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t adaptive_latency;
+
+	/**
+	 * The maximum amount of latency (in milliseconds) that adaptive_latency may add
+	 * on top of the configured playback latency.
+	 *
+	 * Default: 200
+	**/
+	unsigned adaptive_latency_max;
+
+	/**
+	 * What to play (along with async_callbacks) when pjsip falls behind, and the play ring runs dry.
+	 * The render side never waits for pjsip, so it has to play something else in the meantime.
+	 * Once pjsip catches up again, playback fades back in (see fade_msec), from whatever level
+	 * the concealment got down to.
+	 *
+	 * Default: PJMEDIA_SND_IPHONE_CONCEAL_REPEAT
+	**/
+	pjmedia_snd_iphone_concealment underrun_concealment;
+
+	/**
+	 * The sample rate to run the voice unit at, or 0 to run it at the clock rate requested by pjsip.
+	 *
+	 * When this differs from the pjsip clock rate, the driver converts between the two rates itself,
+	 * instead of relying on the voice unit to do so. Use PJMEDIA_SND_IPHONE_NATIVE_RATE to run
+	 * the voice unit at the current hardware sample rate, so core audio doesn't have to convert at all.
+	 *
+	 * Default: 0
+	**/
+	unsigned hw_clock_rate;
+
+	/**
+	 * Quality of the in-driver sample rate conversion (see hw_clock_rate).
+	 *
+	 * This is the length of the resampling filter, in samples of the lower of the two rates.
+	 * A longer filter has a wider passband, at a proportionally higher CPU cost.
+	 * Must be a multiple of 8, from 16 to 128.
+	 *
+	 * Default: 64
+	**/
+	unsigned resampler_taps;
+
+	/**
+	 * When enabled, the driver measures the actual sample rates of the capture and playback hardware,
+	 * and resamples the captured audio ever so slightly so it keeps pace with playback.
+	 *
+	 * This matters when input and output are driven by different clocks (e.g. some bluetooth headsets).
+	 * Without it, pjsip has to drop or insert audio every so often on long calls.
+	 * Only applies to streams that both capture and play.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t drift_compensation;
+
+	/**
+	 * When enabled, the voice unit is kept around (initialized, but stopped) after the last stream is closed.
+	 * The next pjmedia_snd_open then doesn't have to create and initialize a voice unit, which speeds up call setup.
+	 * The voice unit is only reconfigured if the next stream uses a different format or direction.
+	 *
+	 * A warm voice unit is disposed of by pjmedia_snd_deinit, or when this option is disabled again.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t keep_warm;
+
+	/**
+	 * The kind of audio unit to run the voice unit on.
+	 *
+	 * Voice processing costs CPU and adds latency, which is wasted in headset or playback-only scenarios.
+	 * With PJMEDIA_SND_IPHONE_UNIT_AUTO, streams that capture get voice processing, and playback-only streams
+	 * (e.g. ringback or prompts) get RemoteIO. Or, if a voice unit was kept warm (keep_warm),
+	 * its voice processing is bypassed rather than creating a new audio unit.
+	 *
+	 * The voice unit is shared by all open streams, so a stream that's opened while others are open
+	 * never takes voice processing away from them. But it may add voice processing: It may turn bypassed
+	 * voice processing back on, or replace RemoteIO with VoiceProcessingIO. Replacing the audio unit
+	 * briefly interrupts the streams that are running.
+	 *
+	 * Default: PJMEDIA_SND_IPHONE_UNIT_AUTO
+	**/
+	pjmedia_snd_iphone_unit_type unit_type;
+
+	/**
+	 * Whether the automatic gain control of voice processing is enabled
+	 * (PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING only).
+	 *
+	 * Default: PJ_TRUE
+	**/
+	pj_bool_t voice_agc;
+
+	/**
+	 * When enabled, the voice unit exchanges 32-bit float samples with the hardware instead of 16-bit integers.
+	 * This avoids a conversion inside core audio (whose hardware side is float), and the driver converts
+	 * to and from the 16-bit (or 32-bit, see pjmedia_snd_open) frames pjsip uses with vector code instead.
+	 * If the voice unit rejects the float format, the driver falls back to 16 bits.
+	 *
+	 * Like the other voice unit settings, this only takes effect when the voice unit is (re)configured,
+	 * i.e. not while another stream is sharing it.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t float_format;
+
+	/**
+	 * When enabled (along with float_format), captured float samples are dithered (TPDF)
+	 * when they are reduced to 16 bits, instead of simply being rounded.
+	 *
+	 * Default: PJ_TRUE
+	**/
+	pj_bool_t dither;
+
+	/**
+	 * The length (in milliseconds, at most 100) of the ramp with which playback is faded in when the stream
+	 * is started, resumed after an interruption, or recovers from an underrun (async_callbacks),
+	 * and faded out when the stream is stopped. This avoids the clicks of jumping from or to silence.
+	 * The fade out makes pjmedia_snd_stream_stop wait that much longer. Use 0 to disable fading.
+	 *
+	 * Default: 5
+	**/
+	unsigned fade_msec;
+
+	/**
+	 * When enabled, every captured packet is classified as voice or silence before it's passed to rec_cb,
+	 * by its energy and zero-crossing rate (see vad_threshold and vad_zcr_threshold).
+	 * After voice, packets are still considered voice for vad_hangover_msec, so trailing syllables aren't cut off.
+	 *
+	 * The analysis runs right before rec_cb, on the same thread (see async_callbacks).
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t vad;
+
+	/**
+	 * The level (in dBFS) above which a packet is considered voice.
+	 * A packet within 10 dB below this level is considered voice too, if its zero-crossing rate
+	 * is above vad_zcr_threshold, so unvoiced sounds (like "s" and "f") aren't mistaken for silence.
+	 *
+	 * Default: -45
+	**/
+	int vad_threshold;
+
+	/**
+	 * The number of zero crossings per 1000 samples above which a quiet packet is considered voice (see vad_threshold).
+	 *
+	 * Default: 300
+	**/
+	unsigned vad_zcr_threshold;
+
+	/**
+	 * How long (in milliseconds) packets are still considered voice after the last packet with voice.
+	 *
+	 * Default: 200
+	**/
+	unsigned vad_hangover_msec;
+
+	/**
+	 * When enabled (along with vad), silent packets aren't passed to rec_cb at all.
+	 * The timestamps passed to rec_cb then skip the suppressed packets.
+	 *
+	 * Default: PJ_FALSE
+	**/
+	pj_bool_t vad_suppress;
+
+	/**
+	 * If set (along with vad), this is invoked with the activity of every captured packet,
+	 * right before the packet is passed to rec_cb (or would have been, see vad_suppress).
+	 *
+	 * Default: NULL
+	**/
+	pjmedia_snd_iphone_vad_cb vad_cb;
+
+	/**
+	 * If set, every captured packet of a stream that both captures and plays is first passed to this callback,
+	 * along with the played packet it lines up with, so a software echo canceller can be plugged in.
+	 * This is invoked wherever rec_cb itself would have been, before voice activity detection.
+	 *
+	 * Default: NULL
+	**/
+	pjmedia_snd_iphone_aec_cb aec_cb;
+
+} pjmedia_snd_iphone_options;
+
+/**
+ * Value for hw_clock_rate that runs the voice unit at the current hardware sample rate.
+**/
+#define PJMEDIA_SND_IPHONE_NATIVE_RATE  ((unsigned)-1)
+
+/**
+ * Number of buckets in a histogram.
+**/
+#define PJMEDIA_SND_IPHONE_HISTOGRAM_BUCKETS  20
+
+/**
+ * Fixed-bucket histogram of durations, in microseconds.
+ *
+ * Bucket 0 counts values below 1 usec.
+ * Bucket i (for i > 0) counts values from 2^(i-1) up to (but not including) 2^i usec.
+ * The last bucket also counts everything above that.
+**/
+typedef struct pjmedia_snd_iphone_histogram
+{
+	pj_uint32_t count[PJMEDIA_SND_IPHONE_HISTOGRAM_BUCKETS];
+
+	/** The largest value seen, in usec. **/
+	pj_uint32_t max;
+
+} pjmedia_snd_iphone_histogram;
+
+/**
+ * Statistics for one direction (render or capture) of a stream.
+**/
+typedef struct pjmedia_snd_iphone_io_stats
+{
+	/** Number of times core audio invoked the IO callback. **/
+	pj_uint32_t callbacks;
+
+	/** Smallest, largest and most recent number of frames (inNumberFrames) per IO callback. **/
+	pj_uint32_t min_frames;
+	pj_uint32_t max_frames;
+	pj_uint32_t last_frames;
+
+	/** Number of times the hardware sample time didn't follow on from the previous IO callback. **/
+	pj_uint32_t discontinuities;
+
+	/** Number of times the captured audio couldn't be fetched from the voice unit (capture only). **/
+	pj_uint32_t errors;
+
+	/** Time spent in the IO callback. **/
+	pjmedia_snd_iphone_histogram callback_usec;
+
+	/** Time spent in play_cb / rec_cb (on the worker thread in asynchronous mode). **/
+	pjmedia_snd_iphone_histogram pjsip_usec;
+
+	/** Deviation of the time between IO callbacks from the nominal time (inNumberFrames / sample rate). **/
+	pjmedia_snd_iphone_histogram jitter_usec;
+
+	/** Packets handed to pjsip in place, packets staged, and bytes copied by the reframer. **/
+	pj_uint32_t direct_packets;
+	pj_uint32_t staged_packets;
+	pj_uint32_t bytes_copied;
+
+} pjmedia_snd_iphone_io_stats;
+
+/**
+ * Realtime statistics of a stream.
+**/
+typedef struct pjmedia_snd_iphone_stats
+{
+	pjmedia_snd_iphone_io_stats render;
+	pjmedia_snd_iphone_io_stats capture;
+
+	/** Number of packets the render side had to conceal (asynchronous mode, see underrun_concealment). **/
+	pj_uint32_t play_underruns;
+
+	/** Number of times the play ring ran dry, i.e. the number of runs of concealed packets. **/
+	pj_uint32_t underrun_events;
+
+	/** Number of concealed packets that were filled with repeated audio or comfort noise, rather than silence. **/
+	pj_uint32_t concealed_packets;
+
+	/** Number of captured packets classified as voice (including the hangover), and as silence (vad). **/
+	pj_uint32_t vad_active_packets;
+	pj_uint32_t vad_silent_packets;
+
+	/** Number of silent packets that weren't passed to rec_cb (vad_suppress). **/
+	pj_uint32_t vad_suppressed_packets;
+
+	/** Number of captured packets passed to aec_cb with a far-end packet, and without one. **/
+	pj_uint32_t aec_pairs;
+	pj_uint32_t aec_unaligned;
+
+	/** Number of captured packets the capture side had to drop (asynchronous mode). **/
+	pj_uint32_t rec_overruns;
+
+	/** Measured deviation of the capture and playback hardware clocks from their nominal rate,
+	 *  in parts per billion (drift_compensation). **/
+	pj_int32_t capture_clock_ppb;
+	pj_int32_t render_clock_ppb;
+
+	/** Adjustment currently applied to the ratio of the capture resampler, in parts per billion. **/
+	pj_int32_t drift_correction_ppb;
+
+	/** Time spent in pjmedia_snd_open, in usec. **/
+	pj_uint32_t open_usec;
+
+	/** Whether pjmedia_snd_open had to create the voice unit (1), or could use an existing one (0),
+	 *  either shared with another stream or kept warm (keep_warm). **/
+	pj_uint32_t unit_created;
+
+	/** The kind of audio unit the voice unit ran on when the stream was opened
+	 *  (a pjmedia_snd_iphone_unit_type, never PJMEDIA_SND_IPHONE_UNIT_AUTO). **/
+	pj_uint32_t unit_type;
+
+	/** Time from the start of pjmedia_snd_open until the first render and capture callback for the stream,
+	 *  in usec. These are 0 until the callback happens. **/
+	pj_uint32_t first_render_usec;
+	pj_uint32_t first_capture_usec;
+
+	/** Number of times the stream was resumed after an audio session interruption. **/
+	pj_uint32_t resumes;
+
+	/** How long the stream was suspended by the most recent interruption, in msec. **/
+	pj_uint32_t suspended_msec;
+
+	/** Time from the end of the most recent interruption until the first render and capture callback
+	 *  for the stream, in usec. **/
+	pj_uint32_t resume_render_usec;
+	pj_uint32_t resume_capture_usec;
+
+} pjmedia_snd_iphone_stats;
+
+/**
+ * Parameters of the loopback backend (see pjmedia_snd_iphone_use_loopback).
+**/
+typedef struct pjmedia_snd_iphone_loopback_param
+{
+	/**
+	 * The sample rate the simulated hardware runs at (used with PJMEDIA_SND_IPHONE_NATIVE_RATE).
+	 *
+	 * Default: 44100
+	**/
+	unsigned hw_clock_rate;
+
+	/**
+	 * The number of frames per IO cycle, or 0 to derive it from the IO buffer duration,
+	 * which follows pjmedia_snd_set_latency like it does on the device. At most 4096.
+	 *
+	 * Default: 0
+	**/
+	unsigned frames_per_cycle;
+
+	/**
+	 * When enabled, the IO cycles are paced by the host clock, like the real hardware.
+	 * Otherwise they run back to back, as fast as the driver keeps up, which is useful for benchmarks.
+	 *
+	 * Default: PJ_TRUE
+	**/
+	pj_bool_t realtime;
+
+	/**
+	 * A 16-bit PCM WAV file (mono or stereo) to capture from, played in a loop.
+	 * If NULL, the rendered audio is captured again instead (see loopback_delay).
+	 *
+	 * Default: NULL
+	**/
+	const char *capture_file;
+
+	/**
+	 * A WAV file to write the rendered audio to, or NULL.
+	 * The file is written from the time the voice unit starts until it's stopped or reconfigured.
+	 *
+	 * Default: NULL
+	**/
+	const char *render_file;
+
+	/**
+	 * Without a capture_file, the number of IO cycles (at most 32) after which rendered audio is captured again.
+	 *
+	 * Default: 0
+	**/
+	unsigned loopback_delay;
+
+} pjmedia_snd_iphone_loopback_param;
+
+/**
+ * Initializes the given options struct with the default values.
+**/
+void pjmedia_snd_iphone_options_default(pjmedia_snd_iphone_options *opt);
+
+/**
+ * Sets the options used for streams opened from now on.
+**/
+pj_status_t pjmedia_snd_iphone_set_options(const pjmedia_snd_iphone_options *opt);
+
+/**
+ * Gets the options currently used for newly opened streams.
+**/
+pj_status_t pjmedia_snd_iphone_get_options(pjmedia_snd_iphone_options *opt);
+
+/**
+ * Takes a snapshot of the realtime statistics of the given stream.
+ *
+ * The statistics are updated by the core audio IO threads without any locking,
+ * and this method may be safely invoked from any other thread at any time.
+ * Each individual value is read atomically, but the snapshot as a whole is not,
+ * so values that are updated in the meantime may be off by one IO cycle relative to each other.
+**/
+pj_status_t pjmedia_snd_iphone_stream_get_stats(pjmedia_snd_stream *strm, pjmedia_snd_iphone_stats *stats);
+
+/**
+ * Converts a capture timestamp (as passed to rec_cb) to the host time at which its first sample was captured,
+ * in mach_absolute_time units (the same as AudioTimeStamp.mHostTime),
+ * or pj_get_timestamp units when running on the loopback backend (see pjmedia_snd_iphone_use_loopback).
+ *
+ * This can be used to synchronize captured audio with other media (e.g. video).
+ * The timestamp may lie in the past or the future; it's converted relative to the most recently captured audio.
+ * Returns PJ_EINVALIDOP if nothing has been captured yet.
+ *
+ * This may be safely invoked from any thread at any time.
+**/
+pj_status_t pjmedia_snd_iphone_stream_get_capture_host_time(pjmedia_snd_stream *strm,
+                                                            pj_uint32_t timestamp,
+                                                            pj_uint64_t *host_time);
+
+/**
+ * Initializes the given loopback parameters with the default values.
+**/
+void pjmedia_snd_iphone_loopback_param_default(pjmedia_snd_iphone_loopback_param *param);
+
+/**
+ * Runs the driver on the loopback backend, which doesn't need any audio hardware (or audio session).
+ * Instead, a timer thread drives the IO callbacks, with audio from and to WAV files.
+ * This allows the driver to be tested and benchmarked in the simulator, or on any other platform.
+ *
+ * Pass NULL to go back to the default backend (core audio on Apple platforms, loopback everywhere else).
+ * May be invoked before or after pjmedia_snd_init, but not while a stream is open (PJ_EBUSY).
+ * The file names are copied.
+**/
+pj_status_t pjmedia_snd_iphone_use_loopback(const pjmedia_snd_iphone_loopback_param *param);
+
+PJ_END_DECL
+
+#endif	/* __IPHONESOUND_H__ */
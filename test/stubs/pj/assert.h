@@ -0,0 +1,13 @@
+#ifndef __PJ_ASSERT_H__
+#define __PJ_ASSERT_H__
+
+#include <pj/types.h>
+#include <assert.h>
+
+#define pj_assert(expr)  assert(expr)
+
+// Like a release build of pjlib, argument checks return an error instead of asserting,
+// so the tests can exercise them
+#define PJ_ASSERT_RETURN(expr, retval)  do { if(!(expr)) return retval; } while(0)
+
+#endif
@@ -0,0 +1 @@
+#include <pj/types.h>
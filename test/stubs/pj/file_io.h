@@ -0,0 +1,27 @@
+#ifndef __PJ_FILE_IO_H__
+#define __PJ_FILE_IO_H__
+
+#include <pj/types.h>
+
+enum pj_file_access
+{
+	PJ_O_RDONLY = 0x1101,
+	PJ_O_WRONLY = 0x1102,
+	PJ_O_RDWR   = 0x1103,
+	PJ_O_APPEND = 0x1108
+};
+
+enum pj_file_seek_type
+{
+	PJ_SEEK_SET = 0x1201,
+	PJ_SEEK_CUR = 0x1202,
+	PJ_SEEK_END = 0x1203
+};
+
+pj_status_t pj_file_open(pj_pool_t *pool, const char *pathname, unsigned flags, pj_oshandle_t *fd);
+pj_status_t pj_file_close(pj_oshandle_t fd);
+pj_status_t pj_file_write(pj_oshandle_t fd, const void *data, pj_ssize_t *size);
+pj_status_t pj_file_read(pj_oshandle_t fd, void *data, pj_ssize_t *size);
+pj_status_t pj_file_setpos(pj_oshandle_t fd, long offset, enum pj_file_seek_type whence);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __PJ_LOG_H__
+#define __PJ_LOG_H__
+
+#include <pj/types.h>
+
+#define PJ_LOG(level, arg)  do { if((level) <= pj_log_get_level()) pj_log_wrapper arg; } while(0)
+
+void pj_log_wrapper(const char *sender, const char *format, ...);
+
+int pj_log_get_level(void);
+void pj_log_set_level(int level);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __PJ_OS_H__
+#define __PJ_OS_H__
+
+#include <pj/types.h>
+
+#define PJ_THREAD_DESC_SIZE  64
+#define PJ_THREAD_DEFAULT_STACK_SIZE  8192
+
+typedef long pj_thread_desc[PJ_THREAD_DESC_SIZE];
+
+typedef int (pj_thread_proc)(void *arg);
+
+pj_status_t pj_thread_create(pj_pool_t *pool,
+                             const char *thread_name,
+                             pj_thread_proc *proc,
+                             void *arg,
+                             pj_size_t stack_size,
+                             unsigned flags,
+                             pj_thread_t **thread);
+
+pj_status_t pj_thread_register(const char *thread_name, pj_thread_desc desc, pj_thread_t **thread);
+pj_bool_t pj_thread_is_registered(void);
+
+pj_status_t pj_thread_join(pj_thread_t *thread);
+pj_status_t pj_thread_destroy(pj_thread_t *thread);
+pj_status_t pj_thread_sleep(unsigned msec);
+
+pj_status_t pj_mutex_create_simple(pj_pool_t *pool, const char *name, pj_mutex_t **mutex);
+pj_status_t pj_mutex_lock(pj_mutex_t *mutex);
+pj_status_t pj_mutex_unlock(pj_mutex_t *mutex);
+pj_status_t pj_mutex_destroy(pj_mutex_t *mutex);
+
+pj_status_t pj_get_timestamp(pj_timestamp *ts);
+pj_status_t pj_get_timestamp_freq(pj_timestamp *freq);
+
+pj_uint32_t pj_elapsed_usec(const pj_timestamp *start, const pj_timestamp *stop);
+pj_uint32_t pj_elapsed_msec(const pj_timestamp *start, const pj_timestamp *stop);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __PJ_POOL_H__
+#define __PJ_POOL_H__
+
+#include <pj/types.h>
+
+#define PJ_POOL_ALIGNMENT  4
+
+typedef void pj_pool_callback(pj_pool_t *pool, pj_size_t size);
+
+/**
+ * A pool is a list of blocks. Like pjlib, the pool and its first block are carved out of
+ * the first chunk of memory, and a pool created with an increment of 0 can never grow.
+**/
+typedef struct pj_pool_block
+{
+	struct pj_pool_block *next;
+	
+	unsigned char *buf;
+	unsigned char *cur;
+	unsigned char *end;
+	
+} pj_pool_block;
+
+struct pj_pool_t
+{
+	char name[32];
+	
+	pj_pool_factory *factory;
+	
+	pj_pool_block *blocks;
+	
+	pj_size_t capacity;
+	pj_size_t increment;
+	
+	pj_pool_callback *callback;
+};
+
+struct pj_pool_factory
+{
+	// Number of pools created and not yet released (so the tests can check for leaks)
+	int poolCount;
+};
+
+pj_pool_t *pj_pool_create(pj_pool_factory *factory,
+                          const char *name,
+                          pj_size_t initial_size,
+                          pj_size_t increment_size,
+                          pj_pool_callback *callback);
+
+void pj_pool_release(pj_pool_t *pool);
+
+void *pj_pool_alloc(pj_pool_t *pool, pj_size_t size);
+void *pj_pool_zalloc(pj_pool_t *pool, pj_size_t size);
+
+pj_size_t pj_pool_get_capacity(pj_pool_t *pool);
+pj_size_t pj_pool_get_used_size(pj_pool_t *pool);
+
+#define PJ_POOL_ALLOC_T(pool, type)   ((type *)pj_pool_alloc(pool, sizeof(type)))
+#define PJ_POOL_ZALLOC_T(pool, type)  ((type *)pj_pool_zalloc(pool, sizeof(type)))
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __PJ_STRING_H__
+#define __PJ_STRING_H__
+
+#include <pj/types.h>
+
+#define pj_ansi_strlen  strlen
+#define pj_ansi_strcpy  strcpy
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * Minimal stand-in for pjlib, just enough to build and run the driver on Linux for the tests.
+ * Only what iphonesound.c uses is declared, with the same names and signatures as pjlib.
+**/
+
+#ifndef __PJ_TYPES_H__
+#define __PJ_TYPES_H__
+
+#include <stddef.h>
+#include <string.h>
+
+#define PJ_BEGIN_DECL
+#define PJ_END_DECL
+
+#define PJ_DECL(type)  type
+#define PJ_DEF(type)   type
+
+typedef int pj_status_t;
+typedef int pj_bool_t;
+
+typedef signed char        pj_int8_t;
+typedef unsigned char      pj_uint8_t;
+typedef short              pj_int16_t;
+typedef unsigned short     pj_uint16_t;
+typedef int                pj_int32_t;
+typedef unsigned int       pj_uint32_t;
+typedef long long          pj_int64_t;
+typedef unsigned long long pj_uint64_t;
+
+typedef size_t pj_size_t;
+typedef long   pj_ssize_t;
+
+#define PJ_TRUE     1
+#define PJ_FALSE    0
+#define PJ_SUCCESS  0
+
+// Error codes (same values as pjlib)
+#define PJ_ERRNO_START_STATUS  70000
+#define PJ_EUNKNOWN       (PJ_ERRNO_START_STATUS + 1)
+#define PJ_EINVAL         (PJ_ERRNO_START_STATUS + 4)
+#define PJ_ENAMETOOLONG   (PJ_ERRNO_START_STATUS + 5)
+#define PJ_ENOTFOUND      (PJ_ERRNO_START_STATUS + 6)
+#define PJ_ENOMEM         (PJ_ERRNO_START_STATUS + 7)
+#define PJ_ETOOMANY       (PJ_ERRNO_START_STATUS + 10)
+#define PJ_EBUSY          (PJ_ERRNO_START_STATUS + 11)
+#define PJ_ENOTSUP        (PJ_ERRNO_START_STATUS + 12)
+#define PJ_EINVALIDOP     (PJ_ERRNO_START_STATUS + 13)
+
+typedef union pj_timestamp
+{
+	struct
+	{
+		pj_uint32_t lo;
+		pj_uint32_t hi;
+	} u32;
+	
+	pj_uint64_t u64;
+	
+} pj_timestamp;
+
+typedef struct pj_pool_t pj_pool_t;
+typedef struct pj_pool_factory pj_pool_factory;
+typedef struct pj_thread_t pj_thread_t;
+typedef struct pj_mutex_t pj_mutex_t;
+
+typedef void *pj_oshandle_t;
+
+#define PJ_ARRAY_SIZE(a)  (sizeof(a) / sizeof((a)[0]))
+
+#define pj_bzero(dst, size)       memset((dst), 0, (size))
+#define pj_memcpy(dst, src, size) memcpy((dst), (src), (size))
+
+/**
+ * Initializes the stand-in. Registers the calling thread, like pj_init does.
+**/
+pj_status_t pj_init(void);
+
+#endif
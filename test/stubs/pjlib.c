@@ -0,0 +1,443 @@
+/**
+ * Minimal stand-in for pjlib, implemented on top of POSIX.
+ * See pj/types.h.
+**/
+
+#include <pj/types.h>
+#include <pj/pool.h>
+#include <pj/log.h>
+#include <pj/os.h>
+#include <pj/file_io.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+static __thread pj_bool_t threadRegistered = PJ_FALSE;
+
+static int logLevel = 2;
+
+pj_status_t pj_init(void)
+{
+	threadRegistered = PJ_TRUE;
+	
+	const char *level = getenv("PJ_LOG_LEVEL");
+	
+	if(level)
+	{
+		logLevel = atoi(level);
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Pools
+**/
+
+static pj_pool_block *poolBlockCreate(pj_size_t size)
+{
+	pj_pool_block *block = (pj_pool_block *)malloc(sizeof(pj_pool_block) + size);
+	
+	if(block == NULL)
+	{
+		return NULL;
+	}
+	
+	block->next = NULL;
+	block->buf  = (unsigned char *)(block + 1);
+	block->cur  = block->buf;
+	block->end  = block->buf + size;
+	
+	return block;
+}
+
+static void *poolBlockAlloc(pj_pool_block *block, pj_size_t size)
+{
+	unsigned char *p = (unsigned char *)(((pj_size_t)block->cur + PJ_POOL_ALIGNMENT - 1) & ~(pj_size_t)(PJ_POOL_ALIGNMENT - 1));
+	
+	if((p + size) > block->end)
+	{
+		return NULL;
+	}
+	
+	block->cur = p + size;
+	
+	return p;
+}
+
+pj_pool_t *pj_pool_create(pj_pool_factory *factory,
+                          const char *name,
+                          pj_size_t initial_size,
+                          pj_size_t increment_size,
+                          pj_pool_callback *callback)
+{
+	// Like pjlib, the pool itself lives at the start of its first block
+	
+	if(initial_size < sizeof(pj_pool_t))
+	{
+		initial_size = sizeof(pj_pool_t);
+	}
+	
+	pj_pool_block *block = poolBlockCreate(initial_size);
+	
+	if(block == NULL)
+	{
+		return NULL;
+	}
+	
+	pj_pool_t *pool = (pj_pool_t *)poolBlockAlloc(block, sizeof(pj_pool_t));
+	
+	snprintf(pool->name, sizeof(pool->name), "%s", name ? name : "pool");
+	
+	pool->factory   = factory;
+	pool->blocks    = block;
+	pool->capacity  = sizeof(pj_pool_block) + initial_size;
+	pool->increment = increment_size;
+	pool->callback  = callback;
+	
+	if(factory)
+	{
+		factory->poolCount++;
+	}
+	
+	return pool;
+}
+
+void pj_pool_release(pj_pool_t *pool)
+{
+	if(pool->factory)
+	{
+		pool->factory->poolCount--;
+	}
+	
+	// The pool lives in its own first block, which is the last one in the list
+	
+	pj_pool_block *block = pool->blocks;
+	
+	while(block)
+	{
+		pj_pool_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void *pj_pool_alloc(pj_pool_t *pool, pj_size_t size)
+{
+	pj_pool_block *block;
+	
+	for(block = pool->blocks; block; block = block->next)
+	{
+		void *p = poolBlockAlloc(block, size);
+		
+		if(p)
+		{
+			return p;
+		}
+	}
+	
+	if(pool->increment == 0)
+	{
+		if(pool->callback)
+		{
+			pool->callback(pool, size);
+		}
+		
+		return NULL;
+	}
+	
+	pj_size_t blockSize = pool->increment;
+	
+	if(blockSize < (size + PJ_POOL_ALIGNMENT))
+	{
+		blockSize = size + PJ_POOL_ALIGNMENT;
+	}
+	
+	block = poolBlockCreate(blockSize);
+	
+	if(block == NULL)
+	{
+		if(pool->callback)
+		{
+			pool->callback(pool, size);
+		}
+		
+		return NULL;
+	}
+	
+	// New blocks go in front (the first block, which holds the pool, stays last)
+	
+	block->next = pool->blocks;
+	pool->blocks = block;
+	pool->capacity += sizeof(pj_pool_block) + blockSize;
+	
+	return poolBlockAlloc(block, size);
+}
+
+void *pj_pool_zalloc(pj_pool_t *pool, pj_size_t size)
+{
+	void *p = pj_pool_alloc(pool, size);
+	
+	if(p)
+	{
+		memset(p, 0, size);
+	}
+	
+	return p;
+}
+
+pj_size_t pj_pool_get_capacity(pj_pool_t *pool)
+{
+	return pool->capacity;
+}
+
+pj_size_t pj_pool_get_used_size(pj_pool_t *pool)
+{
+	pj_size_t used = 0;
+	pj_pool_block *block;
+	
+	for(block = pool->blocks; block; block = block->next)
+	{
+		used += sizeof(pj_pool_block) + (block->cur - block->buf);
+	}
+	
+	return used;
+}
+
+/**
+ * Logging
+**/
+
+void pj_log_wrapper(const char *sender, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	
+	fprintf(stderr, "%-16s ", sender);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	
+	va_end(args);
+}
+
+int pj_log_get_level(void)
+{
+	return logLevel;
+}
+
+void pj_log_set_level(int level)
+{
+	logLevel = level;
+}
+
+/**
+ * Threads
+**/
+
+struct pj_thread_t
+{
+	pthread_t thread;
+	pj_thread_proc *proc;
+	void *arg;
+};
+
+static void *threadMain(void *arg)
+{
+	pj_thread_t *thread = (pj_thread_t *)arg;
+	
+	threadRegistered = PJ_TRUE;
+	thread->proc(thread->arg);
+	
+	return NULL;
+}
+
+pj_status_t pj_thread_create(pj_pool_t *pool,
+                             const char *thread_name,
+                             pj_thread_proc *proc,
+                             void *arg,
+                             pj_size_t stack_size,
+                             unsigned flags,
+                             pj_thread_t **p_thread)
+{
+	pj_thread_t *thread = PJ_POOL_ZALLOC_T(pool, pj_thread_t);
+	
+	if(thread == NULL)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	thread->proc = proc;
+	thread->arg  = arg;
+	
+	if(pthread_create(&thread->thread, NULL, threadMain, thread) != 0)
+	{
+		return PJ_EUNKNOWN;
+	}
+	
+	*p_thread = thread;
+	return PJ_SUCCESS;
+}
+
+// What pj_thread_register returns, so tests can make it fail
+pj_status_t stubThreadRegisterStatus = PJ_SUCCESS;
+
+pj_status_t pj_thread_register(const char *thread_name, pj_thread_desc desc, pj_thread_t **thread)
+{
+	if(stubThreadRegisterStatus != PJ_SUCCESS)
+	{
+		return stubThreadRegisterStatus;
+	}
+	
+	threadRegistered = PJ_TRUE;
+	
+	*thread = (pj_thread_t *)desc;
+	return PJ_SUCCESS;
+}
+
+pj_bool_t pj_thread_is_registered(void)
+{
+	return threadRegistered;
+}
+
+pj_status_t pj_thread_join(pj_thread_t *thread)
+{
+	return (pthread_join(thread->thread, NULL) == 0) ? PJ_SUCCESS : PJ_EINVALIDOP;
+}
+
+pj_status_t pj_thread_destroy(pj_thread_t *thread)
+{
+	return PJ_SUCCESS;
+}
+
+pj_status_t pj_thread_sleep(unsigned msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000L };
+	
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Mutexes
+**/
+
+struct pj_mutex_t
+{
+	pthread_mutex_t mutex;
+};
+
+pj_status_t pj_mutex_create_simple(pj_pool_t *pool, const char *name, pj_mutex_t **p_mutex)
+{
+	pj_mutex_t *mutex = PJ_POOL_ZALLOC_T(pool, pj_mutex_t);
+	
+	if(mutex == NULL)
+	{
+		return PJ_ENOMEM;
+	}
+	
+	pthread_mutex_init(&mutex->mutex, NULL);
+	
+	*p_mutex = mutex;
+	return PJ_SUCCESS;
+}
+
+pj_status_t pj_mutex_lock(pj_mutex_t *mutex)
+{
+	return (pthread_mutex_lock(&mutex->mutex) == 0) ? PJ_SUCCESS : PJ_EINVALIDOP;
+}
+
+pj_status_t pj_mutex_unlock(pj_mutex_t *mutex)
+{
+	return (pthread_mutex_unlock(&mutex->mutex) == 0) ? PJ_SUCCESS : PJ_EINVALIDOP;
+}
+
+pj_status_t pj_mutex_destroy(pj_mutex_t *mutex)
+{
+	pthread_mutex_destroy(&mutex->mutex);
+	return PJ_SUCCESS;
+}
+
+/**
+ * Timestamps (nanoseconds of the monotonic clock)
+**/
+
+pj_status_t pj_get_timestamp(pj_timestamp *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	ts->u64 = ((pj_uint64_t)now.tv_sec * 1000000000ULL) + (pj_uint64_t)now.tv_nsec;
+	return PJ_SUCCESS;
+}
+
+pj_status_t pj_get_timestamp_freq(pj_timestamp *freq)
+{
+	freq->u64 = 1000000000ULL;
+	return PJ_SUCCESS;
+}
+
+pj_uint32_t pj_elapsed_usec(const pj_timestamp *start, const pj_timestamp *stop)
+{
+	return (pj_uint32_t)((stop->u64 - start->u64) / 1000);
+}
+
+pj_uint32_t pj_elapsed_msec(const pj_timestamp *start, const pj_timestamp *stop)
+{
+	return (pj_uint32_t)((stop->u64 - start->u64) / 1000000);
+}
+
+/**
+ * File IO
+**/
+
+pj_status_t pj_file_open(pj_pool_t *pool, const char *pathname, unsigned flags, pj_oshandle_t *fd)
+{
+	const char *mode;
+	
+	switch(flags)
+	{
+		case PJ_O_RDONLY : mode = "rb";  break;
+		case PJ_O_WRONLY : mode = "wb";  break;
+		case PJ_O_RDWR   : mode = "r+b"; break;
+		default          : mode = "ab";  break;
+	}
+	
+	FILE *file = fopen(pathname, mode);
+	
+	if(file == NULL)
+	{
+		return PJ_ENOTFOUND;
+	}
+	
+	*fd = file;
+	return PJ_SUCCESS;
+}
+
+pj_status_t pj_file_close(pj_oshandle_t fd)
+{
+	return (fclose((FILE *)fd) == 0) ? PJ_SUCCESS : PJ_EUNKNOWN;
+}
+
+pj_status_t pj_file_write(pj_oshandle_t fd, const void *data, pj_ssize_t *size)
+{
+	*size = (pj_ssize_t)fwrite(data, 1, (size_t)*size, (FILE *)fd);
+	return ferror((FILE *)fd) ? PJ_EUNKNOWN : PJ_SUCCESS;
+}
+
+pj_status_t pj_file_read(pj_oshandle_t fd, void *data, pj_ssize_t *size)
+{
+	*size = (pj_ssize_t)fread(data, 1, (size_t)*size, (FILE *)fd);
+	return ferror((FILE *)fd) ? PJ_EUNKNOWN : PJ_SUCCESS;
+}
+
+pj_status_t pj_file_setpos(pj_oshandle_t fd, long offset, enum pj_file_seek_type whence)
+{
+	int origin = (whence == PJ_SEEK_SET) ? SEEK_SET : ((whence == PJ_SEEK_CUR) ? SEEK_CUR : SEEK_END);
+	
+	return (fseek((FILE *)fd, offset, origin) == 0) ? PJ_SUCCESS : PJ_EUNKNOWN;
+}
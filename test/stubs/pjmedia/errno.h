@@ -0,0 +1,18 @@
+#ifndef __PJMEDIA_ERRNO_H__
+#define __PJMEDIA_ERRNO_H__
+
+#include <pj/types.h>
+
+#define PJMEDIA_ERRNO_START  220000
+
+#define PJMEDIA_ENCCLOCKRATE      (PJMEDIA_ERRNO_START + 70)
+#define PJMEDIA_ENCSAMPLESPFRAME  (PJMEDIA_ERRNO_START + 71)
+#define PJMEDIA_ENCTYPE           (PJMEDIA_ERRNO_START + 72)
+#define PJMEDIA_ENCBITS           (PJMEDIA_ERRNO_START + 73)
+#define PJMEDIA_ENCBYTES          (PJMEDIA_ERRNO_START + 74)
+#define PJMEDIA_ENCCHANNEL        (PJMEDIA_ERRNO_START + 75)
+#define PJMEDIA_ENOTCOMPATIBLE    (PJMEDIA_ERRNO_START + 76)
+#define PJMEDIA_ENOSNDREC         (PJMEDIA_ERRNO_START + 100)
+#define PJMEDIA_ENOSNDPLAY        (PJMEDIA_ERRNO_START + 101)
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __PJMEDIA_SOUND_H__
+#define __PJMEDIA_SOUND_H__
+
+#include <pj/types.h>
+#include <pj/pool.h>
+
+typedef enum pjmedia_dir
+{
+	PJMEDIA_DIR_NONE              = 0,
+	PJMEDIA_DIR_ENCODING          = 1,
+	PJMEDIA_DIR_CAPTURE           = PJMEDIA_DIR_ENCODING,
+	PJMEDIA_DIR_DECODING          = 2,
+	PJMEDIA_DIR_PLAYBACK          = PJMEDIA_DIR_DECODING,
+	PJMEDIA_DIR_ENCODING_DECODING = 3,
+	PJMEDIA_DIR_CAPTURE_PLAYBACK  = PJMEDIA_DIR_ENCODING_DECODING
+	
+} pjmedia_dir;
+
+typedef struct pjmedia_snd_stream pjmedia_snd_stream;
+
+typedef struct pjmedia_snd_dev_info
+{
+	char name[64];
+	unsigned input_count;
+	unsigned output_count;
+	unsigned default_samples_per_sec;
+	
+} pjmedia_snd_dev_info;
+
+typedef struct pjmedia_snd_stream_info
+{
+	pjmedia_dir dir;
+	int play_id;
+	int rec_id;
+	unsigned clock_rate;
+	unsigned channel_count;
+	unsigned samples_per_frame;
+	unsigned bits_per_sample;
+	unsigned rec_latency;
+	unsigned play_latency;
+	
+} pjmedia_snd_stream_info;
+
+typedef pj_status_t (*pjmedia_snd_play_cb)(void *user_data, pj_uint32_t timestamp, void *output, unsigned size);
+typedef pj_status_t (*pjmedia_snd_rec_cb)(void *user_data, pj_uint32_t timestamp, void *input, unsigned size);
+
+#define PJMEDIA_SND_DEFAULT_REC_LATENCY   100
+#define PJMEDIA_SND_DEFAULT_PLAY_LATENCY  100
+
+pj_status_t pjmedia_snd_init(pj_pool_factory *factory);
+pj_status_t pjmedia_snd_deinit(void);
+
+int pjmedia_snd_get_dev_count(void);
+const pjmedia_snd_dev_info *pjmedia_snd_get_dev_info(unsigned index);
+
+pj_status_t pjmedia_snd_open_rec(int index, unsigned clock_rate, unsigned channel_count, unsigned samples_per_frame,
+                                 unsigned bits_per_sample, pjmedia_snd_rec_cb rec_cb, void *user_data,
+                                 pjmedia_snd_stream **p_snd_strm);
+
+pj_status_t pjmedia_snd_open_player(int index, unsigned clock_rate, unsigned channel_count, unsigned samples_per_frame,
+                                    unsigned bits_per_sample, pjmedia_snd_play_cb play_cb, void *user_data,
+                                    pjmedia_snd_stream **p_snd_strm);
+
+pj_status_t pjmedia_snd_open(int rec_id, int play_id, unsigned clock_rate, unsigned channel_count,
+                             unsigned samples_per_frame, unsigned bits_per_sample,
+                             pjmedia_snd_rec_cb rec_cb, pjmedia_snd_play_cb play_cb, void *user_data,
+                             pjmedia_snd_stream **p_snd_strm);
+
+pj_status_t pjmedia_snd_stream_get_info(pjmedia_snd_stream *strm, pjmedia_snd_stream_info *pi);
+pj_status_t pjmedia_snd_stream_start(pjmedia_snd_stream *stream);
+pj_status_t pjmedia_snd_stream_stop(pjmedia_snd_stream *stream);
+pj_status_t pjmedia_snd_stream_close(pjmedia_snd_stream *stream);
+
+pj_status_t pjmedia_snd_set_latency(unsigned input_latency, unsigned output_latency);
+
+// The audio session hooks of the iPhone port of pjmedia
+
+typedef struct pjmedia_snd_audio_session_callback
+{
+	void (*startAudioSession)(pj_uint32_t category);
+	void (*stopAudioSession)(void);
+	
+} pjmedia_snd_audio_session_callback;
+
+void pjmedia_snd_audio_session_set_callbacks(pjmedia_snd_audio_session_callback *cb);
+void pjmedia_snd_audio_session_interruption(void *userData, pj_uint32_t interruptionState);
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * Helpers shared by the driver tests and benchmarks.
+ *
+ * Every test program includes iphonesound.c directly (before this file), so it can drive the driver's
+ * internal components (the reframer, the rings, the resampler...) as well as its public API.
+ *
+ * A test program runs its tests when invoked without arguments, and its benchmarks when invoked with --bench.
+**/
+
+#ifndef __IPHONESOUND_TEST_H__
+#define __IPHONESOUND_TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int testFailures = 0;
+
+// Checks a condition inside a test function (which returns void), and fails the test if it doesn't hold.
+#define CHECK(expr)  \
+	do { if(!(expr)) { testFail(__FILE__, __LINE__, #expr); return; } } while(0)
+
+// Same as CHECK, but prints some context when the check fails.
+#define CHECK_MSG(expr, ...)  \
+	do { if(!(expr)) { testFail(__FILE__, __LINE__, #expr); fprintf(stderr, "    " __VA_ARGS__); fprintf(stderr, "\n"); return; } } while(0)
+
+#define RUN_TEST(test)  testRun(#test, test)
+
+static void testFail(const char *file, int line, const char *expr)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+	testFailures++;
+}
+
+static void testRun(const char *name, void (*test)(void))
+{
+	int failures = testFailures;
+	
+	test();
+	
+	printf("%-48s %s\n", name, (testFailures == failures) ? "ok" : "FAILED");
+	fflush(stdout);
+}
+
+/**
+ * Prints the summary, and returns the exit status of the test program.
+**/
+static int testSummary(void)
+{
+	if(testFailures > 0)
+	{
+		printf("%d check(s) failed\n", testFailures);
+		return 1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Whether the test program was asked to run its benchmarks instead of its tests.
+**/
+static __attribute__((unused)) int benchRequested(int argc, char **argv)
+{
+	return (argc > 1) && (strcmp(argv[1], "--bench") == 0);
+}
+
+/**
+ * Returns the time of the monotonic clock, in seconds.
+**/
+static __attribute__((unused)) double benchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/**
+ * Returns the next value of a deterministic pseudo random sequence (32-bit xorshift).
+ * The state must not be zero.
+**/
+static __attribute__((unused)) unsigned testRandom(unsigned *state)
+{
+	unsigned x = *state;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	
+	*state = x;
+	return x;
+}
+
+/**
+ * Fills a buffer with pseudo random samples, including the extremes of the 16-bit range.
+**/
+static __attribute__((unused)) void testRandomSamples(pj_int16_t *samples, unsigned numSamples, unsigned *state)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		unsigned r = testRandom(state);
+		
+		switch(r % 16)
+		{
+			case 0  : samples[i] = -32768; break;
+			case 1  : samples[i] = 32767;  break;
+			default : samples[i] = (pj_int16_t)(r >> 8); break;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,540 @@
+/**
+ * Tests and benchmarks of the sample conversion kernels.
+ *
+ * Each kernel must be bit-exact with a plain per-sample loop, whatever vector unit it was compiled for
+ * (NEON, SSE2, or none), for any length and any alignment. For float to 16 bits without dither, that loop
+ * rounds with lrintf (to nearest, ties to even), so every vector unit has to round ties the same way.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define TEST_MAX_SAMPLES  4096
+
+/**
+ * The mono to stereo loop of the original render callback, which duplicated one sample at a time.
+**/
+static void __attribute__((noinline)) referenceMonoToStereo(pj_int16_t *dst, const pj_int16_t *src, unsigned numFrames)
+{
+	pj_uint16_t *audioBuffer = (pj_uint16_t *)dst;
+	const pj_uint16_t *outputBuffer = (const pj_uint16_t *)src;
+	
+	unsigned audioBufferSize = numFrames * 4;
+	unsigned outputBufferSize = numFrames * 2;
+	
+	while((outputBufferSize > 0) && (audioBufferSize > 0))
+	{
+		*audioBuffer++ = *outputBuffer;
+		*audioBuffer++ = *outputBuffer++;
+		
+		audioBufferSize -= 4;
+		outputBufferSize -= 2;
+	}
+}
+
+/**
+ * The stereo to mono loop of the original input callback, which took every other sample.
+**/
+static void __attribute__((noinline)) referenceStereoToMono(pj_int16_t *dst, const pj_int16_t *src, unsigned numFrames)
+{
+	pj_uint16_t *inputBuffer = (pj_uint16_t *)dst;
+	const pj_uint16_t *audioBuffer = (const pj_uint16_t *)src;
+	
+	unsigned inputBufferSize = numFrames * 2;
+	unsigned audioBufferSize = numFrames * 4;
+	
+	while((inputBufferSize > 0) && (audioBufferSize > 0))
+	{
+		*inputBuffer = *audioBuffer;
+		
+		inputBuffer += 1;
+		audioBuffer += 2;
+		
+		inputBufferSize -= 2;
+		audioBufferSize -= 4;
+	}
+}
+
+static pj_int16_t testInput[(TEST_MAX_SAMPLES * 2) + 16];
+static pj_int16_t testExpected[(TEST_MAX_SAMPLES * 2) + 16];
+static pj_int16_t testActual[(TEST_MAX_SAMPLES * 2) + 16];
+
+typedef void (*test_channel_kernel)(pj_int16_t *dst, const pj_int16_t *src, unsigned numFrames);
+
+/**
+ * Runs a channel conversion kernel and its reference loop on the same random input,
+ * for every length up to 64 frames (and a few long ones), and every sample offset within a vector.
+ * Samples just past the end of the output must be left alone.
+**/
+static int testChannelKernel(test_channel_kernel kernel, test_channel_kernel reference, unsigned dstChannels)
+{
+	static const unsigned longLengths[] = { 160, 320, 882, 960, 4093 };
+	
+	unsigned state = 0x2545f491;
+	unsigned length, offset;
+	
+	for(length = 0; length < (64 + PJ_ARRAY_SIZE(longLengths)); length++)
+	{
+		unsigned numFrames = (length < 64) ? length : longLengths[length - 64];
+		
+		for(offset = 0; offset < 8; offset++)
+		{
+			testRandomSamples(testInput, PJ_ARRAY_SIZE(testInput), &state);
+			
+			// Both outputs start out with the same garbage, so any stray write shows
+			
+			testRandomSamples(testExpected, PJ_ARRAY_SIZE(testExpected), &state);
+			memcpy(testActual, testExpected, sizeof(testActual));
+			
+			reference(testExpected + offset, testInput + offset, numFrames);
+			kernel(testActual + offset, testInput + offset, numFrames);
+			
+			if(memcmp(testActual, testExpected, sizeof(testActual)) != 0)
+			{
+				unsigned i;
+				for(i = 0; testActual[i] == testExpected[i]; i++);
+				
+				fprintf(stderr, "    %u frames at offset %u: sample %u is %d, expected %d (output has %u channels)\n",
+				        numFrames, offset, i, testActual[i], testExpected[i], dstChannels);
+				return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+static void testMonoToStereo(void)
+{
+	CHECK(testChannelKernel(monoToStereo, referenceMonoToStereo, 2));
+}
+
+static void testStereoToMono(void)
+{
+	CHECK(testChannelKernel(stereoToMono, referenceStereoToMono, 1));
+}
+
+/**
+ * copyFrames picks the right kernel for each channel combination.
+**/
+static void testCopyFrames(void)
+{
+	unsigned state = 0x9e3779b9;
+	testRandomSamples(testInput, 2 * 320, &state);
+	
+	copyFrames(testActual, 2, testInput, 1, 320);
+	referenceMonoToStereo(testExpected, testInput, 320);
+	CHECK(memcmp(testActual, testExpected, 2 * 320 * sizeof(pj_int16_t)) == 0);
+	
+	copyFrames(testActual, 1, testInput, 2, 320);
+	referenceStereoToMono(testExpected, testInput, 320);
+	CHECK(memcmp(testActual, testExpected, 320 * sizeof(pj_int16_t)) == 0);
+	
+	copyFrames(testActual, 2, testInput, 2, 320);
+	CHECK(memcmp(testActual, testInput, 2 * 320 * sizeof(pj_int16_t)) == 0);
+}
+
+// Sample format conversion
+
+static float testFloatInput[TEST_MAX_SAMPLES + 16];
+static float testFloatExpected[TEST_MAX_SAMPLES + 16];
+static float testFloatActual[TEST_MAX_SAMPLES + 16];
+
+static pj_int32_t testInt32Input[TEST_MAX_SAMPLES + 16];
+static pj_int32_t testInt32Expected[TEST_MAX_SAMPLES + 16];
+static pj_int32_t testInt32Actual[TEST_MAX_SAMPLES + 16];
+
+static void __attribute__((noinline)) referenceInt16ToFloat(float *dst, const pj_int16_t *src, unsigned numSamples)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		dst[i] = src[i] / 32768.0f;
+	}
+}
+
+static void __attribute__((noinline)) referenceFloatToInt16(pj_int16_t *dst, const float *src, unsigned numSamples)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		float value = src[i] * 32768.0f;
+		
+		if(value > 32767.0f)  value = 32767.0f;
+		if(value < -32768.0f) value = -32768.0f;
+		
+		dst[i] = (pj_int16_t)lrintf(value);
+	}
+}
+
+static void __attribute__((noinline)) referenceInt16ToInt32(pj_int32_t *dst, const pj_int16_t *src, unsigned numSamples)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		dst[i] = (pj_int32_t)src[i] * 65536;
+	}
+}
+
+static void __attribute__((noinline)) referenceInt32ToInt16(pj_int16_t *dst, const pj_int32_t *src, unsigned numSamples)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		pj_int64_t rounded = ((pj_int64_t)src[i] + 0x8000) >> 16;
+		
+		dst[i] = (pj_int16_t)((rounded > 32767) ? 32767 : rounded);
+	}
+}
+
+/**
+ * Fills a buffer with float samples that are hard to round: exact halves (which must round to even),
+ * values just either side of them, the limits of the 16-bit range and beyond, and plain random ones.
+**/
+static void testRandomFloats(float *samples, unsigned numSamples, unsigned *state)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		unsigned r = testRandom(state);
+		float half = ((float)(pj_int16_t)(r >> 16) + 0.5f) / 32768.0f;
+		
+		switch(r % 8)
+		{
+			case 0  : samples[i] = half; break;
+			case 1  : samples[i] = nextafterf(half, 2.0f); break;
+			case 2  : samples[i] = nextafterf(half, -2.0f); break;
+			case 3  : samples[i] = ((r >> 3) & 1) ? 32767.5f / 32768.0f : -32768.5f / 32768.0f; break;
+			case 4  : samples[i] = ((r >> 3) & 1) ? 3.0f : -3.0f; break;
+			default : samples[i] = ((float)(r >> 8) / 8388608.0f) - 1.0f; break;
+		}
+	}
+}
+
+#define TEST_LENGTHS  (64 + 5)
+
+static unsigned testLength(unsigned length)
+{
+	static const unsigned longLengths[] = { 160, 320, 882, 960, 4093 };
+	
+	return (length < 64) ? length : longLengths[length - 64];
+}
+
+static void testInt16ToFloat(void)
+{
+	unsigned state = 0x51ed270b;
+	unsigned length, offset;
+	
+	for(length = 0; length < TEST_LENGTHS; length++)
+	{
+		for(offset = 0; offset < 8; offset++)
+		{
+			unsigned numSamples = testLength(length);
+			
+			testRandomSamples(testInput, PJ_ARRAY_SIZE(testInput), &state);
+			testRandomFloats(testFloatExpected, PJ_ARRAY_SIZE(testFloatExpected), &state);
+			memcpy(testFloatActual, testFloatExpected, sizeof(testFloatActual));
+			
+			referenceInt16ToFloat(testFloatExpected + offset, testInput, numSamples);
+			int16ToFloat(testFloatActual + offset, testInput, numSamples);
+			
+			CHECK_MSG(memcmp(testFloatActual, testFloatExpected, sizeof(testFloatActual)) == 0,
+			          "%u samples at offset %u", numSamples, offset);
+		}
+	}
+}
+
+/**
+ * Without dither, floatToInt16 rounds and saturates exactly like lrintf with clamping.
+**/
+static void testFloatToInt16(void)
+{
+	unsigned state = 0x3c6ef372;
+	unsigned length, offset;
+	
+	for(length = 0; length < TEST_LENGTHS; length++)
+	{
+		for(offset = 0; offset < 8; offset++)
+		{
+			unsigned numSamples = testLength(length);
+			
+			testRandomFloats(testFloatInput, PJ_ARRAY_SIZE(testFloatInput), &state);
+			testRandomSamples(testExpected, PJ_ARRAY_SIZE(testExpected), &state);
+			memcpy(testActual, testExpected, sizeof(testActual));
+			
+			referenceFloatToInt16(testExpected + offset, testFloatInput, numSamples);
+			floatToInt16(testActual + offset, testFloatInput, numSamples, NULL);
+			
+			if(memcmp(testActual, testExpected, sizeof(testActual)) != 0)
+			{
+				unsigned i;
+				for(i = 0; testActual[i] == testExpected[i]; i++);
+				
+				CHECK_MSG(0, "%u samples at offset %u: sample %u (%.9g) is %d, expected %d", numSamples, offset, i,
+				          testFloatInput[i - offset] * 32768.0f, testActual[i], testExpected[i]);
+			}
+		}
+	}
+}
+
+/**
+ * Every 16-bit value survives the trip to float and back.
+**/
+static void testFloatRoundTrip(void)
+{
+	static pj_int16_t samples[65536];
+	static float floats[65536];
+	static pj_int16_t result[65536];
+	
+	unsigned i;
+	
+	for(i = 0; i < 65536; i++)
+	{
+		samples[i] = (pj_int16_t)(i - 32768);
+	}
+	
+	int16ToFloat(floats, samples, 65536);
+	floatToInt16(result, floats, 65536, NULL);
+	
+	CHECK(memcmp(result, samples, sizeof(samples)) == 0);
+}
+
+/**
+ * With dither, every sample stays within 1.5 LSB of the input, and on average the dither
+ * lets a level between two 16-bit values through (which plain rounding would lose).
+**/
+static void testFloatToInt16Dither(void)
+{
+	static const float levels[] = { 0.0f, 0.25f, -0.25f, 0.5f, 1000.3f, -20000.7f };
+	
+	pj_uint32_t dither[DITHER_LANES];
+	unsigned i, k, n;
+	
+	ditherInit(dither);
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(levels); k++)
+	{
+		for(i = 0; i < TEST_MAX_SAMPLES; i++)
+		{
+			testFloatInput[i] = levels[k] / 32768.0f;
+		}
+		
+		double sum = 0, mean;
+		
+		for(n = 0; n < 64; n++)
+		{
+			// An odd length, so the scalar tail is used as well
+			floatToInt16(testActual, testFloatInput, TEST_MAX_SAMPLES - 3, dither);
+			
+			for(i = 0; i < TEST_MAX_SAMPLES - 3; i++)
+			{
+				CHECK_MSG(fabsf(testActual[i] - levels[k]) <= 1.5f, "level %g: sample %d", levels[k], testActual[i]);
+				sum += testActual[i];
+			}
+		}
+		
+		mean = sum / (64.0 * (TEST_MAX_SAMPLES - 3));
+		
+		CHECK_MSG(fabs(mean - levels[k]) < 0.01, "level %g comes out at %.4f on average", levels[k], mean);
+	}
+}
+
+static void testInt16ToInt32(void)
+{
+	unsigned state = 0xa54ff53a;
+	unsigned length, offset, i;
+	
+	for(length = 0; length < TEST_LENGTHS; length++)
+	{
+		for(offset = 0; offset < 8; offset++)
+		{
+			unsigned numSamples = testLength(length);
+			
+			testRandomSamples(testInput, PJ_ARRAY_SIZE(testInput), &state);
+			
+			for(i = 0; i < PJ_ARRAY_SIZE(testInt32Expected); i++)
+			{
+				testInt32Expected[i] = (pj_int32_t)testRandom(&state);
+			}
+			memcpy(testInt32Actual, testInt32Expected, sizeof(testInt32Actual));
+			
+			referenceInt16ToInt32(testInt32Expected + offset, testInput, numSamples);
+			int16ToInt32(testInt32Actual + offset, testInput, numSamples);
+			
+			CHECK_MSG(memcmp(testInt32Actual, testInt32Expected, sizeof(testInt32Actual)) == 0,
+			          "%u samples at offset %u", numSamples, offset);
+		}
+	}
+}
+
+/**
+ * int32ToInt16 rounds to the nearest 16-bit value, halves up, and saturates at the top of the range.
+ * Besides random values, that's checked with exact halves, values just either side of them, and the limits.
+**/
+static void testInt32ToInt16(void)
+{
+	unsigned state = 0x510e527f;
+	unsigned length, offset, i;
+	
+	for(length = 0; length < TEST_LENGTHS; length++)
+	{
+		for(offset = 0; offset < 8; offset++)
+		{
+			unsigned numSamples = testLength(length);
+			
+			for(i = 0; i < PJ_ARRAY_SIZE(testInt32Input); i++)
+			{
+				unsigned r = testRandom(&state);
+				
+				switch(r % 8)
+				{
+					case 0  : testInt32Input[i] = (pj_int32_t)0x80000000u; break;
+					case 1  : testInt32Input[i] = (pj_int32_t)(0x7fff8000u + (testRandom(&state) % 0x8000)); break;
+					case 2  : testInt32Input[i] = (pj_int32_t)((r & 0xffff0000u) | 0x8000) - 1 + (int)(testRandom(&state) % 3); break;
+					default : testInt32Input[i] = (pj_int32_t)r; break;
+				}
+			}
+			
+			testRandomSamples(testExpected, PJ_ARRAY_SIZE(testExpected), &state);
+			memcpy(testActual, testExpected, sizeof(testActual));
+			
+			referenceInt32ToInt16(testExpected + offset, testInt32Input, numSamples);
+			int32ToInt16(testActual + offset, testInt32Input, numSamples);
+			
+			CHECK_MSG(memcmp(testActual, testExpected, sizeof(testActual)) == 0,
+			          "%u samples at offset %u", numSamples, offset);
+		}
+	}
+}
+
+// Benchmarks
+
+#define BENCH_ITERATIONS  200000
+
+/**
+ * Returns the time one call of a kernel takes, in nanoseconds.
+**/
+static double benchKernel(test_channel_kernel kernel, unsigned numFrames)
+{
+	unsigned i;
+	double start = benchNow();
+	
+	for(i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		kernel(testActual, testInput, numFrames);
+		
+		// Keep the compiler from hoisting the call out of the loop
+		__asm__ __volatile__("" : : "r"(testActual) : "memory");
+	}
+	
+	return ((benchNow() - start) * 1e9) / BENCH_ITERATIONS;
+}
+
+static void benchChannelKernels(void)
+{
+	static const unsigned packetSamples[] = { 160, 320, 960 };
+	unsigned i;
+
+#if USE_NEON
+	const char *unit = "NEON";
+#elif USE_SSE2
+	const char *unit = "SSE2";
+#else
+	const char *unit = "scalar";
+#endif
+
+	printf("channel conversion, ns per packet (%s vs the original per-sample loops)\n", unit);
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(packetSamples); i++)
+	{
+		unsigned n = packetSamples[i];
+		
+		printf("  %4u samples   mono->stereo %7.1f (loop %7.1f)   stereo->mono %7.1f (loop %7.1f)\n", n,
+		       benchKernel(monoToStereo, n), benchKernel(referenceMonoToStereo, n),
+		       benchKernel(stereoToMono, n), benchKernel(referenceStereoToMono, n));
+	}
+}
+
+// Each kernel converts a packet of 960 samples (20 ms of 48 kHz mono) from the input buffers into the output buffers
+#define BENCH_SAMPLES  960
+
+static pj_uint32_t benchDither[DITHER_LANES];
+
+static void benchInt16ToFloat(void)         { int16ToFloat(testFloatActual, testInput, BENCH_SAMPLES); }
+static void benchInt16ToFloatLoop(void)     { referenceInt16ToFloat(testFloatActual, testInput, BENCH_SAMPLES); }
+static void benchFloatToInt16(void)         { floatToInt16(testActual, testFloatInput, BENCH_SAMPLES, NULL); }
+static void benchFloatToInt16Dither(void)   { floatToInt16(testActual, testFloatInput, BENCH_SAMPLES, benchDither); }
+static void benchFloatToInt16Loop(void)     { referenceFloatToInt16(testActual, testFloatInput, BENCH_SAMPLES); }
+static void benchInt16ToInt32(void)         { int16ToInt32(testInt32Actual, testInput, BENCH_SAMPLES); }
+static void benchInt16ToInt32Loop(void)     { referenceInt16ToInt32(testInt32Actual, testInput, BENCH_SAMPLES); }
+static void benchInt32ToInt16(void)         { int32ToInt16(testActual, testInt32Input, BENCH_SAMPLES); }
+static void benchInt32ToInt16Loop(void)     { referenceInt32ToInt16(testActual, testInt32Input, BENCH_SAMPLES); }
+
+/**
+ * Returns the time a format conversion takes, in nanoseconds per sample.
+**/
+static double benchFormat(void (*convert)(void))
+{
+	unsigned i;
+	double start = benchNow();
+	
+	for(i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		convert();
+		__asm__ __volatile__("" : : : "memory");
+	}
+	
+	return ((benchNow() - start) * 1e9) / ((double)BENCH_ITERATIONS * BENCH_SAMPLES);
+}
+
+static void benchFormatKernels(void)
+{
+	unsigned state = 0x6a09e667;
+	unsigned i;
+	
+	testRandomSamples(testInput, BENCH_SAMPLES, &state);
+	testRandomFloats(testFloatInput, BENCH_SAMPLES, &state);
+	
+	for(i = 0; i < BENCH_SAMPLES; i++)
+	{
+		testInt32Input[i] = (pj_int32_t)testRandom(&state);
+	}
+	
+	ditherInit(benchDither);
+	
+	printf("sample format conversion, ns per sample (vectorized vs per-sample loop)\n");
+	printf("  int16 -> float         %6.3f (loop %6.3f)\n", benchFormat(benchInt16ToFloat), benchFormat(benchInt16ToFloatLoop));
+	printf("  float -> int16         %6.3f (loop %6.3f)\n", benchFormat(benchFloatToInt16), benchFormat(benchFloatToInt16Loop));
+	printf("  float -> int16, dither %6.3f\n", benchFormat(benchFloatToInt16Dither));
+	printf("  int16 -> int32         %6.3f (loop %6.3f)\n", benchFormat(benchInt16ToInt32), benchFormat(benchInt16ToInt32Loop));
+	printf("  int32 -> int16         %6.3f (loop %6.3f)\n", benchFormat(benchInt32ToInt16), benchFormat(benchInt32ToInt16Loop));
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(benchRequested(argc, argv))
+	{
+		benchChannelKernels();
+		benchFormatKernels();
+		return 0;
+	}
+	
+	RUN_TEST(testMonoToStereo);
+	RUN_TEST(testStereoToMono);
+	RUN_TEST(testCopyFrames);
+	RUN_TEST(testInt16ToFloat);
+	RUN_TEST(testFloatToInt16);
+	RUN_TEST(testFloatRoundTrip);
+	RUN_TEST(testFloatToInt16Dither);
+	RUN_TEST(testInt16ToInt32);
+	RUN_TEST(testInt32ToInt16);
+	
+	return testSummary();
+}
@@ -0,0 +1,305 @@
+/**
+ * Simulation of the clock drift compensation, with the capture and render clocks skewed by up to ±200 ppm.
+ *
+ * The simulation runs the driver's own clock estimators, drift controller and variable input resampler,
+ * the way the IO callbacks drive them. Each side of the hardware delivers IO cycles of a fixed number of frames
+ * at its actual rate, stamped with its own sample time and a slightly jittery host time. The capture side
+ * resamples what it gets to the pjsip rate, while the render side consumes frames at the nominal ratio.
+ * The difference between the frames captured and rendered is what pjsip's delay buffer has to absorb,
+ * so that's what we watch. Everything runs on simulated time, so it's exact and repeatable.
+ *
+ * Run with --bench to print the fill of each scenario, with and without compensation.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define SIM_HW_RATE      44100
+#define SIM_CLOCK_RATE   16000
+#define SIM_IO_FRAMES    1024
+
+// A 20 ms packet at the pjsip rate
+#define SIM_PACKET_FRAMES  (SIM_CLOCK_RATE / 50)
+
+// Host time is in nanoseconds, and every IO cycle is stamped up to 200 usec late
+#define SIM_HOST_TICKS   1e9
+#define SIM_HOST_JITTER  200000
+
+// The input resampler is as short as the options allow, which keeps the simulation quick.
+// The filter length doesn't change how many frames come out.
+#define SIM_FILTER_LENGTH  16
+
+#define SIM_SECONDS  600
+
+static pj_pool_factory testFactory;
+
+typedef struct sim_scenario
+{
+	const char *name;
+	
+	// How far each clock is off its nominal rate, in parts per million
+	double capturePpm;
+	double renderPpm;
+	
+} sim_scenario;
+
+static const sim_scenario simScenarios[] =
+{
+	{ "capture +200 ppm",            200,    0 },
+	{ "capture -200 ppm",           -200,    0 },
+	{ "render +200 ppm",               0,  200 },
+	{ "render -200 ppm",               0, -200 },
+	{ "capture +100, render -100",   100, -100 },
+	{ "both +200 ppm (same clock)",  200,  200 },
+};
+
+/**
+ * The outcome of a simulation.
+**/
+typedef struct sim_result
+{
+	// How far the difference between captured and rendered frames strayed from where it started,
+	// over the whole run, and over the last minute
+	pj_int32_t maxDeviation;
+	pj_int32_t finalMaxDeviation;
+	
+	// The deviation at the end of the run
+	pj_int32_t finalDeviation;
+	
+	// What the clock estimators measured, and the correction applied at the end
+	pj_int32_t capturePpb;
+	pj_int32_t renderPpb;
+	pj_int32_t correction;
+	
+} sim_result;
+
+/**
+ * Returns the host time (in nanoseconds) at which the given frame of a clock is played or captured, plus jitter.
+**/
+static pj_uint64_t simHostTime(pj_uint64_t frame, double actualRate, unsigned *state)
+{
+	double seconds = frame / actualRate;
+	
+	return (pj_uint64_t)(seconds * SIM_HOST_TICKS) + (testRandom(state) % SIM_HOST_JITTER);
+}
+
+static int simulate(const sim_scenario *scenario, pj_bool_t compensate, unsigned seconds, sim_result *result)
+{
+	static pj_int16_t input[RESAMPLER_CHUNK_FRAMES];
+	static pj_int16_t output[RESAMPLER_CHUNK_FRAMES];
+	
+	double captureRate = SIM_HW_RATE * (1.0 + (scenario->capturePpm / 1e6));
+	double renderRate  = SIM_HW_RATE * (1.0 + (scenario->renderPpm / 1e6));
+	
+	snd_arena arena;
+	pj_pool_t *pool = arenaCreate(resamplerArenaSize(SIM_HW_RATE, SIM_CLOCK_RATE, 1, SIM_FILTER_LENGTH,
+	                                                 RESAMPLER_CHUNK_FRAMES, PJ_TRUE), &arena);
+	snd_resampler *rs;
+	
+	if((pool == NULL) ||
+	   (resamplerCreate(&arena, SIM_HW_RATE, SIM_CLOCK_RATE, 1, SIM_FILTER_LENGTH,
+	                    RESAMPLER_CHUNK_FRAMES, PJ_TRUE, &rs) != PJ_SUCCESS))
+	{
+		return 0;
+	}
+	
+	snd_clock_estimator captureClock, renderClock;
+	snd_drift_ctl driftCtl;
+	
+	clockEstimatorInit(&captureClock, SIM_HW_RATE, SIM_HOST_TICKS);
+	clockEstimatorInit(&renderClock, SIM_HW_RATE, SIM_HOST_TICKS);
+	driftCtlInit(&driftCtl, SIM_CLOCK_RATE);
+	
+	unsigned maxOutput = (RESAMPLER_CHUNK_FRAMES * SIM_CLOCK_RATE / SIM_HW_RATE) + 2;
+	unsigned state = 0x5eed1234;
+	
+	// Frames on either side of the hardware, and at the pjsip rate
+	pj_uint64_t captureFrames = 0;
+	pj_uint64_t renderFrames = 0;
+	pj_int64_t captured = 0;
+	pj_int64_t rendered = 0;
+	
+	// The difference we start from
+	pj_bool_t haveStart = PJ_FALSE;
+	double start = 0;
+	
+	pj_bzero(result, sizeof(sim_result));
+	
+	double end = seconds;
+	double lastMinute = end - 60;
+	
+	for(;;)
+	{
+		double captureTime = captureFrames / captureRate;
+		double renderTime = renderFrames / renderRate;
+		
+		if((captureTime >= end) && (renderTime >= end))
+		{
+			break;
+		}
+		
+		if(renderTime <= captureTime)
+		{
+			// The render IO cycle (see voiceUnitRender).
+			// The output resampler has a fixed ratio, so it consumes pjsip frames at exactly the nominal ratio.
+			
+			clockEstimatorUpdate(&renderClock, (double)renderFrames,
+			                     simHostTime(renderFrames, renderRate, &state), SIM_IO_FRAMES);
+			
+			renderFrames += SIM_IO_FRAMES;
+			rendered = (pj_int64_t)(renderFrames * SIM_CLOCK_RATE / SIM_HW_RATE);
+			
+			continue;
+		}
+		
+		// The capture IO cycle (see voiceUnitCapture, updateDriftCompensation and resampleCapture)
+		
+		pj_bool_t measured = clockEstimatorUpdate(&captureClock, (double)captureFrames,
+		                                          simHostTime(captureFrames, captureRate, &state), SIM_IO_FRAMES);
+		
+		if(compensate && measured && (renderClock.measurements > 0))
+		{
+			pj_int32_t correction = driftCtlUpdate(&driftCtl, captureClock.ppb, renderClock.ppb,
+			                                       (pj_int32_t)(captured - rendered));
+			
+			resamplerSetAdjustment(rs, correction);
+		}
+		
+		unsigned remaining = SIM_IO_FRAMES;
+		
+		while(remaining > 0)
+		{
+			unsigned chunk = (remaining < RESAMPLER_CHUNK_FRAMES) ? remaining : RESAMPLER_CHUNK_FRAMES;
+			
+			captured += resamplerProcess(rs, input, chunk, output, maxOutput);
+			remaining -= chunk;
+		}
+		
+		captureFrames += SIM_IO_FRAMES;
+		
+		// The difference only changes in steps of a whole IO cycle, on either side.
+		// So compare what has been captured with what has been rendered by the very same moment,
+		// which is how much pjsip actually has to buffer.
+		
+		double now = captureFrames / captureRate;
+		double renderedNow = now * renderRate * SIM_CLOCK_RATE / SIM_HW_RATE;
+		
+		if(!haveStart)
+		{
+			haveStart = PJ_TRUE;
+			start = captured - renderedNow;
+		}
+		
+		pj_int32_t deviation = (pj_int32_t)lrint((captured - renderedNow) - start);
+		pj_int32_t magnitude = (deviation < 0) ? -deviation : deviation;
+		
+		if(magnitude > result->maxDeviation)
+		{
+			result->maxDeviation = magnitude;
+		}
+		
+		if((now >= lastMinute) && (magnitude > result->finalMaxDeviation))
+		{
+			result->finalMaxDeviation = magnitude;
+		}
+		
+		result->finalDeviation = deviation;
+	}
+	
+	result->capturePpb = captureClock.ppb;
+	result->renderPpb = renderClock.ppb;
+	result->correction = driftCtl.correction;
+	
+	pj_pool_release(pool);
+	
+	return 1;
+}
+
+/**
+ * Without compensation, the fill drifts away at the rate of the skew.
+ * This makes sure the simulation actually models the problem.
+**/
+static void testUncompensated(void)
+{
+	sim_result result;
+	
+	CHECK(simulate(&simScenarios[0], PJ_FALSE, SIM_SECONDS, &result));
+	
+	// 200 ppm of 16 kHz over 10 minutes is 1920 frames
+	double expected = 200e-6 * SIM_CLOCK_RATE * SIM_SECONDS;
+	
+	CHECK_MSG(fabs(result.finalDeviation - expected) < (expected * 0.05),
+	          "the fill drifted by %d frames, expected %.0f", result.finalDeviation, expected);
+}
+
+/**
+ * With compensation, the fill stays within a packet for any skew up to 200 ppm, all through the run.
+ * (The controller only sees the difference in steps of an IO cycle on either side, so it can't do much better.)
+ * The clock estimators measure each skew to within a few ppm.
+**/
+static void testCompensated(void)
+{
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(simScenarios); i++)
+	{
+		const sim_scenario *scenario = &simScenarios[i];
+		sim_result result;
+		
+		CHECK(simulate(scenario, PJ_TRUE, SIM_SECONDS, &result));
+		
+		CHECK_MSG(result.maxDeviation <= SIM_PACKET_FRAMES,
+		          "%s: the fill strayed %d frames", scenario->name, result.maxDeviation);
+		
+		CHECK_MSG(abs(result.capturePpb - (pj_int32_t)(scenario->capturePpm * 1000)) < 5000,
+		          "%s: capture clock measured at %d ppb", scenario->name, result.capturePpb);
+		
+		CHECK_MSG(abs(result.renderPpb - (pj_int32_t)(scenario->renderPpm * 1000)) < 5000,
+		          "%s: render clock measured at %d ppb", scenario->name, result.renderPpb);
+	}
+}
+
+// Benchmarks
+
+static void benchScenarios(void)
+{
+	unsigned i;
+	
+	printf("drift compensation, %u Hz hardware, %u Hz pjsip, %u frame IO cycles, %u minutes\n",
+	       SIM_HW_RATE, SIM_CLOCK_RATE, SIM_IO_FRAMES, SIM_SECONDS * 2 / 60);
+	printf("  %-28s %12s %26s %24s %12s\n", "", "uncompensated", "compensated: max (last min)", "measured ppm (cap/ren)",
+	       "correction");
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(simScenarios); i++)
+	{
+		sim_result off, on;
+		
+		simulate(&simScenarios[i], PJ_FALSE, SIM_SECONDS * 2, &off);
+		simulate(&simScenarios[i], PJ_TRUE, SIM_SECONDS * 2, &on);
+		
+		printf("  %-28s %12d %18d (%5d) %12.1f / %7.1f %12.1f\n", simScenarios[i].name,
+		       off.finalDeviation, on.maxDeviation, on.finalMaxDeviation,
+		       on.capturePpb / 1000.0, on.renderPpb / 1000.0, on.correction / 1000.0);
+	}
+	
+	printf("  (frames of fill, at %u frames per packet)\n", SIM_PACKET_FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	// The resampler lives in an arena, which comes from the driver's pool factory
+	snd_pool_factory = &testFactory;
+	
+	if(benchRequested(argc, argv))
+	{
+		benchScenarios();
+		return 0;
+	}
+	
+	RUN_TEST(testUncompensated);
+	RUN_TEST(testCompensated);
+	
+	return testSummary();
+}
@@ -0,0 +1,732 @@
+/**
+ * Tests and benchmarks of the fade stage (options.fade_msec).
+ *
+ * rampApply must match the scalar formula for any length and alignment, whatever vector unit it was compiled for.
+ * A stream that plays a constant level must come out with the exact shape of the ramp: faded in when it's started
+ * and resumed after an interruption, and faded out when it's stopped. A stop in the middle of a fade in must
+ * turn around from the level the fade in got to, rather than jumping back up to full volume first.
+ *
+ * The same goes for recovering from an underrun in asynchronous mode: the concealment must be exactly what
+ * underrun_concealment asks for, and the fade in must pick up from the level the concealment got down to.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define TEST_MAX_SAMPLES  4096
+
+#define TEST_CLOCK_RATE     16000
+#define TEST_PACKET_FRAMES  320
+#define TEST_CYCLE_FRAMES   185
+
+// What the stream under test plays, all the time
+#define TEST_LEVEL          16384
+
+#define TEST_RENDER_FILE    "test_fade.wav"
+
+static pj_pool_factory testFactory;
+
+/**
+ * The scalar formula of rampApply: rounded Q15, with the complement of the gain if invert is set.
+**/
+static pj_int16_t referenceGain(pj_int16_t sample, pj_int16_t gain, pj_bool_t invert)
+{
+	pj_int32_t g = invert ? (32767 - gain) : gain;
+	
+	return (pj_int16_t)(((sample * g) + (1 << 14)) >> 15);
+}
+
+static pj_int16_t testGains[TEST_MAX_SAMPLES + 16];
+static pj_int16_t testExpected[TEST_MAX_SAMPLES + 16];
+static pj_int16_t testActual[TEST_MAX_SAMPLES + 16];
+
+/**
+ * rampApply matches the scalar formula for every length up to 64 samples (and a few long ones),
+ * every sample offset within a vector, and both directions. Samples past the end must be left alone.
+**/
+static void testRampKernel(void)
+{
+	static const unsigned longLengths[] = { 160, 320, 882, 960, 4093 };
+	
+	unsigned state = 0x7f4a7c15;
+	unsigned length, offset, i;
+	pj_bool_t invert;
+	
+	for(length = 0; length < (64 + PJ_ARRAY_SIZE(longLengths)); length++)
+	{
+		unsigned numSamples = (length < 64) ? length : longLengths[length - 64];
+		
+		for(offset = 0; offset < 8; offset++)
+		{
+			for(invert = PJ_FALSE; invert <= PJ_TRUE; invert++)
+			{
+				testRandomSamples(testExpected, PJ_ARRAY_SIZE(testExpected), &state);
+				memcpy(testActual, testExpected, sizeof(testActual));
+				
+				// Gains cover the whole Q15 range of the ramp, including both ends
+				for(i = 0; i < PJ_ARRAY_SIZE(testGains); i++)
+				{
+					unsigned r = testRandom(&state);
+					testGains[i] = ((r % 8) == 0) ? 0 : ((r % 8) == 1) ? 32767 : (pj_int16_t)(r % 32768);
+				}
+				
+				// The gains come from a different offset than the samples, like the ramp does
+				for(i = 0; i < numSamples; i++)
+				{
+					testExpected[offset + i] = referenceGain(testExpected[offset + i], testGains[7 - offset + i], invert);
+				}
+				
+				rampApply(testActual + offset, testGains + (7 - offset), numSamples, invert);
+				
+				if(memcmp(testActual, testExpected, sizeof(testActual)) != 0)
+				{
+					for(i = 0; testActual[i] == testExpected[i]; i++);
+					
+					CHECK_MSG(0, "%u samples at offset %u, invert %d: sample %u is %d, expected %d",
+					          numSamples, offset, invert, i, testActual[i], testExpected[i]);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * The extremes of both the samples and the gains don't overflow.
+**/
+static void testRampLimits(void)
+{
+	static const pj_int16_t samples[] = { 32767, -32768, 32767, -32768, 1, -1, 0, 32767, -32768, 12345 };
+	static const pj_int16_t gains[]   = { 32767, 32767,  0,     0,      32767, 32767, 32767, 16384, 16384, 1 };
+	
+	pj_int16_t actual[PJ_ARRAY_SIZE(samples)];
+	pj_bool_t invert;
+	unsigned i;
+	
+	for(invert = PJ_FALSE; invert <= PJ_TRUE; invert++)
+	{
+		memcpy(actual, samples, sizeof(actual));
+		rampApply(actual, gains, PJ_ARRAY_SIZE(samples), invert);
+		
+		for(i = 0; i < PJ_ARRAY_SIZE(samples); i++)
+		{
+			CHECK_MSG(actual[i] == referenceGain(samples[i], gains[i], invert), "invert %d: %d * %d is %d",
+			          invert, samples[i], gains[i], actual[i]);
+		}
+	}
+}
+
+// The fade stage of a stream
+
+static pj_status_t testPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	pj_int16_t *samples = (pj_int16_t *)output;
+	unsigned i;
+	
+	for(i = 0; i < size / sizeof(pj_int16_t); i++)
+	{
+		samples[i] = TEST_LEVEL;
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Has the loopback backend run at the stream's rate, in realtime, writing what it renders to renderFile (if any).
+**/
+static pj_bool_t testUseLoopback(const char *renderFile)
+{
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	param.hw_clock_rate = TEST_CLOCK_RATE;
+	param.frames_per_cycle = TEST_CYCLE_FRAMES;
+	param.render_file = renderFile;
+	
+	return (pjmedia_snd_iphone_use_loopback(&param) == PJ_SUCCESS);
+}
+
+/**
+ * Opens a mono playback stream of TEST_LEVEL, with a ramp of the given length.
+**/
+static pjmedia_snd_stream *testOpenPlayer(unsigned fadeMsec)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.fade_msec = fadeMsec;
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	if((pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS) ||
+	   (pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+	                            testPlayCallback, NULL, &snd_strm) != PJ_SUCCESS))
+	{
+		return NULL;
+	}
+	
+	return snd_strm;
+}
+
+/**
+ * Returns the sample the fade stage makes of TEST_LEVEL at the given position of the ramp,
+ * fading in, or fading out (the complement of the gain).
+**/
+static pj_int16_t testFaded(const snd_fade *fade, unsigned position, pj_bool_t out)
+{
+	return referenceGain(TEST_LEVEL, fade->ramp[position], out);
+}
+
+/**
+ * Renders an IO cycle of the voice unit, which must not be started.
+**/
+static void testRender(snd_voice_unit *unit, pj_uint64_t sampleTime, unsigned numFrames, pj_int16_t *output)
+{
+	snd_io_time time;
+	
+	time.sampleTime = (double)sampleTime;
+	time.hostTime = 0;
+	time.sampleTimeValid = PJ_TRUE;
+	time.hostTimeValid = PJ_FALSE;
+	
+	voiceUnitRender(unit, &time, numFrames, output, numFrames * unit->outputFormat.channels * sizeof(pj_int16_t));
+}
+
+/**
+ * Stopping a stream in the middle of its fade in turns the fade around where it got to,
+ * and fades out from there, taking as long as the fade in took so far.
+ *
+ * The fade stage works on whole packets, so the ramp is longer than a packet,
+ * and the stop is requested after the first packet.
+**/
+static void testStopDuringFadeIn(void)
+{
+	static pj_int16_t output[4 * TEST_PACKET_FRAMES];
+	
+	CHECK(testUseLoopback(NULL));
+	
+	// 50 msec at 16 kHz is 800 frames, two and a half packets
+	pjmedia_snd_stream *snd_strm = testOpenPlayer(50);
+	CHECK(snd_strm != NULL);
+	
+	snd_voice_unit *unit = snd_strm->unit;
+	snd_fade *fade = &snd_strm->fade;
+	
+	// Serve the stream without starting the voice unit, so the render callback is ours to drive,
+	// and start the fade in the way pjmedia_snd_stream_start does
+	
+	voiceUnitSlotAdd(unit->players, snd_strm);
+	fadeStart(fade);
+	
+	testRender(unit, 0, TEST_PACKET_FRAMES, output);
+	
+	snd_fade_state during = fade->state;
+	
+	ATOMIC_STORE(&fade->stopRequested, PJ_TRUE);
+	
+	testRender(unit, TEST_PACKET_FRAMES, 3 * TEST_PACKET_FRAMES, output + TEST_PACKET_FRAMES);
+	
+	snd_fade_state after = fade->state;
+	unsigned length = fade->length;
+	
+	// The expected samples, worked out before the ramp goes away with the stream
+	
+	static pj_int16_t expected[4 * TEST_PACKET_FRAMES];
+	unsigned i;
+	
+	for(i = 0; i < TEST_PACKET_FRAMES; i++)
+	{
+		expected[i] = testFaded(fade, i, PJ_FALSE);
+	}
+	
+	for(i = 0; i < TEST_PACKET_FRAMES; i++)
+	{
+		expected[TEST_PACKET_FRAMES + i] = testFaded(fade, length - TEST_PACKET_FRAMES + i, PJ_TRUE);
+	}
+	
+	for(i = 2 * TEST_PACKET_FRAMES; i < 4 * TEST_PACKET_FRAMES; i++)
+	{
+		expected[i] = 0;
+	}
+	
+	// The largest step of the fade in, which the turnaround mustn't exceed
+	
+	int step = 0;
+	
+	for(i = 1; i < TEST_PACKET_FRAMES; i++)
+	{
+		if(expected[i] - expected[i - 1] > step)
+			step = expected[i] - expected[i - 1];
+	}
+	
+	voiceUnitSlotRemove(unit->players, snd_strm);
+	pjmedia_snd_stream_close(snd_strm);
+	
+	CHECK(length == 800);
+	CHECK(during == FADE_IN);
+	CHECK(after == FADE_SILENT);
+	
+	for(i = 0; i < 4 * TEST_PACKET_FRAMES; i++)
+	{
+		CHECK_MSG(output[i] == expected[i], "sample %u is %d, expected %d", i, output[i], expected[i]);
+	}
+	
+	int turnaround = output[TEST_PACKET_FRAMES] - output[TEST_PACKET_FRAMES - 1];
+	
+	CHECK_MSG(abs(turnaround) <= step, "the level jumps by %d where the fade turns around", turnaround);
+}
+
+/**
+ * Checks that the given samples are a whole fade in (or out) of TEST_LEVEL.
+**/
+static pj_bool_t testIsRamp(const pj_int16_t *samples, unsigned numSamples, const pj_int16_t *ramp, unsigned length,
+                            pj_bool_t out)
+{
+	unsigned i;
+	
+	if(numSamples < length)
+	{
+		return PJ_FALSE;
+	}
+	
+	for(i = 0; i < length; i++)
+	{
+		if(samples[i] != referenceGain(TEST_LEVEL, ramp[i], out))
+		{
+			return PJ_FALSE;
+		}
+	}
+	
+	return PJ_TRUE;
+}
+
+/**
+ * A stream that's started, interrupted and stopped on the loopback backend renders a fade in,
+ * the level, another fade in where it was resumed, the level, a fade out, and silence until the voice unit stops.
+ * (An interruption cuts the audio off, there's no fading out when the audio session is already gone.)
+**/
+static void testStartResumeStop(void)
+{
+	static pj_int16_t ramp[TEST_CLOCK_RATE / 100];
+	static pj_int16_t rendered[TEST_CLOCK_RATE * 2];
+	
+	CHECK(testUseLoopback(TEST_RENDER_FILE));
+	
+	// 10 msec is 160 frames, half a packet
+	pjmedia_snd_stream *snd_strm = testOpenPlayer(10);
+	CHECK(snd_strm != NULL);
+	
+	unsigned length = snd_strm->fade.length;
+	memcpy(ramp, snd_strm->fade.ramp, length * sizeof(pj_int16_t));
+	
+	pj_status_t status = pjmedia_snd_stream_start(snd_strm);
+	pj_thread_sleep(100);
+	
+	pjmedia_snd_audio_session_interruption(NULL, kAudioSessionBeginInterruption);
+	pj_thread_sleep(20);
+	pjmedia_snd_audio_session_interruption(NULL, kAudioSessionEndInterruption);
+	
+	pj_thread_sleep(100);
+	pjmedia_snd_stream_stop(snd_strm);
+	
+	// Closing the last stream disposes of the voice unit, which completes the render file
+	pjmedia_snd_stream_close(snd_strm);
+	
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	snd_wav_file wav;
+	unsigned numSamples = 0;
+	
+	if(pool && (wavOpenRead(pool, TEST_RENDER_FILE, &wav) == PJ_SUCCESS))
+	{
+		numSamples = wav.dataSize / sizeof(pj_int16_t);
+		
+		if(numSamples > PJ_ARRAY_SIZE(rendered))
+		{
+			numSamples = PJ_ARRAY_SIZE(rendered);
+		}
+		
+		wavRead(&wav, rendered, numSamples);
+		wavClose(&wav, PJ_FALSE);
+	}
+	
+	if(pool)
+	{
+		pj_pool_release(pool);
+	}
+	
+	remove(TEST_RENDER_FILE);
+	
+	CHECK(status == PJ_SUCCESS);
+	CHECK(length == TEST_CLOCK_RATE / 100);
+	CHECK_MSG(numSamples > 4 * length, "rendered %u samples", numSamples);
+	
+	// Started
+	
+	CHECK_MSG(testIsRamp(rendered, numSamples, ramp, length, PJ_FALSE), "the stream didn't fade in when started");
+	
+	unsigned i = length;
+	unsigned resumes = 0;
+	
+	for(;;)
+	{
+		while((i < numSamples) && (rendered[i] == TEST_LEVEL))
+		{
+			i++;
+		}
+		
+		// Resumed
+		
+		if(testIsRamp(rendered + i, numSamples - i, ramp, length, PJ_FALSE))
+		{
+			resumes++;
+			i += length;
+			continue;
+		}
+		
+		break;
+	}
+	
+	CHECK_MSG(resumes == 1, "the stream faded in %u times after the start", resumes);
+	
+	// Stopped
+	
+	CHECK_MSG(testIsRamp(rendered + i, numSamples - i, ramp, length, PJ_TRUE),
+	          "the stream didn't fade out when stopped (sample %u of %u is %d)", i, numSamples, rendered[i]);
+	
+	for(i += length; i < numSamples; i++)
+	{
+		CHECK_MSG(rendered[i] == 0, "sample %u after the fade out is %d", i, rendered[i]);
+	}
+}
+
+// Underrun concealment
+
+static volatile int testStalled;
+
+/**
+ * Plays TEST_LEVEL like testPlayCallback, but not while the test has pjsip stalled.
+**/
+static pj_status_t testStallingPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	while(__atomic_load_n(&testStalled, __ATOMIC_ACQUIRE))
+	{
+		pj_thread_sleep(1);
+	}
+	
+	return testPlayCallback(user_data, timestamp, output, size);
+}
+
+/**
+ * Waits until the worker thread has topped up the play ring, or a few seconds have passed.
+**/
+static pj_bool_t testWaitRing(pjmedia_snd_stream *snd_strm, pj_uint32_t size)
+{
+	unsigned msec;
+	
+	for(msec = 0; (msec < 5000) && (ringAvailable(&snd_strm->playRing) < size); msec++)
+	{
+		pj_thread_sleep(1);
+	}
+	
+	return (ringAvailable(&snd_strm->playRing) >= size);
+}
+
+/**
+ * Returns the n-th sample of the given concealed packet of TEST_LEVEL, for REPEAT (see concealmentFill).
+**/
+static pj_int16_t testRepeated(unsigned packet, unsigned n)
+{
+	pj_int32_t total = CONCEAL_REPEAT_PACKETS * TEST_PACKET_FRAMES;
+	pj_int32_t gain = ((total - (pj_int32_t)(packet * TEST_PACKET_FRAMES) - (pj_int32_t)n) << 15) / total;
+	
+	return (pj_int16_t)((TEST_LEVEL * gain) >> 15);
+}
+
+/**
+ * Has pjsip stall in an asynchronous mono stream of TEST_LEVEL until the given number of packets were concealed,
+ * and checks what was concealed, the statistics, and the fade back in once pjsip catches up.
+ * 
+ * The worker thread runs for real, but the render callback is ours to drive, one packet per IO cycle.
+**/
+static void testConceal(pjmedia_snd_iphone_concealment concealment, unsigned concealed)
+{
+	static pj_int16_t output[64 * TEST_PACKET_FRAMES];
+	
+	CHECK(testUseLoopback(NULL));
+	
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.async_callbacks = PJ_TRUE;
+	options.underrun_concealment = concealment;
+	
+	// 10 msec at 16 kHz is 160 frames, half a packet
+	options.fade_msec = 10;
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	CHECK(pjmedia_snd_iphone_set_options(&options) == PJ_SUCCESS);
+	CHECK(pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+	                              testStallingPlayCallback, NULL, &snd_strm) == PJ_SUCCESS);
+	
+	snd_voice_unit *unit = snd_strm->unit;
+	
+	// Serve the stream without starting the voice unit, and without a fade in from the start
+	
+	__atomic_store_n(&testStalled, 0, __ATOMIC_RELEASE);
+	
+	voiceUnitSlotAdd(unit->players, snd_strm);
+	pj_status_t status = startWorkerThread(snd_strm);
+	
+	// Once the play ring is full, pjsip stalls. The ring is played out, and then the underrun is concealed.
+	
+	unsigned buffered = snd_strm->playRingTarget / snd_strm->packet_size;
+	unsigned stalled = buffered + concealed;
+	unsigned i, n;
+	
+	pj_bool_t filled = testWaitRing(snd_strm, buffered * snd_strm->packet_size);
+	
+	__atomic_store_n(&testStalled, 1, __ATOMIC_RELEASE);
+	
+	for(i = 0; (i < stalled) && (i < 62); i++)
+	{
+		testRender(unit, i * TEST_PACKET_FRAMES, TEST_PACKET_FRAMES, output + (i * TEST_PACKET_FRAMES));
+	}
+	
+	// pjsip catches up
+	
+	__atomic_store_n(&testStalled, 0, __ATOMIC_RELEASE);
+	
+	pj_bool_t caughtUp = testWaitRing(snd_strm, 2 * snd_strm->packet_size);
+	
+	for(i = stalled; (i < stalled + 2) && (i < 64); i++)
+	{
+		testRender(unit, i * TEST_PACKET_FRAMES, TEST_PACKET_FRAMES, output + (i * TEST_PACKET_FRAMES));
+	}
+	
+	// The expected fade in, worked out before the ramp goes away with the stream.
+	// It starts where REPEAT left off, or from silence.
+	
+	static pj_int16_t fadeIn[2 * TEST_PACKET_FRAMES];
+	unsigned length = snd_strm->fade.length;
+	unsigned position = 0;
+	
+	if((concealment == PJMEDIA_SND_IPHONE_CONCEAL_REPEAT) && (concealed < CONCEAL_REPEAT_PACKETS))
+	{
+		pj_int32_t gain = ((CONCEAL_REPEAT_PACKETS - concealed) << 15) / CONCEAL_REPEAT_PACKETS;
+		
+		while((position < length) && (snd_strm->fade.ramp[position] < gain))
+		{
+			position++;
+		}
+	}
+	
+	for(n = 0; n < 2 * TEST_PACKET_FRAMES; n++)
+	{
+		fadeIn[n] = (position + n < length) ? testFaded(&snd_strm->fade, position + n, PJ_FALSE) : TEST_LEVEL;
+	}
+	
+	// The largest step of the whole ramp, which the level mustn't jump by where the fade in starts
+	
+	int step = 0;
+	
+	for(n = 1; n < length; n++)
+	{
+		int diff = testFaded(&snd_strm->fade, n, PJ_FALSE) - testFaded(&snd_strm->fade, n - 1, PJ_FALSE);
+		
+		if(diff > step)
+			step = diff;
+	}
+	
+	pjmedia_snd_iphone_stats stats;
+	pjmedia_snd_iphone_stream_get_stats(snd_strm, &stats);
+	
+	if(status == PJ_SUCCESS)
+	{
+		stopWorkerThread(snd_strm);
+	}
+	
+	voiceUnitSlotRemove(unit->players, snd_strm);
+	pjmedia_snd_stream_close(snd_strm);
+	
+	CHECK(status == PJ_SUCCESS);
+	CHECK(filled && caughtUp);
+	CHECK(stalled + 2 <= 64);
+	
+	// What was buffered plays out untouched
+	
+	for(n = 0; n < buffered * TEST_PACKET_FRAMES; n++)
+	{
+		CHECK_MSG(output[n] == TEST_LEVEL, "buffered sample %u is %d", n, output[n]);
+	}
+	
+	// The concealment
+	
+	const pj_int16_t *concealment_output = output + (buffered * TEST_PACKET_FRAMES);
+	
+	for(i = 0; i < concealed; i++)
+	{
+		const pj_int16_t *packet = concealment_output + (i * TEST_PACKET_FRAMES);
+		double energy = 0;
+		
+		for(n = 0; n < TEST_PACKET_FRAMES; n++)
+		{
+			energy += (double)packet[n] * packet[n];
+			
+			if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_REPEAT)
+			{
+				pj_int16_t expected = (i < CONCEAL_REPEAT_PACKETS) ? testRepeated(i, n) : 0;
+				
+				CHECK_MSG(packet[n] == expected, "sample %u of concealed packet %u is %d, expected %d",
+				          n, i, packet[n], expected);
+			}
+			else if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_SILENCE)
+			{
+				CHECK_MSG(packet[n] == 0, "sample %u of concealed packet %u is %d", n, i, packet[n]);
+			}
+		}
+		
+		if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_NOISE)
+		{
+			// Noise at the level of the audio (the quietest there was), which isn't the audio itself
+			double level = sqrt(energy / TEST_PACKET_FRAMES);
+			
+			CHECK_MSG((level > TEST_LEVEL * 0.9) && (level < TEST_LEVEL * 1.1), "concealed packet %u has level %.0f",
+			          i, level);
+			CHECK(memcmp(packet, packet + 1, (TEST_PACKET_FRAMES - 1) * sizeof(pj_int16_t)) != 0);
+		}
+	}
+	
+	// The statistics: one underrun, with every packet of it concealed, and the packets that weren't silent
+	
+	unsigned audible = 0;
+	
+	if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_NOISE)
+		audible = concealed;
+	else if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_REPEAT)
+		audible = (concealed < CONCEAL_REPEAT_PACKETS) ? concealed : CONCEAL_REPEAT_PACKETS;
+	
+	CHECK_MSG(stats.underrun_events == 1, "%u underrun events", stats.underrun_events);
+	CHECK_MSG(stats.play_underruns == concealed, "%u play underruns", stats.play_underruns);
+	CHECK_MSG(stats.concealed_packets == audible, "%u concealed packets, expected %u", stats.concealed_packets, audible);
+	
+	// The recovery fades in from where the concealment left off
+	
+	const pj_int16_t *recovered = output + (stalled * TEST_PACKET_FRAMES);
+	
+	for(n = 0; n < 2 * TEST_PACKET_FRAMES; n++)
+	{
+		CHECK_MSG(recovered[n] == fadeIn[n], "sample %u after the underrun is %d, expected %d",
+		          n, recovered[n], fadeIn[n]);
+	}
+	
+	if(concealment == PJMEDIA_SND_IPHONE_CONCEAL_REPEAT)
+	{
+		int jump = recovered[0] - recovered[-1];
+		
+		CHECK_MSG(abs(jump) <= step, "the level jumps by %d where the fade in starts", jump);
+	}
+}
+
+/**
+ * REPEAT fades the last packet out over a few packets. If pjsip catches up before it's silent,
+ * the fade in starts from there, rather than dipping to silence and back.
+**/
+static void testConcealRepeat(void)
+{
+	unsigned concealed;
+	
+	for(concealed = 1; concealed <= CONCEAL_REPEAT_PACKETS + 1; concealed++)
+	{
+		testConceal(PJMEDIA_SND_IPHONE_CONCEAL_REPEAT, concealed);
+	}
+}
+
+static void testConcealNoise(void)
+{
+	testConceal(PJMEDIA_SND_IPHONE_CONCEAL_NOISE, 3);
+}
+
+static void testConcealSilence(void)
+{
+	testConceal(PJMEDIA_SND_IPHONE_CONCEAL_SILENCE, 2);
+}
+
+// Benchmarks
+
+#define BENCH_ITERATIONS  100000
+
+/**
+ * Returns the time rampApply takes on the given number of samples, in nanoseconds per sample.
+**/
+static double benchRamp(unsigned numSamples, pj_bool_t invert)
+{
+	unsigned i;
+	double start = benchNow();
+	
+	for(i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		rampApply(testActual, testGains, numSamples, invert);
+		
+		// Keep the compiler from hoisting the call out of the loop
+		__asm__ __volatile__("" : : "r"(testActual) : "memory");
+	}
+	
+	return ((benchNow() - start) * 1e9) / ((double)BENCH_ITERATIONS * numSamples);
+}
+
+static void benchFade(void)
+{
+#if USE_NEON
+	const char *unit = "NEON";
+#elif USE_SSE2
+	const char *unit = "SSE2";
+#else
+	const char *unit = "scalar";
+#endif
+
+	unsigned state = 0x2545f491;
+	unsigned i;
+	
+	testRandomSamples(testActual, TEST_MAX_SAMPLES, &state);
+	
+	for(i = 0; i < TEST_MAX_SAMPLES; i++)
+	{
+		testGains[i] = (pj_int16_t)(testRandom(&state) % 32768);
+	}
+	
+	printf("rampApply (%s), ns/sample\n", unit);
+	printf("  %4u samples: %.3f in, %.3f out\n", 80, benchRamp(80, PJ_FALSE), benchRamp(80, PJ_TRUE));
+	printf("  %4u samples: %.3f in, %.3f out\n", 882, benchRamp(882, PJ_FALSE), benchRamp(882, PJ_TRUE));
+	printf("  %4u samples: %.3f in, %.3f out\n", TEST_MAX_SAMPLES,
+	       benchRamp(TEST_MAX_SAMPLES, PJ_FALSE), benchRamp(TEST_MAX_SAMPLES, PJ_TRUE));
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(!testUseLoopback(NULL) || (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		benchFade();
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testRampKernel);
+	RUN_TEST(testRampLimits);
+	RUN_TEST(testStopDuringFadeIn);
+	RUN_TEST(testStartResumeStop);
+	RUN_TEST(testConcealRepeat);
+	RUN_TEST(testConcealNoise);
+	RUN_TEST(testConcealSilence);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}
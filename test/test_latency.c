@@ -0,0 +1,380 @@
+/**
+ * Simulation of the adaptive latency controller (snd_latency_ctl) with synthetic timing traces.
+ *
+ * The simulation models the asynchronous mode the way the driver runs it: the IO thread takes audio
+ * out of the play ring every IO cycle, and the worker thread wakes up every half packet, updates the
+ * controller, and tops the ring up to the target. A trace says when pjsip stalls the worker (in play_cb),
+ * and when the capture side overruns. The whole thing runs on simulated time, so it's exact and repeatable.
+ *
+ * Run with --bench to print a summary of each trace, which is handy for tuning the controller.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+// A 20 ms mono packet at 8 kHz
+#define SIM_CLOCK_RATE     8000
+#define SIM_PACKET_FRAMES  160
+#define SIM_PACKET_SIZE    (SIM_PACKET_FRAMES * sizeof(pj_int16_t))
+
+// The IO thread runs every 185 frames, and the worker every half packet (as in pjmedia_snd_open)
+#define SIM_IO_FRAMES       185
+#define SIM_IO_PERIOD       ((SIM_IO_FRAMES * 1000000) / SIM_CLOCK_RATE)
+#define SIM_WORKER_PERIOD   10000
+
+// The ring starts out with three packets (enough to cover an IO cycle and a worker period, in whole packets),
+// and may grow by up to 7 more
+#define SIM_MIN_TARGET  (3 * SIM_PACKET_SIZE)
+#define SIM_MAX_TARGET  (10 * SIM_PACKET_SIZE)
+
+typedef enum sim_event_type
+{
+	SIM_STALL,     // play_cb blocks the worker for a while
+	SIM_OVERRUN    // the capture side drops a packet
+	
+} sim_event_type;
+
+typedef struct sim_event
+{
+	pj_uint64_t usec;
+	sim_event_type type;
+	pj_uint64_t duration;
+	
+} sim_event;
+
+typedef struct sim_trace
+{
+	const char *name;
+	pj_uint64_t length;
+	sim_event events[64];
+	unsigned count;
+	
+} sim_trace;
+
+/**
+ * The outcome of a simulation.
+**/
+typedef struct sim_result
+{
+	// Packets the IO thread found missing, and runs of them
+	pj_uint32_t underruns;
+	pj_uint32_t underrunEvents;
+	
+	// Underrun events in the last minute of the trace
+	pj_uint32_t lateUnderrunEvents;
+	
+	unsigned maxTarget;
+	unsigned finalTarget;
+	
+	// Average target over the trace (in bytes), and a hash of every change in the target
+	double meanTarget;
+	pj_uint32_t targetHash;
+	
+	pj_uint32_t growCount;
+	pj_uint32_t shrinkCount;
+	
+} sim_result;
+
+/**
+ * Runs the controller through a trace.
+**/
+static void simulate(const sim_trace *trace, sim_result *result)
+{
+	snd_latency_ctl ctl;
+	latencyCtlInit(&ctl, SIM_MIN_TARGET, SIM_MAX_TARGET, SIM_PACKET_SIZE, ADAPTIVE_LATENCY_SHRINK_INTERVAL * SIM_CLOCK_RATE);
+	
+	memset(result, 0, sizeof(sim_result));
+	result->targetHash = 2166136261u;
+	
+	// The play ring is only modeled by how many bytes it holds
+	
+	unsigned ringFill = 0;
+	unsigned target = ctl.target;
+	
+	pj_uint32_t playedFrames = 0;
+	pj_uint32_t lastPlayedFrames = 0;
+	pj_uint32_t overruns = 0;
+	pj_bool_t underrunning = PJ_FALSE;
+	
+	pj_uint64_t nextIO = SIM_IO_PERIOD;
+	pj_uint64_t nextWorker = 0;
+	pj_uint64_t lastTargetChange = 0;
+	double targetArea = 0;
+	
+	unsigned e;
+	
+	while((nextIO < trace->length) || (nextWorker < trace->length))
+	{
+		if(nextIO <= nextWorker)
+		{
+			// IO cycle: play SIM_IO_FRAMES frames from the ring, and count the packets we're short
+			
+			unsigned needed = SIM_IO_FRAMES * sizeof(pj_int16_t);
+			
+			if(ringFill >= needed)
+			{
+				ringFill -= needed;
+				underrunning = PJ_FALSE;
+			}
+			else
+			{
+				unsigned missing = needed - ringFill;
+				
+				result->underruns += (missing + SIM_PACKET_SIZE - 1) / SIM_PACKET_SIZE;
+				
+				if(!underrunning)
+				{
+					result->underrunEvents++;
+					
+					if(nextIO + 60000000 >= trace->length)
+					{
+						result->lateUnderrunEvents++;
+					}
+				}
+				
+				ringFill = 0;
+				underrunning = PJ_TRUE;
+			}
+			
+			playedFrames += SIM_IO_FRAMES;
+			nextIO += SIM_IO_PERIOD;
+		}
+		else
+		{
+			pj_uint64_t now = nextWorker;
+			
+			// Worker cycle: update the controller on audio time, then top up the ring
+			
+			for(e = 0; e < trace->count; e++)
+			{
+				const sim_event *event = &trace->events[e];
+				
+				if((event->type == SIM_OVERRUN) && (event->usec > (now - SIM_WORKER_PERIOD)) && (event->usec <= now))
+				{
+					overruns++;
+				}
+			}
+			
+			unsigned newTarget = latencyCtlUpdate(&ctl, playedFrames - lastPlayedFrames, result->underruns, overruns);
+			lastPlayedFrames = playedFrames;
+			
+			if(newTarget != target)
+			{
+				targetArea += (double)target * (double)(now - lastTargetChange);
+				lastTargetChange = now;
+				
+				result->targetHash = (result->targetHash ^ newTarget) * 16777619u;
+				result->targetHash = (result->targetHash ^ (pj_uint32_t)(now / 1000)) * 16777619u;
+				
+				target = newTarget;
+			}
+			
+			if(target > result->maxTarget)
+			{
+				result->maxTarget = target;
+			}
+			
+			while((ringFill + SIM_PACKET_SIZE) <= target)
+			{
+				ringFill += SIM_PACKET_SIZE;
+			}
+			
+			// A stall that starts before the next wakeup keeps the worker in play_cb until it's over
+			
+			nextWorker = now + SIM_WORKER_PERIOD;
+			
+			for(e = 0; e < trace->count; e++)
+			{
+				const sim_event *event = &trace->events[e];
+				
+				if((event->type == SIM_STALL) && (event->usec >= now) && (event->usec < nextWorker))
+				{
+					nextWorker = event->usec + event->duration;
+				}
+			}
+		}
+	}
+	
+	targetArea += (double)target * (double)(trace->length - lastTargetChange);
+	
+	result->finalTarget = target;
+	result->meanTarget = targetArea / (double)trace->length;
+	result->growCount = ctl.growCount;
+	result->shrinkCount = ctl.shrinkCount;
+}
+
+#define SEC(s)   ((pj_uint64_t)(s) * 1000000)
+#define MSEC(m)  ((pj_uint64_t)(m) * 1000)
+
+/**
+ * Without any stalls, the minimum is plenty, and the target never moves.
+**/
+static void testSteady(void)
+{
+	sim_trace trace = { "steady", SEC(120), { { 0 } }, 0 };
+	sim_result result;
+	
+	simulate(&trace, &result);
+	
+	CHECK(result.underruns == 0);
+	CHECK(result.growCount == 0);
+	CHECK(result.finalTarget == SIM_MIN_TARGET);
+}
+
+/**
+ * A single long stall causes underruns, and the target grows by a packet per worker cycle that sees them.
+ * After the stall, it shrinks by a packet every ADAPTIVE_LATENCY_SHRINK_INTERVAL seconds, back to the minimum.
+**/
+static void testSingleStall(void)
+{
+	sim_trace trace = { "single stall", SEC(120), { { SEC(5), SIM_STALL, MSEC(120) } }, 1 };
+	sim_result result;
+	
+	simulate(&trace, &result);
+	
+	CHECK(result.underrunEvents == 1);
+	CHECK(result.growCount >= 1);
+	CHECK(result.shrinkCount == result.growCount);
+	CHECK(result.maxTarget == SIM_MIN_TARGET + (result.growCount * SIM_PACKET_SIZE));
+	CHECK(result.finalTarget == SIM_MIN_TARGET);
+}
+
+/**
+ * The same stall every 3 seconds: the target grows until the stalls no longer cause underruns,
+ * and then only creeps down (and glitches) once per shrink interval.
+**/
+static void testRecurringStalls(void)
+{
+	sim_trace trace = { "recurring stalls", SEC(300), { { 0 } }, 0 };
+	sim_result result;
+	
+	for(trace.count = 0; trace.count < 64; trace.count++)
+	{
+		trace.events[trace.count].usec = SEC(3) * (trace.count + 1);
+		trace.events[trace.count].type = SIM_STALL;
+		trace.events[trace.count].duration = MSEC(70);
+	}
+	
+	trace.length = SEC(3) * 65;
+	
+	simulate(&trace, &result);
+	
+	CHECK(result.underrunEvents > 0);
+	CHECK(result.finalTarget > SIM_MIN_TARGET);
+	CHECK(result.maxTarget <= SIM_MAX_TARGET);
+	
+	// At most one probe per shrink interval, in the last minute
+	CHECK_MSG(result.lateUnderrunEvents <= ((60 / ADAPTIVE_LATENCY_SHRINK_INTERVAL) + 1),
+	          "%u underrun events in the last minute", result.lateUnderrunEvents);
+}
+
+/**
+ * Stalls longer than the maximum can cover never push the target past it.
+**/
+static void testMaximum(void)
+{
+	sim_trace trace = { "huge stalls", SEC(41), { { 0 } }, 0 };
+	sim_result result;
+	
+	for(trace.count = 0; trace.count < 20; trace.count++)
+	{
+		trace.events[trace.count].usec = SEC(2) * (trace.count + 1);
+		trace.events[trace.count].type = SIM_STALL;
+		trace.events[trace.count].duration = MSEC(500);
+	}
+	
+	simulate(&trace, &result);
+	
+	CHECK(result.maxTarget == SIM_MAX_TARGET);
+	CHECK(result.finalTarget == SIM_MAX_TARGET);
+}
+
+/**
+ * Capture overruns are glitches too, even when playback is fine.
+**/
+static void testOverruns(void)
+{
+	sim_trace trace = { "overruns", SEC(30), { { SEC(2), SIM_OVERRUN, 0 }, { SEC(4), SIM_OVERRUN, 0 } }, 2 };
+	sim_result result;
+	
+	simulate(&trace, &result);
+	
+	CHECK(result.underruns == 0);
+	CHECK(result.growCount == 2);
+	CHECK(result.shrinkCount == 2);
+	CHECK(result.finalTarget == SIM_MIN_TARGET);
+}
+
+/**
+ * The controller only depends on the trace, so the same trace always gives the same targets at the same times.
+**/
+static void testDeterministic(void)
+{
+	sim_trace trace = { "mixed", SEC(90), { { SEC(1), SIM_STALL, MSEC(60) },
+	                                        { SEC(7), SIM_OVERRUN, 0 },
+	                                        { SEC(8), SIM_STALL, MSEC(200) },
+	                                        { SEC(40), SIM_STALL, MSEC(45) } }, 4 };
+	sim_result a, b;
+	
+	simulate(&trace, &a);
+	simulate(&trace, &b);
+	
+	CHECK(a.targetHash == b.targetHash);
+	CHECK(a.underruns == b.underruns);
+	CHECK(a.growCount > 0);
+}
+
+// Benchmarks (a summary of each trace, for tuning)
+
+static void benchTraces(void)
+{
+	static const unsigned stallMsec[] = { 30, 50, 70, 100, 150, 250 };
+	unsigned i;
+	
+	printf("adaptive latency, stall every 3 s for 3 minutes (packet = %u ms, shrink interval = %u s)\n",
+	       (SIM_PACKET_FRAMES * 1000) / SIM_CLOCK_RATE, ADAPTIVE_LATENCY_SHRINK_INTERVAL);
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(stallMsec); i++)
+	{
+		sim_trace trace;
+		sim_result result;
+		
+		memset(&trace, 0, sizeof(trace));
+		trace.length = SEC(3) * 65;
+		
+		for(trace.count = 0; trace.count < 64; trace.count++)
+		{
+			trace.events[trace.count].usec = SEC(3) * (trace.count + 1);
+			trace.events[trace.count].type = SIM_STALL;
+			trace.events[trace.count].duration = MSEC(stallMsec[i]);
+		}
+		
+		simulate(&trace, &result);
+		
+		printf("  %3u ms stalls: %4u underrun events (%5u packets), mean target %5.1f ms, max %3u ms, %u grows, %u shrinks\n",
+		       stallMsec[i], result.underrunEvents, result.underruns,
+		       (result.meanTarget * 1000) / (SIM_CLOCK_RATE * sizeof(pj_int16_t)),
+		       (result.maxTarget * 1000) / (unsigned)(SIM_CLOCK_RATE * sizeof(pj_int16_t)),
+		       result.growCount, result.shrinkCount);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(benchRequested(argc, argv))
+	{
+		benchTraces();
+		return 0;
+	}
+	
+	RUN_TEST(testSteady);
+	RUN_TEST(testSingleStall);
+	RUN_TEST(testRecurringStalls);
+	RUN_TEST(testMaximum);
+	RUN_TEST(testOverruns);
+	RUN_TEST(testDeterministic);
+	
+	return testSummary();
+}
@@ -0,0 +1,1030 @@
+/**
+ * Full-duplex tests and benchmarks on the loopback backend.
+ *
+ * The loopback backend captures from a WAV file and renders to another one, so a full-duplex stream that plays
+ * back whatever it captures must reproduce the capture file in the render file, bit for bit,
+ * as long as nothing in between changes the audio: the stream runs at the hardware rate, and dither is off.
+ * That's checked for mono and stereo, with 16-bit and float buses, and with 16-bit and 32-bit pjsip frames.
+ * Without a capture file, the backend captures what it rendered, which is used to check the echo canceller's reference.
+ *
+ * Run with --bench to print how fast the driver runs full-duplex IO cycles, with the loopback backend
+ * running as fast as it can rather than in realtime, and how long each frame takes for every format combination.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#include <pthread.h>
+
+#define TEST_CLOCK_RATE     16000
+#define TEST_PACKET_FRAMES  320
+
+// Not a divisor of the packet size, so the reframers are exercised
+#define TEST_CYCLE_FRAMES   185
+
+// The capture file isn't a whole number of packets either, so it's looped in the middle of one
+#define TEST_INPUT_FRAMES   40037
+
+// How many packets are captured and played back, and how many packets of silence come first
+#define TEST_PACKETS        400
+#define TEST_PREFILL        3
+
+// How many IO cycles it takes the loopback backend to capture what it rendered, in the echo reference test
+#define TEST_REFERENCE_DELAY  4
+
+#define TEST_CAPTURE_FILE   "test_loopback_in.wav"
+#define TEST_RENDER_FILE    "test_loopback_out.wav"
+
+static pj_pool_factory testFactory;
+
+static pj_int16_t testInput[TEST_INPUT_FRAMES * 2];
+// Big enough for stereo 32-bit frames
+static pj_uint8_t testCaptured[TEST_PACKETS * TEST_PACKET_FRAMES * 2 * sizeof(pj_int32_t)];
+static pj_int16_t testRendered[(TEST_PACKETS + TEST_PREFILL + 64) * TEST_PACKET_FRAMES * 2];
+
+/**
+ * The stream under test plays back whatever it captured, TEST_PREFILL packets later.
+**/
+typedef struct test_echo
+{
+	// The packets captured so far (only the first TEST_PACKETS are kept), and the packets played so far
+	pj_uint32_t captured;
+	pj_uint32_t played;
+	
+	// The packets that were due to be played before they were captured
+	unsigned late;
+	
+} test_echo;
+
+static test_echo testEcho;
+
+static pj_status_t testRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_echo *echo = (test_echo *)user_data;
+	
+	if(echo->captured < TEST_PACKETS)
+	{
+		memcpy(testCaptured + (echo->captured * size), input, size);
+	}
+	
+	__atomic_store_n(&echo->captured, echo->captured + 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t testPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	test_echo *echo = (test_echo *)user_data;
+	pj_uint32_t packet = echo->played++;
+	
+	if((packet < TEST_PREFILL) || (packet >= TEST_PACKETS + TEST_PREFILL))
+	{
+		pj_bzero(output, size);
+		return PJ_SUCCESS;
+	}
+	
+	packet -= TEST_PREFILL;
+	
+	if(packet >= echo->captured)
+	{
+		echo->late++;
+		pj_bzero(output, size);
+		return PJ_SUCCESS;
+	}
+	
+	memcpy(output, testCaptured + (packet * size), size);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Writes a WAV file of pseudo random audio, covering the whole 16-bit range.
+**/
+static pj_bool_t testWriteInput(const char *path, unsigned channels)
+{
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	snd_wav_file wav;
+	
+	unsigned state = 0x1234567 + channels;
+	testRandomSamples(testInput, TEST_INPUT_FRAMES * channels, &state);
+	
+	if((pool == NULL) || (wavOpenWrite(pool, path, TEST_CLOCK_RATE, channels, &wav) != PJ_SUCCESS))
+	{
+		return PJ_FALSE;
+	}
+	
+	wavWrite(&wav, testInput, TEST_INPUT_FRAMES);
+	wavClose(&wav, PJ_TRUE);
+	
+	pj_pool_release(pool);
+	
+	return (wav.dataSize == TEST_INPUT_FRAMES * channels * sizeof(pj_int16_t));
+}
+
+/**
+ * Reads the render file into testRendered. Returns the number of frames read, or 0 on failure.
+**/
+static unsigned testReadOutput(const char *path, unsigned channels)
+{
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	snd_wav_file wav;
+	
+	if((pool == NULL) || (wavOpenRead(pool, path, &wav) != PJ_SUCCESS))
+	{
+		return 0;
+	}
+	
+	unsigned numFrames = wav.dataSize / (channels * sizeof(pj_int16_t));
+	
+	if((wav.channels != channels) || (wav.sampleRate != TEST_CLOCK_RATE))
+	{
+		numFrames = 0;
+	}
+	
+	if(numFrames > PJ_ARRAY_SIZE(testRendered) / channels)
+	{
+		numFrames = PJ_ARRAY_SIZE(testRendered) / channels;
+	}
+	
+	wavRead(&wav, testRendered, numFrames);
+	wavClose(&wav, PJ_FALSE);
+	
+	pj_pool_release(pool);
+	
+	return numFrames;
+}
+
+/**
+ * Has the loopback backend run as fast as it can, with the given capture and render files (if any).
+**/
+static pj_bool_t testUseLoopback(unsigned hwClockRate, unsigned framesPerCycle, const char *captureFile,
+                                 const char *renderFile)
+{
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	param.hw_clock_rate = hwClockRate;
+	param.frames_per_cycle = framesPerCycle;
+	param.realtime = PJ_FALSE;
+	param.capture_file = captureFile;
+	param.render_file = renderFile;
+	
+	return (pjmedia_snd_iphone_use_loopback(&param) == PJ_SUCCESS);
+}
+
+/**
+ * Opens a full-duplex stream that echoes what it captures, with the given bus format and pjsip sample size,
+ * no dither and no fade in.
+**/
+static pjmedia_snd_stream *testOpenEcho(unsigned clockRate, unsigned channels, unsigned bitsPerSample,
+                                        pj_bool_t floatFormat, unsigned hwClockRate)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.float_format = floatFormat;
+	options.dither = PJ_FALSE;
+	options.fade_msec = 0;
+	options.hw_clock_rate = hwClockRate;
+	
+	pj_bzero(&testEcho, sizeof(testEcho));
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	if((pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS) ||
+	   (pjmedia_snd_open(-1, -1, clockRate, channels, TEST_PACKET_FRAMES * channels, bitsPerSample,
+	                     testRecCallback, testPlayCallback, &testEcho, &snd_strm) != PJ_SUCCESS))
+	{
+		return NULL;
+	}
+	
+	return snd_strm;
+}
+
+/**
+ * Runs the stream until it has captured the given number of packets, or a few seconds have passed.
+**/
+static pj_bool_t testRunEcho(pjmedia_snd_stream *snd_strm, pj_uint32_t packets)
+{
+	unsigned msec;
+	
+	if(pjmedia_snd_stream_start(snd_strm) != PJ_SUCCESS)
+	{
+		return PJ_FALSE;
+	}
+	
+	for(msec = 0; (msec < 5000) && (__atomic_load_n(&testEcho.captured, __ATOMIC_ACQUIRE) < packets); msec++)
+	{
+		pj_thread_sleep(1);
+	}
+	
+	pjmedia_snd_stream_stop(snd_strm);
+	
+	return (testEcho.captured >= packets);
+}
+
+/**
+ * Returns a captured sample as a 16-bit sample, or -1 if it's a 32-bit sample that isn't a 16-bit sample widened.
+**/
+static int testCapturedSample(unsigned i, unsigned bitsPerSample)
+{
+	if(bitsPerSample == 16)
+	{
+		return ((const pj_int16_t *)testCaptured)[i];
+	}
+	
+	pj_int32_t sample = ((const pj_int32_t *)testCaptured)[i];
+	
+	return ((sample & 0xffff) == 0) ? (sample >> 16) : -1;
+}
+
+/**
+ * Captures from a WAV file and renders what was captured to another one, and compares the three.
+**/
+static void testRoundTrip(void)
+{
+	unsigned channels, bitsPerSample;
+	pj_bool_t floatFormat;
+	
+	for(channels = 1; channels <= 2; channels++)
+	{
+		for(bitsPerSample = 16; bitsPerSample <= 32; bitsPerSample += 16)
+		{
+			for(floatFormat = PJ_FALSE; floatFormat <= PJ_TRUE; floatFormat++)
+			{
+				CHECK(testWriteInput(TEST_CAPTURE_FILE, channels));
+				CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, TEST_CAPTURE_FILE, TEST_RENDER_FILE));
+				
+				pjmedia_snd_stream *snd_strm = testOpenEcho(TEST_CLOCK_RATE, channels, bitsPerSample, floatFormat, 0);
+				CHECK(snd_strm != NULL);
+				
+				pj_bool_t isFloat = snd_strm->unit->outputFormat.isFloat && snd_strm->unit->inputFormat.isFloat;
+				
+				// The last packet captured is played TEST_PREFILL packets later, so run until it has surely been rendered
+				pj_bool_t done = testRunEcho(snd_strm, TEST_PACKETS + TEST_PREFILL + 2);
+				
+				// Closing the last stream disposes of the voice unit, which completes the render file
+				pjmedia_snd_stream_close(snd_strm);
+				
+				unsigned rendered = testReadOutput(TEST_RENDER_FILE, channels);
+				
+				remove(TEST_CAPTURE_FILE);
+				remove(TEST_RENDER_FILE);
+				
+				CHECK_MSG(done, "%u channel(s), %u bits, float %d: captured %u packets",
+				          channels, bitsPerSample, floatFormat, testEcho.captured);
+				CHECK(isFloat == floatFormat);
+				CHECK(testEcho.late == 0);
+				
+				// What was captured is the capture file, looped
+				
+				unsigned numFrames = TEST_PACKETS * TEST_PACKET_FRAMES;
+				unsigned i;
+				
+				for(i = 0; i < numFrames * channels; i++)
+				{
+					if(testCapturedSample(i, bitsPerSample) != testInput[i % (TEST_INPUT_FRAMES * channels)])
+					{
+						break;
+					}
+				}
+				
+				CHECK_MSG(i == numFrames * channels, "%u channel(s), %u bits, float %d: captured sample %u is %d, expected %d",
+				          channels, bitsPerSample, floatFormat, i, testCapturedSample(i, bitsPerSample),
+				          testInput[i % (TEST_INPUT_FRAMES * channels)]);
+				
+				// What was rendered is the silence we started with, and then what was captured
+				
+				unsigned silence = TEST_PREFILL * TEST_PACKET_FRAMES * channels;
+				
+				CHECK_MSG(rendered >= (TEST_PREFILL * TEST_PACKET_FRAMES) + numFrames,
+				          "%u channel(s), %u bits, float %d: rendered %u frames", channels, bitsPerSample, floatFormat, rendered);
+				
+				for(i = 0; i < silence; i++)
+				{
+					CHECK(testRendered[i] == 0);
+				}
+				
+				for(i = 0; i < numFrames * channels; i++)
+				{
+					if(testRendered[silence + i] != testCapturedSample(i, bitsPerSample))
+					{
+						break;
+					}
+				}
+				
+				CHECK_MSG(i == numFrames * channels, "%u channel(s), %u bits, float %d: rendered sample %u differs from "
+				          "the captured sample", channels, bitsPerSample, floatFormat, i);
+			}
+		}
+	}
+}
+
+/**
+ * Starting and stopping a stream any number of times doesn't grow the voice unit's pool,
+ * even though the loopback backend opens its files and creates its timer thread on every start.
+ * Nor does it leave any pools behind once the stream is closed.
+**/
+static void testRestart(void)
+{
+	int pools = testFactory.poolCount;
+	
+	CHECK(testWriteInput(TEST_CAPTURE_FILE, 1));
+	CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, TEST_CAPTURE_FILE, TEST_RENDER_FILE));
+	
+	pjmedia_snd_stream *snd_strm = testOpenEcho(TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 0);
+	CHECK(snd_strm != NULL);
+	
+	pj_pool_t *unitPool = snd_strm->unit->pool;
+	pj_size_t capacity = 0;
+	pj_bool_t grew = PJ_FALSE;
+	pj_bool_t started = PJ_TRUE;
+	unsigned i;
+	
+	for(i = 0; (i < 100) && started; i++)
+	{
+		started = (pjmedia_snd_stream_start(snd_strm) == PJ_SUCCESS);
+		pjmedia_snd_stream_stop(snd_strm);
+		
+		if(i == 0)
+		{
+			capacity = pj_pool_get_capacity(unitPool);
+		}
+		else if(pj_pool_get_capacity(unitPool) != capacity)
+		{
+			grew = PJ_TRUE;
+		}
+	}
+	
+	pj_size_t finalCapacity = pj_pool_get_capacity(unitPool);
+	
+	pjmedia_snd_stream_close(snd_strm);
+	
+	remove(TEST_CAPTURE_FILE);
+	remove(TEST_RENDER_FILE);
+	
+	CHECK(started);
+	CHECK_MSG(!grew, "the voice unit's pool grew from %u to %u bytes", (unsigned)capacity, (unsigned)finalCapacity);
+	CHECK_MSG(testFactory.poolCount == pools, "%d pools left behind", testFactory.poolCount - pools);
+}
+
+static snd_backend testFailingBackend;
+
+static pj_status_t testFailingStart(snd_voice_unit *unit)
+{
+	return PJ_ENOMEM;
+}
+
+/**
+ * If the voice unit fails to start, so does the stream, and the next start tries again.
+**/
+static void testStartFailure(void)
+{
+	CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, NULL, NULL));
+	
+	pjmedia_snd_stream *snd_strm = testOpenEcho(TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 0);
+	CHECK(snd_strm != NULL);
+	
+	snd_voice_unit *unit = snd_strm->unit;
+	
+	testFailingBackend = loopback_backend;
+	testFailingBackend.unitStart = testFailingStart;
+	
+	unit->backend = &testFailingBackend;
+	
+	pj_status_t status = pjmedia_snd_stream_start(snd_strm);
+	pj_bool_t stopped = !unit->isRunning && (snd_strm->state == SND_STREAM_STOPPED);
+	
+	unit->backend = &loopback_backend;
+	
+	pj_bool_t done = testRunEcho(snd_strm, 10);
+	
+	pjmedia_snd_stream_close(snd_strm);
+	
+	CHECK_MSG(status == PJ_ENOMEM, "the stream started with status %d", status);
+	CHECK(stopped);
+	CHECK_MSG(done, "the stream didn't run once started again");
+}
+
+static pj_status_t testFailingInit(void)
+{
+	return PJ_ENOMEM;
+}
+
+/**
+ * If the backend fails to initialize, so does the driver, without leaving anything behind.
+ * Opening a stream fails, rather than finding a half initialized driver.
+**/
+static void testInitFailure(void)
+{
+	pjmedia_snd_deinit();
+	
+	int pools = testFactory.poolCount;
+	
+	testFailingBackend = loopback_backend;
+	testFailingBackend.init = testFailingInit;
+	
+	snd_io_backend = &testFailingBackend;
+	
+	pj_status_t status = pjmedia_snd_init(&testFactory);
+	pj_bool_t clean = (snd_pool_factory == NULL) && (snd_pool == NULL) && (snd_streams_mutex == NULL) &&
+	                  (testFactory.poolCount == pools);
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	pj_status_t openStatus = pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+	                                                 testPlayCallback, &testEcho, &snd_strm);
+	
+	// Leave the driver initialized for whatever comes next
+	snd_io_backend = &loopback_backend;
+	
+	CHECK(pjmedia_snd_init(&testFactory) == PJ_SUCCESS);
+	
+	CHECK(status == PJ_ENOMEM);
+	CHECK(clean);
+	CHECK(openStatus == PJ_EINVALIDOP);
+}
+
+static pj_uint32_t testPlayed;
+
+/**
+ * Plays silence, and counts the packets played.
+**/
+static pj_status_t testCountingPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	pj_bzero(output, size);
+	
+	__atomic_add_fetch(&testPlayed, 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Waits until the given number of packets more have been played, or a few seconds have passed.
+**/
+static pj_bool_t testWaitPlayed(pj_uint32_t packets)
+{
+	pj_uint32_t target = __atomic_load_n(&testPlayed, __ATOMIC_ACQUIRE) + packets;
+	unsigned msec;
+	
+	for(msec = 0; (msec < 5000) && (__atomic_load_n(&testPlayed, __ATOMIC_ACQUIRE) < target); msec++)
+	{
+		pj_thread_sleep(1);
+	}
+	
+	return (__atomic_load_n(&testPlayed, __ATOMIC_ACQUIRE) >= target);
+}
+
+/**
+ * Opens and starts a playback-only stream with the default options (PJMEDIA_SND_IPHONE_UNIT_AUTO),
+ * playing silence through testCountingPlayCallback.
+**/
+static pjmedia_snd_stream *testStartPlayer(void)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	if((pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS) ||
+	   (pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+	                            testCountingPlayCallback, NULL, &snd_strm) != PJ_SUCCESS))
+	{
+		return NULL;
+	}
+	
+	if(pjmedia_snd_stream_start(snd_strm) != PJ_SUCCESS)
+	{
+		pjmedia_snd_stream_close(snd_strm);
+		return NULL;
+	}
+	
+	return snd_strm;
+}
+
+/**
+ * A playback-only stream runs on RemoteIO. A full-duplex stream opened while it's playing gets voice processing,
+ * replacing RemoteIO with VoiceProcessingIO, and the playback-only stream keeps playing.
+**/
+static void testUnitUpgrade(void)
+{
+	CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, NULL, NULL));
+	
+	pjmedia_snd_stream *player = testStartPlayer();
+	CHECK(player != NULL);
+	
+	pj_bool_t played = testWaitPlayed(5);
+	
+	pjmedia_snd_iphone_stats playerStats;
+	pjmedia_snd_iphone_stream_get_stats(player, &playerStats);
+	
+	pjmedia_snd_stream *echo = testOpenEcho(TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 0);
+	
+	pjmedia_snd_iphone_stats echoStats;
+	pj_bzero(&echoStats, sizeof(echoStats));
+	
+	pj_bool_t running = player->unit->isRunning;
+	pj_bool_t playedOn = PJ_FALSE;
+	pj_bool_t done = PJ_FALSE;
+	
+	if(echo)
+	{
+		pjmedia_snd_iphone_stream_get_stats(echo, &echoStats);
+		
+		playedOn = testWaitPlayed(5);
+		done = testRunEcho(echo, 10);
+		
+		pjmedia_snd_stream_close(echo);
+	}
+	
+	pjmedia_snd_iphone_unit_type unitType = player->unit->unitType;
+	
+	pjmedia_snd_stream_close(player);
+	
+	CHECK(played);
+	CHECK(playerStats.unit_type == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO);
+	CHECK(echo != NULL);
+	CHECK_MSG(echoStats.unit_type == PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING,
+	          "the full-duplex stream runs on unit type %u", echoStats.unit_type);
+	CHECK(unitType == PJMEDIA_SND_IPHONE_UNIT_VOICE_PROCESSING);
+	CHECK(running);
+	CHECK_MSG(playedOn, "the playback-only stream stopped playing once the voice unit was replaced");
+	CHECK(done);
+}
+
+static int testInitializeFailures;
+
+static pj_status_t testFailingInitialize(snd_voice_unit *unit)
+{
+	if(testInitializeFailures > 0)
+	{
+		testInitializeFailures--;
+		return PJ_ENOMEM;
+	}
+	
+	return loopback_backend.unitInitialize(unit);
+}
+
+static unsigned testUnitsCreated;
+
+static pj_status_t testCountingCreate(snd_voice_unit *unit)
+{
+	testUnitsCreated++;
+	
+	return loopback_backend.unitCreate(unit);
+}
+
+/**
+ * If VoiceProcessingIO fails to initialize for a full-duplex stream, the full-duplex stream fails to open,
+ * and the playback-only stream gets a RemoteIO unit again, and keeps playing.
+**/
+static void testUnitUpgradeFailure(void)
+{
+	CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, NULL, NULL));
+	
+	pjmedia_snd_stream *player = testStartPlayer();
+	CHECK(player != NULL);
+	
+	snd_voice_unit *unit = player->unit;
+	
+	testFailingBackend = loopback_backend;
+	testFailingBackend.unitInitialize = testFailingInitialize;
+	testFailingBackend.unitCreate = testCountingCreate;
+	testInitializeFailures = 1;
+	testUnitsCreated = 0;
+	
+	unit->backend = &testFailingBackend;
+	
+	pjmedia_snd_stream *echo = testOpenEcho(TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 0);
+	
+	unit->backend = &loopback_backend;
+	
+	pjmedia_snd_iphone_unit_type unitType = unit->unitType;
+	pjmedia_dir unitDir = unit->dir;
+	pjmedia_dir ioDir = ((snd_loopback_unit *)unit->backendState)->ioDir;
+	pj_bool_t running = unit->isRunning;
+	pj_bool_t played = testWaitPlayed(5);
+	
+	if(echo)
+	{
+		pjmedia_snd_stream_close(echo);
+	}
+	
+	pjmedia_snd_stream_close(player);
+	
+	CHECK(echo == NULL);
+	CHECK(testInitializeFailures == 0);
+	CHECK_MSG(testUnitsCreated == 2, "%u audio units created, expected VoiceProcessingIO and RemoteIO again",
+	          testUnitsCreated);
+	CHECK_MSG(unitType == PJMEDIA_SND_IPHONE_UNIT_REMOTE_IO, "the voice unit was left on unit type %u", unitType);
+	CHECK(unitDir == PJMEDIA_DIR_PLAYBACK);
+	CHECK_MSG(ioDir == PJMEDIA_DIR_PLAYBACK, "the backend has IO enabled for direction %d", ioDir);
+	CHECK(running);
+	CHECK_MSG(played, "the playback-only stream stopped playing");
+}
+
+/**
+ * An IO thread of our own, which pjlib doesn't know about, runs a few IO cycles of a stream
+ * (which must not be started).
+**/
+typedef struct test_io_thread
+{
+	pjmedia_snd_stream *snd_strm;
+	
+	// Whether all rendered audio was silent
+	pj_bool_t silent;
+	
+} test_io_thread;
+
+extern pj_status_t stubThreadRegisterStatus;
+
+static void *testIOThreadProc(void *arg)
+{
+	test_io_thread *io = (test_io_thread *)arg;
+	snd_voice_unit *unit = io->snd_strm->unit;
+	
+	pj_int16_t buffer[TEST_CYCLE_FRAMES];
+	snd_io_time time;
+	unsigned cycle, i;
+	
+	time.hostTime = 0;
+	time.sampleTimeValid = PJ_TRUE;
+	time.hostTimeValid = PJ_FALSE;
+	
+	io->silent = PJ_TRUE;
+	
+	for(cycle = 0; cycle < 20; cycle++)
+	{
+		time.sampleTime = (double)(cycle * TEST_CYCLE_FRAMES);
+		
+		renderStream(unit, io->snd_strm, &time, TEST_CYCLE_FRAMES, buffer, sizeof(buffer));
+		
+		for(i = 0; i < TEST_CYCLE_FRAMES; i++)
+		{
+			io->silent = io->silent && (buffer[i] == 0);
+		}
+		
+		captureStream(unit, io->snd_strm, &time, TEST_CYCLE_FRAMES, buffer, sizeof(buffer));
+	}
+	
+	return NULL;
+}
+
+/**
+ * Counts the messages in the deferred log (that haven't been drained yet) with the given log level.
+**/
+static unsigned testLogged(const snd_log *log, int level)
+{
+	unsigned count = 0;
+	pj_uint32_t i;
+	
+	for(i = log->readIndex; i != log->writeIndex; i++)
+	{
+		count += (log->entries[i % DEFERRED_LOG_SIZE].level == level);
+	}
+	
+	return count;
+}
+
+/**
+ * In synchronous mode, an IO thread that can't be registered with pjlib never calls into pjsip.
+ * The stream plays silence and drops the captured audio, and logs the failure once per IO thread.
+**/
+static void testRegisterFailure(void)
+{
+	pj_status_t statuses[] = { PJ_EUNKNOWN, PJ_SUCCESS };
+	unsigned s;
+	
+	for(s = 0; s < PJ_ARRAY_SIZE(statuses); s++)
+	{
+		CHECK(testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, NULL, NULL));
+		
+		pjmedia_snd_stream *snd_strm = testOpenEcho(TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 0);
+		CHECK(snd_strm != NULL);
+		
+		// Play something other than silence from the start
+		memset(testCaptured, 0x11, sizeof(testCaptured));
+		testEcho.played = TEST_PREFILL;
+		testEcho.captured = TEST_PACKETS;
+		
+		test_io_thread io;
+		io.snd_strm = snd_strm;
+		
+		pthread_t thread;
+		
+		stubThreadRegisterStatus = statuses[s];
+		pj_bool_t created = (pthread_create(&thread, NULL, testIOThreadProc, &io) == 0);
+		
+		if(created)
+		{
+			pthread_join(thread, NULL);
+		}
+		
+		stubThreadRegisterStatus = PJ_SUCCESS;
+		
+		pj_bool_t failed = snd_strm->unit->outputThreadFailed && snd_strm->unit->inputThreadFailed;
+		unsigned errors = testLogged(&snd_strm->renderLog, 1) + testLogged(&snd_strm->captureLog, 1);
+		
+		resetIOThreads(snd_strm->unit);
+		pjmedia_snd_stream_close(snd_strm);
+		
+		CHECK(created);
+		
+		if(statuses[s] != PJ_SUCCESS)
+		{
+			CHECK(failed);
+			CHECK_MSG(errors == 2, "%u errors logged, expected one per IO thread", errors);
+			CHECK_MSG(testEcho.played == TEST_PREFILL, "play_cb was invoked %u times",
+			          testEcho.played - TEST_PREFILL);
+			CHECK_MSG(testEcho.captured == TEST_PACKETS, "rec_cb was invoked %u times",
+			          testEcho.captured - TEST_PACKETS);
+			CHECK(io.silent);
+		}
+		else
+		{
+			// Our own thread gets registered as usual, and gets the callbacks going
+			CHECK(!failed);
+			CHECK(errors == 0);
+			CHECK(testEcho.played > TEST_PREFILL);
+			CHECK(testEcho.captured > TEST_PACKETS);
+			CHECK(!io.silent);
+		}
+	}
+}
+
+#if !SND_ARENA_CHECK
+#error "The echo reference test relies on SND_ARENA_CHECK to catch allocations on the IO threads"
+#endif
+
+/**
+ * The echo reference test plays numbered samples, which the loopback backend captures again loopback_delay IO cycles later.
+ * They're numbered from 1 (so silence is told apart) to a whole number of packets, and then again.
+**/
+#define TEST_REFERENCE_PERIOD  (100 * TEST_PACKET_FRAMES)
+
+static pj_int16_t testReferenceSample(int number)
+{
+	return (pj_int16_t)((((number - 1) % TEST_REFERENCE_PERIOD) + TEST_REFERENCE_PERIOD) % TEST_REFERENCE_PERIOD + 1);
+}
+
+typedef struct test_reference
+{
+	// The samples played so far
+	pj_uint32_t played;
+	
+	// The packets captured so far, and how many of them had a far-end packet, and started after playback did
+	pj_uint32_t captured;
+	unsigned paired;
+	unsigned checked;
+	
+	// The first packet that didn't line up, if any
+	unsigned mismatches;
+	unsigned farEndFirst;
+	unsigned nearEndFirst;
+	unsigned delay;
+	
+} test_reference;
+
+static test_reference testReference;
+
+static pj_status_t testNumberedPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	test_reference *ref = (test_reference *)user_data;
+	pj_int16_t *samples = (pj_int16_t *)output;
+	unsigned i;
+	
+	for(i = 0; i < size / sizeof(pj_int16_t); i++)
+	{
+		samples[i] = testReferenceSample(++ref->played);
+	}
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t testCountingRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_reference *ref = (test_reference *)user_data;
+	
+	__atomic_store_n(&ref->captured, ref->captured + 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Checks that the far-end packet is a packet as it was played, and that the near-end packet,
+ * which is what was played loopback_delay cycles earlier, is where the delay says it is.
+**/
+static void testAecCallback(void *user_data, pj_uint32_t timestamp, const pj_int16_t *far_end,
+                            pj_int16_t *near_end, unsigned samples, unsigned delay)
+{
+	test_reference *ref = (test_reference *)user_data;
+	
+	if(far_end == NULL)
+	{
+		return;
+	}
+	
+	ref->paired++;
+	
+	// Until playback has been looped back, the near-end packet is (partly) silence
+	if((near_end[0] == 0) || (near_end[samples - 1] == 0))
+	{
+		return;
+	}
+	
+	ref->checked++;
+	
+	// The played sample at the start of the near-end packet, and the one that was looped back to it
+	int playing = far_end[0] + delay;
+	int looped = playing - (TEST_REFERENCE_DELAY * TEST_CYCLE_FRAMES);
+	
+	// Far-end packets start on a packet boundary of the played samples
+	pj_bool_t lined = (((far_end[0] - 1) % TEST_PACKET_FRAMES) == 0);
+	unsigned i;
+	
+	for(i = 0; i < samples; i++)
+	{
+		if((far_end[i] != testReferenceSample(far_end[0] + i)) || (near_end[i] != testReferenceSample(looped + i)))
+		{
+			lined = PJ_FALSE;
+		}
+	}
+	
+	if(!lined && (ref->mismatches++ == 0))
+	{
+		ref->farEndFirst = far_end[0];
+		ref->nearEndFirst = near_end[0];
+		ref->delay = delay;
+	}
+}
+
+/**
+ * The echo canceller gets the packets exactly as they were played, with a delay that accounts for
+ * the playback and capture timing, so the echo turns up loopback_delay cycles after where the delay puts it.
+ * This runs under SND_ARENA_CHECK, so copying the far-end packet doesn't allocate on the capture side.
+**/
+static void testEchoReference(void)
+{
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	param.hw_clock_rate = TEST_CLOCK_RATE;
+	param.frames_per_cycle = TEST_CYCLE_FRAMES;
+	param.realtime = PJ_FALSE;
+	param.loopback_delay = TEST_REFERENCE_DELAY;
+	
+	CHECK(pjmedia_snd_iphone_use_loopback(&param) == PJ_SUCCESS);
+	
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.dither = PJ_FALSE;
+	options.fade_msec = 0;
+	options.aec_cb = testAecCallback;
+	
+	pj_bzero(&testReference, sizeof(testReference));
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	CHECK(pjmedia_snd_iphone_set_options(&options) == PJ_SUCCESS);
+	CHECK(pjmedia_snd_open(-1, -1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16, testCountingRecCallback,
+	                       testNumberedPlayCallback, &testReference, &snd_strm) == PJ_SUCCESS);
+	
+	pj_bool_t started = (pjmedia_snd_stream_start(snd_strm) == PJ_SUCCESS);
+	unsigned msec;
+	
+	for(msec = 0; started && (msec < 5000) && (__atomic_load_n(&testReference.captured, __ATOMIC_ACQUIRE) < 150); msec++)
+	{
+		pj_thread_sleep(1);
+	}
+	
+	pjmedia_snd_stream_stop(snd_strm);
+	
+	pjmedia_snd_iphone_stats stats;
+	pjmedia_snd_iphone_stream_get_stats(snd_strm, &stats);
+	
+	pjmedia_snd_stream_close(snd_strm);
+	pjmedia_snd_iphone_options_default(&options);
+	pjmedia_snd_iphone_set_options(&options);
+	
+	CHECK(started);
+	CHECK(testReference.captured >= 150);
+	CHECK_MSG(testReference.checked >= 100, "%u of %u captured packets were checked (%u paired)",
+	          testReference.checked, testReference.captured, testReference.paired);
+	CHECK(stats.aec_pairs == testReference.paired);
+	CHECK_MSG(testReference.mismatches == 0, "%u packets didn't line up, the first with far end %u, near end %u, delay %u",
+	          testReference.mismatches, testReference.farEndFirst, testReference.nearEndFirst, testReference.delay);
+}
+
+// Benchmarks
+
+#define BENCH_MSEC  500
+
+/**
+ * Runs a full-duplex stream without any files for a while, and prints how many frames it ran per second,
+ * how many times faster than realtime that is, and how long each frame took (capture and render together).
+**/
+static void benchStream(const char *name, unsigned clockRate, unsigned channels, unsigned bitsPerSample,
+                        pj_bool_t floatFormat, unsigned hwClockRate, unsigned framesPerCycle)
+{
+	if(!testUseLoopback(hwClockRate, framesPerCycle, NULL, NULL))
+	{
+		return;
+	}
+	
+	pjmedia_snd_stream *snd_strm = testOpenEcho(clockRate, channels, bitsPerSample, floatFormat, hwClockRate);
+	
+	if(snd_strm == NULL)
+	{
+		return;
+	}
+	
+	double start = benchNow();
+	
+	if(pjmedia_snd_stream_start(snd_strm) != PJ_SUCCESS)
+	{
+		pjmedia_snd_stream_close(snd_strm);
+		return;
+	}
+	
+	pj_thread_sleep(BENCH_MSEC);
+	pjmedia_snd_stream_stop(snd_strm);
+	
+	double elapsed = benchNow() - start;
+	
+	pjmedia_snd_stream_close(snd_strm);
+	
+	double frames = (double)testEcho.captured * TEST_PACKET_FRAMES;
+	
+	printf("  %-40s %12.0f %12.0f %10.1f\n", name, frames / elapsed, frames / clockRate / elapsed,
+	       (elapsed * 1e9) / frames);
+}
+
+static void benchLoopback(void)
+{
+	printf("full-duplex loopback for %u msec, packets of %u frames, play callback echoing the rec callback\n",
+	       BENCH_MSEC, TEST_PACKET_FRAMES);
+	printf("  %-40s %12s %12s %10s\n", "", "frames/s", "x realtime", "ns/frame");
+	
+	benchStream("16 kHz mono, 185 frame cycles", TEST_CLOCK_RATE, 1, 16, PJ_FALSE, TEST_CLOCK_RATE, 185);
+	benchStream("16 kHz mono, 1024 frame cycles", TEST_CLOCK_RATE, 1, 16, PJ_FALSE, TEST_CLOCK_RATE, 1024);
+	benchStream("16 kHz stereo, 512 frame cycles", TEST_CLOCK_RATE, 2, 16, PJ_FALSE, TEST_CLOCK_RATE, 512);
+	benchStream("16 kHz mono on 48 kHz, 1024 cycles", TEST_CLOCK_RATE, 1, 16, PJ_FALSE, 48000, 1024);
+	
+	// Every combination of bus format, pjsip sample size and channels, at the same rate and cycle size
+	
+	unsigned channels, bitsPerSample;
+	pj_bool_t floatFormat;
+	
+	printf("\nformat combinations, 16 kHz, 512 frame cycles\n");
+	printf("  %-40s %12s %12s %10s\n", "", "frames/s", "x realtime", "ns/frame");
+	
+	for(floatFormat = PJ_FALSE; floatFormat <= PJ_TRUE; floatFormat++)
+	{
+		for(bitsPerSample = 16; bitsPerSample <= 32; bitsPerSample += 16)
+		{
+			for(channels = 1; channels <= 2; channels++)
+			{
+				char name[64];
+				
+				snprintf(name, sizeof(name), "%s bus, %u-bit frames, %s", floatFormat ? "float" : "16-bit",
+				         bitsPerSample, (channels == 1) ? "mono" : "stereo");
+				
+				benchStream(name, TEST_CLOCK_RATE, channels, bitsPerSample, floatFormat, TEST_CLOCK_RATE, 512);
+			}
+		}
+	}
+	
+	benchStream("float bus, 32-bit frames, mono on 48 kHz", TEST_CLOCK_RATE, 1, 32, PJ_TRUE, 48000, 512);
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(!testUseLoopback(TEST_CLOCK_RATE, TEST_CYCLE_FRAMES, NULL, NULL) ||
+	   (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		benchLoopback();
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testRoundTrip);
+	RUN_TEST(testRestart);
+	RUN_TEST(testStartFailure);
+	RUN_TEST(testInitFailure);
+	RUN_TEST(testUnitUpgrade);
+	RUN_TEST(testUnitUpgradeFailure);
+	RUN_TEST(testEchoReference);
+	RUN_TEST(testRegisterFailure);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}
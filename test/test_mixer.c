@@ -0,0 +1,510 @@
+/**
+ * Tests and benchmarks of the playback mixer.
+ *
+ * mixSaturate must match a plain clamped add for any length and alignment, whatever vector unit it was compiled for.
+ * The render callback (voiceUnitRender) must produce the saturated sum of every active playback stream,
+ * added in slot order, which is checked end to end with up to MAX_ACTIVE_STREAMS streams on the loopback backend.
+ * And when a new stream fails to set up the voice unit they share, the streams already using it must carry on.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define TEST_MAX_SAMPLES  4096
+
+static pj_pool_factory testFactory;
+
+/**
+ * Adds one sample at a time, and clamps the sum to the 16-bit range.
+**/
+static void __attribute__((noinline)) referenceMix(pj_int16_t *dst, const pj_int16_t *src, unsigned numSamples)
+{
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		pj_int32_t sum = (pj_int32_t)dst[i] + src[i];
+		
+		if(sum > 32767)  sum = 32767;
+		if(sum < -32768) sum = -32768;
+		
+		dst[i] = (pj_int16_t)sum;
+	}
+}
+
+static pj_int16_t testSource[TEST_MAX_SAMPLES + 16];
+static pj_int16_t testExpected[TEST_MAX_SAMPLES + 16];
+static pj_int16_t testActual[TEST_MAX_SAMPLES + 16];
+
+/**
+ * mixSaturate matches the reference for every length up to 64 samples (and a few long ones),
+ * and every sample offset within a vector. Samples just past the end of the output must be left alone.
+**/
+static void testMixSaturate(void)
+{
+	static const unsigned longLengths[] = { 160, 320, 882, 960, 4093 };
+	
+	unsigned state = 0x6d2b79f5;
+	unsigned length, offset;
+	
+	for(length = 0; length < (64 + PJ_ARRAY_SIZE(longLengths)); length++)
+	{
+		unsigned numSamples = (length < 64) ? length : longLengths[length - 64];
+		
+		for(offset = 0; offset < 8; offset++)
+		{
+			testRandomSamples(testSource, PJ_ARRAY_SIZE(testSource), &state);
+			testRandomSamples(testExpected, PJ_ARRAY_SIZE(testExpected), &state);
+			memcpy(testActual, testExpected, sizeof(testActual));
+			
+			// The source comes from a different offset than the destination, like the mix buffer does
+			referenceMix(testExpected + offset, testSource + (7 - offset), numSamples);
+			mixSaturate(testActual + offset, testSource + (7 - offset), numSamples);
+			
+			if(memcmp(testActual, testExpected, sizeof(testActual)) != 0)
+			{
+				unsigned i;
+				for(i = 0; testActual[i] == testExpected[i]; i++);
+				
+				CHECK_MSG(0, "%u samples at offset %u: sample %u is %d, expected %d",
+				          numSamples, offset, i, testActual[i], testExpected[i]);
+			}
+		}
+	}
+}
+
+/**
+ * Sums at and beyond the limits clip, rather than wrap around.
+**/
+static void testMixLimits(void)
+{
+	static const pj_int16_t a[]        = { 32767, -32768, 30000, -30000, 32767, -32768, 1, -1, 0 };
+	static const pj_int16_t b[]        = { 1,     -1,     30000, -30000, -32768, 32767, -1, 1, 0 };
+	static const pj_int16_t expected[] = { 32767, -32768, 32767, -32768, -1,     -1,     0,  0, 0 };
+	
+	pj_int16_t dst[PJ_ARRAY_SIZE(a)];
+	memcpy(dst, a, sizeof(dst));
+	
+	mixSaturate(dst, b, PJ_ARRAY_SIZE(a));
+	
+	CHECK(memcmp(dst, expected, sizeof(dst)) == 0);
+}
+
+// The render callback, with several streams
+
+#define TEST_CLOCK_RATE     16000
+#define TEST_PACKET_FRAMES  320
+
+/**
+ * A playback stream under test. Each one plays its own pseudo random audio, which gets loud enough
+ * that several of them together clip.
+**/
+typedef struct test_player
+{
+	pjmedia_snd_stream *snd_strm;
+	unsigned seed;
+	
+	pj_uint32_t samples;
+	
+} test_player;
+
+static pj_int16_t testPlayerSample(const test_player *player, pj_uint32_t position)
+{
+	unsigned state = (player->seed * 2654435761u) ^ (position * 40503u) ^ 0x9e3779b9;
+	
+	testRandom(&state);
+	return (pj_int16_t)(testRandom(&state) >> 17) - 8192;
+}
+
+static pj_status_t testPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	test_player *player = (test_player *)user_data;
+	pj_int16_t *samples = (pj_int16_t *)output;
+	unsigned i;
+	
+	for(i = 0; i < size / sizeof(pj_int16_t); i++)
+	{
+		samples[i] = testPlayerSample(player, player->samples++);
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Opens the given number of playback streams on the loopback backend, all sharing the voice unit,
+ * and makes them active without starting the unit, so the render callback is ours to drive.
+**/
+static pj_bool_t testOpenPlayers(test_player *players, unsigned count, unsigned channels)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	// A fade in would make the first few milliseconds harder to predict
+	options.fade_msec = 0;
+	
+	if(pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS)
+	{
+		return PJ_FALSE;
+	}
+	
+	// Whatever happens, testClosePlayers can tell which streams were opened
+	pj_bzero(players, count * sizeof(test_player));
+	
+	unsigned i;
+	
+	for(i = 0; i < count; i++)
+	{
+		players[i].seed = i + 1;
+		
+		if(pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, channels, TEST_PACKET_FRAMES * channels, 16,
+		                           testPlayCallback, &players[i], &players[i].snd_strm) != PJ_SUCCESS)
+		{
+			return PJ_FALSE;
+		}
+		
+		voiceUnitSlotAdd(players[i].snd_strm->unit->players, players[i].snd_strm);
+	}
+	
+	return PJ_TRUE;
+}
+
+static void testClosePlayers(test_player *players, unsigned count)
+{
+	unsigned i;
+	
+	for(i = 0; i < count; i++)
+	{
+		if(players[i].snd_strm)
+		{
+			voiceUnitSlotRemove(players[i].snd_strm->unit->players, players[i].snd_strm);
+			pjmedia_snd_stream_close(players[i].snd_strm);
+		}
+	}
+}
+
+/**
+ * Renders an IO cycle of the shared voice unit.
+**/
+static void testRender(snd_voice_unit *unit, pj_uint64_t sampleTime, unsigned numFrames, pj_int16_t *output)
+{
+	snd_io_time time;
+	
+	time.sampleTime = (double)sampleTime;
+	time.hostTime = 0;
+	time.sampleTimeValid = PJ_TRUE;
+	time.hostTimeValid = PJ_FALSE;
+	
+	voiceUnitRender(unit, &time, numFrames, output, numFrames * unit->outputFormat.channels * sizeof(pj_int16_t));
+}
+
+static void testMixStreams(void)
+{
+	static const unsigned cycles[] = { 185, 186, 512, 1, 1024, 93 };
+	static pj_int16_t output[TEST_MAX_SAMPLES * 2];
+	static pj_int16_t expected[TEST_MAX_SAMPLES * 2];
+	
+	unsigned count, channels;
+	
+	for(channels = 1; channels <= 2; channels++)
+	{
+		for(count = 1; count <= MAX_ACTIVE_STREAMS; count++)
+		{
+			test_player players[MAX_ACTIVE_STREAMS];
+			
+			if(!testOpenPlayers(players, count, channels))
+			{
+				testClosePlayers(players, count);
+				CHECK_MSG(0, "unable to open %u streams", count);
+			}
+			
+			snd_voice_unit *unit = players[0].snd_strm->unit;
+			pj_uint64_t position = 0;
+			unsigned bad = 0;
+			unsigned k, i, s;
+			
+			for(k = 0; k < 200; k++)
+			{
+				unsigned numFrames = cycles[k % PJ_ARRAY_SIZE(cycles)];
+				unsigned numSamples = numFrames * channels;
+				
+				testRender(unit, position / channels, numFrames, output);
+				
+				// The streams are mixed in slot order, which is the order they were opened in
+				for(i = 0; i < numSamples; i++)
+				{
+					expected[i] = testPlayerSample(&players[0], position + i);
+				}
+				
+				for(s = 1; s < count; s++)
+				{
+					for(i = 0; i < numSamples; i++)
+					{
+						pj_int16_t sample = testPlayerSample(&players[s], position + i);
+						referenceMix(&expected[i], &sample, 1);
+					}
+				}
+				
+				if(memcmp(output, expected, numSamples * sizeof(pj_int16_t)) != 0)
+				{
+					bad++;
+				}
+				
+				position += numSamples;
+			}
+			
+			testClosePlayers(players, count);
+			
+			CHECK_MSG(bad == 0, "%u stream(s), %u channel(s): %u IO cycles are wrong", count, channels, bad);
+		}
+	}
+}
+
+// Reconfiguring the shared voice unit
+
+/**
+ * Which step of setting up the voice unit the failing backend fails.
+**/
+typedef enum test_failure
+{
+	TEST_FAIL_NONE,
+	TEST_FAIL_CAPTURE_FORMAT,
+	TEST_FAIL_INITIALIZE,
+	TEST_FAIL_PLAYBACK_FORMAT
+	
+} test_failure;
+
+static test_failure testFailure;
+static snd_backend testFailingBackend;
+
+static pj_status_t testFailingSetFormat(snd_voice_unit *unit, pjmedia_dir bus, unsigned clockRate, unsigned channels,
+                                        pj_bool_t isFloat, snd_bus_format *format)
+{
+	// Leave a mark on the format, like a backend that gives up halfway
+	format->channels = 7;
+	
+	if(((testFailure == TEST_FAIL_CAPTURE_FORMAT) && (bus == PJMEDIA_DIR_CAPTURE)) ||
+	   ((testFailure == TEST_FAIL_PLAYBACK_FORMAT) && (bus == PJMEDIA_DIR_PLAYBACK)))
+	{
+		return PJ_EINVAL;
+	}
+	
+	return loopback_backend.unitSetFormat(unit, bus, clockRate, channels, isFloat, format);
+}
+
+static pj_status_t testFailingInitialize(snd_voice_unit *unit)
+{
+	if(testFailure == TEST_FAIL_INITIALIZE)
+	{
+		// Only once, the voice unit has to come back for the other stream
+		testFailure = TEST_FAIL_NONE;
+		return PJ_EINVAL;
+	}
+	
+	return loopback_backend.unitInitialize(unit);
+}
+
+static pj_uint32_t testCallbacks;
+
+static pj_status_t testCountPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	pj_bzero(output, size);
+	__atomic_fetch_add(&testCallbacks, 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t testCountRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	__atomic_fetch_add(&testCallbacks, 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+static pjmedia_snd_stream *testOpenStream(pjmedia_dir dir)
+{
+	pjmedia_snd_stream *snd_strm = NULL;
+	pj_status_t status;
+	
+	if(dir == PJMEDIA_DIR_PLAYBACK)
+	{
+		status = pjmedia_snd_open_player(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+		                                 testCountPlayCallback, NULL, &snd_strm);
+	}
+	else
+	{
+		status = pjmedia_snd_open_rec(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+		                              testCountRecCallback, NULL, &snd_strm);
+	}
+	
+	return (status == PJ_SUCCESS) ? snd_strm : NULL;
+}
+
+/**
+ * A stream that fails to open while another one is running leaves the voice unit the way the running stream had it:
+ * initialized, with only its direction enabled, its bus format intact, and still running.
+**/
+static void testReconfigureFailure(void)
+{
+	static const test_failure failures[] = { TEST_FAIL_CAPTURE_FORMAT, TEST_FAIL_INITIALIZE, TEST_FAIL_PLAYBACK_FORMAT };
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(failures); i++)
+	{
+		// The stream that's already running uses the direction that isn't going to fail
+		
+		pjmedia_dir runningDir = (failures[i] == TEST_FAIL_PLAYBACK_FORMAT) ? PJMEDIA_DIR_CAPTURE : PJMEDIA_DIR_PLAYBACK;
+		pjmedia_dir newDir = (runningDir == PJMEDIA_DIR_CAPTURE) ? PJMEDIA_DIR_PLAYBACK : PJMEDIA_DIR_CAPTURE;
+		
+		pjmedia_snd_stream *running = testOpenStream(runningDir);
+		CHECK(running != NULL);
+		
+		snd_voice_unit *unit = running->unit;
+		snd_loopback_unit *lb = (snd_loopback_unit *)unit->backendState;
+		
+		if(pjmedia_snd_stream_start(running) != PJ_SUCCESS)
+		{
+			pjmedia_snd_stream_close(running);
+			CHECK_MSG(0, "unable to start the first stream");
+		}
+		
+		snd_bus_format format = (runningDir == PJMEDIA_DIR_CAPTURE) ? unit->inputFormat : unit->outputFormat;
+		
+		testFailingBackend = loopback_backend;
+		testFailingBackend.unitSetFormat = testFailingSetFormat;
+		testFailingBackend.unitInitialize = testFailingInitialize;
+		
+		unit->backend = &testFailingBackend;
+		testFailure = failures[i];
+		
+		pjmedia_snd_stream *failed = testOpenStream(newDir);
+		
+		testFailure = TEST_FAIL_NONE;
+		unit->backend = &loopback_backend;
+		
+		// The callbacks of the running stream carry on
+		
+		pj_uint32_t callbacks = __atomic_load_n(&testCallbacks, __ATOMIC_ACQUIRE);
+		pj_thread_sleep(100);
+		pj_bool_t alive = (__atomic_load_n(&testCallbacks, __ATOMIC_ACQUIRE) != callbacks);
+		
+		snd_bus_format after = (runningDir == PJMEDIA_DIR_CAPTURE) ? unit->inputFormat : unit->outputFormat;
+		
+		pj_bool_t restored = (unit->dir == runningDir) && unit->isRunning && lb->initialized &&
+		                     (lb->ioDir == (int)runningDir) && (lb->thread != NULL) &&
+		                     (memcmp(&format, &after, sizeof(format)) == 0);
+		
+		if(failed)
+		{
+			pjmedia_snd_stream_close(failed);
+		}
+		
+		pjmedia_snd_stream_stop(running);
+		pjmedia_snd_stream_close(running);
+		
+		CHECK_MSG(failed == NULL, "failure %u: the stream opened anyway", failures[i]);
+		CHECK_MSG(restored, "failure %u: the voice unit wasn't restored (dir %d, running %d)",
+		          failures[i], unit->dir, unit->isRunning);
+		CHECK_MSG(alive, "failure %u: the running stream stopped", failures[i]);
+	}
+}
+
+// Benchmarks
+
+#define BENCH_ITERATIONS  100000
+
+/**
+ * Returns the time it takes to mix one source into another, in nanoseconds per sample.
+**/
+static double benchKernel(void (*kernel)(pj_int16_t *, const pj_int16_t *, unsigned), unsigned numSamples)
+{
+	unsigned i;
+	double start = benchNow();
+	
+	for(i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		kernel(testActual, testSource, numSamples);
+		
+		// Keep the compiler from hoisting the call out of the loop
+		__asm__ __volatile__("" : : "r"(testActual) : "memory");
+	}
+	
+	return ((benchNow() - start) * 1e9) / ((double)BENCH_ITERATIONS * numSamples);
+}
+
+static void benchMixer(void)
+{
+	static pj_int16_t output[1024 * 2];
+	unsigned count;
+
+#if USE_NEON
+	const char *unit = "NEON";
+#elif USE_SSE2
+	const char *unit = "SSE2";
+#else
+	const char *unit = "scalar";
+#endif
+
+	unsigned state = 0x2545f491;
+	testRandomSamples(testSource, TEST_MAX_SAMPLES, &state);
+	
+	printf("mixSaturate, 4096 samples: %.3f ns/sample (%s), %.3f ns/sample (clamped loop)\n",
+	       benchKernel(mixSaturate, TEST_MAX_SAMPLES), unit, benchKernel(referenceMix, TEST_MAX_SAMPLES));
+	
+	printf("render callback, 1024 stereo frames per IO cycle, %u Hz, ns per frame\n", TEST_CLOCK_RATE);
+	
+	for(count = 1; count <= MAX_ACTIVE_STREAMS; count++)
+	{
+		test_player players[MAX_ACTIVE_STREAMS];
+		
+		if(!testOpenPlayers(players, count, 2))
+		{
+			testClosePlayers(players, count);
+			return;
+		}
+		
+		snd_voice_unit *unit = players[0].snd_strm->unit;
+		unsigned k, cycles = 2000;
+		double start = benchNow();
+		
+		for(k = 0; k < cycles; k++)
+		{
+			testRender(unit, (pj_uint64_t)k * 1024, 1024, output);
+		}
+		
+		double elapsed = benchNow() - start;
+		
+		testClosePlayers(players, count);
+		
+		printf("  %u source(s): %7.1f (including the play callbacks)\n", count, (elapsed * 1e9) / (cycles * 1024.0));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	if((pjmedia_snd_iphone_use_loopback(&param) != PJ_SUCCESS) || (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		benchMixer();
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testMixSaturate);
+	RUN_TEST(testMixLimits);
+	RUN_TEST(testMixStreams);
+	RUN_TEST(testReconfigureFailure);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}
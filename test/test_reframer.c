@@ -0,0 +1,580 @@
+/**
+ * Tests and benchmarks of the reframer (snd_reframer).
+ *
+ * The reframer is driven with recorded sequences of inNumberFrames values, the way core audio calls the IO callbacks.
+ * The audio that comes out of it, and the timestamps it passes to pjsip, must be exactly what the packets hold,
+ * no matter how the device buffers split them up.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+// Sequences of inNumberFrames values, as recorded from core audio, which are replayed in a loop.
+
+typedef struct test_io_trace
+{
+	const char *name;
+	const unsigned *frames;
+	unsigned count;
+	
+} test_io_trace;
+
+// 44.1 kHz hardware with a 4.2 ms IO buffer (185.22 frames per cycle)
+static const unsigned trace185[] = {
+	185, 186, 185, 185, 185, 186, 185, 185, 185, 186, 185, 185, 185, 185, 186, 185, 185, 185, 186, 185
+};
+
+// 44.1 kHz hardware with the default 23 ms IO buffer
+static const unsigned trace512[] = {
+	512
+};
+
+// A route change in the middle of a call: the IO buffer duration changes, and there are a few odd cycles
+static const unsigned traceMixed[] = {
+	512, 512, 512, 186, 185, 185, 1024, 1, 471, 186, 185, 93, 92, 512, 4096, 185, 186, 7, 505
+};
+
+#define TRACE(frames)  { #frames, frames, PJ_ARRAY_SIZE(frames) }
+
+static const test_io_trace testTraces[] = {
+	TRACE(trace185),
+	TRACE(trace512),
+	TRACE(traceMixed)
+};
+
+// Packet sizes of 20 ms at the usual pjsip clock rates
+static const unsigned testClockRates[] = { 8000, 16000, 44100 };
+
+#define TEST_PACKET_MSEC  20
+
+// The audio pjsip plays and the audio the device captures, in samples.
+// Each sample has a value that's unique within any stretch of the test, so any misplaced sample shows.
+#define TEST_SOURCE_SAMPLES  (1 << 20)
+
+static pj_int16_t testSource[TEST_SOURCE_SAMPLES];
+static pj_int16_t testOutput[TEST_SOURCE_SAMPLES];
+
+/**
+ * State of the pjsip side of a reframer under test.
+**/
+typedef struct test_endpoint
+{
+	snd_reframer *rf;
+	
+	// The timestamp the next callback should have
+	pj_uint32_t nextTimestamp;
+	
+	// Number of samples played from testSource, or captured into testOutput
+	unsigned samples;
+	
+	unsigned callbacks;
+	unsigned badTimestamps;
+	unsigned badSizes;
+	
+} test_endpoint;
+
+static pj_status_t testPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	test_endpoint *ep = (test_endpoint *)user_data;
+	
+	if(timestamp != ep->nextTimestamp) ep->badTimestamps++;
+	if(size != ep->rf->packetSize) ep->badSizes++;
+	
+	memcpy(output, testSource + ep->samples, size);
+	
+	ep->samples += size / sizeof(pj_int16_t);
+	ep->nextTimestamp = timestamp + ep->rf->samplesPerFrame;
+	ep->callbacks++;
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t testRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_endpoint *ep = (test_endpoint *)user_data;
+	
+	if(timestamp != ep->nextTimestamp) ep->badTimestamps++;
+	if(size != ep->rf->packetSize) ep->badSizes++;
+	
+	memcpy(testOutput + ep->samples, input, size);
+	
+	ep->samples += size / sizeof(pj_int16_t);
+	ep->nextTimestamp = timestamp + ep->rf->samplesPerFrame;
+	ep->callbacks++;
+	
+	return PJ_SUCCESS;
+}
+
+static void testFillSource(void)
+{
+	unsigned i;
+	
+	for(i = 0; i < TEST_SOURCE_SAMPLES; i++)
+	{
+		testSource[i] = (pj_int16_t)(i * 7919);
+	}
+}
+
+/**
+ * Returns the sample that a channel of a frame should have after channel conversion,
+ * when the frames of the source audio have srcChannels channels.
+**/
+static pj_int16_t testConvertedSample(const pj_int16_t *src, unsigned srcChannels, unsigned dstChannels,
+                                      unsigned frame, unsigned channel)
+{
+	if(srcChannels == dstChannels)
+	{
+		return src[(frame * srcChannels) + channel];
+	}
+	
+	// Mono to stereo copies the sample into both channels, and stereo to mono takes the left channel
+	return src[frame * srcChannels];
+}
+
+/**
+ * Replays a trace through a render reframer, and checks the audio it produces and the timestamps it passes to pjsip.
+ * The device buffers are offset by the given number of bytes, to exercise the unaligned path.
+**/
+static int testReplayRender(const test_io_trace *trace, unsigned clockRate,
+                            unsigned packetChannels, unsigned deviceChannels, unsigned misalign)
+{
+	unsigned packetFrames = (clockRate * TEST_PACKET_MSEC) / 1000;
+	unsigned packetSize = packetFrames * packetChannels * sizeof(pj_int16_t);
+	
+	static pj_uint8_t staging[8192];
+	static pj_uint8_t device[(8192 * 2 * sizeof(pj_int16_t)) + 16];
+	
+	snd_reframer rf;
+	reframerInit(&rf, staging, packetSize, packetChannels, deviceChannels, packetFrames * packetChannels);
+	reframerResetRender(&rf);
+	
+	test_endpoint ep;
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.play_cb = testPlayCallback;
+	rf.user_data = &ep;
+	
+	// Run the trace until we've played 2 seconds of audio (or the source runs out)
+	
+	unsigned totalFrames = clockRate * 2;
+	unsigned frame = 0;
+	unsigned cycle = 0;
+	
+	while(frame < totalFrames)
+	{
+		unsigned numFrames = trace->frames[cycle++ % trace->count];
+		pj_int16_t *out = (pj_int16_t *)(device + misalign);
+		
+		reframerRender(&rf, out, numFrames * deviceChannels * sizeof(pj_int16_t));
+		
+		unsigned f, c;
+		for(f = 0; f < numFrames; f++)
+		{
+			for(c = 0; c < deviceChannels; c++)
+			{
+				pj_int16_t expected = testConvertedSample(testSource, packetChannels, deviceChannels, frame + f, c);
+				pj_int16_t actual;
+				
+				memcpy(&actual, device + misalign + (((f * deviceChannels) + c) * sizeof(pj_int16_t)), sizeof(actual));
+				
+				if(actual != expected)
+				{
+					fprintf(stderr, "    render %s at %u Hz, %u -> %u channels: frame %u channel %u is %d, expected %d\n",
+					        trace->name, clockRate, packetChannels, deviceChannels, frame + f, c, actual, expected);
+					return 0;
+				}
+			}
+		}
+		
+		frame += numFrames;
+	}
+	
+	if(ep.badTimestamps || ep.badSizes)
+	{
+		fprintf(stderr, "    render %s at %u Hz: %u bad timestamps, %u bad sizes\n",
+		        trace->name, clockRate, ep.badTimestamps, ep.badSizes);
+		return 0;
+	}
+	
+	// Every packet was asked for exactly when it was needed, and no sooner
+	
+	unsigned expectedCallbacks = (frame + packetFrames - 1) / packetFrames;
+	
+	if((ep.callbacks != expectedCallbacks) || ((rf.directCount + rf.stagedCount) != ep.callbacks))
+	{
+		fprintf(stderr, "    render %s at %u Hz: %u callbacks, expected %u\n",
+		        trace->name, clockRate, ep.callbacks, expectedCallbacks);
+		return 0;
+	}
+	
+	return 1;
+}
+
+/**
+ * Replays a trace through a capture reframer, and checks the packets and timestamps it passes to pjsip.
+**/
+static int testReplayCapture(const test_io_trace *trace, unsigned clockRate,
+                             unsigned packetChannels, unsigned deviceChannels, unsigned misalign)
+{
+	unsigned packetFrames = (clockRate * TEST_PACKET_MSEC) / 1000;
+	unsigned packetSize = packetFrames * packetChannels * sizeof(pj_int16_t);
+	
+	static pj_uint8_t staging[8192];
+	static pj_uint8_t device[(8192 * 2 * sizeof(pj_int16_t)) + 16];
+	
+	snd_reframer rf;
+	reframerInit(&rf, staging, packetSize, packetChannels, deviceChannels, packetFrames * packetChannels);
+	reframerResetCapture(&rf);
+	
+	test_endpoint ep;
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.rec_cb = testRecCallback;
+	rf.user_data = &ep;
+	
+	// The device captures testSource, in device channels
+	
+	unsigned totalFrames = clockRate * 2;
+	unsigned frame = 0;
+	unsigned cycle = 0;
+	
+	while(frame < totalFrames)
+	{
+		unsigned numFrames = trace->frames[cycle++ % trace->count];
+		
+		memcpy(device + misalign, testSource + (frame * deviceChannels), numFrames * deviceChannels * sizeof(pj_int16_t));
+		
+		reframerCapture(&rf, device + misalign, numFrames * deviceChannels * sizeof(pj_int16_t));
+		
+		frame += numFrames;
+	}
+	
+	if(ep.badTimestamps || ep.badSizes)
+	{
+		fprintf(stderr, "    capture %s at %u Hz: %u bad timestamps, %u bad sizes\n",
+		        trace->name, clockRate, ep.badTimestamps, ep.badSizes);
+		return 0;
+	}
+	
+	// Every complete packet was passed on as soon as it was complete, and the rest is staged
+	
+	if((ep.callbacks != (frame / packetFrames)) || (rf.bufferOffset != ((frame % packetFrames) * packetChannels * sizeof(pj_int16_t))))
+	{
+		fprintf(stderr, "    capture %s at %u Hz: %u callbacks, expected %u\n",
+		        trace->name, clockRate, ep.callbacks, frame / packetFrames);
+		return 0;
+	}
+	
+	unsigned f, c;
+	for(f = 0; f < (ep.callbacks * packetFrames); f++)
+	{
+		for(c = 0; c < packetChannels; c++)
+		{
+			pj_int16_t expected = testConvertedSample(testSource, deviceChannels, packetChannels, f, c);
+			pj_int16_t actual = testOutput[(f * packetChannels) + c];
+			
+			if(actual != expected)
+			{
+				fprintf(stderr, "    capture %s at %u Hz, %u -> %u channels: frame %u channel %u is %d, expected %d\n",
+				        trace->name, clockRate, deviceChannels, packetChannels, f, c, actual, expected);
+				return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+/**
+ * Replays every trace, at every clock rate, in every channel combination, through both reframers.
+**/
+static void testReplayTraces(void)
+{
+	unsigned t, r, pc, dc;
+	
+	for(t = 0; t < PJ_ARRAY_SIZE(testTraces); t++)
+	{
+		for(r = 0; r < PJ_ARRAY_SIZE(testClockRates); r++)
+		{
+			for(pc = 1; pc <= 2; pc++)
+			{
+				for(dc = 1; dc <= 2; dc++)
+				{
+					CHECK(testReplayRender(&testTraces[t], testClockRates[r], pc, dc, 0));
+					CHECK(testReplayCapture(&testTraces[t], testClockRates[r], pc, dc, 0));
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Device buffers that aren't sample aligned can't be handed to pjsip, so everything goes through the staging buffer.
+ * The output must be the same.
+**/
+static void testUnalignedDeviceBuffers(void)
+{
+	unsigned r, pc, dc;
+	
+	for(r = 0; r < PJ_ARRAY_SIZE(testClockRates); r++)
+	{
+		for(pc = 1; pc <= 2; pc++)
+		{
+			for(dc = 1; dc <= 2; dc++)
+			{
+				CHECK(testReplayRender(&testTraces[2], testClockRates[r], pc, dc, 1));
+				CHECK(testReplayCapture(&testTraces[2], testClockRates[r], pc, dc, 1));
+			}
+		}
+	}
+}
+
+/**
+ * Resetting a render reframer drops the rest of the staged packet, and the next cycle starts with a new one.
+ * Resetting a capture reframer drops the partial packet.
+**/
+static void testReset(void)
+{
+	static pj_uint8_t staging[320];
+	static pj_int16_t device[512];
+	
+	snd_reframer rf;
+	test_endpoint ep;
+	
+	reframerInit(&rf, staging, 320, 1, 1, 160);
+	reframerResetRender(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.play_cb = testPlayCallback;
+	rf.user_data = &ep;
+	
+	reframerRender(&rf, device, 100 * sizeof(pj_int16_t));
+	CHECK(ep.callbacks == 1);
+	
+	reframerResetRender(&rf);
+	reframerRender(&rf, device, 100 * sizeof(pj_int16_t));
+	
+	CHECK(ep.callbacks == 2);
+	CHECK(device[0] == testSource[160]);
+	CHECK(ep.badTimestamps == 0);
+	
+	reframerInit(&rf, staging, 320, 1, 1, 160);
+	reframerResetCapture(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.rec_cb = testRecCallback;
+	rf.user_data = &ep;
+	
+	memcpy(device, testSource, sizeof(device));
+	
+	reframerCapture(&rf, device, 100 * sizeof(pj_int16_t));
+	reframerResetCapture(&rf);
+	reframerCapture(&rf, device + 100, 160 * sizeof(pj_int16_t));
+	
+	CHECK(ep.callbacks == 1);
+	CHECK(testOutput[0] == testSource[100]);
+	CHECK(ep.badTimestamps == 0);
+}
+
+/**
+ * Whole packets are read and written in place, in the device buffer, and only a packet that straddles
+ * two device buffers is copied through the staging buffer. The copy counters must account for every frame.
+**/
+static void testCopyAccounting(void)
+{
+	static pj_uint8_t staging[320];
+	static pj_int16_t device[1024];
+	
+	snd_reframer rf;
+	test_endpoint ep;
+	unsigned i;
+	
+	// 160-frame packets line up with 320-frame device buffers, so nothing is copied at all
+	
+	reframerInit(&rf, staging, 320, 1, 1, 160);
+	reframerResetRender(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.play_cb = testPlayCallback;
+	rf.user_data = &ep;
+	
+	for(i = 0; i < 10; i++)
+	{
+		reframerRender(&rf, device, 320 * sizeof(pj_int16_t));
+	}
+	
+	CHECK(rf.directCount == 20);
+	CHECK(rf.stagedCount == 0);
+	CHECK(rf.copyCount == 0);
+	CHECK(rf.bytesCopied == 0);
+	
+	// With 512-frame device buffers, every cycle has at least two whole packets,
+	// and copies less than a packet on either side of them
+	
+	reframerInit(&rf, staging, 320, 1, 1, 160);
+	reframerResetRender(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.play_cb = testPlayCallback;
+	rf.user_data = &ep;
+	
+	for(i = 0; i < 100; i++)
+	{
+		pj_uint32_t direct = rf.directCount;
+		
+		reframerRender(&rf, device, 512 * sizeof(pj_int16_t));
+		
+		CHECK((rf.directCount - direct) >= 2);
+		CHECK(rf.lastBytesCopied < (2 * 320));
+		CHECK(rf.lastBytesCopied == ((512 - ((rf.directCount - direct) * 160)) * sizeof(pj_int16_t)));
+	}
+	
+	CHECK((rf.directCount * 320) + rf.bytesCopied == (100 * 512 * sizeof(pj_int16_t)));
+	CHECK(rf.stagedCount <= 100);
+	
+	reframerInit(&rf, staging, 320, 1, 1, 160);
+	reframerResetCapture(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.rec_cb = testRecCallback;
+	rf.user_data = &ep;
+	
+	for(i = 0; i < 100; i++)
+	{
+		pj_uint32_t direct = rf.directCount;
+		
+		reframerCapture(&rf, device, 512 * sizeof(pj_int16_t));
+		
+		CHECK((rf.directCount - direct) >= 2);
+		CHECK(rf.lastBytesCopied == ((512 - ((rf.directCount - direct) * 160)) * sizeof(pj_int16_t)));
+	}
+	
+	CHECK((rf.directCount * 320) + rf.bytesCopied == (100 * 512 * sizeof(pj_int16_t)));
+	
+	// With channel conversion, every frame has to be copied
+	
+	reframerInit(&rf, staging, 320, 1, 2, 160);
+	reframerResetRender(&rf);
+	memset(&ep, 0, sizeof(ep));
+	
+	ep.rf = &rf;
+	rf.play_cb = testPlayCallback;
+	rf.user_data = &ep;
+	
+	for(i = 0; i < 10; i++)
+	{
+		reframerRender(&rf, device, 320 * 2 * sizeof(pj_int16_t));
+	}
+	
+	CHECK(rf.directCount == 0);
+	CHECK(rf.stagedCount == 20);
+	CHECK(rf.bytesCopied == (10 * 320 * 2 * sizeof(pj_int16_t)));
+}
+
+// Benchmarks
+
+static pj_status_t benchPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	memcpy(output, testSource, size);
+	return PJ_SUCCESS;
+}
+
+static pj_status_t benchRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	return PJ_SUCCESS;
+}
+
+/**
+ * Measures the cost of reframing one hardware frame, in each direction, for a trace.
+**/
+static void benchReframer(const test_io_trace *trace, unsigned clockRate, unsigned packetChannels, unsigned deviceChannels)
+{
+	unsigned packetFrames = (clockRate * TEST_PACKET_MSEC) / 1000;
+	unsigned packetSize = packetFrames * packetChannels * sizeof(pj_int16_t);
+	
+	static pj_uint8_t staging[8192];
+	static pj_int16_t device[8192 * 2];
+	
+	// One minute of audio per direction
+	
+	unsigned totalFrames = clockRate * 60;
+	unsigned frame, cycle;
+	
+	snd_reframer rf;
+	reframerInit(&rf, staging, packetSize, packetChannels, deviceChannels, packetFrames * packetChannels);
+	reframerResetRender(&rf);
+	rf.play_cb = benchPlayCallback;
+	
+	double start = benchNow();
+	
+	for(frame = 0, cycle = 0; frame < totalFrames; )
+	{
+		unsigned numFrames = trace->frames[cycle++ % trace->count];
+		
+		reframerRender(&rf, device, numFrames * deviceChannels * sizeof(pj_int16_t));
+		frame += numFrames;
+	}
+	
+	double renderTime = benchNow() - start;
+	
+	reframerInit(&rf, staging, packetSize, packetChannels, deviceChannels, packetFrames * packetChannels);
+	reframerResetCapture(&rf);
+	rf.rec_cb = benchRecCallback;
+	
+	start = benchNow();
+	
+	for(frame = 0, cycle = 0; frame < totalFrames; )
+	{
+		unsigned numFrames = trace->frames[cycle++ % trace->count];
+		
+		reframerCapture(&rf, device, numFrames * deviceChannels * sizeof(pj_int16_t));
+		frame += numFrames;
+	}
+	
+	double captureTime = benchNow() - start;
+	
+	printf("%-10s %5u Hz  %u -> %u ch   render %6.2f ns/frame   capture %6.2f ns/frame\n",
+	       trace->name, clockRate, packetChannels, deviceChannels,
+	       (renderTime * 1e9) / frame, (captureTime * 1e9) / frame);
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	testFillSource();
+	
+	if(benchRequested(argc, argv))
+	{
+		unsigned t, r, pc, dc;
+		
+		for(t = 0; t < PJ_ARRAY_SIZE(testTraces); t++)
+		{
+			for(r = 0; r < PJ_ARRAY_SIZE(testClockRates); r++)
+			{
+				for(pc = 1; pc <= 2; pc++)
+				{
+					for(dc = 1; dc <= 2; dc++)
+					{
+						benchReframer(&testTraces[t], testClockRates[r], pc, dc);
+					}
+				}
+			}
+		}
+		
+		return 0;
+	}
+	
+	RUN_TEST(testReplayTraces);
+	RUN_TEST(testUnalignedDeviceBuffers);
+	RUN_TEST(testReset);
+	RUN_TEST(testCopyAccounting);
+	
+	return testSummary();
+}
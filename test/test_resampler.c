@@ -0,0 +1,513 @@
+/**
+ * Tests and benchmarks of the polyphase resampler.
+ *
+ * The quality tests pass a sine through the resampler and fit the ideal sine at the output rate to what comes out.
+ * Everything that doesn't fit (aliasing, imaging, passband ripple, rounding) counts as noise.
+ * They cover every conversion between the pjsip rates (8, 16, 32 and 48 kHz) and the hardware rates (44.1 and 48 kHz),
+ * in both directions, for mono and stereo.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#include <math.h>
+
+// The default filter length (see pjmedia_snd_iphone_options_default)
+#define TEST_FILTER_LENGTH  64
+
+// The least signal to noise ratio we accept for a tone well inside the passband
+#define TEST_MIN_SNR  60.0
+
+#define TEST_AMPLITUDE  16000.0
+
+// Input chunk sizes, similar to what the IO callbacks pass in (never more than RESAMPLER_CHUNK_FRAMES)
+static const unsigned testChunks[] = { 185, 256, 1, 93, 240, 37, 160, 7 };
+
+static pj_pool_factory testFactory;
+
+static const unsigned testPjsipRates[] = { 8000, 16000, 32000, 48000 };
+static const unsigned testHardwareRates[] = { 44100, 48000 };
+
+#define TEST_MAX_FRAMES  (48000 * 2)
+
+static pj_int16_t testInput[TEST_MAX_FRAMES * RESAMPLER_MAX_CHANNELS];
+static pj_int16_t testOutput[(TEST_MAX_FRAMES * 6 + 64) * RESAMPLER_MAX_CHANNELS];
+
+/**
+ * Creates a resampler in an arena of its own.
+ * The pool holding the arena must be released by the caller.
+**/
+static pj_pool_t *testCreateResampler(unsigned inRate,
+                                      unsigned outRate,
+                                      unsigned channels,
+                                      unsigned filterLength,
+                                      pj_bool_t variable,
+                                      snd_resampler **p_rs)
+{
+	snd_arena arena;
+	pj_pool_t *pool = arenaCreate(resamplerArenaSize(inRate, outRate, channels, filterLength,
+	                                                 RESAMPLER_CHUNK_FRAMES, variable), &arena);
+	if(pool == NULL)
+	{
+		return NULL;
+	}
+	
+	if(resamplerCreate(&arena, inRate, outRate, channels, filterLength,
+	                   RESAMPLER_CHUNK_FRAMES, variable, p_rs) != PJ_SUCCESS)
+	{
+		pj_pool_release(pool);
+		return NULL;
+	}
+	
+	return pool;
+}
+
+/**
+ * Fills testInput with a sine of the given frequency, the same in every channel.
+**/
+static void testSine(double frequency, unsigned rate, unsigned channels, unsigned numFrames)
+{
+	unsigned i, c;
+	
+	for(i = 0; i < numFrames; i++)
+	{
+		pj_int16_t sample = (pj_int16_t)lrint(TEST_AMPLITUDE * sin(2 * M_PI * frequency * i / rate));
+		
+		for(c = 0; c < channels; c++)
+		{
+			testInput[(i * channels) + c] = sample;
+		}
+	}
+}
+
+/**
+ * Passes numFrames frames of testInput through the resampler, in chunks of varying size,
+ * and returns the number of frames written to testOutput.
+**/
+static unsigned testResample(snd_resampler *rs, unsigned numFrames)
+{
+	unsigned inFrames = 0;
+	unsigned outFrames = 0;
+	unsigned k = 0;
+	
+	while(inFrames < numFrames)
+	{
+		unsigned chunk = testChunks[k++ % PJ_ARRAY_SIZE(testChunks)];
+		
+		if(chunk > (numFrames - inFrames))
+		{
+			chunk = numFrames - inFrames;
+		}
+		
+		outFrames += resamplerProcess(rs,
+		                              testInput + (inFrames * rs->channels), chunk,
+		                              testOutput + (outFrames * rs->channels), TEST_MAX_FRAMES * 6);
+		inFrames += chunk;
+	}
+	
+	return outFrames;
+}
+
+/**
+ * Fits a sine of the given frequency (by least squares, any phase) to one channel of the output,
+ * skipping the first frames (while the filter fills up), and returns the signal to noise ratio in dB.
+**/
+static double testSnr(unsigned channel, unsigned channels, unsigned skip, unsigned numFrames,
+                      double frequency, unsigned rate)
+{
+	unsigned i;
+	
+	double ss = 0, sc = 0, cc = 0, xs = 0, xc = 0;
+	
+	for(i = skip; i < numFrames; i++)
+	{
+		double s = sin(2 * M_PI * frequency * i / rate);
+		double c = cos(2 * M_PI * frequency * i / rate);
+		double x = testOutput[(i * channels) + channel];
+		
+		ss += s * s;
+		sc += s * c;
+		cc += c * c;
+		xs += x * s;
+		xc += x * c;
+	}
+	
+	double det = (ss * cc) - (sc * sc);
+	double a = ((xs * cc) - (xc * sc)) / det;
+	double b = ((xc * ss) - (xs * sc)) / det;
+	
+	double signal = 0, noise = 0;
+	
+	for(i = skip; i < numFrames; i++)
+	{
+		double fit = (a * sin(2 * M_PI * frequency * i / rate)) + (b * cos(2 * M_PI * frequency * i / rate));
+		double error = testOutput[(i * channels) + channel] - fit;
+		
+		signal += fit * fit;
+		noise += error * error;
+	}
+	
+	return 10 * log10(signal / noise);
+}
+
+/**
+ * The vectorized dot product matches a plain loop for every supported length.
+**/
+static void testDotProduct(void)
+{
+	static pj_int16_t x[512] __attribute__((aligned(16)));
+	static pj_int16_t h[512] __attribute__((aligned(16)));
+	
+	unsigned state = 0x1234567;
+	unsigned i, n;
+	
+	for(i = 0; i < 512; i++)
+	{
+		x[i] = (pj_int16_t)testRandom(&state);
+		h[i] = (pj_int16_t)((testRandom(&state) % 32768) - 16384);
+	}
+	
+	for(n = 8; n <= 512; n += 8)
+	{
+		pj_int64_t expected = 0;
+		
+		for(i = 0; i < n; i++)
+		{
+			expected += (pj_int32_t)x[i] * h[i];
+		}
+		
+		CHECK_MSG(dotProduct(x, h, n) == (pj_int32_t)expected, "length %u", n);
+	}
+}
+
+/**
+ * Runs a sine through one conversion, and returns the lowest signal to noise ratio of any channel.
+ * Returns a negative value if the number of frames that came out doesn't match the ratio.
+**/
+static double measureConversion(unsigned inRate, unsigned outRate, unsigned channels, unsigned filterLength, double frequency)
+{
+	snd_resampler *rs;
+	pj_pool_t *pool = testCreateResampler(inRate, outRate, channels, filterLength, PJ_FALSE, &rs);
+	
+	if(pool == NULL)
+	{
+		fprintf(stderr, "    %u -> %u: unable to create the resampler\n", inRate, outRate);
+		return -1;
+	}
+	
+	unsigned inFrames = inRate / 2;
+	
+	testSine(frequency, inRate, channels, inFrames);
+	unsigned outFrames = testResample(rs, inFrames);
+	
+	// Until the history has filled up, the output is the start of the filter's step response
+	unsigned skip = (unsigned)(((pj_uint64_t)rs->taps * outRate / inRate) + 1);
+	
+	pj_pool_release(pool);
+	
+	// The output lags the input by the filter delay, but is never more than a frame off the ratio
+	
+	double expected = (double)inFrames * outRate / inRate;
+	
+	if((outFrames > expected + 1) || (outFrames + 1 < expected))
+	{
+		fprintf(stderr, "    %u -> %u: %u frames out, expected %.1f\n", inRate, outRate, outFrames, expected);
+		return -1;
+	}
+	
+	double lowest = 1000;
+	unsigned c;
+	
+	for(c = 0; c < channels; c++)
+	{
+		double snr = testSnr(c, channels, skip, outFrames, frequency, outRate);
+		
+		if(snr < lowest)
+		{
+			lowest = snr;
+		}
+	}
+	
+	return lowest;
+}
+
+/**
+ * Checks the quality of one conversion, with a 1 kHz tone and one close to the top of the passband.
+**/
+static int testConversion(unsigned inRate, unsigned outRate, unsigned channels)
+{
+	double lowerRate = (inRate < outRate) ? inRate : outRate;
+	double frequencies[] = { 1000.0, lowerRate * 0.4 };
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(frequencies); i++)
+	{
+		double snr = measureConversion(inRate, outRate, channels, TEST_FILTER_LENGTH, frequencies[i]);
+		
+		if(snr < TEST_MIN_SNR)
+		{
+			fprintf(stderr, "    %u -> %u, %u channel(s), %.0f Hz: SNR %.1f dB\n",
+			        inRate, outRate, channels, frequencies[i], snr);
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+static void testSineQuality(void)
+{
+	unsigned i, j, channels;
+	
+	for(channels = 1; channels <= 2; channels++)
+	{
+		for(i = 0; i < PJ_ARRAY_SIZE(testPjsipRates); i++)
+		{
+			for(j = 0; j < PJ_ARRAY_SIZE(testHardwareRates); j++)
+			{
+				if(testPjsipRates[i] == testHardwareRates[j]) continue;
+				
+				// Render (pjsip to hardware), and capture (hardware to pjsip)
+				
+				CHECK(testConversion(testPjsipRates[i], testHardwareRates[j], channels));
+				CHECK(testConversion(testHardwareRates[j], testPjsipRates[i], channels));
+			}
+		}
+	}
+}
+
+/**
+ * A tone above half the output rate must not alias into the output.
+ * The stopband starts at half the lower rate, and is about 80 dB down.
+**/
+static void testAliasRejection(void)
+{
+	static const unsigned rates[][2] = { { 48000, 8000 }, { 44100, 8000 }, { 44100, 16000 }, { 48000, 32000 } };
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(rates); i++)
+	{
+		unsigned inRate = rates[i][0];
+		unsigned outRate = rates[i][1];
+		
+		// Comfortably past the transition band, which is a few input samples of the lower rate wide
+		double frequency = outRate * 0.65;
+		
+		snd_resampler *rs;
+		pj_pool_t *pool = testCreateResampler(inRate, outRate, 1, TEST_FILTER_LENGTH, PJ_FALSE, &rs);
+		CHECK(pool != NULL);
+		
+		testSine(frequency, inRate, 1, inRate / 2);
+		unsigned outFrames = testResample(rs, inRate / 2);
+		
+		pj_pool_release(pool);
+		
+		double energy = 0;
+		unsigned n;
+		
+		for(n = 256; n < outFrames; n++)
+		{
+			energy += (double)testOutput[n] * testOutput[n];
+		}
+		
+		double rms = sqrt(energy / (outFrames - 256));
+		double rejection = 20 * log10((TEST_AMPLITUDE / sqrt(2)) / (rms + 1e-9));
+		
+		CHECK_MSG(rejection >= TEST_MIN_SNR, "%u -> %u: %.0f Hz is only %.1f dB down", inRate, outRate, frequency, rejection);
+	}
+}
+
+/**
+ * Passing in the number of frames resamplerInputFrames asks for yields the requested output,
+ * which is how the render path pulls a given number of frames out of the resampler.
+ * It never asks for more than it needs, so over many calls the input tracks the ratio.
+**/
+static void testInputFrames(void)
+{
+	static const unsigned rates[][2] = { { 8000, 44100 }, { 16000, 48000 }, { 48000, 44100 }, { 32000, 48000 } };
+	unsigned i, k;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(rates); i++)
+	{
+		snd_resampler *rs;
+		pj_pool_t *pool = testCreateResampler(rates[i][0], rates[i][1], 1, TEST_FILTER_LENGTH, PJ_FALSE, &rs);
+		CHECK(pool != NULL);
+		
+		testSine(1000.0, rates[i][0], 1, RESAMPLER_CHUNK_FRAMES);
+		
+		// Leave room for the rounding, so the input never exceeds maxInput
+		unsigned maxOutput = RESAMPLER_CHUNK_FRAMES;
+		
+		if(rates[i][0] > rates[i][1])
+		{
+			maxOutput = (RESAMPLER_CHUNK_FRAMES * rates[i][1] / rates[i][0]) - 4;
+		}
+		
+		pj_uint64_t totalIn = 0;
+		pj_uint64_t totalOut = 0;
+		
+		for(k = 0; k < 1000; k++)
+		{
+			unsigned outFrames = 1 + ((k * 37) % maxOutput);
+			unsigned inFrames = resamplerInputFrames(rs, outFrames);
+			
+			CHECK_MSG(inFrames <= RESAMPLER_CHUNK_FRAMES, "%u frames in for %u out", inFrames, outFrames);
+			CHECK_MSG(resamplerProcess(rs, testInput, inFrames, testOutput, outFrames) == outFrames,
+			          "%u -> %u, %u frames out", rates[i][0], rates[i][1], outFrames);
+			
+			totalIn += inFrames;
+			totalOut += outFrames;
+		}
+		
+		pj_pool_release(pool);
+		
+		double expected = (double)totalOut * rates[i][0] / rates[i][1];
+		
+		CHECK_MSG(fabs(totalIn - expected) <= 2, "%u -> %u: %llu frames in, expected %.1f",
+		          rates[i][0], rates[i][1], (unsigned long long)totalIn, expected);
+	}
+}
+
+// Benchmarks
+
+/**
+ * Returns the time it takes to produce one output frame, in nanoseconds.
+**/
+static double benchConversion(unsigned inRate, unsigned outRate, unsigned filterLength, pj_bool_t adjusted)
+{
+	snd_resampler *rs;
+	pj_pool_t *pool = testCreateResampler(inRate, outRate, 1, filterLength, adjusted, &rs);
+	
+	if(pool == NULL)
+	{
+		return 0;
+	}
+	
+	if(adjusted)
+	{
+		// Any adjustment makes every output interpolate between two phases
+		resamplerSetAdjustment(rs, 100000);
+	}
+	
+	testSine(1000.0, inRate, 1, RESAMPLER_CHUNK_FRAMES);
+	
+	unsigned total = 0;
+	unsigned k;
+	double start = benchNow();
+	
+	for(k = 0; k < 20000; k++)
+	{
+		total += resamplerProcess(rs, testInput, RESAMPLER_CHUNK_FRAMES, testOutput, TEST_MAX_FRAMES);
+	}
+	
+	double elapsed = benchNow() - start;
+	
+	pj_pool_release(pool);
+	
+	return (elapsed * 1e9) / total;
+}
+
+static void benchResampler(void)
+{
+	static const unsigned filterLengths[] = { 32, 64, 128 };
+	unsigned i, j, f;
+
+#if USE_NEON
+	const char *unit = "NEON";
+#elif USE_SSE2
+	const char *unit = "SSE2";
+#else
+	const char *unit = "scalar";
+#endif
+
+	printf("resampler, SNR of a 1 kHz tone (dB)\n");
+	printf("                    ");
+	
+	for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+	{
+		printf("  %3u taps", filterLengths[f]);
+	}
+	printf("\n");
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(testPjsipRates); i++)
+	{
+		for(j = 0; j < PJ_ARRAY_SIZE(testHardwareRates); j++)
+		{
+			unsigned pjsipRate = testPjsipRates[i];
+			unsigned hardwareRate = testHardwareRates[j];
+			
+			if(pjsipRate == hardwareRate) continue;
+			
+			printf("  %5u -> %5u   ", pjsipRate, hardwareRate);
+			for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+			{
+				printf("  %8.1f", measureConversion(pjsipRate, hardwareRate, 1, filterLengths[f], 1000.0));
+			}
+			printf("\n");
+			
+			printf("  %5u -> %5u   ", hardwareRate, pjsipRate);
+			for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+			{
+				printf("  %8.1f", measureConversion(hardwareRate, pjsipRate, 1, filterLengths[f], 1000.0));
+			}
+			printf("\n");
+		}
+	}
+	
+	printf("\nresampler, ns per output sample (mono, %s dot product)\n", unit);
+	printf("                    ");
+	
+	for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+	{
+		printf("  %3u taps  (drift)", filterLengths[f]);
+	}
+	printf("\n");
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(testPjsipRates); i++)
+	{
+		for(j = 0; j < PJ_ARRAY_SIZE(testHardwareRates); j++)
+		{
+			unsigned pjsipRate = testPjsipRates[i];
+			unsigned hardwareRate = testHardwareRates[j];
+			
+			if(pjsipRate == hardwareRate) continue;
+			
+			printf("  %5u -> %5u   ", pjsipRate, hardwareRate);
+			for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+			{
+				printf("  %8.1f %8.1f", benchConversion(pjsipRate, hardwareRate, filterLengths[f], PJ_FALSE),
+				       benchConversion(pjsipRate, hardwareRate, filterLengths[f], PJ_TRUE));
+			}
+			printf("\n");
+			
+			printf("  %5u -> %5u   ", hardwareRate, pjsipRate);
+			for(f = 0; f < PJ_ARRAY_SIZE(filterLengths); f++)
+			{
+				printf("  %8.1f %8.1f", benchConversion(hardwareRate, pjsipRate, filterLengths[f], PJ_FALSE),
+				       benchConversion(hardwareRate, pjsipRate, filterLengths[f], PJ_TRUE));
+			}
+			printf("\n");
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	// The resamplers live in stream arenas, which come from the driver's pool factory
+	snd_pool_factory = &testFactory;
+	
+	if(benchRequested(argc, argv))
+	{
+		benchResampler();
+		return 0;
+	}
+	
+	RUN_TEST(testDotProduct);
+	RUN_TEST(testSineQuality);
+	RUN_TEST(testAliasRejection);
+	RUN_TEST(testInputFrames);
+	
+	return testSummary();
+}
@@ -0,0 +1,414 @@
+/**
+ * Tests and benchmarks of suspending and resuming streams across audio session interruptions.
+ *
+ * A full-duplex stream runs on the loopback backend in realtime, with the capture side hearing
+ * whatever was rendered in the same IO cycle. The play callback numbers every sample it produces
+ * by its position in the stream, so both the render file and the captured audio show exactly
+ * which samples made it through, and in which order.
+ *
+ * An interruption must stop the IO callbacks, and the end of it must get them going again with the
+ * timestamps still contiguous. What the staging buffers held from before the interruption is dropped:
+ * the rendered audio picks up at a packet boundary, and no captured packet mixes audio from
+ * before and after the interruption (or audio and silence).
+ *
+ * Run with --bench to print the time from the end of an interruption to the first render and capture callback.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define TEST_CLOCK_RATE     16000
+#define TEST_PACKET_FRAMES  320
+
+// Not a divisor of the packet size, so the staging buffers are partially filled most of the time
+#define TEST_CYCLE_FRAMES   185
+
+#define TEST_RENDER_FILE    "test_resume.wav"
+
+#define TEST_MAX_PACKETS    1024
+
+static pj_pool_factory testFactory;
+
+/**
+ * What the callbacks of the stream under test saw.
+**/
+typedef struct test_stream
+{
+	pj_uint32_t playCallbacks;
+	pj_uint32_t recCallbacks;
+	
+	// The timestamps pjsip got, and whether any of them skipped or repeated
+	pj_uint32_t nextPlayTimestamp;
+	pj_uint32_t nextRecTimestamp;
+	unsigned playTimestampErrors;
+	unsigned recTimestampErrors;
+	
+	// The captured packets whose samples aren't numbered consecutively
+	unsigned mixedPackets;
+	
+} test_stream;
+
+static test_stream testStream;
+
+static pj_status_t testPlayCallback(void *user_data, pj_uint32_t timestamp, void *output, unsigned size)
+{
+	test_stream *ts = (test_stream *)user_data;
+	pj_int16_t *samples = (pj_int16_t *)output;
+	unsigned i;
+	
+	if((ts->playCallbacks > 0) && (timestamp != ts->nextPlayTimestamp))
+	{
+		ts->playTimestampErrors++;
+	}
+	
+	for(i = 0; i < size / sizeof(pj_int16_t); i++)
+	{
+		samples[i] = (pj_int16_t)(timestamp + i);
+	}
+	
+	ts->nextPlayTimestamp = timestamp + (size / sizeof(pj_int16_t));
+	
+	__atomic_fetch_add(&ts->playCallbacks, 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+static pj_status_t testRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_stream *ts = (test_stream *)user_data;
+	const pj_int16_t *samples = (const pj_int16_t *)input;
+	unsigned i;
+	
+	if((ts->recCallbacks > 0) && (timestamp != ts->nextRecTimestamp))
+	{
+		ts->recTimestampErrors++;
+	}
+	
+	// In asynchronous mode, the render side has nothing to play right after resume (the play ring is discarded),
+	// so the first packets captured may be silent
+	
+	pj_bool_t silent = PJ_TRUE;
+	
+	for(i = 0; i < size / sizeof(pj_int16_t); i++)
+	{
+		silent = silent && (samples[i] == 0);
+	}
+	
+	for(i = 1; (i < size / sizeof(pj_int16_t)) && !silent; i++)
+	{
+		if(samples[i] != (pj_int16_t)(samples[i - 1] + 1))
+		{
+			ts->mixedPackets++;
+			break;
+		}
+	}
+	
+	ts->nextRecTimestamp = timestamp + (size / sizeof(pj_int16_t));
+	
+	__atomic_fetch_add(&ts->recCallbacks, 1, __ATOMIC_RELEASE);
+	
+	return PJ_SUCCESS;
+}
+
+static pj_uint32_t testCallbacks(void)
+{
+	return __atomic_load_n(&testStream.playCallbacks, __ATOMIC_ACQUIRE) +
+	       __atomic_load_n(&testStream.recCallbacks, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Has the loopback backend run in realtime, writing what it renders to renderFile (if any).
+**/
+static pj_bool_t testUseLoopback(const char *renderFile)
+{
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	param.hw_clock_rate = TEST_CLOCK_RATE;
+	param.frames_per_cycle = TEST_CYCLE_FRAMES;
+	param.loopback_delay = 0;
+	param.render_file = renderFile;
+	
+	return (pjmedia_snd_iphone_use_loopback(&param) == PJ_SUCCESS);
+}
+
+/**
+ * Opens a full-duplex stream at the hardware rate, without a fade in, so every rendered sample is predictable.
+**/
+static pjmedia_snd_stream *testOpenStream(pj_bool_t async)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.async_callbacks = async;
+	options.fade_msec = 0;
+	
+	pjmedia_snd_stream *snd_strm = NULL;
+	
+	pj_bzero(&testStream, sizeof(testStream));
+	
+	if((pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS) ||
+	   (pjmedia_snd_open(-1, -1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, 16,
+	                     testRecCallback, testPlayCallback, &testStream, &snd_strm) != PJ_SUCCESS))
+	{
+		return NULL;
+	}
+	
+	return snd_strm;
+}
+
+/**
+ * Checks the rendered audio in the render file. The samples are numbered consecutively,
+ * except where the stream was resumed, where they pick up at a packet boundary, and the silence at the end.
+ * Returns the number of times that happened, or -1 if the audio is wrong.
+**/
+static int testCheckRenderFile(const char *path)
+{
+	static pj_int16_t samples[TEST_MAX_PACKETS * TEST_PACKET_FRAMES];
+	
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	snd_wav_file wav;
+	
+	if((pool == NULL) || (wavOpenRead(pool, path, &wav) != PJ_SUCCESS))
+	{
+		return -1;
+	}
+	
+	unsigned numSamples = wav.dataSize / sizeof(pj_int16_t);
+	
+	if((wav.channels != 1) || (numSamples > PJ_ARRAY_SIZE(samples)))
+	{
+		wavClose(&wav, PJ_FALSE);
+		pj_pool_release(pool);
+		return -1;
+	}
+	
+	wavRead(&wav, samples, numSamples);
+	wavClose(&wav, PJ_FALSE);
+	pj_pool_release(pool);
+	
+	// Once the stream is stopped, the voice unit renders silence until it's stopped as well
+	
+	while((numSamples > 0) && (samples[numSamples - 1] == 0))
+	{
+		numSamples--;
+	}
+	
+	int resumes = 0;
+	unsigned i;
+	
+	for(i = 1; i < numSamples; i++)
+	{
+		if(samples[i] == (pj_int16_t)(samples[i - 1] + 1))
+		{
+			continue;
+		}
+		
+		// The samples are numbered from 0, and the run is short enough that the numbers don't wrap around
+		if((samples[i] <= samples[i - 1]) || ((samples[i] % TEST_PACKET_FRAMES) != 0))
+		{
+			fprintf(stderr, "    rendered sample %u is %d, after %d\n", i, samples[i], samples[i - 1]);
+			return -1;
+		}
+		
+		resumes++;
+	}
+	
+	return resumes;
+}
+
+/**
+ * Interrupts a running full-duplex stream, and ends the interruption again.
+ * Tried in synchronous and asynchronous mode.
+**/
+static void testSuspendResume(void)
+{
+	pj_bool_t async;
+	
+	for(async = PJ_FALSE; async <= PJ_TRUE; async++)
+	{
+		CHECK(testUseLoopback(async ? NULL : TEST_RENDER_FILE));
+		
+		pjmedia_snd_stream *snd_strm = testOpenStream(async);
+		CHECK(snd_strm != NULL);
+		
+		CHECK(pjmedia_snd_stream_start(snd_strm) == PJ_SUCCESS);
+		pj_thread_sleep(100);
+		
+		pjmedia_snd_audio_session_interruption(NULL, kAudioSessionBeginInterruption);
+		
+		pj_bool_t suspended = (snd_strm->state == SND_STREAM_SUSPENDED) && !snd_strm->unit->isRunning;
+		
+		// No IO cycles happen while the stream is suspended.
+		// (In asynchronous mode, the worker thread may still top up the play ring.)
+		
+		snd_voice_unit *unit = snd_strm->unit;
+		pj_uint32_t cycles = ATOMIC_LOAD(&unit->renderCycles) + ATOMIC_LOAD(&unit->captureCycles);
+		pj_uint32_t callbacks = testCallbacks();
+		
+		pj_thread_sleep(60);
+		
+		pj_bool_t quiet = ((ATOMIC_LOAD(&unit->renderCycles) + ATOMIC_LOAD(&unit->captureCycles)) == cycles);
+		
+		pjmedia_snd_audio_session_interruption(NULL, kAudioSessionEndInterruption);
+		
+		pj_bool_t resumed = (snd_strm->state == SND_STREAM_RUNNING) && unit->isRunning;
+		
+		pj_thread_sleep(100);
+		pj_bool_t running = (testCallbacks() != callbacks);
+		
+		pjmedia_snd_iphone_stats stats;
+		pjmedia_snd_stream_stop(snd_strm);
+		pjmedia_snd_iphone_stream_get_stats(snd_strm, &stats);
+		pjmedia_snd_stream_close(snd_strm);
+		
+		// Closing the last stream disposes of the voice unit, which completes the render file
+		int resumes = 0;
+		
+		if(!async)
+		{
+			resumes = testCheckRenderFile(TEST_RENDER_FILE);
+			remove(TEST_RENDER_FILE);
+		}
+		
+		CHECK_MSG(suspended, "async %d: the stream wasn't suspended", async);
+		CHECK_MSG(quiet, "async %d: the IO cycles carried on while suspended", async);
+		CHECK_MSG(resumed && running, "async %d: the stream didn't resume", async);
+		
+		CHECK_MSG((testStream.playTimestampErrors == 0) && (testStream.recTimestampErrors == 0),
+		          "async %d: %u play and %u rec timestamps aren't contiguous",
+		          async, testStream.playTimestampErrors, testStream.recTimestampErrors);
+		
+		CHECK_MSG(testStream.mixedPackets == 0, "async %d: %u captured packets aren't contiguous",
+		          async, testStream.mixedPackets);
+		
+		// The time to first audio is measured for both directions
+		
+		CHECK(stats.resumes == 1);
+		CHECK_MSG(stats.suspended_msec >= 50, "async %d: suspended for %u msec", async, stats.suspended_msec);
+		CHECK_MSG((stats.resume_render_usec > 0) && (stats.resume_render_usec < 50000) &&
+		          (stats.resume_capture_usec > 0) && (stats.resume_capture_usec < 50000),
+		          "async %d: first render %u usec, first capture %u usec after resume",
+		          async, stats.resume_render_usec, stats.resume_capture_usec);
+		
+		CHECK_MSG(async || (resumes == 1), "the rendered audio resumed %d times", resumes);
+	}
+}
+
+/**
+ * A stream started during an interruption starts out suspended, and runs once the interruption ends.
+**/
+static void testStartWhileInterrupted(void)
+{
+	CHECK(testUseLoopback(NULL));
+	
+	pjmedia_snd_stream *snd_strm = testOpenStream(PJ_FALSE);
+	CHECK(snd_strm != NULL);
+	
+	pjmedia_snd_audio_session_interruption(NULL, kAudioSessionBeginInterruption);
+	
+	pj_status_t status = pjmedia_snd_stream_start(snd_strm);
+	
+	pj_bool_t suspended = (snd_strm->state == SND_STREAM_SUSPENDED) && !snd_strm->unit->isRunning;
+	
+	pj_thread_sleep(40);
+	pj_bool_t quiet = (testCallbacks() == 0);
+	
+	pjmedia_snd_audio_session_interruption(NULL, kAudioSessionEndInterruption);
+	
+	pj_thread_sleep(60);
+	pj_bool_t running = (testCallbacks() > 0);
+	
+	pjmedia_snd_stream_stop(snd_strm);
+	pjmedia_snd_stream_close(snd_strm);
+	
+	CHECK(status == PJ_SUCCESS);
+	CHECK(suspended);
+	CHECK(quiet);
+	CHECK(running);
+	CHECK((testStream.playTimestampErrors == 0) && (testStream.recTimestampErrors == 0));
+}
+
+// Benchmarks
+
+#define BENCH_INTERRUPTIONS  50
+
+static void benchResume(void)
+{
+	pj_bool_t async;
+	
+	if(!testUseLoopback(NULL))
+	{
+		return;
+	}
+	
+	printf("time to first audio after an interruption, %u frame IO cycles at %u Hz, %u interruptions, usec\n",
+	       TEST_CYCLE_FRAMES, TEST_CLOCK_RATE, BENCH_INTERRUPTIONS);
+	printf("  %-6s %24s %24s\n", "", "render: min / avg / max", "capture: min / avg / max");
+	
+	for(async = PJ_FALSE; async <= PJ_TRUE; async++)
+	{
+		pjmedia_snd_stream *snd_strm = testOpenStream(async);
+		
+		if((snd_strm == NULL) || (pjmedia_snd_stream_start(snd_strm) != PJ_SUCCESS))
+		{
+			return;
+		}
+		
+		pj_uint32_t renderMin = 0xffffffff, renderMax = 0, captureMin = 0xffffffff, captureMax = 0;
+		double renderSum = 0, captureSum = 0;
+		unsigned i;
+		
+		for(i = 0; i < BENCH_INTERRUPTIONS; i++)
+		{
+			pj_thread_sleep(20);
+			pjmedia_snd_audio_session_interruption(NULL, kAudioSessionBeginInterruption);
+			pj_thread_sleep(5);
+			pjmedia_snd_audio_session_interruption(NULL, kAudioSessionEndInterruption);
+			pj_thread_sleep(20);
+			
+			pjmedia_snd_iphone_stats stats;
+			pjmedia_snd_iphone_stream_get_stats(snd_strm, &stats);
+			
+			renderSum += stats.resume_render_usec;
+			captureSum += stats.resume_capture_usec;
+			
+			if(stats.resume_render_usec < renderMin)   renderMin = stats.resume_render_usec;
+			if(stats.resume_render_usec > renderMax)   renderMax = stats.resume_render_usec;
+			if(stats.resume_capture_usec < captureMin) captureMin = stats.resume_capture_usec;
+			if(stats.resume_capture_usec > captureMax) captureMax = stats.resume_capture_usec;
+		}
+		
+		pjmedia_snd_stream_stop(snd_strm);
+		pjmedia_snd_stream_close(snd_strm);
+		
+		printf("  %-6s %7u / %6.1f / %6u %7u / %6.1f / %6u\n", async ? "async" : "sync",
+		       renderMin, renderSum / BENCH_INTERRUPTIONS, renderMax,
+		       captureMin, captureSum / BENCH_INTERRUPTIONS, captureMax);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(!testUseLoopback(NULL) || (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		benchResume();
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testSuspendResume);
+	RUN_TEST(testStartWhileInterrupted);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}
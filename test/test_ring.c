@@ -0,0 +1,306 @@
+/**
+ * Tests and benchmarks of the lock-free SPSC ring (snd_ring).
+ *
+ * The stress test runs a producer and a consumer on two threads, with random chunk sizes on both sides,
+ * and checks that every byte comes out exactly once and in order. Build it with "make tsan" to run it
+ * under ThreadSanitizer as well.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#include <sched.h>
+
+static pj_pool_factory testFactory;
+
+/**
+ * The byte at a given position of the stream that goes through the ring.
+ * It depends on more than the low bits of the position, so a chunk that is skipped or repeated
+ * a multiple of 256 bytes away still shows.
+**/
+static pj_uint8_t testStreamByte(pj_uint64_t position)
+{
+	return (pj_uint8_t)((position * 131) ^ (position >> 8) ^ (position >> 19));
+}
+
+/**
+ * Reads and writes are all or nothing, and the ring wraps around its buffer (and its indexes around 2^32).
+**/
+static void testRingSingleThread(void)
+{
+	static pj_uint8_t buffer[64];
+	pj_uint8_t data[64];
+	pj_uint8_t out[64];
+	unsigned i;
+	
+	snd_ring ring;
+	ringInit(&ring, buffer, sizeof(buffer));
+	
+	for(i = 0; i < sizeof(data); i++)
+	{
+		data[i] = (pj_uint8_t)(i + 1);
+	}
+	
+	CHECK(ringAvailable(&ring) == 0);
+	CHECK(ringSpace(&ring) == 64);
+	CHECK(!ringRead(&ring, out, 1));
+	
+	CHECK(ringWrite(&ring, data, 40));
+	CHECK(!ringWrite(&ring, data, 25));
+	CHECK(ringAvailable(&ring) == 40);
+	CHECK(ringSpace(&ring) == 24);
+	
+	CHECK(!ringRead(&ring, out, 41));
+	CHECK(ringRead(&ring, out, 30));
+	CHECK(memcmp(out, data, 30) == 0);
+	
+	// This write wraps around the end of the buffer
+	
+	CHECK(ringWrite(&ring, data, 50));
+	CHECK(ringAvailable(&ring) == 60);
+	
+	CHECK(ringRead(&ring, out, 10));
+	CHECK(memcmp(out, data + 30, 10) == 0);
+	
+	CHECK(ringRead(&ring, out, 50));
+	CHECK(memcmp(out, data, 50) == 0);
+	CHECK(ringAvailable(&ring) == 0);
+	
+	// The indexes run freely, so they wrap at 2^32
+	
+	ring.writeIndex = 0xFFFFFFF0;
+	ring.readIndex  = 0xFFFFFFF0;
+	
+	CHECK(ringWrite(&ring, data, 64));
+	CHECK(ringAvailable(&ring) == 64);
+	CHECK(ringSpace(&ring) == 0);
+	CHECK(ringRead(&ring, out, 64));
+	CHECK(memcmp(out, data, 64) == 0);
+	
+	CHECK(ringWrite(&ring, data, 20));
+	ringDiscard(&ring);
+	CHECK(ringAvailable(&ring) == 0);
+}
+
+// Two-thread stress test
+
+#define STRESS_CAPACITY      1024
+#define STRESS_MAX_CAPACITY  8192
+#define STRESS_BYTES         (48 * 1024 * 1024)
+
+typedef struct test_stress
+{
+	snd_ring ring;
+	pj_uint32_t capacity;
+	
+	// The most either side moves at once
+	unsigned maxChunk;
+	
+	pj_uint64_t total;
+	
+	// Set by the consumer
+	pj_uint64_t consumed;
+	pj_uint64_t mismatchAt;
+	int mismatch;
+	pj_uint32_t maxAvailable;
+	
+	// Number of times either side found the ring full or empty
+	pj_uint64_t producerStalls;
+	pj_uint64_t consumerStalls;
+	
+} test_stress;
+
+static int stressProducer(void *arg)
+{
+	test_stress *stress = (test_stress *)arg;
+	
+	pj_uint8_t chunk[STRESS_MAX_CAPACITY];
+	pj_uint64_t position = 0;
+	unsigned state = 0x12345678;
+	
+	while(position < stress->total)
+	{
+		unsigned size = 1 + (testRandom(&state) % stress->maxChunk);
+		unsigned i;
+		
+		if(size > (stress->total - position))
+		{
+			size = (unsigned)(stress->total - position);
+		}
+		
+		for(i = 0; i < size; i++)
+		{
+			chunk[i] = testStreamByte(position + i);
+		}
+		
+		while(!ringWrite(&stress->ring, chunk, size))
+		{
+			stress->producerStalls++;
+			sched_yield();
+		}
+		
+		position += size;
+	}
+	
+	return 0;
+}
+
+static int stressConsumer(void *arg)
+{
+	test_stress *stress = (test_stress *)arg;
+	
+	pj_uint8_t chunk[STRESS_MAX_CAPACITY];
+	pj_uint64_t position = 0;
+	unsigned state = 0x87654321;
+	
+	while(position < stress->total)
+	{
+		unsigned size = 1 + (testRandom(&state) % stress->maxChunk);
+		unsigned i;
+		
+		if(size > (stress->total - position))
+		{
+			size = (unsigned)(stress->total - position);
+		}
+		
+		pj_uint32_t available = ringAvailable(&stress->ring);
+		
+		if(available > stress->maxAvailable)
+		{
+			stress->maxAvailable = available;
+		}
+		
+		if(!ringRead(&stress->ring, chunk, size))
+		{
+			stress->consumerStalls++;
+			sched_yield();
+			continue;
+		}
+		
+		for(i = 0; i < size; i++)
+		{
+			if(chunk[i] != testStreamByte(position + i))
+			{
+				stress->mismatch = 1;
+				stress->mismatchAt = position + i;
+				stress->consumed = position;
+				return 0;
+			}
+		}
+		
+		position += size;
+	}
+	
+	stress->consumed = position;
+	return 0;
+}
+
+/**
+ * Runs a producer and a consumer thread over the ring, and returns the time it took (in seconds).
+**/
+static double stressRun(test_stress *stress)
+{
+	static pj_uint8_t buffer[STRESS_MAX_CAPACITY];
+	
+	ringInit(&stress->ring, buffer, stress->capacity);
+	
+	// Start near the top of the index range, so the indexes wrap during the run
+	stress->ring.writeIndex = 0xFFF00000;
+	stress->ring.readIndex  = 0xFFF00000;
+	
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	pj_thread_t *producer, *consumer;
+	
+	double start = benchNow();
+	
+	pj_thread_create(pool, "producer", stressProducer, stress, 0, 0, &producer);
+	pj_thread_create(pool, "consumer", stressConsumer, stress, 0, 0, &consumer);
+	
+	pj_thread_join(producer);
+	pj_thread_join(consumer);
+	
+	double elapsed = benchNow() - start;
+	
+	pj_pool_release(pool);
+	
+	return elapsed;
+}
+
+static void testRingStress(void)
+{
+	test_stress stress;
+	memset(&stress, 0, sizeof(stress));
+	
+	stress.capacity = STRESS_CAPACITY;
+	stress.maxChunk = STRESS_CAPACITY / 3;
+	stress.total = STRESS_BYTES;
+	
+	stressRun(&stress);
+	
+	CHECK_MSG(!stress.mismatch, "byte %llu is wrong", (unsigned long long)stress.mismatchAt);
+	CHECK(stress.consumed == stress.total);
+	CHECK(stress.maxAvailable <= STRESS_CAPACITY);
+	CHECK(ringAvailable(&stress.ring) == 0);
+}
+
+/**
+ * Chunks as large as the whole ring only fit once the ring is completely empty.
+**/
+static void testRingStressFullChunks(void)
+{
+	test_stress stress;
+	memset(&stress, 0, sizeof(stress));
+	
+	stress.capacity = STRESS_CAPACITY;
+	stress.maxChunk = STRESS_CAPACITY;
+	stress.total = STRESS_BYTES / 4;
+	
+	stressRun(&stress);
+	
+	CHECK_MSG(!stress.mismatch, "byte %llu is wrong", (unsigned long long)stress.mismatchAt);
+	CHECK(stress.consumed == stress.total);
+	CHECK(stress.maxAvailable <= STRESS_CAPACITY);
+}
+
+// Benchmarks
+
+static void benchRing(void)
+{
+	static const unsigned chunkSizes[] = { 320, 640, 1920 };
+	unsigned i;
+	
+	printf("ring throughput, two threads, %u byte ring, random chunks\n", STRESS_MAX_CAPACITY);
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(chunkSizes); i++)
+	{
+		test_stress stress;
+		memset(&stress, 0, sizeof(stress));
+		
+		stress.capacity = STRESS_MAX_CAPACITY;
+		stress.maxChunk = chunkSizes[i];
+		stress.total = 256 * 1024 * 1024;
+		
+		double elapsed = stressRun(&stress);
+		
+		printf("  chunks of up to %4u bytes: %7.1f MB/s (%llu producer stalls, %llu consumer stalls)\n",
+		       chunkSizes[i], (stress.total / elapsed) / 1e6,
+		       (unsigned long long)stress.producerStalls, (unsigned long long)stress.consumerStalls);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(benchRequested(argc, argv))
+	{
+		benchRing();
+		return 0;
+	}
+	
+	RUN_TEST(testRingSingleThread);
+	RUN_TEST(testRingStress);
+	RUN_TEST(testRingStressFullChunks);
+	
+	return testSummary();
+}
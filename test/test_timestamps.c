@@ -0,0 +1,365 @@
+/**
+ * Tests of the capture timestamps, as passed to rec_cb.
+ *
+ * A capture stream is opened on the loopback backend, and its capture path (captureStream) is driven directly
+ * with random inNumberFrames patterns, the way core audio may call the input callback. Every rec_cb timestamp
+ * must advance by exactly samples_per_frame, with or without resampling, until the hardware sample time jumps.
+ * Then the timestamp must skip ahead by exactly the lost frames, converted to the pjsip clock rate.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#include <math.h>
+
+// The largest IO cycle core audio hands us
+#define TEST_MAX_IO_FRAMES  4096
+
+#define TEST_PACKET_MSEC  20
+
+static pj_pool_factory testFactory;
+
+static pj_int16_t testDevice[TEST_MAX_IO_FRAMES * 2];
+
+typedef struct test_config
+{
+	unsigned clockRate;
+	unsigned hwRate;
+	unsigned channels;
+	
+} test_config;
+
+static const test_config testConfigs[] =
+{
+	{  8000,  8000, 1 },
+	{  8000,  8000, 2 },
+	{ 16000, 16000, 1 },
+	{ 44100, 44100, 2 },
+	{  8000, 44100, 1 },
+	{  8000, 48000, 2 },
+	{ 16000, 44100, 1 },
+	{ 16000, 48000, 2 },
+	{ 48000, 44100, 1 },
+};
+
+/**
+ * State of the pjsip side of the stream under test.
+**/
+typedef struct test_recorder
+{
+	unsigned samplesPerFrame;
+	
+	unsigned packets;
+	pj_uint32_t firstTimestamp;
+	pj_uint32_t lastTimestamp;
+	
+	// Timestamp steps other than samples_per_frame, and how far they stepped beyond it in total
+	unsigned jumps;
+	pj_int64_t skipped;
+	
+	// Without resampling, every captured sample is the position of its frame on the hardware timeline
+	pj_bool_t checkAudio;
+	pj_uint32_t nextSample;
+	unsigned badSamples;
+	
+} test_recorder;
+
+static test_recorder testRecorder;
+
+static pj_status_t testRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_recorder *rec = (test_recorder *)user_data;
+	
+	if(rec->packets == 0)
+	{
+		rec->firstTimestamp = timestamp;
+	}
+	else if(timestamp != rec->lastTimestamp + rec->samplesPerFrame)
+	{
+		rec->jumps++;
+		rec->skipped += (pj_int32_t)(timestamp - rec->lastTimestamp - rec->samplesPerFrame);
+	}
+	
+	rec->packets++;
+	rec->lastTimestamp = timestamp;
+	
+	if(rec->checkAudio)
+	{
+		const pj_int16_t *samples = (const pj_int16_t *)input;
+		unsigned i;
+		
+		for(i = 0; i < size / sizeof(pj_int16_t); i++)
+		{
+			if(samples[i] != (pj_int16_t)rec->nextSample++) rec->badSamples++;
+		}
+	}
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Opens a capture stream on the loopback backend. The stream isn't started, so its capture path
+ * is ours to drive. Returns NULL on failure.
+**/
+static pjmedia_snd_stream *testOpen(const test_config *config)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.hw_clock_rate = config->hwRate;
+	
+	if(pjmedia_snd_iphone_set_options(&options) != PJ_SUCCESS)
+	{
+		return NULL;
+	}
+	
+	unsigned samplesPerFrame = config->clockRate * TEST_PACKET_MSEC / 1000 * config->channels;
+	
+	pj_bzero(&testRecorder, sizeof(testRecorder));
+	testRecorder.samplesPerFrame = samplesPerFrame;
+	testRecorder.checkAudio = (config->clockRate == config->hwRate);
+	
+	pjmedia_snd_stream *snd_strm;
+	
+	if(pjmedia_snd_open_rec(-1, config->clockRate, config->channels, samplesPerFrame, 16,
+	                        testRecCallback, &testRecorder, &snd_strm) != PJ_SUCCESS)
+	{
+		return NULL;
+	}
+	
+	return snd_strm;
+}
+
+/**
+ * Passes one IO cycle to the stream, the way voiceUnitCapture does.
+ * Each sample holds the position of its frame on the hardware timeline.
+**/
+static void testCapture(pjmedia_snd_stream *snd_strm, pj_uint64_t sampleTime, unsigned numFrames)
+{
+	unsigned channels = snd_strm->inputFormat.channels;
+	unsigned i, c;
+	
+	for(i = 0; i < numFrames; i++)
+	{
+		for(c = 0; c < channels; c++)
+		{
+			testDevice[(i * channels) + c] = (pj_int16_t)(((sampleTime + i) * channels) + c);
+		}
+	}
+	
+	snd_io_time time;
+	
+	time.sampleTime = (double)sampleTime;
+	time.hostTime = (pj_uint64_t)(sampleTime * snd_strm->captureTimeline.hostTicksPerSecond / snd_strm->inputFormat.sampleRate);
+	time.sampleTimeValid = PJ_TRUE;
+	time.hostTimeValid = PJ_TRUE;
+	
+	captureStream(snd_strm->unit, snd_strm, &time, numFrames, testDevice, numFrames * snd_strm->inputFormat.bytesPerFrame);
+}
+
+/**
+ * Returns a random IO cycle size: mostly a typical one, sometimes anything from a single frame up to the maximum.
+**/
+static unsigned testRandomFrames(unsigned *state)
+{
+	static const unsigned typical[] = { 185, 186, 512, 1024, 93, 470, 471 };
+	unsigned r = testRandom(state);
+	
+	if((r % 4) == 0)
+	{
+		return 1 + ((r >> 8) % TEST_MAX_IO_FRAMES);
+	}
+	
+	return typical[(r >> 8) % PJ_ARRAY_SIZE(typical)];
+}
+
+/**
+ * With every hardware frame delivered, the timestamps advance by exactly samples_per_frame,
+ * however core audio splits up the audio.
+**/
+static void testContinuous(void)
+{
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(testConfigs); i++)
+	{
+		const test_config *config = &testConfigs[i];
+		pjmedia_snd_stream *snd_strm = testOpen(config);
+		
+		CHECK_MSG(snd_strm != NULL, "%u Hz at %u Hz: unable to open the stream", config->clockRate, config->hwRate);
+		
+		unsigned state = 0x13579bdf + i;
+		pj_uint64_t sampleTime = 0;
+		unsigned k;
+		
+		for(k = 0; k < 3000; k++)
+		{
+			unsigned numFrames = testRandomFrames(&state);
+			
+			testCapture(snd_strm, sampleTime, numFrames);
+			sampleTime += numFrames;
+		}
+		
+		pjmedia_snd_stream_close(snd_strm);
+		
+		// Every frame that went in came out, give or take what's left in the resampler and the staging buffer
+		
+		double expectedPackets = (double)sampleTime * config->clockRate / config->hwRate
+		                         * config->channels / testRecorder.samplesPerFrame;
+		
+		CHECK_MSG(testRecorder.jumps == 0, "%u Hz at %u Hz, %u channel(s): %u timestamps jumped by %lld samples in total",
+		          config->clockRate, config->hwRate, config->channels, testRecorder.jumps, (long long)testRecorder.skipped);
+		CHECK_MSG(fabs(testRecorder.packets - expectedPackets) <= 1.5, "%u Hz at %u Hz: %u packets, expected %.1f",
+		          config->clockRate, config->hwRate, testRecorder.packets, expectedPackets);
+		CHECK_MSG(testRecorder.badSamples == 0, "%u Hz, %u channel(s): %u samples are wrong",
+		          config->clockRate, config->channels, testRecorder.badSamples);
+	}
+}
+
+/**
+ * When the hardware sample time jumps ahead, the timestamp skips ahead by exactly the lost frames,
+ * converted to the pjsip clock rate, with the fractions carried over from one gap to the next.
+**/
+static void testLostFrames(void)
+{
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(testConfigs); i++)
+	{
+		const test_config *config = &testConfigs[i];
+		pjmedia_snd_stream *snd_strm = testOpen(config);
+		
+		CHECK(snd_strm != NULL);
+		
+		// The lost audio doesn't come through, so there's nothing to compare it with
+		testRecorder.checkAudio = PJ_FALSE;
+		
+		unsigned state = 0x2468ace0 + i;
+		pj_uint64_t sampleTime = 0;
+		pj_uint64_t lost = 0;
+		unsigned gaps = 0;
+		unsigned k;
+		
+		for(k = 0; k < 3000; k++)
+		{
+			unsigned numFrames = testRandomFrames(&state);
+			
+			if((k > 0) && ((testRandom(&state) % 50) == 0))
+			{
+				unsigned gap = 1 + (testRandom(&state) % 3000);
+				
+				sampleTime += gap;
+				lost += gap;
+				gaps++;
+			}
+			
+			testCapture(snd_strm, sampleTime, numFrames);
+			sampleTime += numFrames;
+		}
+		
+		// A skip shows in the timestamp of the next packet, so make sure the last one comes out
+		
+		for(k = 0; k < 4; k++)
+		{
+			testCapture(snd_strm, sampleTime, TEST_MAX_IO_FRAMES);
+			sampleTime += TEST_MAX_IO_FRAMES;
+		}
+		
+		pjmedia_snd_stream_close(snd_strm);
+		
+		pj_int64_t expected = (pj_int64_t)floor((double)lost * config->clockRate / config->hwRate) * config->channels;
+		
+		CHECK(gaps > 0);
+		CHECK_MSG(testRecorder.skipped == expected, "%u Hz at %u Hz, %u channel(s): skipped %lld samples, expected %lld",
+		          config->clockRate, config->hwRate, config->channels, (long long)testRecorder.skipped, (long long)expected);
+		CHECK(testRecorder.jumps <= gaps);
+	}
+}
+
+/**
+ * The capture host time of a timestamp is the host time at which its first frame hit the hardware.
+ * Without resampling that's exact. With resampling, each pjsip frame is centered on a hardware frame
+ * half the filter length earlier than the newest input, and the host time is within a hardware frame of that.
+**/
+static void testCaptureHostTime(void)
+{
+	unsigned i;
+	
+	for(i = 0; i < PJ_ARRAY_SIZE(testConfigs); i++)
+	{
+		const test_config *config = &testConfigs[i];
+		pjmedia_snd_stream *snd_strm = testOpen(config);
+		
+		CHECK(snd_strm != NULL);
+		
+		pj_uint64_t hostTime;
+		CHECK(pjmedia_snd_iphone_stream_get_capture_host_time(snd_strm, 0, &hostTime) == PJ_EINVALIDOP);
+		
+		// Start well into the hardware timeline, so the filter delay doesn't reach back before zero
+		unsigned state = 0x0badcafe + i;
+		pj_uint64_t startTime = 1000000;
+		pj_uint64_t sampleTime = startTime;
+		unsigned k;
+		
+		for(k = 0; k < 200; k++)
+		{
+			unsigned numFrames = testRandomFrames(&state);
+			
+			testCapture(snd_strm, sampleTime, numFrames);
+			sampleTime += numFrames;
+		}
+		
+		double ticksPerSecond = snd_strm->captureTimeline.hostTicksPerSecond;
+		
+		// The last packet started this many pjsip frames after the first one
+		double seconds = (double)(testRecorder.lastTimestamp - testRecorder.firstTimestamp)
+		                 / config->channels / config->clockRate;
+		
+		// And the first one started at the first hardware frame, less the filter delay
+		double startFrame = startTime;
+		
+		if(snd_strm->inputResampler)
+		{
+			startFrame -= snd_strm->inputResampler->taps / 2.0;
+		}
+		
+		double expected = ((startFrame / config->hwRate) + seconds) * ticksPerSecond;
+		double tolerance = (config->clockRate == config->hwRate) ? 1.0 : (ticksPerSecond / config->hwRate);
+		
+		CHECK(pjmedia_snd_iphone_stream_get_capture_host_time(snd_strm, testRecorder.lastTimestamp, &hostTime) == PJ_SUCCESS);
+		
+		pjmedia_snd_stream_close(snd_strm);
+		
+		CHECK_MSG(fabs((double)hostTime - expected) <= tolerance, "%u Hz at %u Hz: host time off by %.0f ticks",
+		          config->clockRate, config->hwRate, (double)hostTime - expected);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	if((pjmedia_snd_iphone_use_loopback(&param) != PJ_SUCCESS) || (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		// There's nothing to benchmark here
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testContinuous);
+	RUN_TEST(testLostFrames);
+	RUN_TEST(testCaptureHostTime);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}
@@ -0,0 +1,651 @@
+/**
+ * Tests and benchmarks of voice activity detection (options.vad).
+ *
+ * The analysis (energy and zero crossings) must be exact with a plain per-sample loop, whatever vector unit
+ * it was compiled for, for any length and alignment, mono or stereo (where each channel crosses zero on its own).
+ * The classifier must tell voice from silence by level, let quiet noise-like sounds through by their zero crossings,
+ * and hold voice for the hangover.
+ *
+ * End to end, a stream captures a WAV file made of packets of silence, a tone, quiet noise and a quiet hum,
+ * on the loopback backend. vad_cb must get the expected activity of every packet, in order,
+ * and with vad_suppress, rec_cb must get the active packets only.
+ *
+ * Run with --bench to print how long a 20 ms packet takes to classify, against a budget of a microsecond.
+**/
+
+#include "iphonesound.c"
+#include "test.h"
+
+#define TEST_CLOCK_RATE     16000
+
+// 20 ms packets, and loopback IO cycles that aren't a divisor of them
+#define TEST_PACKET_FRAMES  320
+#define TEST_CYCLE_FRAMES   185
+
+#define TEST_CAPTURE_FILE   "test_vad_in.wav"
+
+#define TEST_MAX_SAMPLES    4096
+
+static pj_pool_factory testFactory;
+
+static pj_int16_t testSamples[TEST_MAX_SAMPLES + 16];
+
+/**
+ * The energy and zero crossings (of each channel), one sample at a time.
+**/
+static void __attribute__((noinline)) referenceAnalyze(const pj_int16_t *samples, unsigned numSamples,
+                                                       unsigned channels, pj_uint64_t *energy, unsigned *crossings)
+{
+	pj_uint64_t sum = 0;
+	unsigned count = 0;
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		sum += (pj_uint64_t)((pj_int64_t)samples[i] * samples[i]);
+		
+		if((i >= channels) && ((samples[i - channels] < 0) != (samples[i] < 0)))
+		{
+			count++;
+		}
+	}
+	
+	*energy = sum;
+	*crossings = count;
+}
+
+/**
+ * Fills a packet with a sine wave of the given frequency and level (in dBFS, where 0 dBFS is a full scale square wave).
+**/
+static void testTone(pj_int16_t *samples, unsigned numSamples, unsigned frequency, double dbfs, unsigned *phase)
+{
+	double amplitude = 32768.0 * sqrt(2.0 * pow(10.0, dbfs / 10.0));
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++, (*phase)++)
+	{
+		samples[i] = (pj_int16_t)lrint(amplitude * sin(2.0 * M_PI * frequency * (*phase) / TEST_CLOCK_RATE));
+	}
+}
+
+/**
+ * Fills a packet with white noise of the given level (in dBFS).
+**/
+static void testNoise(pj_int16_t *samples, unsigned numSamples, double dbfs, unsigned *state)
+{
+	// Uniform noise in [-a, a] has an RMS of a / sqrt(3)
+	double amplitude = 32768.0 * sqrt(3.0 * pow(10.0, dbfs / 10.0));
+	unsigned i;
+	
+	for(i = 0; i < numSamples; i++)
+	{
+		double r = (testRandom(state) / 4294967296.0) * 2.0 - 1.0;
+		samples[i] = (pj_int16_t)lrint(amplitude * r);
+	}
+}
+
+/**
+ * Prepares the detector for 20 ms packets at TEST_CLOCK_RATE, with the default thresholds and the given hangover.
+**/
+static void testVadInit(snd_vad *vad, unsigned hangoverMsec, unsigned channels)
+{
+	pjmedia_snd_iphone_options options;
+	pjmedia_snd_iphone_options_default(&options);
+	
+	options.vad = PJ_TRUE;
+	options.vad_hangover_msec = hangoverMsec;
+	
+	vadInit(vad, &options, TEST_CLOCK_RATE, TEST_PACKET_FRAMES, channels);
+}
+
+static void testAnalyze(void)
+{
+	static const unsigned longLengths[] = { 160, 320, 882, 960, 4093 };
+	
+	unsigned state = 0x7f4a7c15;
+	unsigned channels, length, offset;
+	
+	for(channels = 1; channels <= 2; channels++)
+	{
+		for(length = 0; length < 64 + PJ_ARRAY_SIZE(longLengths); length++)
+		{
+			for(offset = 0; offset < 8; offset++)
+			{
+				unsigned numSamples = (length < 64) ? length : longLengths[length - 64];
+				
+				pj_uint64_t energy, expectedEnergy;
+				unsigned crossings, expectedCrossings;
+				
+				testRandomSamples(testSamples, PJ_ARRAY_SIZE(testSamples), &state);
+				
+				referenceAnalyze(testSamples + offset, numSamples, channels, &expectedEnergy, &expectedCrossings);
+				vadAnalyze(testSamples + offset, numSamples, channels, &energy, &crossings);
+				
+				CHECK_MSG((energy == expectedEnergy) && (crossings == expectedCrossings),
+				          "%u channel(s), %u samples at offset %u: energy %llu, %u crossings, expected %llu, %u",
+				          channels, numSamples, offset, (unsigned long long)energy, crossings,
+				          (unsigned long long)expectedEnergy, expectedCrossings);
+			}
+		}
+	}
+	
+	// The largest energy there is, and the most crossings
+	
+	unsigned i;
+	pj_uint64_t energy;
+	unsigned crossings;
+	
+	for(i = 0; i < TEST_MAX_SAMPLES; i++)
+	{
+		testSamples[i] = -32768;
+	}
+	
+	vadAnalyze(testSamples, TEST_MAX_SAMPLES, 1, &energy, &crossings);
+	
+	CHECK(energy == (pj_uint64_t)TEST_MAX_SAMPLES * 32768 * 32768);
+	CHECK(crossings == 0);
+	
+	for(i = 0; i < TEST_MAX_SAMPLES; i++)
+	{
+		testSamples[i] = (i & 1) ? 32767 : -32768;
+	}
+	
+	vadAnalyze(testSamples, TEST_MAX_SAMPLES, 1, &energy, &crossings);
+	
+	CHECK(crossings == TEST_MAX_SAMPLES - 1);
+	
+	// In stereo, that's two channels that never change sign
+	
+	vadAnalyze(testSamples, TEST_MAX_SAMPLES, 2, &energy, &crossings);
+	
+	CHECK(crossings == 0);
+}
+
+/**
+ * With the default thresholds (-45 dBFS, or -55 dBFS with 300 crossings per 1000 samples),
+ * and no hangover, each kind of packet is classified on its own.
+**/
+static void testClassify(void)
+{
+	static const struct
+	{
+		const char *name;
+		int noise;
+		unsigned frequency;
+		double dbfs;
+		pj_bool_t voice;
+	}
+	packets[] =
+	{
+		{ "tone at -20 dBFS",        0, 1000, -20, PJ_TRUE  },
+		{ "tone at -40 dBFS",        0, 200,  -40, PJ_TRUE  },
+		{ "hum at -50 dBFS",         0, 200,  -50, PJ_FALSE },
+		{ "tone at -60 dBFS",        0, 3000, -60, PJ_FALSE },
+		{ "noise at -40 dBFS",       1, 0,    -40, PJ_TRUE  },
+		{ "noise at -50 dBFS",       1, 0,    -50, PJ_TRUE  },
+		{ "noise at -60 dBFS",       1, 0,    -60, PJ_FALSE },
+		{ "tone at 3 kHz, -50 dBFS", 0, 3000, -50, PJ_TRUE  },
+	};
+	
+	unsigned state = 0x2545f491;
+	unsigned phase = 0;
+	unsigned k;
+	
+	snd_vad vad;
+	testVadInit(&vad, 0, 1);
+	
+	pj_bzero(testSamples, TEST_PACKET_FRAMES * sizeof(pj_int16_t));
+	CHECK(!vadProcess(&vad, testSamples, TEST_PACKET_FRAMES));
+	
+	CHECK(!vadProcess(&vad, testSamples, 0));
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(packets); k++)
+	{
+		if(packets[k].noise)
+			testNoise(testSamples, TEST_PACKET_FRAMES, packets[k].dbfs, &state);
+		else
+			testTone(testSamples, TEST_PACKET_FRAMES, packets[k].frequency, packets[k].dbfs, &phase);
+		
+		pj_bool_t voice = vadProcess(&vad, testSamples, TEST_PACKET_FRAMES);
+		
+		CHECK_MSG(voice == packets[k].voice, "%s: voice %d", packets[k].name, voice);
+	}
+}
+
+/**
+ * In stereo, the zero crossings are counted per channel. A quiet hum with the channels in opposite phase
+ * changes sign between every pair of neighbouring samples, but it's still a hum, not noise.
+**/
+static void testClassifyStereo(void)
+{
+	static pj_int16_t mono[TEST_PACKET_FRAMES];
+	
+	unsigned state = 0x6a09e667;
+	unsigned phase = 0;
+	unsigned i;
+	
+	snd_vad vad;
+	testVadInit(&vad, 0, 2);
+	
+	testTone(mono, TEST_PACKET_FRAMES, 200, -50, &phase);
+	
+	for(i = 0; i < TEST_PACKET_FRAMES; i++)
+	{
+		testSamples[(2 * i) + 0] = mono[i];
+		testSamples[(2 * i) + 1] = (pj_int16_t)-mono[i];
+	}
+	
+	CHECK_MSG(!vadProcess(&vad, testSamples, 2 * TEST_PACKET_FRAMES), "hum at -50 dBFS in opposite phase is voice");
+	
+	// Quiet noise is still voice
+	testNoise(testSamples, 2 * TEST_PACKET_FRAMES, -50, &state);
+	
+	CHECK_MSG(vadProcess(&vad, testSamples, 2 * TEST_PACKET_FRAMES), "noise at -50 dBFS isn't voice");
+}
+
+/**
+ * After voice, the hangover (rounded up to whole packets) is voice too, and then it's silence again.
+ * Voice within the hangover starts it over.
+**/
+static void testHangover(void)
+{
+	static const struct { unsigned msec; unsigned packets; } hangovers[] =
+	{
+		{ 0, 0 }, { 10, 1 }, { 20, 1 }, { 200, 10 }, { 210, 11 }
+	};
+	
+	static pj_int16_t voice[TEST_PACKET_FRAMES];
+	static pj_int16_t silence[TEST_PACKET_FRAMES];
+	
+	unsigned phase = 0;
+	unsigned k, i;
+	
+	testTone(voice, TEST_PACKET_FRAMES, 1000, -20, &phase);
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(hangovers); k++)
+	{
+		snd_vad vad;
+		testVadInit(&vad, hangovers[k].msec, 1);
+		
+		CHECK(!vadProcess(&vad, silence, TEST_PACKET_FRAMES));
+		CHECK(vadProcess(&vad, voice, TEST_PACKET_FRAMES));
+		
+		for(i = 0; (i < hangovers[k].packets) && vadProcess(&vad, silence, TEST_PACKET_FRAMES); i++);
+		
+		CHECK_MSG(i == hangovers[k].packets, "%u msec: %u packets of hangover, expected %u",
+		          hangovers[k].msec, i, hangovers[k].packets);
+		CHECK_MSG(!vadProcess(&vad, silence, TEST_PACKET_FRAMES), "%u msec: the hangover went on", hangovers[k].msec);
+		
+		// Voice in the middle of the hangover makes it last as long again
+		
+		if(hangovers[k].packets > 1)
+		{
+			CHECK(vadProcess(&vad, voice, TEST_PACKET_FRAMES));
+			CHECK(vadProcess(&vad, silence, TEST_PACKET_FRAMES));
+			CHECK(vadProcess(&vad, voice, TEST_PACKET_FRAMES));
+			
+			for(i = 0; (i < hangovers[k].packets + 1) && vadProcess(&vad, silence, TEST_PACKET_FRAMES); i++);
+			
+			CHECK_MSG(i == hangovers[k].packets, "%u msec: %u packets of hangover after voice in the hangover",
+			          hangovers[k].msec, i);
+		}
+	}
+}
+
+// End to end
+
+// The capture file, packet by packet: what's in each run of packets, and whether those packets are voice
+// with the default thresholds and a hangover of 200 msec (10 packets)
+
+typedef enum test_content
+{
+	TEST_SILENCE,
+	TEST_TONE,
+	TEST_NOISE,
+	TEST_HUM
+	
+} test_content;
+
+static const struct
+{
+	test_content content;
+	unsigned packets;
+	unsigned activePackets;
+}
+testScript[] =
+{
+	{ TEST_SILENCE, 5,  0  },
+	{ TEST_TONE,    5,  5  },
+	{ TEST_SILENCE, 15, 10 },
+	{ TEST_NOISE,   5,  5  },
+	{ TEST_SILENCE, 15, 10 },
+	{ TEST_HUM,     5,  0  },
+	{ TEST_SILENCE, 5,  0  },
+};
+
+#define TEST_PACKETS  55
+
+static pj_bool_t testExpected[TEST_PACKETS];
+
+/**
+ * What the callbacks of the stream under test saw.
+**/
+typedef struct test_vad_stream
+{
+	// The activity vad_cb reported for every packet, by packet number, and how many reports there were
+	pj_bool_t active[TEST_PACKETS];
+	pj_uint32_t reports;
+	
+	// The packet numbers rec_cb got, in order, and how many
+	unsigned recPackets[TEST_PACKETS];
+	pj_uint32_t recCallbacks;
+	
+	// Timestamps vad_cb got that weren't the ones expected
+	unsigned timestampErrors;
+	
+	pj_uint32_t firstTimestamp;
+	
+} test_vad_stream;
+
+static test_vad_stream testStream;
+
+static void testVadCallback(void *user_data, pj_uint32_t timestamp, pj_bool_t active)
+{
+	test_vad_stream *ts = (test_vad_stream *)user_data;
+	pj_uint32_t report = ts->reports;
+	
+	if(report == 0)
+	{
+		ts->firstTimestamp = timestamp;
+	}
+	
+	if(timestamp != ts->firstTimestamp + (report * TEST_PACKET_FRAMES))
+	{
+		ts->timestampErrors++;
+	}
+	
+	if(report < TEST_PACKETS)
+	{
+		ts->active[report] = active;
+	}
+	
+	__atomic_store_n(&ts->reports, report + 1, __ATOMIC_RELEASE);
+}
+
+static pj_status_t testRecCallback(void *user_data, pj_uint32_t timestamp, void *input, unsigned size)
+{
+	test_vad_stream *ts = (test_vad_stream *)user_data;
+	
+	if(ts->recCallbacks < TEST_PACKETS)
+	{
+		ts->recPackets[ts->recCallbacks] = (timestamp - ts->firstTimestamp) / TEST_PACKET_FRAMES;
+	}
+	
+	ts->recCallbacks++;
+	
+	return PJ_SUCCESS;
+}
+
+/**
+ * Writes the capture file following testScript, and fills in testExpected.
+**/
+static pj_bool_t testWriteInput(const char *path)
+{
+	static pj_int16_t samples[TEST_PACKETS * TEST_PACKET_FRAMES];
+	
+	unsigned state = 0x9e3779b9;
+	unsigned phase = 0;
+	unsigned packet = 0;
+	unsigned k, i;
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(testScript); k++)
+	{
+		for(i = 0; i < testScript[k].packets; i++, packet++)
+		{
+			pj_int16_t *p = samples + (packet * TEST_PACKET_FRAMES);
+			
+			switch(testScript[k].content)
+			{
+				case TEST_SILENCE : pj_bzero(p, TEST_PACKET_FRAMES * sizeof(pj_int16_t)); break;
+				case TEST_TONE    : testTone(p, TEST_PACKET_FRAMES, 1000, -20, &phase); break;
+				case TEST_NOISE   : testNoise(p, TEST_PACKET_FRAMES, -50, &state); break;
+				case TEST_HUM     : testTone(p, TEST_PACKET_FRAMES, 200, -50, &phase); break;
+			}
+			
+			testExpected[packet] = (i < testScript[k].activePackets);
+		}
+	}
+	
+	pj_pool_t *pool = pj_pool_create(&testFactory, "test", 1024, 1024, NULL);
+	snd_wav_file wav;
+	
+	if((packet != TEST_PACKETS) || (pool == NULL) ||
+	   (wavOpenWrite(pool, path, TEST_CLOCK_RATE, 1, &wav) != PJ_SUCCESS))
+	{
+		return PJ_FALSE;
+	}
+	
+	wavWrite(&wav, samples, TEST_PACKETS * TEST_PACKET_FRAMES);
+	wavClose(&wav, PJ_TRUE);
+	
+	pj_pool_release(pool);
+	
+	return PJ_TRUE;
+}
+
+/**
+ * Has the loopback backend capture from the given file.
+ * In asynchronous mode it runs in realtime, so the worker thread keeps up, and no packet is dropped.
+**/
+static pj_bool_t testUseLoopback(const char *captureFile, pj_bool_t realtime)
+{
+	pjmedia_snd_iphone_loopback_param param;
+	pjmedia_snd_iphone_loopback_param_default(&param);
+	
+	param.hw_clock_rate = TEST_CLOCK_RATE;
+	param.frames_per_cycle = TEST_CYCLE_FRAMES;
+	param.realtime = realtime;
+	param.capture_file = captureFile;
+	
+	return (pjmedia_snd_iphone_use_loopback(&param) == PJ_SUCCESS);
+}
+
+/**
+ * Captures the script with voice activity detection, and checks what vad_cb and rec_cb got,
+ * with synchronous and asynchronous callbacks, and 16-bit and 32-bit frames.
+**/
+static void testStreamVad(void)
+{
+	static const struct { pj_bool_t async; unsigned bitsPerSample; } configs[] =
+	{
+		{ PJ_FALSE, 16 }, { PJ_FALSE, 32 }, { PJ_TRUE, 16 }
+	};
+	
+	unsigned k, i;
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(configs); k++)
+	{
+		CHECK(testWriteInput(TEST_CAPTURE_FILE));
+		CHECK(testUseLoopback(TEST_CAPTURE_FILE, configs[k].async));
+		
+		pjmedia_snd_iphone_options options;
+		pjmedia_snd_iphone_options_default(&options);
+		
+		options.async_callbacks = configs[k].async;
+		options.vad = PJ_TRUE;
+		options.vad_suppress = PJ_TRUE;
+		options.vad_cb = testVadCallback;
+		
+		pj_bzero(&testStream, sizeof(testStream));
+		
+		pjmedia_snd_stream *snd_strm = NULL;
+		
+		CHECK(pjmedia_snd_iphone_set_options(&options) == PJ_SUCCESS);
+		CHECK(pjmedia_snd_open_rec(-1, TEST_CLOCK_RATE, 1, TEST_PACKET_FRAMES, configs[k].bitsPerSample,
+		                           testRecCallback, &testStream, &snd_strm) == PJ_SUCCESS);
+		
+		CHECK(pjmedia_snd_stream_start(snd_strm) == PJ_SUCCESS);
+		
+		unsigned msec;
+		
+		for(msec = 0; (msec < 5000) && (__atomic_load_n(&testStream.reports, __ATOMIC_ACQUIRE) < TEST_PACKETS); msec++)
+		{
+			pj_thread_sleep(1);
+		}
+		
+		pjmedia_snd_stream_stop(snd_strm);
+		
+		pjmedia_snd_iphone_stats stats;
+		pjmedia_snd_iphone_stream_get_stats(snd_strm, &stats);
+		
+		pjmedia_snd_stream_close(snd_strm);
+		remove(TEST_CAPTURE_FILE);
+		
+		const char *mode = configs[k].async ? "async" : "sync";
+		unsigned bits = configs[k].bitsPerSample;
+		
+		CHECK_MSG(testStream.reports >= TEST_PACKETS, "%s, %u bits: %u packets reported", mode, bits, testStream.reports);
+		CHECK_MSG(testStream.timestampErrors == 0, "%s, %u bits: %u timestamps skipped or repeated",
+		          mode, bits, testStream.timestampErrors);
+		
+		// vad_cb got the activity of every packet
+		
+		for(i = 0; i < TEST_PACKETS; i++)
+		{
+			CHECK_MSG(testStream.active[i] == testExpected[i], "%s, %u bits: packet %u is active %d, expected %d",
+			          mode, bits, i, testStream.active[i], testExpected[i]);
+		}
+		
+		// rec_cb got the active packets, and only them
+		
+		unsigned active = 0;
+		
+		for(i = 0; (i < testStream.recCallbacks) && (i < TEST_PACKETS); i++)
+		{
+			if(testStream.recPackets[i] >= TEST_PACKETS)
+			{
+				break;
+			}
+			
+			CHECK_MSG(testExpected[testStream.recPackets[i]], "%s, %u bits: silent packet %u passed to rec_cb",
+			          mode, bits, testStream.recPackets[i]);
+			
+			CHECK_MSG((i == 0) || (testStream.recPackets[i] > testStream.recPackets[i - 1]),
+			          "%s, %u bits: packet %u passed to rec_cb out of order", mode, bits, testStream.recPackets[i]);
+			
+			active++;
+		}
+		
+		unsigned expectedActive = 0;
+		
+		for(i = 0; i < TEST_PACKETS; i++)
+		{
+			expectedActive += testExpected[i];
+		}
+		
+		CHECK_MSG(active == expectedActive, "%s, %u bits: %u packets passed to rec_cb, expected %u",
+		          mode, bits, active, expectedActive);
+		
+		// The stats count every packet the stream classified (which may be a few more than were checked)
+		
+		CHECK(stats.vad_active_packets + stats.vad_silent_packets == testStream.reports);
+		CHECK(stats.vad_suppressed_packets == stats.vad_silent_packets);
+		CHECK(stats.vad_active_packets == testStream.recCallbacks);
+	}
+}
+
+// Benchmarks
+
+#define BENCH_ITERATIONS  200000
+
+// The budget per 20 ms packet, in microseconds
+#define BENCH_BUDGET_USEC  1.0
+
+static void __attribute__((noinline)) referenceProcess(const pj_int16_t *samples, unsigned numSamples)
+{
+	pj_uint64_t energy;
+	unsigned crossings;
+	
+	referenceAnalyze(samples, numSamples, 1, &energy, &crossings);
+	
+	__asm__ __volatile__("" : : "r"(energy), "r"(crossings));
+}
+
+/**
+ * Returns the time it takes to classify a packet of the given number of samples, in microseconds,
+ * with the driver's detector, or with just the per-sample analysis loop (for comparison).
+**/
+static double benchPacket(unsigned numSamples, pj_bool_t reference)
+{
+	snd_vad vad;
+	testVadInit(&vad, 200, 1);
+	
+	unsigned i;
+	double start = benchNow();
+	
+	for(i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		if(reference)
+			referenceProcess(testSamples, numSamples);
+		else
+			vadProcess(&vad, testSamples, numSamples);
+		
+		__asm__ __volatile__("" : : : "memory");
+	}
+	
+	return ((benchNow() - start) * 1e6) / BENCH_ITERATIONS;
+}
+
+static void benchVad(void)
+{
+	static const struct { const char *name; unsigned samples; } packets[] =
+	{
+		{ "8 kHz mono",     160  },
+		{ "16 kHz mono",    320  },
+		{ "48 kHz mono",    960  },
+		{ "48 kHz stereo",  1920 },
+	};
+	
+	unsigned state = 0x85ebca6b;
+	unsigned k;
+	
+	testNoise(testSamples, TEST_MAX_SAMPLES, -30, &state);
+	
+	printf("voice activity detection, usec per 20 ms packet (budget %.1f usec)\n", BENCH_BUDGET_USEC);
+	
+	for(k = 0; k < PJ_ARRAY_SIZE(packets); k++)
+	{
+		double usec = benchPacket(packets[k].samples, PJ_FALSE);
+		
+		printf("  %-16s %7.3f (per-sample loop %7.3f)   %s\n", packets[k].name, usec,
+		       benchPacket(packets[k].samples, PJ_TRUE), (usec <= BENCH_BUDGET_USEC) ? "within budget" : "OVER BUDGET");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pj_init();
+	
+	if(!testUseLoopback(NULL, PJ_FALSE) || (pjmedia_snd_init(&testFactory) != PJ_SUCCESS))
+	{
+		printf("unable to initialize the driver\n");
+		return 1;
+	}
+	
+	if(benchRequested(argc, argv))
+	{
+		benchVad();
+		pjmedia_snd_deinit();
+		return 0;
+	}
+	
+	RUN_TEST(testAnalyze);
+	RUN_TEST(testClassify);
+	RUN_TEST(testClassifyStereo);
+	RUN_TEST(testHangover);
+	RUN_TEST(testStreamVad);
+	
+	pjmedia_snd_deinit();
+	
+	return testSummary();
+}